@@ -2,25 +2,79 @@
 #define ALMGR_H
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <unordered_set>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 /********************************************************************************
  * ALMgr - Access List manager, basically reads from a text document to find the
  *         IP address given. If it's a whitelist, then returns true for allowed
  *         if found and opposite for blacklists
+ *
+ *         The file holds one entry per line: a host address (10.1.2.3) or a
+ *         subnet in CIDR form (10.1.0.0/16). Blank lines and lines starting with
+ *         # are skipped, as are lines that do not parse.
+ *
+ *         The list is loaded once into a hash set of hosts plus a prefix trie of
+ *         subnets, so a lookup is one hash probe and at most 32 trie steps. The
+ *         file's mtime/size is checked at most once every al_check_secs and the
+ *         list is reloaded when it changed. A reload builds a new table and swaps
+ *         it in whole, so lookups see either the old list or the new one. If the
+ *         file can't be read on a reload, the old list stays in effect.
  ********************************************************************************/
 
+// How often isAllowed looks at the file for changes
+const time_t al_check_secs = 1;
+
 class ALMgr {
    public:
       ALMgr(const char *al_file, bool is_whitelist = true);
       ~ALMgr();
 
+      // Throws runtime_error if the list was never loaded and the file can't be read
       bool isAllowed(const char *ipaddr);
       bool isAllowed(unsigned long ipaddr);
 
+      // Loads the file now if it changed since the last load. Returns true if it did
+      bool reload();
+
+      // Number of host and subnet entries in the loaded list
+      size_t size();
+
    private:
+      // One immutable copy of the list. Addresses are kept in host byte order
+      struct al_table {
+         struct trie_node {
+            int child[2] = { -1, -1 };
+            bool terminal = false;     // A subnet ends here
+         };
+
+         void addSubnet(uint32_t addr, unsigned int prefix_len);
+         bool inSubnet(uint32_t addr) const;
+
+         std::unordered_set<uint32_t> hosts;
+         std::vector<trie_node> trie;
+         size_t num_subnets = 0;
+      };
+
+      std::shared_ptr<const al_table> loadTable();
+      std::shared_ptr<const al_table> getTable();
+
       std::string _al_file;
 
       bool _is_whitelist;
+
+      std::shared_ptr<const al_table> _table;
+      pthread_mutex_t _mutex;
+
+      // What the file looked like when _table was loaded, and when we last looked
+      time_t _last_check;
+      struct timespec _file_mtime;
+      off_t _file_size;
+      ino_t _file_ino;
 };
 
 #endif // ALMGR_H
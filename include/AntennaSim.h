@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include "exceptions.h"
 #include "DronePlotDB.h"
+#include "SimClock.h"
 
 // Simulates an antenna receiving drone information and populates the DronePlotDB class as it "receives"
 // information. 
@@ -32,6 +33,10 @@ public:
 
    int getOffset();
 
+   // Injects by a clock shared with others (e.g. a virtual one, see SimClock.h) instead of
+   // its own. If the clock hasn't been started, simulate starts it. Call before simulate
+   void setClock(SimClock *clock) { _clock = clock; };
+
 private:
    
    double getAdjustedTime();
@@ -48,7 +53,8 @@ private:
 
    pthread_mutex_t _offset_mutex;
 
-   time_t _start_time;
+   SimClock _own_clock;
+   SimClock *_clock;
 };
 
 
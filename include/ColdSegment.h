@@ -0,0 +1,64 @@
+#ifndef COLDSEGMENT_H
+#define COLDSEGMENT_H
+
+#include <list>
+#include <string>
+#include <functional>
+#include <stdint.h>
+#include "DronePlotDB.h"
+
+/***************************************************************************************
+ * ColdSegment - a sealed DronePlotDB segment spilled to disk. The plots are written
+ *               once, in timestamp order, then the file is mapped read-only, so reading
+ *               them pulls pages through the page cache and the kernel can drop them
+ *               again whenever it needs the memory. The file is deleted when the
+ *               segment goes away.
+ *
+ *               File layout: a cold_file_header, then count plots, each getDataSize()
+ *               bytes in DronePlot::serialize order. Host byte order throughout.
+ *
+ ***************************************************************************************/
+
+struct cold_file_header {
+   char magic[4];          // "DPSG"
+   uint16_t version;
+   uint16_t record_size;   // DronePlot::getDataSize()
+   uint32_t count;         // Plots in the file
+   uint32_t reserved;
+   int64_t start;          // The segment's start (plot time)
+};
+
+static_assert(sizeof(cold_file_header) == 24, "cold_file_header must stay 24 bytes");
+
+class ColdSegment
+{
+public:
+   // Writes plots (sorted by timestamp, none dead) to filename and maps it
+   ColdSegment(const std::string &filename, time_t start, std::list<DronePlot> &plots);
+   virtual ~ColdSegment();
+
+   // Owns its file and mapping, so it can't be copied
+   ColdSegment(const ColdSegment &) = delete;
+   ColdSegment &operator=(const ColdSegment &) = delete;
+
+   time_t getStart() { return _start; };
+   size_t size() { return _count; };
+
+   // Calls func with a copy of each plot timestamped from start to end (inclusive), found
+   // by binary search so only their pages are touched. Returns the plots visited
+   size_t scanRange(time_t start, time_t end, const std::function<void(DronePlot &)> &func);
+
+private:
+   // The timestamp of plot i, read straight out of the mapping
+   time_t getTimestamp(size_t i);
+
+   std::string _filename;
+   time_t _start;
+   size_t _count;
+   size_t _record_size;
+
+   uint8_t *_map;
+   size_t _map_size;
+};
+
+#endif
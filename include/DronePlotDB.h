@@ -2,7 +2,12 @@
 #define DRONEPLOTDB_H
 
 #include <list>
+#include <map>
 #include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
 #include "exceptions.h"
@@ -17,6 +22,7 @@
 #define DBFLAG_USER2    0x8   // Change as needed
 #define DBFLAG_USER3    0x16  // Change as needed
 #define DBFLAG_USER4    0x32
+#define DBFLAG_DEAD     0x80  // Erased in tombstone mode, waiting to be compacted (see below)
 
 // Manages the drone plot database for a particular node.
 class DronePlot
@@ -29,6 +35,7 @@ public:
    // Function to serialize, or convert this data into a binary stream in a vector class and back
    void serialize(std::vector<uint8_t> &buf);
    void deserialize(std::vector<uint8_t> &buf, unsigned int start_pt = 0);
+   void deserialize(const uint8_t *buf);  // getDataSize() bytes, unchecked
 
    // Reads and writes this plot to/from a buffer in comma-separated format
    int readCSV(std::string &buf);
@@ -47,6 +54,10 @@ public:
    time_t timestamp;
    float latitude;
    float longitude;
+
+   // When the antenna received it (PlotTrace::now), 0 if it came from elsewhere. Not
+   // serialized, only used to trace replication latency (see PlotTrace.h)
+   uint64_t inject_ns;
    
 private:
    unsigned short _flags;
@@ -54,10 +65,43 @@ private:
 };
 
 
+// Seconds of plot time each DronePlotDB segment holds unless set otherwise, and how much
+// recent plot time stays in memory when there's a cold tier (see below)
+const time_t default_segment_secs = 300;
+const time_t default_hot_secs = 600;
+
+class ColdSegment;
+
+/**************************************************************************************************
+ * PlotSegment - the plots of one slice of plot time in a DronePlotDB, timestamps from start up to
+ *               start plus the database's segment secs
+ *
+ **************************************************************************************************/
+struct PlotSegment {
+   time_t start;
+   std::list<DronePlot> plots;
+   size_t dead = 0;           // Plots flagged DBFLAG_DEAD
+};
+
 /**************************************************************************************************
  * DronePlotDB - class to manage a database of DronePlot objects, which manage drone GPS plots that
  *               are "received" by the antenna or another replication server
  *
+ *               Plots are kept in segments by timestamp, oldest segment first, so dropping old
+ *               plots (see setRetention) unlinks whole segments and time range scans only walk
+ *               the segments they overlap. Iterating the database walks the segments in order.
+ *
+ *               With a cold tier set, segments that have fallen out of the hot window are sealed:
+ *               written to a file and mapped back read-only (see ColdSegment.h), so memory is
+ *               bounded by the hot window however much history is kept. Iterators, erase,
+ *               removeIf and sortByTime only see the hot segments. size(), scanRange, retention
+ *               and the file writes cover both tiers.
+ *
+ *               In tombstone mode, erased plots are only flagged DBFLAG_DEAD and stay in the list
+ *               until compact reclaims them, so erasing is constant time and never moves the
+ *               plots a reader is walking. Anything iterating the database should skip plots
+ *               with DBFLAG_DEAD set. size() counts live plots only
+ *
  **************************************************************************************************/
 class DronePlotDB 
 {
@@ -65,9 +109,48 @@ public:
    DronePlotDB();
    virtual ~DronePlotDB();
 
+   // Walks every plot, segment by segment. Like the std::list iterators it replaces, adding
+   // plots doesn't invalidate it, and erase (below) hands back the next one
+   class iterator {
+   public:
+      iterator() {};
+
+      DronePlot &operator*() const { return *_pos; };
+      DronePlot *operator->() const { return &(*_pos); };
+
+      iterator &operator++() { _pos++; skipEmpty(); return *this; };
+      iterator operator++(int) { iterator old = *this; ++(*this); return old; };
+
+      bool operator==(const iterator &other) const {
+         return (_seg == other._seg) && ((_seg == _end) || (_pos == other._pos)); };
+      bool operator!=(const iterator &other) const { return !(*this == other); };
+
+   private:
+      friend class DronePlotDB;
+
+      iterator(std::list<PlotSegment>::iterator seg, std::list<PlotSegment>::iterator end,
+               std::list<DronePlot>::iterator pos):_seg(seg), _end(end), _pos(pos) { skipEmpty(); };
+
+      // Moves on to the next segment with plots once we're past the end of this one
+      void skipEmpty() {
+         while ((_seg != _end) && (_pos == _seg->plots.end())) {
+            _seg++;
+            if (_seg != _end)
+               _pos = _seg->plots.begin();
+         }
+      };
+
+      std::list<PlotSegment>::iterator _seg, _end;
+      std::list<DronePlot>::iterator _pos;
+   };
+
    // Add a plot to the database with the given attributes (mutex'd)
    void addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude);
 
+   // Add a batch of plots in one go, setting flags on each (mutex'd once for the batch). The
+   // plots are moved over, leaving plots empty
+   void addPlots(std::list<DronePlot> &plots, unsigned short flags = 0);
+
    // Load or write the database to/from a CSV file, 
    int loadCSVFile(const char *filename);
    int writeCSVFile(const char *filename);
@@ -76,7 +159,8 @@ public:
    int loadBinaryFile(const char *filename);
    int writeBinaryFile(const char *filename);
    
-   // Sort the database in order of timestamp 
+   // Sort the database in order of timestamp. Plots whose timestamp was changed to outside
+   // their segment are moved to the right one first
    void sortByTime();
 
    // Remove all plotpoints of a particular node (used to generate binary, not for student use)
@@ -84,23 +168,96 @@ public:
 
    // Iterators for simple access to the database. Can use these to modify drone plot points
    // but won't be able to add/delete PlotObjects. Use erase (below) for that as it is mutex'd
-   std::list<DronePlot>::iterator begin() { return _dbdata.begin(); };
-   std::list<DronePlot>::iterator end() { return _dbdata.end(); };
+   iterator begin() { return iterator(_segments.begin(), _segments.end(),
+                          _segments.empty() ? std::list<DronePlot>::iterator() :
+                                              _segments.front().plots.begin()); };
+   iterator end() { return iterator(_segments.end(), _segments.end(),
+                                    std::list<DronePlot>::iterator()); };
+
+   // Calls func with each live plot timestamped from start to end (inclusive), walking only
+   // the segments that overlap, in both tiers. Cold plots are passed as copies, so changes to
+   // them aren't kept. Not mutex'd, like the iterators. Returns the plots visited
+   size_t scanRange(time_t start, time_t end, const std::function<void(DronePlot &)> &func);
    
-   // Manipulate database entries (mutex'd functions)
+   // Manipulate database entries (mutex'd functions). In tombstone mode erase marks the plot
+   // dead instead (i counts live plots)
    void popFront();
    void erase(unsigned int i);
-   std::list<DronePlot>::iterator erase(std::list<DronePlot>::iterator dptr);
+   iterator erase(iterator dptr);
+
+   // Erases every live plot pred returns true for, in one pass under one lock. Returns the
+   // number erased
+   size_t removeIf(const std::function<bool(DronePlot &)> &pred);
+
+   // Tombstone mode (see above). Turning it off compacts first
+   void setTombstones(bool tombstones);
+   bool isTombstones() { return _tombstones; };
+
+   // Reclaims the dead plots, returning how many. The lock is held while they're unlinked
+   // but not while they're freed
+   size_t compact();
+   size_t deadCount() { return _dead; };
+
+   // How many seconds of plot time each segment holds. Can only be changed while empty
+   void setSegmentSecs(time_t secs);
+   time_t getSegmentSecs() { return _segment_secs; };
+   size_t segmentCount() { return _segments.size(); };
 
+   // Cold tier (see above): sealSegments seals the oldest hot segments while they ended more
+   // than hot_secs before now and hold no plots still flagged DBFLAG_NEW (the newest segment
+   // always stays hot). Files go in dir, an empty dir turns the cold tier off. Returns the
+   // plots sealed. Throws runtime_error if a file can't be written (that segment stays hot)
+   void setColdTier(const std::string &dir, time_t hot_secs = default_hot_secs);
+   size_t sealSegments(time_t now);
+   size_t coldSize() { return _cold_count; };
+   size_t coldSegmentCount() { return _cold.size(); };
 
-   // Return the number of plot points stored
-   size_t size() { return _dbdata.size(); };
+   // End of the newest sealed segment's time, 0 if nothing is sealed. Plots from before it
+   // may have copies in the cold tier
+   time_t coldEnd();
+
+   // Start of the oldest segment held (the oldest hot one if hot_only), 0 if there are none
+   time_t oldestStart(bool hot_only = false);
+
+   // Retention: applyRetention drops whole segments, oldest first, that ended more than
+   // max_age secs before now, then while there are more than max_plots live plots (keeping
+   // the newest segment). 0 turns either limit off. Returns the live plots dropped
+   void setRetention(time_t max_age, size_t max_plots);
+   size_t applyRetention(time_t now);
+
+   // Return the number of live plot points stored, in both tiers
+   size_t size() { return _count - _dead + _cold_count; };
 
    // Wipe the database
    void clear();
 
 private:
-   std::list<DronePlot> _dbdata;
+   // The segment a timestamp belongs in, created if need be. Call with the mutex locked
+   time_t segmentStart(time_t timestamp);
+   std::list<PlotSegment>::iterator findSegment(time_t timestamp);
+
+   // Erases or marks dead one plot, returning the next. Call with the mutex locked
+   iterator killPlot(iterator dptr);
+
+   // The segments in time order, and each one by its start for findSegment (only used with
+   // the mutex locked, unlike _segments, which readers walk)
+   std::list<PlotSegment> _segments;
+   std::map<time_t, std::list<PlotSegment>::iterator> _seg_index;
+   time_t _segment_secs = default_segment_secs;
+   size_t _count = 0;         // Plots in every segment, dead or alive
+
+   bool _tombstones = false;
+   size_t _dead = 0;          // Plots flagged DBFLAG_DEAD still in a segment
+
+   time_t _max_age = 0;
+   size_t _max_plots = 0;
+
+   // Sealed segments, in order of their start, and the plots in them
+   std::list<std::unique_ptr<ColdSegment>> _cold;
+   size_t _cold_count = 0;
+   std::string _cold_dir;
+   time_t _hot_secs = default_hot_secs;
+   unsigned int _cold_files = 0;     // Files created, to name the next
 
    pthread_mutex_t _mutex; 
 };
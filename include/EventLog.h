@@ -0,0 +1,110 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+/***************************************************************************************
+ * EventLog - structured log of replication activity. Every event is a fixed-size
+ *            binary record (no string formatting) copied into a memory-mapped file,
+ *            so logging costs a mutex and a memcpy. When a file holds records_per_file
+ *            records it is rotated: name -> name.1 -> ... -> name.<max_files-1>, the
+ *            oldest is deleted and a new name is started. Records reach the page cache
+ *            as they are written, so they survive the process dying.
+ *
+ *            File layout: an event_file_header, then up to capacity event_records.
+ *            All fields are in host byte order. evdecode prints or aggregates files.
+ *
+ ***************************************************************************************/
+
+enum event_type : uint16_t {
+   ev_none = 0,
+   ev_conn_accepted,    // Server accepted a connection
+   ev_connect_failed,   // Client could not reach the peer
+   ev_auth_ok,          // Peer passed the challenge
+   ev_auth_failed,      // Peer failed the challenge
+   ev_frame_sent,       // Session frame sent: bytes on the wire, plots in it
+   ev_frame_acked,      // Session frame acknowledged: plots in it, latency since sent
+   ev_frame_recv,       // Session frame received: bytes on the wire
+   ev_session_lost,     // Session dropped: plots = frames left unacknowledged
+   ev_batch_applied,    // Replicated batch applied: bytes decoded, plots new, latency of apply
+   ev_digest_match,     // Digest check found the replicas match
+   ev_digest_diverged,  // Digest check found differences: plots = divergent buckets
+   ev_max
+};
+
+struct event_record {
+   uint64_t timestamp_ns;  // CLOCK_REALTIME
+   uint64_t latency_ns;
+   uint32_t bytes;
+   uint32_t plots;
+   uint16_t type;          // event_type
+   uint16_t reserved;
+   char peer[20];          // Peer's server ID, NUL padded
+};
+
+struct event_file_header {
+   char magic[4];          // "REVT"
+   uint16_t version;
+   uint16_t record_size;
+   uint32_t capacity;      // Records the file has room for
+   uint32_t count;         // Records written so far
+   uint64_t created_ns;
+   uint8_t reserved[40];
+};
+
+static_assert(sizeof(event_record) == 48, "event_record must stay 48 bytes");
+static_assert(sizeof(event_file_header) == 64, "event_file_header must stay 64 bytes");
+
+class EventLog
+{
+public:
+   EventLog(const char *filename, unsigned int records_per_file = 65536,
+                                                unsigned int max_files = 4);
+   virtual ~EventLog();
+
+   // Records an event. Safe to call from any thread, and never throws: if a rotation can't
+   // start the next file, records are dropped from then on
+   void log(event_type type, const char *peer, uint32_t bytes = 0, uint32_t plots = 0,
+                                                uint64_t latency_ns = 0);
+
+   // Records dropped for want of a file, and rotated files that couldn't be trimmed (they
+   // still read back, just with their unused space)
+   uint64_t getDropped();
+   unsigned int getTrimFailures();
+
+   // Current CLOCK_REALTIME in ns, the time base of the records
+   static uint64_t now();
+
+   // Current CLOCK_MONOTONIC in ns, for timing latencies and deadlines
+   static uint64_t monotonic();
+
+   static const char *getTypeName(uint16_t type);
+
+   // Reads the records of an event file, for the decoder
+   static void readFile(const char *filename, std::vector<event_record> &records);
+
+private:
+   void openFile();
+   bool closeFile();
+   void rotate();
+
+   std::string _filename;
+   unsigned int _records_per_file;
+   unsigned int _max_files;
+
+   int _fd;
+   uint8_t *_map;
+   size_t _map_size;
+   event_file_header *_header;
+   event_record *_records;
+
+   uint64_t _dropped;
+   unsigned int _trim_failures;
+
+   pthread_mutex_t _mutex;
+};
+
+#endif
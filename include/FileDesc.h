@@ -42,14 +42,15 @@ public:
    // Writes a single byte to the FD
    ssize_t writeByte(unsigned char data);
 
-   // Checks if the FD has data available to be read
-   bool hasData(long ms_timeout = 10);
+   // Checks if the FD has data available to be read, waiting up to usec_timeout
+   bool hasData(long usec_timeout = 10);
 
    // Checks if the FD is still open (network connections will still appear open even if lost link)
    bool isOpen();
 
    int getFD() { return _fd; };
 
+   // Closes the FD if it's open (safe to call again)
    void closeFD();
 
    // The code must be defined here for a template for the next two functions
@@ -129,12 +130,14 @@ public:
  
 protected:
 
-   int _fd;
+   int _fd = -1;
  
 };
 
 /********************************************************************************************
- * SocketFD class - includes methods for managing a network socket
+ * SocketFD class - includes methods for managing a network socket. The object owns its socket:
+ *                  it is opened when first needed (bind, connect or accept), replaced by each
+ *                  new connect or accept, and closed when the object goes away
  *
  ********************************************************************************************/
 
@@ -143,12 +146,34 @@ public:
    SocketFD();
    ~SocketFD();
 
+   // Owns the socket, so it can't be copied
+   SocketFD(const SocketFD &) = delete;
+   SocketFD &operator=(const SocketFD &) = delete;
+
+   enum connect_status { connect_failed, connect_done, connect_pending };
+
+   // Opens the socket first if need be
+   void setNonBlocking();
+
    void bindFD(const char *ip_addr, unsigned short int port);
-   bool connectTo(const char *ip_addr, unsigned short port);
-   bool connectTo(unsigned long ip_addr, unsigned short port);
+
+   // Non-blocking connect: startConnect begins connecting (ip_addr and port in network
+   // format) without waiting, checkConnect waits up to usec_timeout for the outcome. The
+   // socket is back in blocking mode once connected
+   connect_status startConnect(unsigned long ip_addr, unsigned short port);
+   connect_status checkConnect(long usec_timeout = 0);
+
+   // Blocking connect, giving up after usec_timeout (-1 to wait as long as the kernel does)
+   bool connectTo(const char *ip_addr, unsigned short port, long usec_timeout = -1);
+   bool connectTo(unsigned long ip_addr, unsigned short port, long usec_timeout = -1);
+
    void listenFD(int backlog = 5);
    bool acceptFD(SocketFD &server);
 
+   // Reads or writes up to size bytes without blocking (see below)
+   ssize_t recvSome(uint8_t *buf, size_t size);
+   ssize_t sendSome(const uint8_t *buf, size_t size);
+
    // Sets this address to reusable to prevent problems when sockets don't shut down properly
    void setReusable();
 
@@ -158,6 +183,9 @@ public:
 
 private:
 
+   // Creates the socket if there isn't one
+   void openSocket();
+
    sockaddr_in _fd_addr;
 
 };
@@ -0,0 +1,80 @@
+#ifndef FLEETGEN_H
+#define FLEETGEN_H
+
+#include <vector>
+#include <queue>
+#include <stdint.h>
+#include "DronePlotDB.h"
+
+/***************************************************************************************
+ * FleetGen - synthetic drone fleet, as a stream of the plots each antenna node hears.
+ *            Drones start at random times in the first quarter of the run and fly
+ *            straight lines over the Dayton area (bouncing off its edges), reporting
+ *            every report_secs. The area is split into one longitude band per node and
+ *            the node owning the band always hears a report; every other node also hears
+ *            it with probability overlap.
+ *
+ *            Each node's plots are stamped with its clock offset (fixed per node, up to
+ *            +/- max_offset secs) plus up to +/- jitter secs of noise per plot. This is on
+ *            top of AntennaSim's own random offset when the files are replayed.
+ *
+ *            Plots come out in order of true time, so memory use only depends on the
+ *            number of drones and any number of plots can be streamed out. Each drone has
+ *            its own random stream derived from the seed, so the output is the same for a
+ *            seed on every platform.
+ *
+ ***************************************************************************************/
+
+struct fleet_params {
+   unsigned int drones = 10;
+   unsigned int secs = 900;         // Length of the run (in sim secs)
+   unsigned int nodes = 3;
+   unsigned int report_secs = 5;    // How often each drone reports its position
+   double overlap = 0.5;            // Chance a report is also heard outside its band
+   unsigned int max_offset = 0;     // Per-node clock offset range (secs)
+   unsigned int jitter = 0;         // Per-plot timestamp noise (secs)
+   uint64_t seed = 1;
+};
+
+class FleetGen
+{
+public:
+   // Throws: runtime_error if the parameters can't make a fleet
+   FleetGen(const fleet_params &params);
+   virtual ~FleetGen();
+
+   // The next plot heard by any node, false once the run is over
+   bool next(DronePlot &plot);
+
+   // The clock offset node_id (1-based) stamps its plots with
+   int getOffset(unsigned int node_id);
+
+private:
+   struct drone_state {
+      uint64_t rng;           // splitmix64 state
+      double lat, lon;
+      double dlat, dlon;      // Movement per report
+   };
+
+   // Deterministic randoms from a splitmix64 state
+   static uint64_t nextRand(uint64_t &state);
+   static double uniform(uint64_t &state, double low, double high);
+
+   // Moves a drone one report along and queues the plots of the nodes that heard it
+   void report(unsigned int drone_id, time_t true_time);
+
+   fleet_params _params;
+
+   std::vector<drone_state> _drones;
+   std::vector<int> _offsets;
+
+   // (true time of the next report, drone_id), earliest first
+   typedef std::pair<time_t, unsigned int> due_report;
+   std::priority_queue<due_report, std::vector<due_report>, std::greater<due_report>> _due;
+
+   // Plots from the last report not yet handed out by next()
+   std::vector<DronePlot> _heard;
+   unsigned int _heard_pos = 0;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef IOWORKER_H
+#define IOWORKER_H
+
+#include <list>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include "TCPConn.h"
+#include "LogMgr.h"
+#include "MPSCQueue.h"
+#include "PlotTrace.h"
+
+/***************************************************************************************
+ * conn_event - what an IOWorker reports back to the replication thread: a decoded
+ *              replication delta received on a connection, or a connection that was
+ *              dropped (so the QueueMgr knows it can launch another sync/check)
+ *
+ ***************************************************************************************/
+struct conn_event {
+   enum event_type { ev_data, ev_dropped };
+
+   event_type type = ev_data;
+   std::string server_id;
+   bool stream = false;       // Dropped connection was a replication session
+   bool check = false;        // Dropped connection was a digest check
+   std::vector<uint8_t> data; // ReplLog delta for ev_data
+   plot_trace trace;          // The batch's trace for ev_data, if it had one
+};
+
+/***************************************************************************************
+ * IOWorker - owns a set of TCPConn objects and does all their socket handling, crypto
+ *            and batch decoding, so a slow peer or a large batch only stalls the
+ *            connections of one worker rather than the replication thread. Connections
+ *            are handed over with addConn and never shared between workers. Results go
+ *            to the replication thread through a lock-free MPSC queue shared by all
+ *            workers.
+ *
+ *            start() runs the worker on its own thread, optionally pinned to a CPU.
+ *            Without start(), whoever owns the worker calls handleConns() directly.
+ *
+ ***************************************************************************************/
+class IOWorker
+{
+public:
+   IOWorker(unsigned int worker_id, MPSCQueue<conn_event> &events, LogMgr &server_log,
+                                                                  unsigned int verbosity);
+   virtual ~IOWorker();
+
+   // Runs handleConns on a new thread until stop() (cpu < 0: no affinity)
+   void start(int cpu = -1);
+   void stop();
+
+   // Hands a connection over to this worker, which takes ownership (mutex'd)
+   void addConn(TCPConn *conn);
+
+   // Number of connections owned, for spreading the load
+   unsigned int getNumConns() { return _num_conns; };
+
+   // One pass over the connections. Returns the number of events posted
+   unsigned int handleConns();
+
+private:
+   static void *t_worker(void *data);
+   void run();
+
+   // Posts the batches waiting on a connection's input buffer
+   unsigned int postData(TCPConn &conn);
+
+   unsigned int _worker_id;
+
+   std::list<std::unique_ptr<TCPConn>> _conns;
+
+   // Connections handed over but not yet picked up by the worker thread
+   std::list<std::unique_ptr<TCPConn>> _new_conns;
+   pthread_mutex_t _mutex;
+
+   std::atomic<unsigned int> _num_conns;
+
+   pthread_t _thread;
+   bool _running = false;
+   std::atomic<bool> _shutdown;
+
+   MPSCQueue<conn_event> &_events;
+
+   LogMgr &_server_log;
+   unsigned int _verbosity;
+};
+
+#endif
@@ -2,35 +2,130 @@
 #define LOGMGR_H
 
 #include <string>
+#include <map>
+#include <atomic>
+#include <memory>
+#include <time.h>
+#include <pthread.h>
 
 /********************************************************************************
  * LogMgr - Log file manager. Includes setting log levels and a function to write
- *          a log entry if it is below a specified log level. Opens for each write
- *          in append mode to help with thread conflicts (but no mutexing)
+ *          a log entry if it is below a specified log level.
+ *
+ *          writeLog only copies the message and its time into a slot of a
+ *          lock-free ring buffer, so it is safe (and cheap) to call from any
+ *          thread. A writer thread owned by the LogMgr drains the ring, formats the
+ *          timestamps (the string is cached and rebuilt once a second) and writes
+ *          each batch with a single fflush. Messages longer than log_msg_size are
+ *          cut short.
+ *
+ *          When the ring is full, the full_policy decides: lp_drop (default)
+ *          counts the message as dropped and returns, and the writer notes how
+ *          many were lost in the log. lp_block waits for room.
+ *
+ *          writeLogLimited tags a record with a key (e.g. "connect:ds3") and lets
+ *          through at most one record per key every key interval. Records in
+ *          between are only counted. The count is logged as "Previous '<key>'
+ *          message repeated N times." ahead of the next record let through for
+ *          the key, or by the writer thread once the key has been quiet for an
+ *          interval.
  ********************************************************************************/
 
+// Ring slots (a power of 2) and the longest message a slot holds
+const unsigned int log_ring_size = 1024;
+const unsigned int log_msg_size = 256;
+
+// Default for how often a keyed record is let through
+const time_t log_key_interval = 60;
+
 class LogMgr {
    public:
-      LogMgr(const char *log_file, unsigned int log_lvl);
+      enum full_policy { lp_drop, lp_block };
+
+      LogMgr(const char *log_file, unsigned int log_lvl, full_policy policy = lp_drop);
       ~LogMgr();
 
       void writeLog(const char *str, unsigned int lvl=0);
       void writeLog(std::string &str, unsigned int lvl=0);
       void strerrLog(const char *str, unsigned int lvl=0);
 
+      // Rate limited by key, see above
+      void writeLogLimited(const std::string &key, const char *str, unsigned int lvl=0);
+      void setKeyInterval(time_t secs) { _key_interval = secs; };
+
+      // Waits until everything logged so far is in the file
+      void flush();
+
       void closeLog();
-      
+
       unsigned int getLogLvl() { return _log_lvl; }
 
+      void setFullPolicy(full_policy policy) { _policy = policy; };
+
+      // Messages written to the file, and messages lost to a full ring or unwritable file
+      unsigned long getWritten() { return _written; };
+      unsigned long getDropped() { return _dropped; };
+
       static void createTimestamp(std::string &buf);
 
       void changeFilename(const char *filename);
 
    private:
+      struct log_slot {
+         std::atomic<unsigned long> seq;  // Slot is free for pos when seq == pos, full at pos+1
+         time_t timestamp;
+         unsigned int len;
+         char msg[log_msg_size];
+      };
+
+      bool tryPush(const char *str, time_t timestamp);
+
+      // Writer thread: logs the counts of keys that went quiet and forgets idle keys
+      void sweepKeys(time_t now);
+
+      static void *t_writer(void *data);
+      void runWriter();
+
+      // Writes out what is in the ring. Returns the number of messages written
+      unsigned int writeBatch();
+
       std::string _log_file;  // Path/name of the log to write to
       unsigned int _log_lvl;  // The verbosity level
-   
+      std::atomic<full_policy> _policy;
+
       FILE *_lfptr = NULL;
+
+      // Guards _lfptr and _log_file between the writer thread and closeLog/changeFilename
+      pthread_mutex_t _mutex;
+
+      std::unique_ptr<log_slot[]> _ring;
+      std::atomic<unsigned long> _enqueue_pos;
+      std::atomic<unsigned long> _dequeue_pos;  // Only the writer thread moves this
+      std::atomic<unsigned long> _flushed_pos;  // Everything before this is in the file
+
+      std::atomic<unsigned long> _written;
+      std::atomic<unsigned long> _dropped;
+      unsigned long _dropped_reported = 0;
+      bool _open_failed = false;
+
+      // Per key: when a record was last let through, when one last came in and how many were
+      // held back since the last one let through
+      struct key_state {
+         time_t last_logged = 0;
+         time_t last_seen = 0;
+         unsigned long suppressed = 0;
+      };
+      std::map<std::string, key_state> _keys;
+      pthread_mutex_t _key_mutex;
+      std::atomic<time_t> _key_interval;
+      time_t _last_sweep = 0;
+
+      // Cached "Sun Oct 18 23:51:55 2026" for _stamp_time (writer thread only)
+      time_t _stamp_time = 0;
+      std::string _stamp;
+
+      pthread_t _writer;
+      std::atomic<bool> _shutdown;
 };
 
 #endif // ALMGR_H
@@ -0,0 +1,69 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+/***************************************************************************************
+ * MPSCQueue - lock-free multi-producer, single-consumer FIFO queue (Vyukov style linked
+ *             list). Any thread may push, only one thread may pop. Producers never wait
+ *             on each other or on the consumer: a push is one allocation plus one atomic
+ *             exchange.
+ *
+ *             A push that is midway (exchanged but not yet linked) can make pop report
+ *             an empty queue for a moment--the element shows up on a later pop.
+ *
+ ***************************************************************************************/
+template <typename T>
+class MPSCQueue
+{
+public:
+   MPSCQueue() {
+      node *stub = new node();
+      _head.store(stub, std::memory_order_relaxed);
+      _tail = stub;
+   };
+
+   ~MPSCQueue() {
+      T item;
+      while (pop(item));
+      delete _tail;
+   };
+
+   // Any thread: adds an item to the back of the queue
+   void push(T &&item) {
+      node *new_node = new node(std::move(item));
+      node *prev = _head.exchange(new_node, std::memory_order_acq_rel);
+      prev->next.store(new_node, std::memory_order_release);
+   };
+
+   // Consumer thread only: takes the item off the front. Returns false if empty
+   bool pop(T &item) {
+      node *next = _tail->next.load(std::memory_order_acquire);
+      if (next == NULL)
+         return false;
+
+      // next becomes the new stub once its item is moved out
+      item = std::move(next->item);
+      delete _tail;
+      _tail = next;
+      return true;
+   };
+
+private:
+   MPSCQueue(const MPSCQueue &) = delete;
+   MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+   struct node {
+      node():next(NULL) {};
+      node(T &&in_item):item(std::move(in_item)),next(NULL) {};
+
+      T item;
+      std::atomic<node *> next;
+   };
+
+   std::atomic<node *> _head;    // Last node pushed, producers swap in
+   node *_tail;                  // Stub in front of the next item, consumer only
+};
+
+#endif
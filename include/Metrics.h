@@ -0,0 +1,190 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <stdint.h>
+#include <pthread.h>
+#include "FileDesc.h"
+
+/***************************************************************************************
+ * Metrics - process-wide registry of counters, gauges and histograms, written out in
+ *           the Prometheus text format. Metrics are registered once (usually into a
+ *           static at the top of the file that updates them) and updated lock-free:
+ *
+ *              MetricCounter - sharded by thread, so concurrent inc() calls from
+ *                              different threads don't fight over a cache line
+ *              MetricGauge   - a single atomic value
+ *              MetricHistogram - HDR style log-linear buckets (16 per power of two, so
+ *                              values are kept to within ~6%), sharded by thread like
+ *                              the counters and merged when read
+ *
+ *           Registering a name (plus labels) that already exists returns the existing
+ *           metric. MetricsServer answers HTTP requests with the text.
+ *
+ ***************************************************************************************/
+
+// Counter shards, and the histogram's sub-buckets per power of two (2^metric_sub_bits)
+const unsigned int metric_shards = 16;
+
+// Histogram shards. Each holds a full set of buckets (~8KB), so there are fewer of them and
+// threads share one once there are more threads than shards
+const unsigned int metric_hist_shards = 8;
+const unsigned int metric_sub_bits = 4;
+const unsigned int metric_buckets = (64 - metric_sub_bits + 1) << metric_sub_bits;
+
+class Metric
+{
+public:
+   Metric(const std::string &name, const std::string &help, const std::string &labels);
+   virtual ~Metric();
+
+   const std::string &getName() { return _name; };
+   const std::string &getHelp() { return _help; };
+
+   // The Prometheus type name and the sample lines
+   virtual const char *getType() = 0;
+   virtual void writeSamples(std::string &out) = 0;
+
+protected:
+   // name{labels} (or name{labels,extra} / name alone)
+   std::string sampleName(const char *suffix = "", const std::string &extra = "");
+
+   // The calling thread's shard number, 0 to metric_shards - 1
+   static unsigned int getShard();
+
+   std::string _name;
+   std::string _help;
+   std::string _labels;    // e.g. peer="ds2"
+};
+
+class MetricCounter : public Metric
+{
+public:
+   MetricCounter(const std::string &name, const std::string &help, const std::string &labels);
+
+   void inc(uint64_t n = 1) {
+      _shards[getShard()].value.fetch_add(n, std::memory_order_relaxed);
+   };
+   uint64_t getValue();
+
+   const char *getType() { return "counter"; };
+   void writeSamples(std::string &out);
+
+private:
+   struct alignas(64) shard {
+      std::atomic<uint64_t> value{0};
+   };
+   shard _shards[metric_shards];
+};
+
+class MetricGauge : public Metric
+{
+public:
+   MetricGauge(const std::string &name, const std::string &help, const std::string &labels);
+
+   void set(int64_t value) { _value.store(value, std::memory_order_relaxed); };
+   void add(int64_t n) { _value.fetch_add(n, std::memory_order_relaxed); };
+   int64_t getValue() { return _value.load(std::memory_order_relaxed); };
+
+   const char *getType() { return "gauge"; };
+   void writeSamples(std::string &out);
+
+private:
+   std::atomic<int64_t> _value;
+};
+
+class MetricHistogram : public Metric
+{
+public:
+   MetricHistogram(const std::string &name, const std::string &help, const std::string &labels);
+
+   void observe(uint64_t value) {
+      shard &sh = _shards[getShard() % metric_hist_shards];
+      sh.buckets[getBucket(value)].fetch_add(1, std::memory_order_relaxed);
+      sh.count.fetch_add(1, std::memory_order_relaxed);
+      sh.sum.fetch_add(value, std::memory_order_relaxed);
+   };
+
+   uint64_t getCount();
+   uint64_t getSum();
+
+   // Value at quantile q (0.0-1.0), accurate to the bucket width. 0 if empty
+   uint64_t getQuantile(double q);
+
+   // Prometheus buckets are exported at each power of two
+   const char *getType() { return "histogram"; };
+   void writeSamples(std::string &out);
+
+   static unsigned int getBucket(uint64_t value);
+   static uint64_t getBucketLimit(unsigned int bucket);   // Highest value in the bucket
+
+private:
+   // Adds up the shards' buckets into counts (metric_buckets of them), returning the total
+   uint64_t mergeBuckets(uint64_t *counts);
+
+   struct alignas(64) shard {
+      std::atomic<uint64_t> buckets[metric_buckets];
+      std::atomic<uint64_t> count;
+      std::atomic<uint64_t> sum;
+   };
+   shard _shards[metric_hist_shards];
+};
+
+class Metrics
+{
+public:
+   Metrics();
+   virtual ~Metrics();
+
+   // The registry everything in the process reports to
+   static Metrics &global();
+
+   MetricCounter &counter(const std::string &name, const std::string &help,
+                                                   const std::string &labels = "");
+   MetricGauge &gauge(const std::string &name, const std::string &help,
+                                                   const std::string &labels = "");
+   MetricHistogram &histogram(const std::string &name, const std::string &help,
+                                                   const std::string &labels = "");
+
+   // Every metric in the Prometheus text exposition format
+   void writeText(std::string &out);
+
+private:
+   template <typename T>
+   T &getMetric(const std::string &name, const std::string &help, const std::string &labels);
+
+   // Keyed by name then labels, so a metric's label sets are written out together
+   std::map<std::pair<std::string, std::string>, std::unique_ptr<Metric>> _metrics;
+   pthread_mutex_t _mutex;
+};
+
+/***************************************************************************************
+ * MetricsServer - serves a Metrics registry over HTTP/1.0 (any path) on its own thread
+ *
+ ***************************************************************************************/
+class MetricsServer
+{
+public:
+   MetricsServer(Metrics &metrics);
+   virtual ~MetricsServer();
+
+   // Throws socket_error if the address can't be bound, runtime_error if no thread
+   void start(const char *ip_addr, unsigned short port);
+   void stop();
+
+private:
+   static void *t_server(void *data);
+   void run();
+
+   Metrics &_metrics;
+   SocketFD _sockfd;
+
+   pthread_t _thread;
+   bool _running = false;
+   std::atomic<bool> _shutdown;
+};
+
+#endif
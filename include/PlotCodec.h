@@ -0,0 +1,71 @@
+#ifndef PLOTCODEC_H
+#define PLOTCODEC_H
+
+#include <vector>
+#include <stdint.h>
+#include "PlotTrace.h"
+
+/***************************************************************************************
+ * PlotCodec - compact encoding for replication batches (ReplLog deltas). Consecutive
+ *             plots of a drone differ by a few seconds and a tiny change in position, so
+ *             each plot is stored as the difference from the previous plot of the same
+ *             drone: zigzag varints of the timestamp and of the latitude/longitude float
+ *             bits. Float bits within a binade behave like a fixed-point number, so the
+ *             deltas are small while decoding stays bit-for-bit exact. The encoded block
+ *             can then optionally be compressed with LZ4 or zstd when they were found by
+ *             configure.
+ *
+ *             Every encoded batch starts with an 8 byte header:
+ *                uint8 encoding, uint8 compression, uint8 flags, uint8 reserved (0),
+ *                uint32 size of the block before compression
+ *             With flag_trace set, a PlotTrace follows the header (see PlotTrace.h)
+ *
+ *             Receivers advertise which encodings/compressions they can decode with
+ *             getCapabilities() and senders pick the best common option with choose().
+ *
+ ***************************************************************************************/
+class PlotCodec
+{
+public:
+   enum encoding_type { enc_raw = 0, enc_delta = 1 };
+   enum compression_type { comp_none = 0, comp_lz4 = 1, comp_zstd = 2 };
+
+   // Capability bits advertised by a receiver
+   static const uint8_t cap_delta = 0x1;
+   static const uint8_t cap_lz4 = 0x2;
+   static const uint8_t cap_zstd = 0x4;
+   static const uint8_t cap_trace = 0x8;
+
+   // Header flags
+   static const uint8_t flag_trace = 0x1;
+
+   static const unsigned int header_size = 8;
+
+   // What this build can decode
+   static uint8_t getCapabilities();
+
+   // Picks the best encoding and compression the peer can decode
+   static void choose(uint8_t peer_caps, encoding_type &enc, compression_type &comp);
+
+   // Encodes a ReplLog delta into buf, header first (replaces buf). A trace is only for
+   // peers that advertised cap_trace
+   static void encode(std::vector<uint8_t> &delta, std::vector<uint8_t> &buf,
+                      encoding_type enc, compression_type comp,
+                      const plot_trace *trace = NULL);
+
+   // Decodes an encoded batch back into a ReplLog delta (replaces delta). trace, if given,
+   // gets the batch's trace or is cleared when it has none
+   static void decode(std::vector<uint8_t> &buf, std::vector<uint8_t> &delta,
+                      plot_trace *trace = NULL);
+
+private:
+   static void deltaEncode(std::vector<uint8_t> &delta, std::vector<uint8_t> &buf);
+   static void deltaDecode(const uint8_t *data, size_t size, std::vector<uint8_t> &delta);
+
+   static void compress(std::vector<uint8_t> &block, std::vector<uint8_t> &buf,
+                        compression_type comp);
+   static void decompress(const uint8_t *data, size_t size, size_t raw_size,
+                          std::vector<uint8_t> &block, compression_type comp);
+};
+
+#endif
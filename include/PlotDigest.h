@@ -0,0 +1,83 @@
+#ifndef PLOTDIGEST_H
+#define PLOTDIGEST_H
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include "DronePlotDB.h"
+
+/***************************************************************************************
+ * PlotDigest - incrementally updated Merkle tree over a set of plots, used to check that
+ *              replicas converged without shipping the data. Plots are partitioned into
+ *              buckets by (time bucket, drone_id). Each bucket hashes to one of the
+ *              fanout^depth leaves, and a leaf's hash is the sum of its plots' hashes so
+ *              adding or removing a plot is O(1) plus marking its ancestors dirty. Inner
+ *              node hashes are recomputed lazily when the tree is queried.
+ *
+ *              Two replicas compare by walking the tree one level per round trip: the
+ *              querying side sends the node indices it wants at a level, compares the
+ *              hashes the other side replies with and only descends into the ones that
+ *              differ. Past the leaves, the reply lists the divergent buckets themselves.
+ *
+ *              Query wire format:  level, count, count x node index
+ *              Reply wire format:  level, count, count x (node index, hash)
+ *                       buckets:   level, count, count x leaf index, num,
+ *                                  num x (time bucket, drone_id, hash)
+ *              (32 bit unsigned ints, 64 bit hashes, host order)
+ *
+ ***************************************************************************************/
+class PlotDigest
+{
+public:
+   PlotDigest(unsigned int bucket_secs = 60);
+   virtual ~PlotDigest();
+
+   static const unsigned int fanout = 16;
+   static const unsigned int depth = 3;
+
+   // Add or remove a plot's contribution to the digest
+   void addPlot(DronePlot &plot);
+   void removePlot(DronePlot &plot);
+
+   // Hash of the whole digest--equal roots mean the replicas hold the same plots
+   uint64_t getRoot();
+
+   // Builds the first query of a comparison (the root)
+   static void rootQuery(std::vector<uint8_t> &query);
+
+   // Other side: answers a query against this digest
+   void answerQuery(std::vector<uint8_t> &query, std::vector<uint8_t> &reply);
+
+   // Querying side: compares the reply against this digest. Returns true if another
+   // round trip is required (query is filled in), false when done, with divergent then
+   // holding the (time bucket, drone_id) pairs that differ (empty if the replicas match)
+   bool checkReply(std::vector<uint8_t> &reply, std::vector<uint8_t> &query,
+                   std::vector<std::pair<unsigned int, unsigned int>> &divergent);
+
+   unsigned int getBucketSecs() { return _bucket_secs; };
+
+private:
+   typedef std::pair<unsigned int, unsigned int> bucket_key;
+
+   uint64_t hashPlot(DronePlot &plot);
+   unsigned int leafOf(const bucket_key &bucket);
+   void updateLeaf(DronePlot &plot, bool add);
+
+   // Recomputes the dirty inner nodes, bottom up
+   void refresh();
+
+   // Number of nodes at a level (1 at the root, fanout^depth at the leaves)
+   unsigned int levelSize(unsigned int level);
+
+   unsigned int _bucket_secs;
+
+   // Node hashes by level, _tree[depth] are the leaves
+   std::vector<std::vector<uint64_t>> _tree;
+   std::vector<std::vector<bool>> _dirty;
+
+   // Per bucket hashes, so divergent buckets can be named exactly
+   std::map<bucket_key, uint64_t> _buckets;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef PLOTTRACE_H
+#define PLOTTRACE_H
+
+#include <vector>
+#include <stdint.h>
+
+/***************************************************************************************
+ * PlotTrace - latency tracing of plots from the antenna to a peer's database. With
+ *             tracing on (repsvr -T) the ReplLog remembers when each local plot was
+ *             injected by AntennaSim and when queueNewPlots sequenced it. Each session
+ *             frame then carries the trace of its first traced plot to the receiver,
+ *             which stamps the remaining stages and adds them to histograms:
+ *
+ *                batch     - injected until sequenced into the ReplLog
+ *                handshake - sequenced until the session sending it was authenticated
+ *                window    - waiting for room in the session's send window
+ *                network   - sent until the receiving I/O worker picked the frame up
+ *                decode    - PlotCodec decode on the I/O worker
+ *                queue     - waiting in the QueueMgr queue for the replication thread
+ *                apply     - ReplLog dedup and the database insert
+ *                total     - injected until applied
+ *
+ *             Only the first hop is traced (relayed plots carry no trace). Timestamps
+ *             are CLOCK_REALTIME, so the cross-host stages assume synchronized clocks.
+ *
+ *             Wire format (after the PlotCodec header, see PlotCodec.h): inject_ns,
+ *             logged_ns, ready_ns, sent_ns as 64 bit unsigned ints in host order
+ *
+ ***************************************************************************************/
+struct plot_trace {
+   // Stamped by the sender and carried in the frame
+   uint64_t inject_ns = 0;    // AntennaSim added the plot, 0 if untraced
+   uint64_t logged_ns = 0;    // queueNewPlots sequenced it into the ReplLog
+   uint64_t ready_ns = 0;     // The sending session finished its handshake
+   uint64_t sent_ns = 0;      // The frame was encoded and sent
+
+   // Stamped by the receiver
+   uint64_t recv_ns = 0;      // An I/O worker took the frame off the connection
+   uint64_t decoded_ns = 0;   // ...and decoded it
+   uint64_t popped_ns = 0;    // The replication thread took it off the queue
+};
+
+class PlotTrace
+{
+public:
+   static const unsigned int wire_size = 4 * sizeof(uint64_t);
+
+   // CLOCK_REALTIME in ns
+   static uint64_t now();
+
+   // Serializes the sender's stamps onto the end of buf / reads them back at pos
+   static void put(std::vector<uint8_t> &buf, const plot_trace &trace);
+   static void get(const uint8_t *data, size_t size, size_t &pos, plot_trace &trace);
+
+   // Receiver: adds a complete trace to the per-stage histograms
+   static void observe(const plot_trace &trace, uint64_t applied_ns);
+};
+
+#endif
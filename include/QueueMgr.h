@@ -3,8 +3,14 @@
 
 #include <queue>
 #include <vector>
+#include <set>
+#include <memory>
 #include <crypto++/secblock.h>
 #include "TCPServer.h"
+#include "ReplLog.h"
+#include "IOWorker.h"
+#include "EventLog.h"
+#include "MPSCQueue.h"
 
 /*******************************************************************************************
  * QueueMgr - Child class of the TCPServer object, manages a Queue for a middleware/app
@@ -21,23 +27,57 @@
  *            management process and second, it assigns all outgoing data to a "Message
  *            Channel Agent", or TCPConn object.
  *
+ *            syncToAll queues anti-entropy syncs instead of fixed data: the connection
+ *            learns the other server's sequence vector during the handshake and sends
+ *            only the ranges of the ReplLog that server is missing. The connection then
+ *            stays up as a replication session, streaming new plots as the log grows, so
+ *            later syncs to a server with a session are no-ops. checkAll queues digest
+ *            comparisons of the ReplLog with each server.
+ *
+ *            With symmetric sessions set, a session carries plots both ways, so each pair
+ *            of servers shares one: the server whose ID sorts first opens it and the other
+ *            streams back over it rather than syncing on its own. Every server in the
+ *            list must have it set.
+ *
+ *            Connections are owned by a pool of IOWorkers started with startWorkers. The
+ *            workers do the socket handling and decoding and post received deltas back
+ *            through a lock-free queue, which handleQueue drains into the queue. With no
+ *            worker threads, one worker is run from handleQueue instead.
+ *
  *******************************************************************************************/
 class QueueMgr : public TCPServer 
 {
 public:
-   QueueMgr(unsigned int verbosity=1);
+   QueueMgr(ReplLog &repl_log, unsigned int verbosity=1);
    virtual ~QueueMgr();
 
+   // Sets up the I/O workers (0 = handle connections on the calling thread), optionally
+   // pinning each to its own CPU. Must be called before handleQueue
+   void startWorkers(unsigned int num_workers, bool pin_cpus = false);
+
+   // Structured events of our connections go here (NULL for none)
+   void setEventLog(EventLog *event_log) { _event_log = event_log; };
+
    void handleQueue();
 
    void populateQueue();
 
-   // Pops a received queue element off the queue
-   bool pop(std::string &sid, std::vector<uint8_t> &data);
+   // Pops a received queue element off the queue, with its trace if trace is given
+   bool pop(std::string &sid, std::vector<uint8_t> &data, plot_trace *trace = NULL);
 
    // Loads replication information into the Queue to transmit to servers
    void sendToAll(std::vector<uint8_t> &data);
    void sendToServer(const char *server_id, std::vector<uint8_t> &data);
+
+   // Queues an anti-entropy sync of the replication log to servers
+   void syncToAll();
+   void syncToServer(const char *server_id);
+
+   // Queues a digest comparison with each server to confirm the replicas converged
+   void checkAll();
+
+   // One replication session per pair of servers, carrying plots both ways (see above)
+   void setSymmetric(bool symmetric) { _symmetric = symmetric; };
    
    // Overload simply to remove this server from _server_list. Calls parent funct
    void bindSvr(const char *ip_addr, unsigned short port);
@@ -57,29 +97,58 @@ public:
 
 private:
 
-   // Launches a connection to the other server from queue data
-   void launchDataConn(const char *sid, std::vector<uint8_t> &data);
-
    // Loads server information from servers.txt
    int loadServerList(const char *filename);
 
    // Set up our types for managing our queue
-   enum qe_type {send, recv};
+   enum qe_type {send, recv, sync, check};
+
+   // Launches a connection to the other server from queue data, or a log sync/digest check
+   void launchDataConn(const char *sid, std::vector<uint8_t> &data, qe_type type = send);
+
+   // True if a replication session to sid exists (for syncs) or a check of sid is still
+   // running or waiting to connect (for checks)
+   bool hasPendingConn(const char *sid, qe_type type);
+
+   // True if sid opens the symmetric session between us, so we don't sync to it ourselves
+   bool isSessionOpener(const char *sid);
+
+   // Hands a connection to the worker with the fewest connections
+   void assignConn(TCPConn *conn);
+
    struct queue_element {
 
-      queue_element(qe_type in_type, const char *in_sid, std::vector<uint8_t> &in_data)
-                  : type(in_type), server_id(in_sid), data(in_data) {}
+      queue_element(qe_type in_type, const char *in_sid, std::vector<uint8_t> &in_data,
+                    const plot_trace &in_trace = plot_trace())
+                  : type(in_type), server_id(in_sid), data(in_data), trace(in_trace) {}
 
       qe_type type;
       std::string server_id;
       std::vector<uint8_t> data;
+      plot_trace trace;
    };
 
    std::string _server_ID;
 
+   // Replication log shared with the ReplServer that owns us
+   ReplLog &_repl_log;
+
    // The queue list
    std::queue<queue_element> _queue;
 
+   // Received deltas and dropped connections posted by the workers
+   MPSCQueue<conn_event> _events;
+
+   std::vector<std::unique_ptr<IOWorker>> _workers;
+   bool _threaded = false;
+
+   // Servers with a replication session, and servers with a check outstanding
+   std::set<std::string> _sessions;
+   std::set<std::string> _checks;
+   bool _symmetric = false;
+
+   EventLog *_event_log = NULL;
+
    std::vector<std::tuple<std::string, unsigned long, unsigned short>> _server_list;  
 };
 
@@ -0,0 +1,58 @@
+#ifndef RECVBUFFER_H
+#define RECVBUFFER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "FileDesc.h"
+
+// Room made for each read, and the smallest the buffer starts out at
+const size_t recv_chunk_size = 64 * 1024;
+
+/***************************************************************************************
+ * RecvBuffer - a connection's receive buffer. fill() reads what the socket has, up to a
+ *              caller's limit, with large non-blocking reads, appending to what's already
+ *              buffered, so messages split over several reads or run together in one are
+ *              put back together for whoever parses them.
+ *
+ *              Bytes are taken off the front by moving a read offset, not by shifting
+ *              the rest down. What's left is only moved to the front when room is needed
+ *              and it's no bigger than what was consumed ahead of it, so each byte is
+ *              moved a bounded number of times however the reads fall.
+ *
+ ***************************************************************************************/
+class RecvBuffer
+{
+public:
+   RecvBuffer();
+   virtual ~RecvBuffer();
+
+   // Reads until the socket has nothing more or limit bytes are buffered. Returns the bytes
+   // read. A closed connection (or failed read) is noted for isClosed, after whatever came
+   // before it is buffered
+   size_t fill(SocketFD &sock, size_t limit);
+
+   // The bytes buffered and not yet consumed
+   const uint8_t *data() const { return _buf.data() + _start; };
+   size_t size() const { return _end - _start; };
+
+   // Takes len bytes off the front
+   void consume(size_t len);
+
+   // Drops everything buffered and the closed state, e.g. for a new connection
+   void clear();
+
+   // Did the last fill find the connection closed?
+   bool isClosed() { return _closed; };
+
+private:
+   // Makes room for len more bytes at the end
+   void reserve(size_t len);
+
+   std::vector<uint8_t> _buf;
+   size_t _start = 0;      // First unconsumed byte
+   size_t _end = 0;        // One past the last byte read
+   bool _closed = false;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef REPLLOG_H
+#define REPLLOG_H
+
+#include <map>
+#include <list>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include "DronePlotDB.h"
+#include "PlotDigest.h"
+#include "PlotTrace.h"
+
+/***************************************************************************************
+ * ReplLog - per-origin replication log used for anti-entropy between peers. Every plot
+ *           injected by an antenna is given a sequence number for its origin, starting at
+ *           1. An origin is the plot's node_id plus the incarnation of the server that
+ *           logged it, a random 64 bit value drawn when its log is created, so a server
+ *           that restarts numbers its plots from 1 again under a new origin instead of
+ *           reusing sequences its peers already hold. Each server holds, per origin, the
+ *           contiguous run of plots 1..N it has seen and advertises N for every origin as
+ *           its "sequence vector". A peer that learns our vector only sends the ranges we
+ *           are missing, so catching up after an outage costs the missing data only.
+ *
+ *           The log doesn't grow forever: trimBefore drops each origin's oldest plots
+ *           once they're older than what the database keeps, and remembers how many were
+ *           dropped as the origin's base. A peer that is missing plots we've trimmed gets
+ *           a range starting at our base + 1 instead, which it takes in place of what it
+ *           was missing (dropping whatever it still held of that origin), so a server
+ *           that was down longer than the retention window resyncs from what's left.
+ *
+ *           Vector wire format:  count, then count x (node_id, incarnation, base,
+ *                                highest_seq)
+ *           Delta wire format:   num_ranges, then per range (node_id, incarnation, base,
+ *                                first_seq, count) followed by count serialized DronePlots
+ *           Incarnations are 64 bit, all other fields 32 bit unsigned integers, in host
+ *           order like the rest of the replication data.
+ *
+ *           A PlotDigest of everything in the log is kept up to date as plots are added
+ *           so replicas can cheaply confirm they hold the same plots.
+ *
+ *           With tracing on, the inject and sequencing times of local plots are kept
+ *           so buildDelta can hand out a trace for each delta (see PlotTrace.h).
+ *
+ *           The log is shared by the replication thread and the I/O workers, so every
+ *           method is mutex'd.
+ *
+ ***************************************************************************************/
+class ReplLog
+{
+public:
+   ReplLog();
+   virtual ~ReplLog();
+
+   // Keep traces of local plots appended from now on
+   void setTracing(bool tracing) { _tracing = tracing; };
+
+   // Adds a locally-received plot to the log, assigning it the next sequence of its origin
+   unsigned int appendLocal(DronePlot &plot);
+
+   // This log's incarnation, the second half of the origins appendLocal puts plots under
+   uint64_t getIncarnation() { return _incarnation; };
+
+   // Serializes our sequence vector into buf (replaces contents)
+   void getVector(std::vector<uint8_t> &buf);
+
+   // Builds the ranges a peer with the given serialized vector is missing (replaces buf),
+   // at most max_plots of them if non-zero. Returns the number of plots placed in the delta.
+   // If trace is given, it gets the trace of the first traced plot in the delta (or is
+   // cleared if there is none)
+   unsigned int buildDelta(std::vector<uint8_t> &peer_vec, std::vector<uint8_t> &buf,
+                           unsigned int max_plots = 0, plot_trace *trace = NULL);
+
+   // Raises a serialized vector to what a peer holding it would hold after applying delta
+   void advanceVector(std::vector<uint8_t> &vec, std::vector<uint8_t> &delta);
+
+   // Applies a delta received from a peer, keeping only the plots that extend our
+   // contiguous runs. Those plots are appended to newplots. Returns the number added
+   unsigned int applyDelta(std::vector<uint8_t> &buf, std::list<DronePlot> &newplots);
+
+   // Total number of plots held in the log
+   size_t size();
+
+   // Drops each origin's oldest plots while they're timestamped before cutoff (stopping at
+   // the first that isn't), taking them out of the digest too. Returns the plots dropped
+   size_t trimBefore(time_t cutoff);
+
+   // Merkle digest over the plots in the log (see PlotDigest.h). A comparison is pinned to the
+   // sequence vector both logs had when it started, since logs that grow while the walk goes
+   // on would show differences that aren't real. Answering a query returns false (and no
+   // reply) once our vector isn't vec any more, and checking a reply returns digest_moved
+   enum digest_status { digest_more, digest_done, digest_moved };
+   bool answerDigestQuery(std::vector<uint8_t> &vec, std::vector<uint8_t> &query,
+                          std::vector<uint8_t> &reply);
+   digest_status checkDigestReply(std::vector<uint8_t> &vec, std::vector<uint8_t> &reply,
+                          std::vector<uint8_t> &query,
+                          std::vector<std::pair<unsigned int, unsigned int>> &divergent);
+   uint64_t getDigestRoot();
+   unsigned int getDigestBucketSecs() { return _digest.getBucketSecs(); };
+
+private:
+   // An origin: node_id and incarnation
+   typedef std::pair<unsigned int, uint64_t> origin_id;
+
+   // The inject/sequencing times of a traced plot (0 if untraced)
+   struct log_trace {
+      uint64_t inject_ns;
+      uint64_t logged_ns;
+   };
+
+   // One origin's plots: sequences 1..base were trimmed, sequence base + n is stored at
+   // offset (n-1) * plot size, and its trace (if tracing) at index n-1
+   struct origin_log {
+      unsigned int base = 0;
+      std::vector<uint8_t> plots;
+      std::vector<log_trace> traces;
+
+      unsigned int highest() { return base + plots.size() / DronePlot::getDataSize(); };
+   };
+
+   // applyDelta with the mutex held
+   void applyRanges(std::vector<uint8_t> &buf, std::list<DronePlot> &newplots,
+                    unsigned int &added);
+
+   // buildDelta's trace lookup, called with the mutex held
+   void findTrace(origin_log &origin, unsigned int first_seq, unsigned int last_seq,
+                  plot_trace &trace);
+
+   // getVector with the mutex held
+   void buildVector(std::vector<uint8_t> &buf);
+
+   // Parses a serialized vector into origin -> highest_seq (and origin -> base into bases)
+   void parseVector(std::vector<uint8_t> &buf, std::map<origin_id, unsigned int> &vec,
+                    std::map<origin_id, unsigned int> *bases = NULL);
+
+   // Drops the first count plots of an origin, called with the mutex held
+   void trimOrigin(origin_log &origin, unsigned int count);
+
+   std::map<origin_id, origin_log> _log;
+   uint64_t _incarnation;
+
+   PlotDigest _digest;
+
+   bool _tracing = false;
+
+   pthread_mutex_t _mutex;
+};
+
+#endif
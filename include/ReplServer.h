@@ -5,6 +5,9 @@
 #include <memory>
 #include "QueueMgr.h"
 #include "DronePlotDB.h"
+#include "ReplLog.h"
+#include "EventLog.h"
+#include "SimClock.h"
 
 /***************************************************************************************
  * ReplServer - class that manages replication between servers. The data is automatically
@@ -25,6 +28,23 @@ public:
    // Main replication loop, continues until _shutdown is set
    void replicate(const char *ip_addr, unsigned short port);
    void replicate();
+
+   // Number of I/O worker threads for the connections (0 = none) and CPU pinning
+   void setIOWorkers(unsigned int num_workers, bool pin_cpus);
+
+   // Records replication activity as binary events (NULL for none). Call before replicate
+   void setEventLog(EventLog *event_log);
+
+   // Traces the latency of our plots to the peers that apply them (see PlotTrace.h). Call
+   // before replicate
+   void setTracing(bool tracing) { _repl_log.setTracing(tracing); };
+
+   // How long the resumption tickets we issue peers are good for (secs, 0 issues none)
+   void setTicketLifetime(time_t secs) { _queue.setTicketLifetime(secs); };
+
+   // One replication session per pair of servers, carrying plots both ways (see
+   // QueueMgr.h). Every server must have it set. Call before replicate
+   void setSymmetric(bool symmetric) { _queue.setSymmetric(symmetric); };
   
    // Call this to shutdown the loop 
    void shutdown();
@@ -33,13 +53,22 @@ public:
    // attempts to check "simulator time" should use this function
    time_t getAdjustedTime();
 
+   // Schedules replication by a clock shared with the antenna (e.g. a virtual one, see
+   // SimClock.h) instead of our own. Call before replicate
+   void setClock(SimClock *clock) { _clock = clock; };
+
 private:
 
-   void addReplDronePlots(std::vector<uint8_t> &data);
-   void addSingleDronePlot(std::vector<uint8_t> &data);
+   void addReplDronePlots(std::string &sid, std::vector<uint8_t> &data,
+                          const plot_trace *trace = NULL);
 
    unsigned int queueNewPlots();
 
+   // Reclaims dead plots in the background (see ReplServer.cpp)
+   static void *t_compactor(void *data);
+
+   // Sequenced copy of every plot we hold, used to sync peers (must be declared before _queue)
+   ReplLog _repl_log;
 
    QueueMgr _queue;    
 
@@ -48,21 +77,36 @@ private:
 
    bool _shutdown;
 
-   // How fast to run the system clock - 1.0 = normal speed, 2.0 = 2x as fast
-   float _time_mult;
-
-   // System clock time of when the server started
-   time_t _start_time;
+   // Sim time, running time_mult times as fast as the system clock from when the server
+   // started (unless a shared clock was set)
+   SimClock _own_clock;
+   SimClock *_clock;
 
    // When the last replication happened so we can know when to do another one
    time_t _last_repl;
 
+   // When we last compared digests with the other servers
+   time_t _last_check;
+
+   // Sealing to the cold tier is held off until then after a failed write
+   time_t _next_seal = 0;
+
    // How much to spam stdout with server status
    unsigned int _verbosity;
 
    // Used to bind the server
    std::string _ip_addr;
    unsigned short _port;
+
+   unsigned int _io_workers;
+   bool _pin_workers;
+
+   EventLog *_event_log = NULL;
+
+   // The compaction thread, and the mutex the replication loop holds while it walks the
+   // database, which compaction takes before unlinking anything
+   pthread_t _compactor;
+   pthread_mutex_t _walk_mutex;
 };
 
 
@@ -0,0 +1,48 @@
+#ifndef SENDBUFFER_H
+#define SENDBUFFER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "FileDesc.h"
+
+/***************************************************************************************
+ * SendBuffer - a connection's outgoing bytes. add() queues them and flush() writes as
+ *              much as the socket will take without blocking, keeping the rest for the
+ *              next flush, so a short write never loses the tail of a message and one
+ *              slow peer can't stall the thread handling every other connection.
+ *
+ *              Like RecvBuffer, bytes are taken off the front by moving an offset, and
+ *              what's left is only moved down when it's no bigger than what was sent
+ *              ahead of it.
+ *
+ ***************************************************************************************/
+class SendBuffer
+{
+public:
+   SendBuffer();
+   virtual ~SendBuffer();
+
+   // Queues buf to go out after whatever is already waiting
+   void add(const std::vector<uint8_t> &buf);
+
+   // Writes until everything is sent or the socket is full. Returns the bytes written. A
+   // failed write is noted for isFailed and the rest is left queued
+   size_t flush(SocketFD &sock);
+
+   // The bytes still waiting to go out
+   size_t size() const { return _buf.size() - _start; };
+
+   // Drops everything queued and the failed state, e.g. for a new connection
+   void clear();
+
+   // Did the last flush fail?
+   bool isFailed() { return _failed; };
+
+private:
+   std::vector<uint8_t> _buf;
+   size_t _start = 0;      // First unsent byte
+   bool _failed = false;
+};
+
+#endif
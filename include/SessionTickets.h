@@ -0,0 +1,97 @@
+#ifndef SESSIONTICKETS_H
+#define SESSIONTICKETS_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+#include <crypto++/secblock.h>
+
+// How long the tickets a server issues are good for by default (secs)
+const time_t default_ticket_secs = 3600;
+
+/***************************************************************************************
+ * SessionTickets - resumption tickets for TCPConn's one round trip handshake, so a peer
+ *                  that reconnects can send data in its first flight.
+ *
+ *                  As a server it issues tickets. A ticket holds the client's Server ID,
+ *                  an expiry time and a resumption secret. It is encrypted and MACed under
+ *                  keys only this process knows, so nothing is kept per client, and all
+ *                  tickets stop working when the process restarts.
+ *
+ *                  Tickets are single use. The first flight of a resumed connection is keyed
+ *                  from the ticket and the client's nonce alone, so anyone who recorded it
+ *                  could send it again. Each ticket's IV is remembered once it's redeemed,
+ *                  until the ticket would have expired, and a ticket seen before is turned
+ *                  down, so a replayed first flight never gets its data accepted. A ticket
+ *                  is only redeemed once the client has proven it holds the secret, so
+ *                  sending a captured ticket without it doesn't use the ticket up.
+ *
+ *                  As a client it keeps the latest ticket each server gave us, along with
+ *                  the secret and the batch encodings that server can decode.
+ *
+ *                  Safe to use from any thread.
+ *
+ ***************************************************************************************/
+class SessionTickets
+{
+public:
+   SessionTickets(time_t lifetime = default_ticket_secs);
+   virtual ~SessionTickets();
+
+   // How long tickets we issue are good for, 0 to issue none
+   void setLifetime(time_t secs);
+   time_t getLifetime();
+
+   // Server: seals a ticket for client_sid holding secret
+   void issue(const std::string &client_sid, const CryptoPP::SecByteBlock &secret,
+                                                         std::vector<uint8_t> &ticket);
+
+   // Server: opens a ticket, returning false if it was tampered with, has expired, wasn't
+   // issued to client_sid or was already redeemed. Gets its secret and expiry
+   bool open(const std::vector<uint8_t> &ticket, const std::string &client_sid,
+             CryptoPP::SecByteBlock &secret, time_t &expires);
+
+   // Server: uses up an opened ticket once the client proved it holds the secret. False if
+   // it was redeemed already
+   bool redeem(const std::vector<uint8_t> &ticket, time_t expires);
+
+   // Client: keeps a ticket server_sid gave us (replacing any earlier one), good for
+   // lifetime secs
+   void store(const std::string &server_sid, const std::vector<uint8_t> &ticket,
+              const CryptoPP::SecByteBlock &secret, uint8_t caps, time_t lifetime);
+
+   // Client: finds a ticket for server_sid that hasn't expired
+   bool find(const std::string &server_sid, std::vector<uint8_t> &ticket,
+             CryptoPP::SecByteBlock &secret, uint8_t &caps);
+
+   // Client: drops server_sid's ticket, e.g. when it was turned down
+   void forget(const std::string &server_sid);
+
+private:
+   // Server: records a redeemed ticket's IV, false if it was redeemed before
+   bool markRedeemed(const std::string &iv, time_t expires);
+
+   struct held_ticket {
+      std::vector<uint8_t> ticket;
+      CryptoPP::SecByteBlock secret;
+      uint8_t caps;
+      time_t expires;
+   };
+
+   time_t _lifetime;
+
+   CryptoPP::SecByteBlock _enc_key, _mac_key;
+
+   std::map<std::string, held_ticket> _held;
+
+   // IVs of the tickets redeemed that haven't expired yet, and when each expires
+   std::set<std::string> _redeemed;
+   std::multimap<time_t, std::string> _redeemed_expiry;
+
+   pthread_mutex_t _mutex;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef SIMCLOCK_H
+#define SIMCLOCK_H
+
+#include <pthread.h>
+
+/***************************************************************************************
+ * SimClock - "sim time", the clock AntennaSim injects plots by and ReplServer schedules
+ *            replication by. Sim time runs time_mult times faster than the real (monotonic)
+ *            clock, from zero at the moment given to start().
+ *
+ *            A virtual clock also skips ahead: sleepUntil() moves it straight to the time
+ *            asked for rather than waiting, so a replay runs as fast as the antenna can
+ *            inject and the replication stack can keep up. Between skips it keeps running
+ *            at time_mult, so timers still fire once the trace has run out.
+ *
+ *            One clock can be shared by the antenna and the servers of a process, and is
+ *            safe to use from any thread.
+ *
+ ***************************************************************************************/
+class SimClock
+{
+public:
+   SimClock(float time_mult = 1.0);
+   virtual ~SimClock();
+
+   // Virtual clocks skip ahead on sleepUntil (see above). Set before start
+   void setVirtual(bool is_virtual) { _virtual = is_virtual; };
+   bool isVirtual() { return _virtual; };
+
+   // Sim time zero is offset real seconds from now. Starting again restarts the clock
+   void start(double offset = 0.0);
+   bool isStarted() { return _started; };
+
+   // Sim seconds since zero
+   double getTime();
+
+   // Sim seconds since zero not counting what was skipped, i.e. the time at the -t pace
+   double getPacedTime();
+
+   // Returns once the clock reaches sim_secs. A virtual clock skips there at once
+   void sleepUntil(double sim_secs);
+
+   // Returns once the clock reaches sim_secs, without skipping (a virtual clock may still
+   // get there sooner when someone else skips it)
+   void waitUntil(double sim_secs);
+
+private:
+   // Monotonic clock in seconds
+   static double realSecs();
+
+   // Sim time from the real time, caller holds _mutex
+   double simTime(double real_secs);
+
+   float _time_mult;
+   bool _virtual = false;
+   bool _started = false;
+
+   double _start_secs = 0.0;     // Real time of sim time zero
+   double _skipped_secs = 0.0;   // Sim time skipped by a virtual clock
+
+   pthread_mutex_t _mutex;
+   pthread_cond_t _skipped;      // Signaled when a virtual clock skips ahead
+};
+
+#endif
@@ -1,12 +1,25 @@
 #ifndef TCPCONN_H
 #define TCPCONN_H
 
+#include <deque>
 #include <crypto++/secblock.h>
 #include "FileDesc.h"
 #include "LogMgr.h"
+#include "ReplLog.h"
+#include "EventLog.h"
+#include "SessionTickets.h"
+#include "RecvBuffer.h"
+#include "SendBuffer.h"
 
 const int max_attempts = 2;
 
+// Replication sessions: frames in flight before waiting on an ACK, and plots per frame
+const unsigned int max_frames_inflight = 8;
+const unsigned int max_frame_plots = 512;
+
+// Bytes waiting to go out on a session before it stops building new frames
+const size_t max_tx_pending = 256 * 1024;
+
 // Methods and attributes to manage a network connection, including tracking the username
 // and a buffer for user input. Status tracks what "phase" of login the user is currently in
 class TCPConn 
@@ -18,7 +31,8 @@ public:
    // The current status of the connection
    enum statustype { s_none, s_connecting, s_connected, s_datatx, s_datarx, 
       s_waitack, s_hasdata, waitServerChallenge, waitClientResponse,
-       challengingServer, waitClientChallenge, waitServerResponse };
+       challengingServer, waitClientChallenge, waitServerResponse, s_digest, s_stream,
+       s_streamrx, waitServerHello, waitClientProof, waitServerResume };
 
    statustype getStatus() { return _status; };
 
@@ -28,11 +42,20 @@ public:
    // depending on the state of the connection
    void handleConnection();
 
-   // connect - second version uses ip_addr in network format (big endian)
+   // connect - second version uses ip_addr in network format (big endian). Doesn't wait for
+   // the other end: if the connect is still underway, finishConnect completes it
    void connect(const char *ip_addr, unsigned short port);
    void connect(unsigned long ip_addr, unsigned short port);
 
-   // Send data to the other end of the connection without encryption
+   // Is a connect still waiting on the other end? finishConnect checks without blocking and
+   // returns true once connected, throwing socket_error if it failed or took too long
+   bool isConnectPending() { return _connect_pending; };
+   bool finishConnect();
+
+   // Send data to the other end of the connection without encryption. Each send is one
+   // message, and getData hands back whole messages however the reads split or merge them.
+   // getData returns false if there isn't one yet, or the connection was lost. sendData
+   // never blocks: whatever the socket won't take yet goes out on later passes
    bool getData(std::vector<uint8_t> &buf);
    bool sendData(std::vector<uint8_t> &buf);
 
@@ -44,10 +67,16 @@ public:
    void encryptData(std::vector<uint8_t> &buf);
    void decryptData(std::vector<uint8_t> &buf);
 
-   // Input data received on the socket
+   // Input data received on the socket (one frame at a time for a replication session)
    bool isInputDataReady() { return _data_ready; };
    void getInputData(std::vector<uint8_t> &buf);
 
+   // Replication sessions only acknowledge frames once they've decoded. ackInputData ACKs
+   // every frame getInputData has handed over. rejectInputData is for a frame that didn't
+   // decode: it drops the frames behind it and the session, so the sender resends them all
+   void ackInputData();
+   void rejectInputData();
+
    // Data about the connection (NodeID = other end's Server Node ID string)
    unsigned long getIPAddr() { return _connfd.getIPAddr(); }; // Network format
    const char *getIPAddrStr(std::string &buf);
@@ -70,6 +99,38 @@ public:
    // Assign outgoing data and sets up the socket to manage the transmission
    void assignOutgoingData(std::vector<uint8_t> &data);
 
+   // Anti-entropy: servers advertise the log's sequence vector with their challenge and
+   // clients build their outgoing data from the log once the peer's vector is known
+   void setReplLog(ReplLog *repl_log) { _repl_log = repl_log; };
+
+   // Digest checks compare the log's PlotDigest with the server's instead of sending data
+   void setDigestCheck(bool check) { _digest_check = check; };
+   bool isDigestCheck() { return _digest_check; };
+
+   // Replication sessions stay connected, streaming frames of the log as it grows with up
+   // to max_frames_inflight unacknowledged. Lost sessions reconnect and resend those frames
+   void setStream(bool stream) { _stream = stream; };
+   bool isStream() { return _stream; };
+
+   // Symmetric sessions also carry the server's frames back to the client. The client sends
+   // its sequence vector as the first frame, and from then on both ends stream the plots
+   // the other is missing, so two servers need one connection and one handshake. Set on the
+   // client; the server follows whatever the client opens with
+   void setSymmetric(bool symmetric) { _symmetric = symmetric; };
+   bool isSymmetric() { return _symmetric; };
+
+   // Clients authenticate with the one round trip hello (see sendHello) unless set to use the
+   // older challenge/response exchange. Servers answer whichever the client opens with
+   void setLegacyAuth(bool legacy) { _legacy_auth = legacy; };
+
+   // Where to issue resumption tickets from and keep the ones we're given (NULL for none).
+   // A client with a ticket for the server skips the handshake and sends data at once
+   void setTickets(SessionTickets *tickets) { _tickets = tickets; };
+
+   // Where to record structured events (NULL for none)
+   void setEventLog(EventLog *event_log) { _event_log = event_log; };
+   EventLog *getEventLog() { return _event_log; };
+
 protected:
    // Functions to execute various stages of a connection 
    void sendSID();
@@ -77,11 +138,62 @@ protected:
    void transmitData();
    void waitForData();
    void awaitAck();
+   void startDigestCheck();
+   void sendDigestQuery(std::vector<uint8_t> &query);
+   void waitForDigest();
+   void startStream();
+   void streamData();
+   void sendVector();
+   void takeFrames();
+   void takeAck(unsigned int seq);
+   void fillWindow();
+   // A session frame sent but not yet acknowledged
+   struct unacked_frame {
+      unsigned int seq;
+      std::vector<uint8_t> delta;   // Unencoded
+      unsigned int plots;
+      uint64_t sent_ns;             // When it was last sent (monotonic), for the ACK latency
+      plot_trace trace;             // Trace of its first traced plot, if any
+   };
+   void sendDelta(unacked_frame &frame);
+   void waitForFrames();
+   void lostStream();
+   void dropSession();
       //authorizing the client and server to eachother using challenge strings and a shared key
    void sendChallenge();
    void waitForChallenge();
    void waitForResponse();
 
+   // One round trip handshake: both ends send a nonce in their first message, derive the
+   // session key from the shared key and both nonces, then prove they hold it
+   void sendHello();
+   void answerHello(std::vector<uint8_t> &hello);
+   void waitForHello();
+   void waitForProof();
+   void deriveSessionKey(const CryptoPP::SecByteBlock &secret, const char *label);
+   void calcProof(const char *label, std::vector<uint8_t> &proof);
+
+   // Resuming with a ticket from an earlier handshake instead (see SessionTickets.h)
+   bool sendResume();
+   void answerResume(std::vector<uint8_t> &buf);
+   void waitForResume();
+   void resumptionSecret(CryptoPP::SecByteBlock &secret);
+   void addTicket(std::vector<uint8_t> &buf);
+   void storeTicket(std::vector<uint8_t> &ticket);
+
+   // Handles data from an authenticated client
+   void processData(std::vector<uint8_t> &buf);
+
+   // Messages: the next one without copying it out of the receive buffer, taking it off
+   // once handled, and adding one to an outgoing buffer
+   bool peekData(const uint8_t *&msg, size_t &len);
+   bool isMessageBuffered(size_t &len);
+   void consumeData(size_t len);
+   static void addMessage(std::vector<uint8_t> &out, std::vector<uint8_t> &buf);
+
+   // Writes what's waiting in _txbuf, returning false if the connection was lost
+   bool flushData();
+
    // Looks for commands in the data stream
    std::vector<uint8_t>::iterator findCmd(std::vector<uint8_t> &buf,
                                                    std::vector<uint8_t> &cmd);
@@ -95,12 +207,24 @@ protected:
    void wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
                                                     std::vector<uint8_t> &endcmd);
 
+   // Session frames, one per message: startcmd, sequence, length, data, endcmd
+   void sendFrame(unsigned int seq, std::vector<uint8_t> &data, std::vector<uint8_t> &startcmd,
+                                                    std::vector<uint8_t> &endcmd);
+   bool getFrame(const uint8_t *msg, size_t len, unsigned int &seq, std::vector<uint8_t> &data,
+                 std::vector<uint8_t> &startcmd, std::vector<uint8_t> &endcmd);
+
 
 private:
 
    bool _connected = false;
 
-   std::vector<uint8_t> c_rep, c_endrep, c_auth, c_endauth, c_ack, c_sid, c_endsid;
+   // A connect that's underway and the time (EventLog::monotonic) to give up on it
+   bool _connect_pending = false;
+   uint64_t _connect_deadline_ns = 0;
+
+   std::vector<uint8_t> c_rep, c_endrep, c_auth, c_endauth, c_ack, c_sid, c_endsid, c_vec, c_endvec,
+                        c_dig, c_enddig, c_cod, c_endcod, c_frm, c_endfrm, c_endack, c_hel,
+                        c_endhel, c_prf, c_endprf, c_res, c_endres, c_tkt, c_endtkt;
 
    statustype _status = s_none;
 
@@ -116,12 +240,63 @@ private:
    // Store outgoing data to be sent over the network
    std::vector<uint8_t> _outputbuf;
 
+   // Replication log to sync from/advertise (NULL for plain data transfers) and the
+   // sequence vector the other end advertised
+   ReplLog *_repl_log = NULL;
+   std::vector<uint8_t> _peer_vec;
+   uint8_t _peer_caps = 0;    // PlotCodec capabilities the other end advertised
+   bool _digest_check = false;
+   std::vector<uint8_t> _digest_vec;   // The vector both logs had when the check started
+
+   // Session sender: frames not yet acknowledged, the next sequence to use and the vector
+   // the other end will have once it applies what we sent
+   bool _stream = false;
+   bool _symmetric = false;
+   std::deque<unacked_frame> _unacked;
+   unsigned int _next_frame = 1;
+   std::vector<uint8_t> _sent_vec;
+
+   // Session receiver (the server, or either end of a symmetric session): frames waiting to
+   // be read by the queue manager with their sequences, and the last one handed over that
+   // hasn't been acknowledged yet (0 if none)
+   std::deque<std::vector<uint8_t>> _frames_in;
+   std::deque<unsigned int> _frames_in_seq;
+   unsigned int _ack_pending = 0;
+
+   // Data read off the socket and not yet handled, including any partial message, and
+   // data sent that the socket hasn't taken yet
+   RecvBuffer _rxbuf;
+   SendBuffer _txbuf;
+
    CryptoPP::SecByteBlock &_aes_key; // Read from a file, our shared key
    std::string _authstr;   // remembers the random authorization string sent
 
+   // One round trip handshake: each end's nonce, the key derived from them and the client's
+   // proof, held back to go out in the same write as the first data
+   bool _legacy_auth = false;
+   std::vector<uint8_t> _client_nonce, _server_nonce;
+   CryptoPP::SecByteBlock _session_key;
+   std::vector<uint8_t> _tx_prefix;
+
+   // Resumption: the ticket store, whether the client resumed and the ticket it resumed
+   // with, redeemed once its proof checks out (server), and what the first flight left us
+   // doing (client)
+   SessionTickets *_tickets = NULL;
+   bool _resumed = false;
+   std::vector<uint8_t> _resume_ticket;
+   time_t _resume_expires = 0;
+   statustype _resume_status = s_none;
+
    unsigned int _verbosity;
 
    LogMgr &_server_log;
+
+   EventLog *_event_log = NULL;
+
+   // When the connection was made (monotonic, to time the handshake) and when it finished
+   // authenticating (on the PlotTrace clock, to trace plots)
+   uint64_t _start_ns = 0;
+   uint64_t _ready_ns = 0;
 };
 
 
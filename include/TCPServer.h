@@ -7,6 +7,8 @@
 #include "FileDesc.h"
 #include "TCPConn.h"
 #include "LogMgr.h"
+#include "ALMgr.h"
+#include "SessionTickets.h"
 #include <crypto++/secblock.h>
 
 /********************************************************************************************
@@ -34,12 +36,24 @@ public:
    TCPConn *handleSocket();
    virtual void handleConnections();
 
+   // Runs a pass over connlist: reconnects or drops connections that lost their link and
+   // handles the rest. Dropped connections are moved to dropped if given, else deleted
+   static void handleConnList(std::list<std::unique_ptr<TCPConn>> &connlist,
+                              LogMgr &server_log, unsigned int verbosity,
+                              std::list<std::unique_ptr<TCPConn>> *dropped = NULL);
+
    unsigned long getIPAddr() { return _sockfd.getIPAddr(); };
    unsigned short getPort() { return _sockfd.getPort(); };
 
    // Change where the log file is writing to
    void changeLogfile(const char *newfile);
 
+   // The server log, for the rest of the server to write to
+   LogMgr &getServerLog() { return _server_log; };
+
+   // How long the resumption tickets we issue are good for (0 = issue none)
+   void setTicketLifetime(time_t secs) { _tickets.setLifetime(secs); };
+
 protected:
 
    void loadAESKey(const char *filename);
@@ -51,8 +65,14 @@ protected:
 
    LogMgr _server_log;
 
+   // Who may connect, loaded once and reloaded when the file changes
+   ALMgr _whitelist;
+
    unsigned int _verbosity;
 
+   // Resumption tickets we issue and the ones other servers gave us
+   SessionTickets _tickets;
+
 private:
    // Class to manage the server socket
    SocketFD _sockfd;
@@ -1,21 +1,30 @@
 #include <arpa/inet.h>
+#include <sys/stat.h>
 #include <stdexcept>
 #include "ALMgr.h"
 #include "strfuncts.h"
 
-ALMgr::ALMgr(const char *al_file, bool is_whitelist):_al_file(al_file),_is_whitelist(is_whitelist) {
-
+ALMgr::ALMgr(const char *al_file, bool is_whitelist):_al_file(al_file),_is_whitelist(is_whitelist),
+                                                      _last_check(0),
+                                                      _file_size(0),
+                                                      _file_ino(0)
+{
+   _file_mtime.tv_sec = 0;
+   _file_mtime.tv_nsec = 0;
+   pthread_mutex_init(&_mutex, NULL);
 }
 
 
 ALMgr::~ALMgr() {
-
+   pthread_mutex_destroy(&_mutex);
 }
 
 /******************************************************************************************************
  * isAllowed - checks to see if the IP address is in the list and allows/denies based off _is_whitelist
- *  
+ *
  *    Second version takes in an unsigned long IP Addr in network (big endian) format
+ *
+ *    Throws: runtime_error if the list has never been loaded and the file can't be read
  ******************************************************************************************************/
 bool ALMgr::isAllowed(const char *ipaddr) {
    in_addr testaddr;
@@ -25,36 +34,175 @@ bool ALMgr::isAllowed(const char *ipaddr) {
 }
 
 bool ALMgr::isAllowed(unsigned long ipaddr) {
-   FILE *alfile;
+   std::shared_ptr<const al_table> table = getTable();
+   uint32_t addr = ntohl((uint32_t) ipaddr);
+
+   bool found = (table->hosts.count(addr) > 0) || table->inSubnet(addr);
 
-   // First, find the IP address in the file
-   if ((alfile = fopen(_al_file.c_str(), "r")) == NULL) {
-      throw std::runtime_error("Unable to open white list file.");
+   if (_is_whitelist)
+      return found;
+   return !found;
+}
+
+/******************************************************************************************************
+ * getTable - returns the current list, reloading it first if it's time to check the file
+ *
+ *    Throws: runtime_error if the list has never been loaded and the file can't be read
+ ******************************************************************************************************/
+std::shared_ptr<const ALMgr::al_table> ALMgr::getTable() {
+   pthread_mutex_lock(&_mutex);
+   bool check = (_table == nullptr) || (time(NULL) - _last_check >= al_check_secs);
+   pthread_mutex_unlock(&_mutex);
+
+   if (check && !reload()) {
+      pthread_mutex_lock(&_mutex);
+      bool loaded = (_table != nullptr);
+      pthread_mutex_unlock(&_mutex);
+
+      if (!loaded)
+         throw std::runtime_error("Unable to open white list file.");
    }
 
-   in_addr al_ip;
-   char strbuf[30];
-   strbuf[0] = '\0';
-   std::string ipstr;
-
-   while (fgets(strbuf, 30, alfile) != NULL) {
-      ipstr = strbuf;
-      clrNewlines(ipstr);
-      inet_pton(AF_INET, ipstr.c_str(), &al_ip);
-
-      if (al_ip.s_addr == ipaddr) {
-         fclose(alfile);
-         if (_is_whitelist)
-            return true;
-         else
-            return false;
+   pthread_mutex_lock(&_mutex);
+   std::shared_ptr<const al_table> table = _table;
+   pthread_mutex_unlock(&_mutex);
+   return table;
+}
+
+/******************************************************************************************************
+ * reload - loads the file if its mtime, size or inode changed since the last load (or nothing has been
+ *          loaded yet) and swaps the new list in
+ *
+ *    Returns: true if a new list was loaded, false if the file was unchanged or couldn't be read
+ ******************************************************************************************************/
+bool ALMgr::reload() {
+   struct stat st;
+
+   pthread_mutex_lock(&_mutex);
+   _last_check = time(NULL);
+   pthread_mutex_unlock(&_mutex);
+
+   if (stat(_al_file.c_str(), &st) != 0)
+      return false;
+
+   pthread_mutex_lock(&_mutex);
+   bool changed = (_table == nullptr) || (st.st_mtim.tv_sec != _file_mtime.tv_sec) ||
+                  (st.st_mtim.tv_nsec != _file_mtime.tv_nsec) || (st.st_size != _file_size) ||
+                  (st.st_ino != _file_ino);
+   pthread_mutex_unlock(&_mutex);
+
+   if (!changed)
+      return false;
+
+   // Parse outside the lock, lookups keep using the old list meanwhile
+   std::shared_ptr<const al_table> table = loadTable();
+   if (table == nullptr)
+      return false;
+
+   pthread_mutex_lock(&_mutex);
+   _table = table;
+   _file_mtime = st.st_mtim;
+   _file_size = st.st_size;
+   _file_ino = st.st_ino;
+   pthread_mutex_unlock(&_mutex);
+   return true;
+}
+
+/******************************************************************************************************
+ * size - number of host and subnet entries in the loaded list (0 if nothing is loaded)
+ ******************************************************************************************************/
+size_t ALMgr::size() {
+   pthread_mutex_lock(&_mutex);
+   size_t count = (_table == nullptr) ? 0 : _table->hosts.size() + _table->num_subnets;
+   pthread_mutex_unlock(&_mutex);
+   return count;
+}
+
+/******************************************************************************************************
+ * loadTable - reads the access list file into a new table
+ *
+ *    Returns: the table, or NULL if the file could not be opened
+ ******************************************************************************************************/
+std::shared_ptr<const ALMgr::al_table> ALMgr::loadTable() {
+   FILE *alfile;
+
+   if ((alfile = fopen(_al_file.c_str(), "r")) == NULL)
+      return nullptr;
+
+   std::shared_ptr<al_table> table(new al_table);
+
+   char strbuf[64];
+   std::string line, ipstr, lenstr;
+
+   while (fgets(strbuf, sizeof(strbuf), alfile) != NULL) {
+      line = strbuf;
+      clrNewlines(line);
+      if ((line.find_first_not_of(" \t") == std::string::npos) || (line[0] == '#'))
+         continue;
+
+      unsigned long prefix_len = 32;
+      if (split(line, ipstr, lenstr, '/')) {
+         char *end;
+         prefix_len = strtoul(lenstr.c_str(), &end, 10);
+         if ((end == lenstr.c_str()) || (prefix_len > 32))
+            continue;
+      } else {
+         ipstr = line;
       }
+      clrSpaces(ipstr);
+
+      in_addr al_ip;
+      if (inet_pton(AF_INET, ipstr.c_str(), &al_ip) != 1)
+         continue;
+
+      if (prefix_len == 32)
+         table->hosts.insert(ntohl(al_ip.s_addr));
+      else
+         table->addSubnet(ntohl(al_ip.s_addr), (unsigned int) prefix_len);
    }
 
    fclose(alfile);
+   return table;
+}
 
-   if (_is_whitelist)
-      return false;
-   return true;
+/******************************************************************************************************
+ * al_table::addSubnet - adds a prefix to the trie, one node per bit from the most significant down
+ ******************************************************************************************************/
+void ALMgr::al_table::addSubnet(uint32_t addr, unsigned int prefix_len) {
+   if (trie.size() == 0)
+      trie.emplace_back();
+
+   int node = 0;
+   for (unsigned int i=0; i<prefix_len; i++) {
+      unsigned int bit = (addr >> (31 - i)) & 1;
+      if (trie[node].child[bit] < 0) {
+         trie[node].child[bit] = (int) trie.size();
+         trie.emplace_back();
+      }
+      node = trie[node].child[bit];
+   }
+
+   if (!trie[node].terminal)
+      num_subnets++;
+   trie[node].terminal = true;
 }
 
+/******************************************************************************************************
+ * al_table::inSubnet - walks the trie along addr's bits, true at the first subnet that covers it
+ ******************************************************************************************************/
+bool ALMgr::al_table::inSubnet(uint32_t addr) const {
+   if (trie.size() == 0)
+      return false;
+
+   int node = 0;
+   for (unsigned int i=0; ; i++) {
+      if (trie[node].terminal)
+         return true;
+      if (i == 32)
+         return false;
+
+      node = trie[node].child[(addr >> (31 - i)) & 1];
+      if (node < 0)
+         return false;
+   }
+}
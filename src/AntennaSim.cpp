@@ -2,6 +2,11 @@
 #include <sys/time.h>
 #include "AntennaSim.h"
 #include "DronePlotDB.h"
+#include "Metrics.h"
+#include "PlotTrace.h"
+
+static MetricCounter &m_antenna_plots = Metrics::global().counter("antenna_plots_total",
+                                          "Plots injected by the antenna simulator");
 
 /*****************************************************************************************
  * AntennaSim (constructor) - takes in a reference to the accessible database that will be
@@ -16,7 +21,8 @@ AntennaSim::AntennaSim(DronePlotDB &dpdb, const char *source_filename, float tim
                                              _time_mult(time_mult),
                                              _time_offset(0),
                                              _verbosity(verbosity),
-                                             _start_time(0)
+                                             _own_clock(time_mult),
+                                             _clock(&_own_clock)
 {
    pthread_mutex_init(&_offset_mutex, NULL);
 
@@ -57,7 +63,7 @@ void AntennaSim::loadSourceDB(const char *filename) {
 }
 
 double AntennaSim::getAdjustedTime() {
-   return static_cast<time_t>(time(NULL) - _start_time) * _time_mult;
+   return _clock->getTime();
 }
 
 /*****************************************************************************************
@@ -78,25 +84,29 @@ void AntennaSim::simulate() {
 
    _time_offset = (rand() % 6) - 3;
 
+   // Sim time zero is now, shifted by our offset. A shared clock may already have been
+   // started by its owner
+   if (!_clock->isStarted())
+      _clock->start(_time_offset);
+
    pthread_mutex_unlock(&_offset_mutex);
 
    if (_verbosity >= 2) 
       std::cout << "SIM: Simulator time offset: " << _time_offset << " secs\n";
-   if (_verbosity >= 1)
-      std::cout << "SIM: Delaying 3 seconds before starting sim to let servers come online.\n";
-
-   // Provide a short 3 second delay before starting
-   for (unsigned int i=3; i>0; i--) {
-      if (_verbosity >= 2)
-         std::cout << i << "\n";
-      sleep(1);
+   // Provide a short 3 second delay before starting. A virtual clock replays as fast as
+   // it can, servers that aren't up yet get the plots on a later sync
+   if (!_clock->isVirtual()) {
+      if (_verbosity >= 1)
+         std::cout << "SIM: Delaying 3 seconds before starting sim to let servers come online.\n";
+
+      for (unsigned int i=3; i>0; i--) {
+         if (_verbosity >= 2)
+            std::cout << i << "\n";
+         sleep(1);
+      }
    }
 
-   // Initialize
-   _start_time = time(NULL) + _time_offset - 3;
-
-   timespec sleeptime;
-   std::list<DronePlot>::iterator diter;
+   DronePlotDB::iterator diter;
 
    // Change all the inject timestamps to the offset time
    for (diter = _source_db.begin(); diter != _source_db.end(); diter++) {
@@ -111,24 +121,18 @@ void AntennaSim::simulate() {
       double adjusted_time = getAdjustedTime();
 
       // If the adjusted time is not past the timestamp on our next inject, sleep until it is
+      // (a virtual clock skips straight to it)
       if (adjusted_time < (double) diter->timestamp) {
-
-         // We need a more precise adjusted time
-
-         // timespan = how long we need to sleep (add .55 secs to prevent rounding down issues
-         double timespan = ((double) diter->timestamp - adjusted_time) / _time_mult + .55;
-         sleeptime.tv_sec = (time_t) timespan;
-         sleeptime.tv_nsec = (long) (1000000000.0 * (timespan - (double) sleeptime.tv_sec));
-         
          if (_verbosity == 3)
-            std::cout << "SIM: Sim sleeping for " << sleeptime.tv_sec << " secs, " << sleeptime.tv_nsec
-                                                                        << " nanosecs\n";
-         nanosleep(&sleeptime, NULL);
+            std::cout << "SIM: Sim sleeping until sim time " << diter->timestamp << "\n";
+         _clock->sleepUntil((double) diter->timestamp);
       }
       
-      // Now inject all that have a timestamp less than the current time
+      // Now inject all that have a timestamp less than the current time, as one batch
+      // flagged new before the replication thread can see it
       adjusted_time = getAdjustedTime();
       diter = _source_db.begin();
+      std::list<DronePlot> batch;
 
       if (_verbosity >= 2)
             std::cout << "SIM: Cur systime: " << (time_t) getAdjustedTime() << "\n";
@@ -140,13 +144,13 @@ void AntennaSim::simulate() {
                   diter->drone_id << ", Time: " << diter->timestamp << " Lat: " << 
                   diter->latitude << ", Long: " << diter->longitude << "\n";
 
-         _to_db.addPlot(diter->drone_id, diter->node_id, diter->timestamp, diter->latitude, diter->longitude);
-         diter = _to_db.end();
-         diter--;
-         diter->setFlags(DBFLAG_NEW);
+         batch.emplace_back(diter->drone_id, diter->node_id, diter->timestamp, diter->latitude, diter->longitude);
+         batch.back().inject_ns = PlotTrace::now();
+         m_antenna_plots.inc();
          _source_db.popFront();
          diter = _source_db.begin();
       }
+      _to_db.addPlots(batch, DBFLAG_NEW);
    }
    
    if (_verbosity >= 2) {
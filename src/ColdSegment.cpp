@@ -0,0 +1,107 @@
+#include <stdexcept>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "ColdSegment.h"
+
+const char cold_magic[4] = { 'D', 'P', 'S', 'G' };
+const uint16_t cold_version = 1;
+
+// Where the timestamp sits in a serialized plot (after drone_id and node_id)
+const size_t cold_ts_offset = sizeof(DronePlot::drone_id) + sizeof(DronePlot::node_id);
+
+/*********************************************************************************************
+ * ColdSegment (constructor) - writes the plots out and maps the file back read-only
+ *
+ *    Params:  filename - the file to create (replaced if it exists)
+ *             start - the segment's start, for the header
+ *             plots - the plots to write, sorted by timestamp
+ *
+ *    Throws: runtime_error if the file could not be written or mapped (it is removed)
+ *********************************************************************************************/
+ColdSegment::ColdSegment(const std::string &filename, time_t start, std::list<DronePlot> &plots):
+                                    _filename(filename),
+                                    _start(start),
+                                    _count(plots.size()),
+                                    _record_size(DronePlot::getDataSize()),
+                                    _map(NULL),
+                                    _map_size(0)
+{
+   cold_file_header header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, cold_magic, sizeof(cold_magic));
+   header.version = cold_version;
+   header.record_size = _record_size;
+   header.count = _count;
+   header.start = start;
+
+   std::vector<uint8_t> buf((uint8_t *) &header, (uint8_t *) &header + sizeof(header));
+   buf.reserve(sizeof(header) + _count * _record_size);
+   for (auto dptr = plots.begin(); dptr != plots.end(); dptr++)
+      dptr->serialize(buf);
+   _map_size = buf.size();
+
+   int fd = open(_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0)
+      throw std::runtime_error("Unable to create cold segment file " + _filename);
+
+   size_t written = 0;
+   while (written < buf.size()) {
+      ssize_t results = write(fd, buf.data() + written, buf.size() - written);
+      if (results <= 0) {
+         close(fd);
+         unlink(_filename.c_str());
+         throw std::runtime_error("Unable to write cold segment file " + _filename);
+      }
+      written += results;
+   }
+
+   // The mapping keeps the file open for us
+   void *map = mmap(NULL, _map_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      unlink(_filename.c_str());
+      throw std::runtime_error("Unable to map cold segment file " + _filename);
+   }
+   _map = (uint8_t *) map;
+}
+
+ColdSegment::~ColdSegment() {
+   munmap(_map, _map_size);
+   unlink(_filename.c_str());
+}
+
+time_t ColdSegment::getTimestamp(size_t i) {
+   time_t timestamp;
+   memcpy(&timestamp, _map + sizeof(cold_file_header) + i * _record_size + cold_ts_offset,
+                                                                        sizeof(timestamp));
+   return timestamp;
+}
+
+/*********************************************************************************************
+ * scanRange - finds the first plot at or after start with a binary search, then reads plots
+ *             until one is past end
+ *
+ *    Returns: the number of plots func was called with
+ *********************************************************************************************/
+size_t ColdSegment::scanRange(time_t start, time_t end,
+                              const std::function<void(DronePlot &)> &func) {
+   size_t low = 0, high = _count;
+   while (low < high) {
+      size_t mid = low + (high - low) / 2;
+      if (getTimestamp(mid) < start)
+         low = mid + 1;
+      else
+         high = mid;
+   }
+
+   DronePlot plot;
+   size_t count = 0;
+   for (size_t i = low; (i < _count) && (getTimestamp(i) <= end); i++) {
+      plot.deserialize(_map + sizeof(cold_file_header) + i * _record_size);
+      func(plot);
+      count++;
+   }
+   return count;
+}
@@ -6,11 +6,28 @@
 #include <sstream>
 #include <fstream>
 #include <iomanip>
+#include <map>
+#include <limits>
+#include <iterator>
 
 #include "DronePlotDB.h"
+#include "ColdSegment.h"
 #include "strfuncts.h"
 #include "FileDesc.h"
+#include "Metrics.h"
 
+static MetricCounter &m_plots_added = Metrics::global().counter("drone_plots_added_total",
+                                          "Plots added to any DronePlotDB, including file loads");
+static MetricCounter &m_plots_erased = Metrics::global().counter("drone_plots_erased_total",
+                                          "Plots erased from any DronePlotDB");
+static MetricCounter &m_plots_expired = Metrics::global().counter("drone_plots_expired_total",
+                                          "Plots dropped from any DronePlotDB by retention");
+static MetricCounter &m_segments_sealed = Metrics::global().counter("drone_segments_sealed_total",
+                                          "DronePlotDB segments moved to the cold tier");
+
+// Every plot time there is, for scans of the whole database
+const time_t all_time_start = std::numeric_limits<time_t>::min();
+const time_t all_time_end = std::numeric_limits<time_t>::max();
 
 // Short compare function for database sort by timestamp
 bool compare_plot(const DronePlot &pp1, const DronePlot &pp2) {
@@ -26,6 +43,7 @@ DronePlot::DronePlot():
                timestamp(0),
                latitude(0.0),
                longitude(0.0),
+               inject_ns(0),
                _flags(0)
 {
    
@@ -41,6 +59,7 @@ DronePlot::DronePlot(int in_droneid, int in_nodeid, int in_timestamp, float in_l
                timestamp(in_timestamp),
                latitude(in_latitude),
                longitude(in_longitude),
+               inject_ns(0),
                _flags(0)
 {
 
@@ -123,6 +142,23 @@ void DronePlot::deserialize(std::vector<uint8_t> &buf, unsigned int start_pt) {
 
 }
 
+/*****************************************************************************************
+ * deserialize - same as above, straight from memory holding getDataSize() bytes (e.g. a
+ *               mapped file)
+ *****************************************************************************************/
+
+void DronePlot::deserialize(const uint8_t *buf) {
+   memcpy(&drone_id, buf, sizeof(drone_id));
+   buf += sizeof(drone_id);
+   memcpy(&node_id, buf, sizeof(node_id));
+   buf += sizeof(node_id);
+   memcpy(&timestamp, buf, sizeof(timestamp));
+   buf += sizeof(timestamp);
+   memcpy(&latitude, buf, sizeof(latitude));
+   buf += sizeof(latitude);
+   memcpy(&longitude, buf, sizeof(longitude));
+}
+
 /*****************************************************************************************
  * readCSV - Populates this drone entry from a csv string
  *
@@ -222,7 +258,7 @@ DronePlotDB::~DronePlotDB() {
 
 
 /*****************************************************************************************
- * addPlot - Adds a plot object at the end of the doubly-linked list
+ * addPlot - Adds a plot object at the end of its time segment
  *
  *    Params:  drone_id - the unique integer ID of this particular drone
  *             node_id - the unique integer ID of the receiving site
@@ -236,12 +272,95 @@ void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float lat
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
-   _dbdata.emplace_back(drone_id, node_id, timestamp, latitude, longitude);
+   findSegment(timestamp)->plots.emplace_back(drone_id, node_id, timestamp, latitude, longitude);
+   _count++;
+   m_plots_added.inc();
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
 }
 
+/*****************************************************************************************
+ * addPlots - Adds a batch of plots at the end of their time segments. Flags are set and
+ *            the plots grouped by segment before the lock is taken, then each group's list
+ *            nodes are spliced over rather than copied, so the lock is held for time in the
+ *            number of segments the batch spans, not its size
+ *
+ *    Params:  plots - the plots to add, left empty
+ *             flags - flags to set on each plot (e.g. DBFLAG_NEW), 0 for none
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::addPlots(std::list<DronePlot> &plots, unsigned short flags) {
+   size_t count = plots.size();
+   std::map<time_t, std::list<DronePlot>> groups;
+
+   auto dptr = plots.begin();
+   while (dptr != plots.end()) {
+      if (flags != 0)
+         dptr->setFlags(flags);
+
+      std::list<DronePlot> &group = groups[segmentStart(dptr->timestamp)];
+      group.splice(group.end(), plots, dptr++);
+   }
+
+   pthread_mutex_lock(&_mutex);
+
+   for (auto gptr = groups.begin(); gptr != groups.end(); gptr++) {
+      std::list<DronePlot> &seg_plots = findSegment(gptr->first)->plots;
+      seg_plots.splice(seg_plots.end(), gptr->second);
+   }
+   _count += count;
+   m_plots_added.inc(count);
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * segmentStart - the start of the segment timestamp falls in (rounding down, negative
+ *                timestamps included)
+ *****************************************************************************************/
+
+time_t DronePlotDB::segmentStart(time_t timestamp) {
+   return timestamp - (((timestamp % _segment_secs) + _segment_secs) % _segment_secs);
+}
+
+/*****************************************************************************************
+ * findSegment - finds the segment timestamp falls in, adding it in order if there isn't
+ *               one. The newest segment, where most plots go, is checked first
+ *
+ *    Note: the mutex must already be locked
+ *
+ *****************************************************************************************/
+
+std::list<PlotSegment>::iterator DronePlotDB::findSegment(time_t timestamp) {
+   time_t start = segmentStart(timestamp);
+
+   if ((_segments.size() > 0) && (_segments.back().start == start))
+      return std::prev(_segments.end());
+
+   auto iptr = _seg_index.lower_bound(start);
+   if ((iptr != _seg_index.end()) && (iptr->first == start))
+      return iptr->second;
+
+   auto sptr = _segments.emplace((iptr == _seg_index.end()) ? _segments.end() : iptr->second);
+   sptr->start = start;
+   _seg_index.emplace_hint(iptr, start, sptr);
+   return sptr;
+}
+
+/*****************************************************************************************
+ * setSegmentSecs - sets how many seconds of plot time a segment holds
+ *
+ *    Throws: runtime_error if secs isn't positive or the database already has plots
+ *****************************************************************************************/
+
+void DronePlotDB::setSegmentSecs(time_t secs) {
+   if ((secs <= 0) || (_count > 0))
+      throw std::runtime_error("Segment size must be positive and set while the database is empty");
+   _segment_secs = secs;
+}
+
 /*****************************************************************************************
  * loadCSVFile - loads in a CSV file containing the plot entries in the right order. The
  *               order should be (no spaces around commas):
@@ -265,7 +384,7 @@ int DronePlotDB::loadCSVFile(const char *filename) {
    // Get line by line, parsing out our data
    std::string buf, data;
    int count = 0;
-   std::list<DronePlot>::iterator newplot;
+   DronePlot newplot(-1, -1, 0, 0.0, 0.0);
   
    while (!cfile.eof()) {
       std::getline(cfile, buf);
@@ -273,18 +392,16 @@ int DronePlotDB::loadCSVFile(const char *filename) {
       if (buf.size() == 0)
          continue;
       
-      // Add this to the end and get an iterator pointing to it
-      _dbdata.emplace_back(-1, -1, 0, 0.0, 0.0);
-      newplot = _dbdata.end();
-      newplot--;
-
-      if (newplot->readCSV(buf) == -1)
+      if (newplot.readCSV(buf) == -1)
          return -1;
 
       // Add it to the database 
+      findSegment(newplot.timestamp)->plots.push_back(newplot);
+      _count++;
       count++;
    }
    cfile.close();
+   m_plots_added.inc(count);
    return count;
 }
 
@@ -306,13 +423,12 @@ int DronePlotDB::writeCSVFile(const char *filename) {
    if (cfile.fail())
       return -1;
 
+   // Both tiers, oldest segment first
    std::string buf;
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
-   for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->writeCSV(buf);
+   count = scanRange(all_time_start, all_time_end, [&](DronePlot &plot) {
+      plot.writeCSV(buf);
       cfile << buf;
-      count++;
-   }
+   });
 
    cfile.close();
    return count; 
@@ -338,16 +454,11 @@ int DronePlotDB::writeBinaryFile(const char *filename) {
 
    // Prep our vector that will be storing our plotpt data with exactly the right size
    std::vector<uint8_t> plot;
-   unsigned int ppsize = DronePlot::getDataSize() * _dbdata.size();
+   unsigned int ppsize = DronePlot::getDataSize() * size();
    plot.reserve(ppsize);
 
-   // Loop through all data points and write them to our binary vector
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
-   for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->serialize(plot);
-
-      count++;
-   }
+   // Loop through all data points (both tiers) and write them to our binary vector
+   count = scanRange(all_time_start, all_time_end, [&](DronePlot &dp) { dp.serialize(plot); });
    // Write it to a file
    std::cout << "Writing count: " << plot.size() << "\n";
    outfile.writeBytes<uint8_t>(plot);
@@ -366,7 +477,7 @@ int DronePlotDB::writeBinaryFile(const char *filename) {
 
 int DronePlotDB::loadBinaryFile(const char *filename) {
    std::vector<uint8_t> buf;
-   std::list<DronePlot>::iterator dptr;
+   DronePlot newplot;
 
    FileFD infile(filename);
    int count = 0;
@@ -378,16 +489,15 @@ int DronePlotDB::loadBinaryFile(const char *filename) {
    unsigned int size = 0;
    unsigned int ppsize = DronePlot::getDataSize();
    while ((size = infile.readBytes<uint8_t>(buf, ppsize)) == ppsize) {
-      _dbdata.emplace_back();
-      dptr = _dbdata.end();
-      dptr--;
-
       // Deserialize
-      dptr->deserialize(buf);
+      newplot.deserialize(buf);
       buf.clear();
 
+      findSegment(newplot.timestamp)->plots.push_back(newplot);
+      _count++;
       count++;
    }
+   m_plots_added.inc(count);
    
    // Final read should be size = 0 or this may be a corrupted file
    if (size != 0) {
@@ -409,32 +519,53 @@ void DronePlotDB::popFront() {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
-   _dbdata.pop_front();
+   iterator first = begin();
+   if (first != end()) {
+      if (first->isFlagSet(DBFLAG_DEAD)) {
+         first._seg->dead--;
+         _dead--;
+      }
+      first._seg->plots.pop_front();
+      _count--;
+
+      // Segments emptied from the front go with it
+      while ((_segments.size() > 0) && _segments.front().plots.empty()) {
+         _seg_index.erase(_segments.front().start);
+         _segments.pop_front();
+      }
+   }
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
 }
 
 /*****************************************************************************************
- * erase - removes the DronePlot at the specified index
+ * erase - removes the DronePlot at the specified index (of the live plots)
  *
  *    Warning: this has up to linear time speed--better to use iterators when possible
  *
  *    Note: this locks the mutex and may block if it is already locked.
  *
+ *    Throws: runtime_error if i is past the end
  *****************************************************************************************/
 
 void DronePlotDB::erase(unsigned int i) {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
-   if (i > _dbdata.size())
+   if (i >= _count - _dead) {
+      pthread_mutex_unlock(&_mutex);
       throw std::runtime_error("erase function called with index out of scope for std::list.");
+   }
 
-   std::list<DronePlot>::iterator diter = _dbdata.begin();
-   for (unsigned int x=0; x<i; x++, diter++);
-
-   _dbdata.erase(diter);
+   iterator diter = begin();
+   for (unsigned int x=0; ; diter++) {
+      if (diter->isFlagSet(DBFLAG_DEAD))
+         continue;
+      if (x++ == i)
+         break;
+   }
 
+   killPlot(diter);
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
@@ -449,11 +580,11 @@ void DronePlotDB::erase(unsigned int i) {
  *
  *****************************************************************************************/
 
-std::list<DronePlot>::iterator DronePlotDB::erase(std::list<DronePlot>::iterator dptr) {
+DronePlotDB::iterator DronePlotDB::erase(DronePlotDB::iterator dptr) {
    // First lock the mutex (blocking)
    pthread_mutex_lock(&_mutex);
 
-   auto retptr = _dbdata.erase(dptr);
+   auto retptr = killPlot(dptr);
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
@@ -461,20 +592,336 @@ std::list<DronePlot>::iterator DronePlotDB::erase(std::list<DronePlot>::iterator
    return retptr;
 }
 
+/*****************************************************************************************
+ * killPlot - erases the plot, or in tombstone mode flags it dead. Already dead plots are
+ *            left as they are
+ *
+ *    Returns: an iterator pointing to the next element in the list
+ *
+ *    Note: the mutex must already be locked
+ *
+ *****************************************************************************************/
+
+DronePlotDB::iterator DronePlotDB::killPlot(DronePlotDB::iterator dptr) {
+   if (dptr->isFlagSet(DBFLAG_DEAD))
+      return ++dptr;
+
+   m_plots_erased.inc();
+   if (!_tombstones) {
+      _count--;
+      return iterator(dptr._seg, _segments.end(), dptr._seg->plots.erase(dptr._pos));
+   }
+
+   dptr->setFlags(DBFLAG_DEAD);
+   dptr._seg->dead++;
+   _dead++;
+   return ++dptr;
+}
+
+/*****************************************************************************************
+ * removeIf - erases (or in tombstone mode marks dead) every live plot that pred returns
+ *            true for, in a single pass
+ *
+ *    Params:  pred - called with each live plot while the mutex is held
+ *
+ *    Returns: the number of plots erased
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+size_t DronePlotDB::removeIf(const std::function<bool(DronePlot &)> &pred) {
+   size_t count = 0;
+
+   pthread_mutex_lock(&_mutex);
+
+   iterator dptr = begin();
+   while (dptr != end()) {
+      if (!dptr->isFlagSet(DBFLAG_DEAD) && pred(*dptr)) {
+         dptr = killPlot(dptr);
+         count++;
+      } else
+         dptr++;
+   }
+
+   pthread_mutex_unlock(&_mutex);
+   return count;
+}
+
+void DronePlotDB::setTombstones(bool tombstones) {
+   if (!tombstones)
+      compact();
+   _tombstones = tombstones;
+}
+
+/*****************************************************************************************
+ * compact - reclaims the plots marked dead in tombstone mode. They're spliced out onto a
+ *           list of our own under the mutex, which is constant time per plot, and freed
+ *           once it's released. Only segments with dead plots are walked, and segments left
+ *           empty are dropped
+ *
+ *    Returns: the number of plots reclaimed
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+size_t DronePlotDB::compact() {
+   std::list<DronePlot> reclaimed;
 
-// Removes all of a particular node (not for student use)
-void DronePlotDB::removeNodeID(unsigned int node_id) {
    pthread_mutex_lock(&_mutex);
 
-   auto del_iter = _dbdata.begin();
-   while (del_iter != _dbdata.end()) {
-      if (del_iter->node_id == node_id)
-         del_iter = _dbdata.erase(del_iter);
-      else
-         del_iter++;
+   auto sptr = _segments.begin();
+   while ((_dead > 0) && (sptr != _segments.end())) {
+      auto dptr = sptr->plots.begin();
+      while ((sptr->dead > 0) && (dptr != sptr->plots.end())) {
+         if (dptr->isFlagSet(DBFLAG_DEAD)) {
+            reclaimed.splice(reclaimed.end(), sptr->plots, dptr++);
+            sptr->dead--;
+            _dead--;
+         } else
+            dptr++;
+      }
+
+      if (sptr->plots.empty()) {
+         _seg_index.erase(sptr->start);
+         sptr = _segments.erase(sptr);
+      } else
+         sptr++;
    }
+   _count -= reclaimed.size();
 
    pthread_mutex_unlock(&_mutex);
+   return reclaimed.size();
+}
+
+/*****************************************************************************************
+ * scanRange - calls func with each live plot timestamped from start to end, skipping the
+ *             segments that don't overlap. Cold and hot segments are walked together in
+ *             order of their start (cold first when they start together)
+ *
+ *    Returns: the number of plots func was called with
+ *
+ *****************************************************************************************/
+
+size_t DronePlotDB::scanRange(time_t start, time_t end,
+                              const std::function<void(DronePlot &)> &func) {
+   size_t count = 0;
+   auto cptr = _cold.begin();
+   auto sptr = _segments.begin();
+
+   while ((cptr != _cold.end()) || (sptr != _segments.end())) {
+      if ((cptr != _cold.end()) &&
+          ((sptr == _segments.end()) || ((*cptr)->getStart() <= sptr->start))) {
+         if ((*cptr)->getStart() > end)
+            break;
+         if ((*cptr)->getStart() + _segment_secs > start)
+            count += (*cptr)->scanRange(start, end, func);
+         cptr++;
+         continue;
+      }
+
+      if (sptr->start > end)
+         break;
+      if (sptr->start + _segment_secs <= start) {
+         sptr++;
+         continue;
+      }
+
+      for (auto dptr = sptr->plots.begin(); dptr != sptr->plots.end(); dptr++) {
+         if (dptr->isFlagSet(DBFLAG_DEAD) || (dptr->timestamp < start) ||
+             (dptr->timestamp > end))
+            continue;
+         func(*dptr);
+         count++;
+      }
+      sptr++;
+   }
+   return count;
+}
+
+void DronePlotDB::setRetention(time_t max_age, size_t max_plots) {
+   pthread_mutex_lock(&_mutex);
+   _max_age = max_age;
+   _max_plots = max_plots;
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * applyRetention - drops the oldest segments, cold or hot, while they're past the age limit
+ *                  or we're over the plot budget. Each one is unlinked under the mutex in
+ *                  constant time and its plots (or file) freed once it's released. The
+ *                  newest hot segment is always kept
+ *
+ *    Params:  now - the current plot time
+ *
+ *    Returns: the number of live plots dropped
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+size_t DronePlotDB::applyRetention(time_t now) {
+   std::list<PlotSegment> dropped;
+   std::list<std::unique_ptr<ColdSegment>> dropped_cold;
+   size_t count = 0;
+
+   pthread_mutex_lock(&_mutex);
+
+   while (true) {
+      bool cold = (_cold.size() > 0) &&
+                  ((_segments.size() == 0) || (_cold.front()->getStart() <= _segments.front().start));
+      if (!cold && (_segments.size() <= 1))
+         break;
+
+      time_t oldest_start = cold ? _cold.front()->getStart() : _segments.front().start;
+      bool too_old = (_max_age > 0) && (oldest_start + _segment_secs <= now - _max_age);
+      bool over_budget = (_max_plots > 0) && (size() > _max_plots);
+      if (!too_old && !over_budget)
+         break;
+
+      if (cold) {
+         count += _cold.front()->size();
+         _cold_count -= _cold.front()->size();
+         dropped_cold.splice(dropped_cold.end(), _cold, _cold.begin());
+         continue;
+      }
+
+      PlotSegment &oldest = _segments.front();
+      count += oldest.plots.size() - oldest.dead;
+      _count -= oldest.plots.size();
+      _dead -= oldest.dead;
+      _seg_index.erase(oldest.start);
+      dropped.splice(dropped.end(), _segments, _segments.begin());
+   }
+
+   pthread_mutex_unlock(&_mutex);
+
+   m_plots_expired.inc(count);
+   return count;
+}
+
+time_t DronePlotDB::oldestStart(bool hot_only) {
+   time_t start = 0;
+
+   pthread_mutex_lock(&_mutex);
+   if (_segments.size() > 0)
+      start = _segments.front().start;
+   if (!hot_only && (_cold.size() > 0) && ((start == 0) || (_cold.front()->getStart() < start)))
+      start = _cold.front()->getStart();
+   pthread_mutex_unlock(&_mutex);
+
+   return start;
+}
+
+time_t DronePlotDB::coldEnd() {
+   time_t end = 0;
+
+   pthread_mutex_lock(&_mutex);
+   if (_cold.size() > 0)
+      end = _cold.back()->getStart() + _segment_secs;
+   pthread_mutex_unlock(&_mutex);
+
+   return end;
+}
+
+void DronePlotDB::setColdTier(const std::string &dir, time_t hot_secs) {
+   _cold_dir = dir;
+   _hot_secs = hot_secs;
+}
+
+/*****************************************************************************************
+ * sealSegments - moves the oldest hot segments to the cold tier while they're ready (see
+ *                DronePlotDB.h). Each one's live plots are copied under the mutex, then
+ *                sorted and written out without it, so the antenna isn't held up by the
+ *                disk. The hot segment is only swapped for the cold one once that's done
+ *
+ *    Params:  now - the current plot time
+ *
+ *    Returns: the number of plots sealed
+ *
+ *    Throws: runtime_error if a segment's file can't be written. The segment stays hot
+ *****************************************************************************************/
+
+size_t DronePlotDB::sealSegments(time_t now) {
+   size_t sealed = 0;
+
+   while (_cold_dir.size() > 0) {
+      std::list<DronePlot> plots;
+      size_t seg_size, seg_dead;
+      time_t start;
+
+      pthread_mutex_lock(&_mutex);
+
+      // The newest segment always stays hot
+      if (_segments.size() <= 1) {
+         pthread_mutex_unlock(&_mutex);
+         break;
+      }
+
+      // The live plots are copied out, so the segment stays in place (and in size() and
+      // scanRange) until the cold one replaces it
+      PlotSegment &oldest = _segments.front();
+      bool ready = (oldest.start + _segment_secs <= now - _hot_secs);
+      for (auto dptr = oldest.plots.begin(); ready && (dptr != oldest.plots.end()); dptr++) {
+         if (dptr->isFlagSet(DBFLAG_DEAD))
+            continue;
+         if (dptr->isFlagSet(DBFLAG_NEW))
+            ready = false;
+         else
+            plots.push_back(*dptr);
+      }
+      start = oldest.start;
+      seg_size = oldest.plots.size();
+      seg_dead = oldest.dead;
+
+      pthread_mutex_unlock(&_mutex);
+
+      if (!ready)
+         break;
+
+      plots.sort(compare_plot);
+
+      std::string filename = _cold_dir + "/plots." + std::to_string(getpid()) + "." +
+                             std::to_string(_cold_files++) + ".seg";
+      std::unique_ptr<ColdSegment> cold(new ColdSegment(filename, start, plots));
+
+      // Swap it in for the hot segment, unless plots were added or erased while it was
+      // written, in which case the file is dropped and the segment tried again next time
+      std::list<PlotSegment> seg;
+
+      pthread_mutex_lock(&_mutex);
+
+      auto iptr = _seg_index.find(start);
+      if ((iptr != _seg_index.end()) && (iptr->second->plots.size() == seg_size) &&
+                                        (iptr->second->dead == seg_dead)) {
+         _count -= seg_size;
+         _dead -= seg_dead;
+         seg.splice(seg.end(), _segments, iptr->second);
+         _seg_index.erase(iptr);
+
+         // Ordered by start (a late plot can bring back a segment older than ones sealed)
+         auto cptr = _cold.end();
+         while ((cptr != _cold.begin()) && ((*std::prev(cptr))->getStart() > start))
+            cptr--;
+         _cold.insert(cptr, std::move(cold));
+         _cold_count += plots.size();
+      }
+
+      pthread_mutex_unlock(&_mutex);
+
+      if (cold != NULL)
+         break;
+
+      sealed += plots.size();
+      m_segments_sealed.inc();
+   }
+   return sealed;
+}
+
+// Removes all of a particular node (not for student use)
+void DronePlotDB::removeNodeID(unsigned int node_id) {
+   removeIf([node_id](DronePlot &plot) { return plot.node_id == node_id; });
 }
 
 /*****************************************************************************************
@@ -485,7 +932,26 @@ void DronePlotDB::removeNodeID(unsigned int node_id) {
 void DronePlotDB::sortByTime() {
    pthread_mutex_lock(&_mutex);
 
-   _dbdata.sort(compare_plot);
+   for (auto sptr = _segments.begin(); sptr != _segments.end(); sptr++) {
+      auto dptr = sptr->plots.begin();
+      while (dptr != sptr->plots.end()) {
+         if (segmentStart(dptr->timestamp) == sptr->start) {
+            dptr++;
+            continue;
+         }
+
+         // Moved out of this segment (e.g. by a skew fix), splice it over to the right one
+         auto dest = findSegment(dptr->timestamp);
+         if (dptr->isFlagSet(DBFLAG_DEAD)) {
+            sptr->dead--;
+            dest->dead++;
+         }
+         dest->plots.splice(dest->plots.end(), sptr->plots, dptr++);
+      }
+   }
+
+   for (auto sptr = _segments.begin(); sptr != _segments.end(); sptr++)
+      sptr->plots.sort(compare_plot);
 
    pthread_mutex_unlock(&_mutex);
 }
@@ -495,6 +961,11 @@ void DronePlotDB::sortByTime() {
  *****************************************************************************************/
 
 void DronePlotDB::clear() {
-   _dbdata.clear();
+   _segments.clear();
+   _seg_index.clear();
+   _cold.clear();
+   _cold_count = 0;
+   _count = 0;
+   _dead = 0;
 }
 
@@ -0,0 +1,257 @@
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "EventLog.h"
+
+const char event_magic[4] = { 'R', 'E', 'V', 'T' };
+const uint16_t event_version = 1;
+
+/*********************************************************************************************
+ * EventLog (constructor) - starts a new event file, rotating an existing one out of the way
+ *
+ *    Params:  filename - the current file, older ones get .1, .2, ... appended
+ *             records_per_file - when to rotate
+ *             max_files - how many files to keep, counting the current one
+ *
+ *    Throws: runtime_error if the file could not be created or mapped
+ *********************************************************************************************/
+EventLog::EventLog(const char *filename, unsigned int records_per_file, unsigned int max_files):
+                                    _filename(filename),
+                                    _records_per_file(records_per_file),
+                                    _max_files(max_files),
+                                    _fd(-1),
+                                    _map(NULL),
+                                    _map_size(0),
+                                    _header(NULL),
+                                    _records(NULL),
+                                    _dropped(0),
+                                    _trim_failures(0)
+{
+   if (_records_per_file == 0)
+      _records_per_file = 1;
+   if (_max_files == 0)
+      _max_files = 1;
+
+   pthread_mutex_init(&_mutex, NULL);
+
+   struct stat st;
+   if (stat(_filename.c_str(), &st) == 0)
+      rotate();
+   else
+      openFile();
+}
+
+EventLog::~EventLog() {
+   // Nothing to report a failed trim to this late, and the file still reads back
+   closeFile();
+   pthread_mutex_destroy(&_mutex);
+}
+
+/*********************************************************************************************
+ * now - the current time in ns since the epoch
+ *********************************************************************************************/
+uint64_t EventLog::now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*********************************************************************************************
+ * monotonic - ns on a clock that only moves forward, whatever happens to the wall clock
+ *********************************************************************************************/
+uint64_t EventLog::monotonic() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*********************************************************************************************
+ * log - fills in the next record of the file, rotating first if it is full
+ *
+ *    Params:  type - what happened
+ *             peer - the other end's server ID (cut to 19 characters)
+ *             bytes, plots, latency_ns - see event_type for what each type puts in these
+ *
+ *    Never throws, as it's called from the I/O paths. If a rotation can't create the new file
+ *    there's no file any more, and this record and all after it are dropped (see getDropped)
+ *********************************************************************************************/
+void EventLog::log(event_type type, const char *peer, uint32_t bytes, uint32_t plots,
+                                                                     uint64_t latency_ns) {
+   event_record rec;
+
+   memset(&rec, 0, sizeof(rec));
+   rec.timestamp_ns = now();
+   rec.latency_ns = latency_ns;
+   rec.bytes = bytes;
+   rec.plots = plots;
+   rec.type = type;
+   if (peer != NULL)
+      strncpy(rec.peer, peer, sizeof(rec.peer) - 1);
+
+   pthread_mutex_lock(&_mutex);
+   if (_map == NULL) {
+      _dropped++;
+      pthread_mutex_unlock(&_mutex);
+      return;
+   }
+
+   try {
+      if (_header->count >= _header->capacity)
+         rotate();
+   } catch (std::runtime_error &) {
+      _dropped++;
+      pthread_mutex_unlock(&_mutex);
+      return;
+   }
+
+   memcpy(&_records[_header->count], &rec, sizeof(rec));
+   _header->count++;
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*********************************************************************************************
+ * openFile - creates _filename at its full size and maps it
+ *
+ *    Throws: runtime_error on failure
+ *********************************************************************************************/
+void EventLog::openFile() {
+   _map_size = sizeof(event_file_header) + (size_t) _records_per_file * sizeof(event_record);
+
+   _fd = open(_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (_fd < 0)
+      throw std::runtime_error("Unable to create event log file " + _filename);
+
+   if (ftruncate(_fd, _map_size) != 0) {
+      close(_fd);
+      _fd = -1;
+      throw std::runtime_error("Unable to size event log file " + _filename);
+   }
+
+   void *map = mmap(NULL, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+   if (map == MAP_FAILED) {
+      close(_fd);
+      _fd = -1;
+      throw std::runtime_error("Unable to map event log file " + _filename);
+   }
+
+   _map = (uint8_t *) map;
+   _header = (event_file_header *) _map;
+   _records = (event_record *) (_map + sizeof(event_file_header));
+
+   memcpy(_header->magic, event_magic, sizeof(event_magic));
+   _header->version = event_version;
+   _header->record_size = sizeof(event_record);
+   _header->capacity = _records_per_file;
+   _header->count = 0;
+   _header->created_ns = now();
+}
+
+/*********************************************************************************************
+ * closeFile - unmaps the current file and trims off the unused records. The header's capacity
+ *             is cut to the records used first, so a file that couldn't be trimmed still reads
+ *             back right, it just keeps its unused space
+ *
+ *    Returns: false if the file couldn't be trimmed
+ *********************************************************************************************/
+bool EventLog::closeFile() {
+   if (_map == NULL)
+      return true;
+
+   size_t used = sizeof(event_file_header) + (size_t) _header->count * sizeof(event_record);
+   _header->capacity = _header->count;
+   munmap(_map, _map_size);
+   bool trimmed = (ftruncate(_fd, used) == 0);
+   close(_fd);
+
+   _map = NULL;
+   _header = NULL;
+   _records = NULL;
+   _fd = -1;
+   return trimmed;
+}
+
+/*********************************************************************************************
+ * rotate - closes the current file, shifts the older ones up a number (dropping the oldest)
+ *          and starts a new one. An old file that couldn't be trimmed is only counted (see
+ *          getTrimFailures), as it still reads back
+ *
+ *    Throws: runtime_error if the new file could not be created
+ *********************************************************************************************/
+void EventLog::rotate() {
+   if (!closeFile())
+      _trim_failures++;
+
+   for (unsigned int i=_max_files - 1; i>0; i--) {
+      std::string older = _filename + "." + std::to_string(i);
+      std::string newer = (i == 1) ? _filename : _filename + "." + std::to_string(i - 1);
+      if (rename(newer.c_str(), older.c_str()) != 0)
+         unlink(older.c_str());
+   }
+   if (_max_files == 1)
+      unlink(_filename.c_str());
+
+   openFile();
+}
+
+/*********************************************************************************************
+ * getDropped, getTrimFailures - mutex'd reads of the failure counts (see log and rotate)
+ *********************************************************************************************/
+uint64_t EventLog::getDropped() {
+   pthread_mutex_lock(&_mutex);
+   uint64_t dropped = _dropped;
+   pthread_mutex_unlock(&_mutex);
+   return dropped;
+}
+
+unsigned int EventLog::getTrimFailures() {
+   pthread_mutex_lock(&_mutex);
+   unsigned int failures = _trim_failures;
+   pthread_mutex_unlock(&_mutex);
+   return failures;
+}
+
+/*********************************************************************************************
+ * getTypeName - name of an event type for display
+ *********************************************************************************************/
+const char *EventLog::getTypeName(uint16_t type) {
+   static const char *names[ev_max] = { "none", "conn_accepted", "connect_failed", "auth_ok",
+                                        "auth_failed", "frame_sent", "frame_acked", "frame_recv",
+                                        "session_lost", "batch_applied", "digest_match",
+                                        "digest_diverged" };
+   if (type >= ev_max)
+      return "unknown";
+   return names[type];
+}
+
+/*********************************************************************************************
+ * readFile - reads the records of an event file (one still being written is fine)
+ *
+ *    Params:  filename - file to read
+ *             records - the records are appended here
+ *
+ *    Throws: runtime_error if the file can't be read or is not an event file
+ *********************************************************************************************/
+void EventLog::readFile(const char *filename, std::vector<event_record> &records) {
+   FILE *fptr = fopen(filename, "rb");
+   if (fptr == NULL)
+      throw std::runtime_error(std::string("Unable to open event file ") + filename);
+
+   event_file_header header;
+   if ((fread(&header, sizeof(header), 1, fptr) != 1) ||
+       (memcmp(header.magic, event_magic, sizeof(event_magic)) != 0) ||
+       (header.version != event_version) || (header.record_size != sizeof(event_record))) {
+      fclose(fptr);
+      throw std::runtime_error(std::string(filename) + " is not a readable event file");
+   }
+
+   size_t start = records.size();
+   records.resize(start + header.count);
+   size_t got = fread(&records[start], sizeof(event_record), header.count, fptr);
+   records.resize(start + got);
+   fclose(fptr);
+}
@@ -4,7 +4,8 @@
 #include <cstring>
 #include <arpa/inet.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include "FileDesc.h"
@@ -61,27 +62,30 @@ ssize_t FileDesc::readByte(unsigned char &buf) {
 }
 
 /*****************************************************************************************
- * hasData - uses the select function to poll the FD for available read data
+ * hasData - polls the FD for available read data. Uses ppoll rather than select so FDs
+ *           above FD_SETSIZE work
  *
- *    Params: ms_timeout - milliseconds to wait for data before returning if none found
+ *    Params: usec_timeout - microseconds to wait for data before returning if none found
  *
- *    Returns: true if data is available for reading, false otherwise
+ *    Returns: true if data is available for reading (or the other end closed), false
+ *             otherwise
+ *
+ *    Throws: socket_error if the FD is closed or the poll fails
  *****************************************************************************************/
 
-bool FileDesc::hasData(long ms_timeout) {
-   fd_set read_fds;
-   timeval timeout;
-
-   timeout.tv_sec = 0;
-   timeout.tv_usec = ms_timeout;
+bool FileDesc::hasData(long usec_timeout) {
+   if (_fd < 0)
+      throw socket_error("Poll on a closed file descriptor.");
 
-   FD_ZERO(&read_fds);
-   FD_SET(_fd, &read_fds);
+   struct pollfd pfd = { _fd, POLLIN, 0 };
+   struct timespec timeout = { usec_timeout / 1000000, (usec_timeout % 1000000) * 1000 };
 
    int n;
-   if ((n = select(_fd+1, &read_fds, NULL, NULL, &timeout)) == -1) {
-      throw socket_error("Select error on file descriptor.");
+   if ((n = ppoll(&pfd, 1, &timeout, NULL)) == -1) {
+      throw socket_error("Poll error on file descriptor.");
    }
+   if ((n > 0) && (pfd.revents & POLLNVAL))
+      throw socket_error("Poll on an invalid file descriptor.");
 
    if (n == 0)
       return false;
@@ -146,28 +150,44 @@ bool FileDesc::isOpen() {
  * closeFD - closes the FD cleanly
  ***************************************************************************************/
 void FileDesc::closeFD() {
+   if (_fd < 0)
+      return;
    close(_fd);
+   _fd = -1;
 }
 
 /****************************************************************************************
- * SocketFD (constructor) - Creates the socket FD for network sockets
+ * SocketFD (constructor) - the socket itself isn't created until it's needed
  *
- *    Throws: socket_error if the socket creation function fails for some reason
-   
  ****************************************************************************************/
 
 SocketFD::SocketFD():FileDesc() {
+   bzero(&_fd_addr, sizeof(_fd_addr));
+}
+
+SocketFD::~SocketFD() {
+   closeFD();
+}
+
+/****************************************************************************************
+ * openSocket - creates the socket FD if there isn't one open
+ *
+ *    Throws: socket_error if the socket creation function fails for some reason
+ ****************************************************************************************/
+
+void SocketFD::openSocket() {
+   if (_fd >= 0)
+      return;
 
-   // Create the socket
    _fd = socket(AF_INET, SOCK_STREAM, 0);
    if (_fd == -1) {
       throw socket_error("Socket creation failed.");
    }
-   bzero(&_fd_addr, sizeof(_fd_addr));
 }
 
-SocketFD::~SocketFD() {
-
+void SocketFD::setNonBlocking() {
+   openSocket();
+   FileDesc::setNonBlocking();
 }
 
 /*****************************************************************************************
@@ -177,7 +197,8 @@ SocketFD::~SocketFD() {
  *****************************************************************************************/
 
 void SocketFD::setReusable() {
-   
+   openSocket();
+
    int enable = 1;
    if (setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
       throw socket_error("setsockopt failure setting SO_REUSEADDR");
@@ -195,6 +216,7 @@ void SocketFD::setReusable() {
  *****************************************************************************************/
 
 void SocketFD::bindFD(const char *ip_addr, short unsigned int port) {
+   openSocket();
 
    // Load the socket information to prep for binding
    _fd_addr.sin_family = AF_INET;
@@ -208,37 +230,95 @@ void SocketFD::bindFD(const char *ip_addr, short unsigned int port) {
 }
 
 /*****************************************************************************************
- * connectTo - attempts to connect via TCP to the given ip address and port
+ * startConnect - starts a non-blocking TCP connect to the given ip address and port on a
+ *                fresh socket (a socket can't be connected twice, so any old one is closed)
+ *
+ *    Params:  ip_addr - the IP address of the server in network format
+ *             port - the port of the server in network format
+ *
+ *    Returns: connect_done if it connected at once, connect_pending if it's underway (see
+ *             checkConnect), connect_failed otherwise
+ *
+ *    Throws: socket_error if the socket can't be created or made non-blocking
+ *****************************************************************************************/
+
+SocketFD::connect_status SocketFD::startConnect(unsigned long ip_addr, unsigned short port) {
+   closeFD();
+   openSocket();
+   setNonBlocking();
+
+   // Load the socket information to prep for binding
+   bzero(&_fd_addr, sizeof(_fd_addr));
+   _fd_addr.sin_family = AF_INET;
+   _fd_addr.sin_addr.s_addr = ip_addr;
+   _fd_addr.sin_port = port;
+
+   if (connect(_fd, (struct sockaddr *) &_fd_addr, sizeof(_fd_addr)) == 0)
+      return checkConnect();
+   if (errno == EINPROGRESS)
+      return connect_pending;
+   return connect_failed;
+}
+
+/*****************************************************************************************
+ * checkConnect - waits up to usec_timeout (-1 for no limit) for a connect started with
+ *                startConnect to finish. Once connected, the socket goes back to blocking
+ *
+ *    Returns: connect_done, connect_pending if it's still going, or connect_failed
+ *****************************************************************************************/
+
+SocketFD::connect_status SocketFD::checkConnect(long usec_timeout) {
+   if (_fd < 0)
+      return connect_failed;
+
+   struct pollfd pfd = { _fd, POLLOUT, 0 };
+   struct timespec timeout = { usec_timeout / 1000000, (usec_timeout % 1000000) * 1000 };
+
+   int n = ppoll(&pfd, 1, (usec_timeout < 0) ? NULL : &timeout, NULL);
+   if ((n == -1) && (errno != EINTR))
+      return connect_failed;
+   if (n <= 0)
+      return connect_pending;
+
+   int err = 0;
+   socklen_t len = sizeof(err);
+   if ((getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) || (err != 0))
+      return connect_failed;
+
+   int flags = fcntl(_fd, F_GETFL);
+   if ((flags < 0) || (fcntl(_fd, F_SETFL, flags & ~O_NONBLOCK) < 0))
+      return connect_failed;
+   return connect_done;
+}
+
+/*****************************************************************************************
+ * connectTo - connects via TCP to the given ip address and port, waiting for the outcome
  *
  *    Params:  ip_addr - the IP address string of the server to connect to in std format
  *             port - the port of the server to connect to
+ *             usec_timeout - how long to wait, -1 for as long as the kernel tries
  *
  *    Returns: true if the connect worked, false otherwise
  *****************************************************************************************/
 
-bool SocketFD::connectTo(const char *ip_addr, unsigned short port) {
+bool SocketFD::connectTo(const char *ip_addr, unsigned short port, long usec_timeout) {
 
    unsigned long n_ip_addr;
 
    inet_pton(AF_INET, ip_addr, &n_ip_addr);
-   return connectTo(n_ip_addr, htons(port));
+   return connectTo(n_ip_addr, htons(port), usec_timeout);
 }
 
-bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port) {
-   if ((_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-      throw socket_error("Socket creation failed.");
-
-   // Load the socket information to prep for binding
-   bzero(&_fd_addr, sizeof(_fd_addr));
-   _fd_addr.sin_family = AF_INET;
-   _fd_addr.sin_addr.s_addr = ip_addr;
-   _fd_addr.sin_port = port;
+bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port, long usec_timeout) {
+   connect_status status = startConnect(ip_addr, port);
+   if (status == connect_pending)
+      status = checkConnect(usec_timeout);
 
-   if (connect(_fd, (struct sockaddr *) &_fd_addr, sizeof(_fd_addr)) != 0)
+   if (status != connect_done) {
+      closeFD();
       return false;
-
+   }
    return true;
-
 }
 
 /*****************************************************************************************
@@ -267,6 +347,7 @@ void SocketFD::listenFD(int backlog) {
 bool SocketFD::acceptFD(SocketFD &server) {
    socklen_t len = sizeof(_fd_addr);
 
+   closeFD();
    _fd = accept(server.getFD(), (struct sockaddr *) &_fd_addr, &len);
    if (_fd == -1)
       return false;
@@ -274,6 +355,46 @@ bool SocketFD::acceptFD(SocketFD &server) {
    return true;
 }
 
+/*****************************************************************************************
+ * recvSome - reads whatever is waiting on the socket, up to size bytes, without blocking
+ *            (whether or not the socket is in non-blocking mode)
+ *
+ *    Returns: bytes read, 0 if nothing was waiting, -1 if the other end closed the
+ *             connection or the read failed
+ *****************************************************************************************/
+
+ssize_t SocketFD::recvSome(uint8_t *buf, size_t size) {
+   while (true) {
+      ssize_t results = recv(_fd, buf, size, MSG_DONTWAIT);
+      if (results > 0)
+         return results;
+      if (results == 0)
+         return -1;
+      if (errno == EINTR)
+         continue;
+      return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+   }
+}
+
+/*****************************************************************************************
+ * sendSome - writes as much of buf as the socket will take, up to size bytes, without
+ *            blocking (whether or not the socket is in non-blocking mode)
+ *
+ *    Returns: bytes written, 0 if the socket's send buffer is full, -1 if the write failed
+ *             (e.g. the other end went away)
+ *****************************************************************************************/
+
+ssize_t SocketFD::sendSome(const uint8_t *buf, size_t size) {
+   while (true) {
+      ssize_t results = send(_fd, buf, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (results >= 0)
+         return results;
+      if (errno == EINTR)
+         continue;
+      return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+   }
+}
+
 /*****************************************************************************************
  * getIPAddr - returns the IP address of this FD in big endian format
  *
@@ -0,0 +1,132 @@
+#include <stdexcept>
+#include <cmath>
+#include "FleetGen.h"
+
+// The area the fleet flies over (degrees), roughly the bundled data's
+const double fleet_south = 39.68;
+const double fleet_north = 39.80;
+const double fleet_west = -84.20;
+const double fleet_east = -84.02;
+
+// Drone ground speed range (degrees per sec)
+const double fleet_min_speed = 0.00005;
+const double fleet_max_speed = 0.0002;
+
+/*********************************************************************************************
+ * FleetGen (constructor) - draws the node clock offsets and places every drone
+ *
+ *    Throws: runtime_error if there are no drones, nodes or time to report in
+ *********************************************************************************************/
+FleetGen::FleetGen(const fleet_params &params):_params(params)
+{
+   if ((params.drones == 0) || (params.nodes == 0) || (params.report_secs == 0) ||
+                                                                        (params.secs == 0))
+      throw std::runtime_error("Fleet needs at least one drone, node, report and second");
+
+   uint64_t seed_rng = params.seed;
+   for (unsigned int i=0; i<params.nodes; i++) {
+      int range = (int) params.max_offset;
+      _offsets.push_back((int) (nextRand(seed_rng) % (2 * range + 1)) - range);
+   }
+
+   // Drone IDs start at 1, the plot serializer treats 0 as unset
+   _drones.resize(params.drones);
+   for (unsigned int i=0; i<params.drones; i++) {
+      drone_state &drone = _drones[i];
+      drone.rng = params.seed ^ ((uint64_t) (i + 1) * 0x9E3779B97F4A7C15ULL);
+
+      drone.lat = uniform(drone.rng, fleet_south, fleet_north);
+      drone.lon = uniform(drone.rng, fleet_west, fleet_east);
+
+      double heading = uniform(drone.rng, 0.0, 2.0 * M_PI);
+      double step = uniform(drone.rng, fleet_min_speed, fleet_max_speed) * params.report_secs;
+      drone.dlat = step * std::sin(heading);
+      drone.dlon = step * std::cos(heading);
+
+      time_t start = 1 + (time_t) (nextRand(drone.rng) % (params.secs / 4 + 1));
+      _due.push(due_report(start, i + 1));
+   }
+}
+
+FleetGen::~FleetGen() {
+
+}
+
+int FleetGen::getOffset(unsigned int node_id) {
+   if ((node_id < 1) || (node_id > _offsets.size()))
+      throw std::runtime_error("Node ID is outside the fleet");
+   return _offsets[node_id - 1];
+}
+
+uint64_t FleetGen::nextRand(uint64_t &state) {
+   uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+double FleetGen::uniform(uint64_t &state, double low, double high) {
+   return low + (high - low) * ((nextRand(state) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+/*********************************************************************************************
+ * next - hands out the plots of the current report one at a time, then moves on to the
+ *        earliest report due
+ *********************************************************************************************/
+bool FleetGen::next(DronePlot &plot) {
+   while (_heard_pos >= _heard.size()) {
+      if (_due.empty())
+         return false;
+
+      due_report due = _due.top();
+      _due.pop();
+
+      report(due.second, due.first);
+      if (due.first + (time_t) _params.report_secs <= (time_t) _params.secs)
+         _due.push(due_report(due.first + _params.report_secs, due.second));
+   }
+
+   plot = _heard[_heard_pos++];
+   return true;
+}
+
+/*********************************************************************************************
+ * report - moves the drone one report along, then works out which nodes heard it and the
+ *          time on each one's clock. Only the drone's own random stream is used, so a drone's
+ *          plots don't depend on how many other drones there are
+ *********************************************************************************************/
+void FleetGen::report(unsigned int drone_id, time_t true_time) {
+   drone_state &drone = _drones[drone_id - 1];
+
+   drone.lat += drone.dlat;
+   drone.lon += drone.dlon;
+   if ((drone.lat < fleet_south) || (drone.lat > fleet_north)) {
+      drone.dlat = -drone.dlat;
+      drone.lat += 2 * drone.dlat;
+   }
+   if ((drone.lon < fleet_west) || (drone.lon > fleet_east)) {
+      drone.dlon = -drone.dlon;
+      drone.lon += 2 * drone.dlon;
+   }
+
+   unsigned int band = (unsigned int) ((drone.lon - fleet_west) / (fleet_east - fleet_west) *
+                                                                           _params.nodes);
+   if (band >= _params.nodes)
+      band = _params.nodes - 1;
+
+   _heard.clear();
+   _heard_pos = 0;
+
+   int jitter_range = (int) _params.jitter;
+   for (unsigned int i=0; i<_params.nodes; i++) {
+      // Draw for every node so the stream doesn't depend on who heard the last report
+      bool heard = (uniform(drone.rng, 0.0, 1.0) < _params.overlap) || (i == band);
+      int jitter = (int) (nextRand(drone.rng) % (2 * jitter_range + 1)) - jitter_range;
+      if (!heard)
+         continue;
+
+      time_t stamp = true_time + _offsets[i] + jitter;
+      _heard.emplace_back(drone_id, i + 1, 0, (float) drone.lat, (float) drone.lon);
+      _heard.back().timestamp = (stamp < 0) ? 0 : stamp;
+   }
+}
@@ -0,0 +1,201 @@
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <sched.h>
+#include "IOWorker.h"
+#include "TCPServer.h"
+#include "PlotCodec.h"
+
+// How long an idle worker naps between passes over its connections
+const useconds_t worker_idle_usecs = 200;
+
+/*********************************************************************************************
+ * IOWorker (constructor) - sets up an idle worker, call start to give it a thread
+ *
+ *    Params:  worker_id - number used in logs
+ *             events - where received batches and dropped connections are posted
+ *             server_log, verbosity - where to log and how much to spam stdout
+ *
+ *********************************************************************************************/
+IOWorker::IOWorker(unsigned int worker_id, MPSCQueue<conn_event> &events, LogMgr &server_log,
+                                                                  unsigned int verbosity):
+                                    _worker_id(worker_id),
+                                    _num_conns(0),
+                                    _shutdown(false),
+                                    _events(events),
+                                    _server_log(server_log),
+                                    _verbosity(verbosity)
+{
+   pthread_mutex_init(&_mutex, NULL);
+}
+
+IOWorker::~IOWorker() {
+   stop();
+   pthread_mutex_destroy(&_mutex);
+}
+
+/*********************************************************************************************
+ * t_worker - thread function, expects the IOWorker passed in with the data param
+ *********************************************************************************************/
+void *IOWorker::t_worker(void *data) {
+   IOWorker *worker = static_cast<IOWorker *>(data);
+
+   worker->run();
+   return NULL;
+}
+
+/*********************************************************************************************
+ * start - launches the worker thread, pinning it to a CPU if cpu >= 0. Failing to pin is
+ *         logged but not fatal
+ *
+ *    Throws: runtime_error if the thread could not be created
+ *********************************************************************************************/
+void IOWorker::start(int cpu) {
+   _shutdown = false;
+   if (pthread_create(&_thread, NULL, t_worker, (void *) this) != 0)
+      throw std::runtime_error("Unable to create I/O worker thread");
+   _running = true;
+
+   if (cpu < 0)
+      return;
+
+   cpu_set_t cpus;
+   CPU_ZERO(&cpus);
+   CPU_SET(cpu, &cpus);
+   if (pthread_setaffinity_np(_thread, sizeof(cpus), &cpus) != 0) {
+      std::stringstream msg;
+      msg << "I/O worker " << _worker_id << " could not be pinned to CPU " << cpu << ".";
+      _server_log.writeLog(msg.str().c_str());
+   }
+}
+
+/*********************************************************************************************
+ * stop - signals the worker thread to finish its pass and waits for it
+ *********************************************************************************************/
+void IOWorker::stop() {
+   if (!_running)
+      return;
+
+   _shutdown = true;
+   pthread_join(_thread, NULL);
+   _running = false;
+}
+
+/*********************************************************************************************
+ * run - the worker thread's loop. Errors are logged and the worker keeps going, since one
+ *       bad connection should not take down the others
+ *********************************************************************************************/
+void IOWorker::run() {
+   while (!_shutdown) {
+      unsigned int posted = 0;
+
+      try {
+         posted = handleConns();
+      } catch (std::runtime_error &e) {
+         std::stringstream msg;
+         msg << "I/O worker " << _worker_id << " error: " << e.what();
+         _server_log.writeLog(msg.str().c_str());
+      }
+
+      // Only nap when there was nothing to hand over
+      if (posted == 0)
+         usleep(worker_idle_usecs);
+   }
+}
+
+/*********************************************************************************************
+ * addConn - hands a connection over to this worker. It is picked up on the next pass
+ *
+ *    Params:  conn - the connection, the worker takes ownership
+ *
+ *********************************************************************************************/
+void IOWorker::addConn(TCPConn *conn) {
+   pthread_mutex_lock(&_mutex);
+   _new_conns.push_back(std::unique_ptr<TCPConn>(conn));
+   pthread_mutex_unlock(&_mutex);
+
+   _num_conns++;
+}
+
+/*********************************************************************************************
+ * handleConns - one pass over our connections: adopts new ones, handles their I/O, then posts
+ *               the batches they received and the ones that were dropped
+ *
+ *    Returns: number of events posted
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ *********************************************************************************************/
+unsigned int IOWorker::handleConns() {
+   unsigned int posted = 0;
+
+   pthread_mutex_lock(&_mutex);
+   _conns.splice(_conns.end(), _new_conns);
+   pthread_mutex_unlock(&_mutex);
+
+   std::list<std::unique_ptr<TCPConn>> dropped;
+   TCPServer::handleConnList(_conns, _server_log, _verbosity, &dropped);
+
+   for (auto conn_it = _conns.begin(); conn_it != _conns.end(); conn_it++)
+      posted += postData(**conn_it);
+
+   for (auto conn_it = dropped.begin(); conn_it != dropped.end(); conn_it++) {
+      conn_event event;
+      event.type = conn_event::ev_dropped;
+      event.server_id = (*conn_it)->getNodeID();
+      event.stream = (*conn_it)->isStream();
+      event.check = (*conn_it)->isDigestCheck();
+      _events.push(std::move(event));
+      posted++;
+   }
+   _num_conns -= dropped.size();
+
+   return posted;
+}
+
+/*********************************************************************************************
+ * postData - decodes the batches waiting on a connection and posts them, then has the
+ *            connection acknowledge them. A batch that fails to decode is logged and the
+ *            connection rejects it, so a session gets it resent rather than skipping it
+ *
+ *    Returns: number of batches posted
+ *********************************************************************************************/
+unsigned int IOWorker::postData(TCPConn &conn) {
+   unsigned int posted = 0;
+
+   while (((conn.getStatus() == TCPConn::s_hasdata) ||
+           (conn.getStatus() == TCPConn::s_streamrx) ||
+           (conn.getStatus() == TCPConn::s_stream)) && conn.isInputDataReady()) {
+      std::vector<uint8_t> buf;
+      conn_event event;
+
+      conn.getInputData(buf);
+      event.server_id = conn.getNodeID();
+
+      uint64_t recv_ns = PlotTrace::now();
+      try {
+         PlotCodec::decode(buf, event.data, &event.trace);
+      } catch (std::runtime_error &e) {
+         std::stringstream msg;
+         msg << "Replication batch from " << conn.getNodeID() << " dropped: " << e.what();
+         _server_log.writeLog(msg.str().c_str());
+         conn.rejectInputData();
+         break;
+      }
+      if (event.trace.inject_ns != 0) {
+         event.trace.recv_ns = recv_ns;
+         event.trace.decoded_ns = PlotTrace::now();
+      }
+
+      if (_verbosity >= 3)
+         std::cout << "Replication batch of " << buf.size() << " bytes from " <<
+                      conn.getNodeID() << " decoded by I/O worker " << _worker_id << "\n";
+
+      _events.push(std::move(event));
+      posted++;
+   }
+
+   if (posted > 0)
+      conn.ackInputData();
+   return posted;
+}
@@ -5,19 +5,51 @@
 #include <ostream>
 #include <string>
 #include <string.h>
+#include <unistd.h>
+#include <iostream>
 #include "LogMgr.h"
 #include "strfuncts.h"
 #include "exceptions.h"
 
 
-// Log manager, supports log_lvl for verbosity control
-LogMgr::LogMgr(const char *log_file, unsigned int log_lvl):_log_file(log_file),_log_lvl(log_lvl) {
+// How long the writer thread naps when the ring is empty, and a blocked writeLog between tries
+const useconds_t log_writer_usecs = 5000;
+const useconds_t log_block_usecs = 100;
 
+// Log manager, supports log_lvl for verbosity control. Starts the writer thread
+LogMgr::LogMgr(const char *log_file, unsigned int log_lvl, full_policy policy):
+                                                _log_file(log_file),
+                                                _log_lvl(log_lvl),
+                                                _policy(policy),
+                                                _ring(new log_slot[log_ring_size]),
+                                                _enqueue_pos(0),
+                                                _dequeue_pos(0),
+                                                _flushed_pos(0),
+                                                _written(0),
+                                                _dropped(0),
+                                                _key_interval(log_key_interval),
+                                                _shutdown(false)
+{
+   pthread_mutex_init(&_mutex, NULL);
+   pthread_mutex_init(&_key_mutex, NULL);
+
+   for (unsigned int i=0; i<log_ring_size; i++)
+      _ring[i].seq.store(i, std::memory_order_relaxed);
+
+   if (pthread_create(&_writer, NULL, t_writer, (void *) this) != 0)
+      throw std::runtime_error("Unable to create log writer thread");
 }
 
 
+// Writes out whatever is still in the ring before closing
 LogMgr::~LogMgr() {
-   closeLog();
+   _shutdown = true;
+   pthread_join(_writer, NULL);
+
+   if (_lfptr != NULL)
+      fclose(_lfptr);
+   pthread_mutex_destroy(&_mutex);
+   pthread_mutex_destroy(&_key_mutex);
 }
 
 /***************************************************************************************************
@@ -37,7 +69,8 @@ void LogMgr::createTimestamp(std::string &buf) {
 }
 
 /***************************************************************************************************
- * writeLog - Writes a string to a log with the timestamp
+ * writeLog - Queues a string to be written to the log with the timestamp. Returns as soon as it is in
+ *            the ring (or dropped, if the ring is full and the policy is lp_drop)
  *
  *    Params:  str - string to write to the log in const char * or std::string format
  *             lvl - the "importance" of this log - can be used to set verbosity
@@ -49,25 +82,14 @@ void LogMgr::writeLog(const char *str, unsigned int lvl) {
    if (lvl > _log_lvl)
       return;
 
-   // If the file is not open yet, open it
-   if (_lfptr == NULL) {
-      if ((_lfptr = fopen(_log_file.c_str(), "a+")) == NULL) {
-         throw logfile_error("Unable to open log file to append.");
+   time_t curtime = time(NULL);
+   while (!tryPush(str, curtime)) {
+      if (_policy == lp_drop) {
+         _dropped++;
+         return;
       }
+      usleep(log_block_usecs);
    }
-
-   // Put together our timestamp and start the log with the stamp
-   std::string logstr;
-   createTimestamp(logstr);
-
-   // Now add on the text to log
-   logstr += " ";
-   logstr += str;
-   logstr += "\n";
-
-   fputs(logstr.c_str(), _lfptr);
-   fflush(_lfptr);
-
 }
 
 void LogMgr::writeLog(std::string &str, unsigned int lvl) {
@@ -93,21 +115,242 @@ void LogMgr::strerrLog(const char *str, unsigned int lvl) {
    return writeLog(logstr.c_str(), lvl);
 }
 
-// self-explanatory
+/***************************************************************************************************
+ * writeLogLimited - Writes a string to the log unless a record with the same key went through less
+ *                   than the key interval ago, in which case it is only counted. The count goes out
+ *                   ahead of the next record that is let through
+ *
+ *    Params:  key - what the record is about, e.g. "connect:ds3"
+ *             str - string to write to the log
+ *             lvl - the "importance" of this log - can be used to set verbosity
+ ***************************************************************************************************/
+
+void LogMgr::writeLogLimited(const std::string &key, const char *str, unsigned int lvl) {
+
+   if (lvl > _log_lvl)
+      return;
+
+   time_t now = time(NULL);
+   unsigned long repeats = 0;
+
+   pthread_mutex_lock(&_key_mutex);
+   key_state &state = _keys[key];
+   state.last_seen = now;
+   if (now - state.last_logged < _key_interval) {
+      state.suppressed++;
+      pthread_mutex_unlock(&_key_mutex);
+      return;
+   }
+   repeats = state.suppressed;
+   state.suppressed = 0;
+   state.last_logged = now;
+   pthread_mutex_unlock(&_key_mutex);
+
+   if (repeats > 0) {
+      std::string msg = "Previous '" + key + "' message repeated " + std::to_string(repeats) +
+                        " times.";
+      writeLog(msg.c_str(), lvl);
+   }
+   writeLog(str, lvl);
+}
+
+/***************************************************************************************************
+ * sweepKeys - logs the held back count of each key that has been quiet for an interval, so a burst
+ *             that stops is still accounted for, then forgets the key
+ ***************************************************************************************************/
+
+void LogMgr::sweepKeys(time_t now) {
+   pthread_mutex_lock(&_key_mutex);
+
+   auto kptr = _keys.begin();
+   while (kptr != _keys.end()) {
+      key_state &state = kptr->second;
+      if ((now - state.last_logged < _key_interval) || (now - state.last_seen < _key_interval)) {
+         kptr++;
+         continue;
+      }
+
+      // Goes through the ring like any other record, the writer never waits on a full one
+      if (state.suppressed > 0) {
+         std::string msg = "Previous '" + kptr->first + "' message repeated " +
+                           std::to_string(state.suppressed) + " times.";
+         if (!tryPush(msg.c_str(), now))
+            _dropped++;
+      }
+      kptr = _keys.erase(kptr);
+   }
+
+   pthread_mutex_unlock(&_key_mutex);
+}
+
+/***************************************************************************************************
+ * tryPush - claims the next free slot of the ring and copies the message into it
+ *
+ *    Returns: false if the ring is full
+ ***************************************************************************************************/
+
+bool LogMgr::tryPush(const char *str, time_t timestamp) {
+   unsigned long pos = _enqueue_pos.load(std::memory_order_relaxed);
+   log_slot *slot;
+
+   while (true) {
+      slot = &_ring[pos & (log_ring_size - 1)];
+      long diff = (long) slot->seq.load(std::memory_order_acquire) - (long) pos;
+
+      // Free for pos, try to claim it (a failed exchange reloads pos)
+      if (diff == 0) {
+         if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+      }
+      // Still holds the message from one lap ago, the ring is full
+      else if (diff < 0)
+         return false;
+      else
+         pos = _enqueue_pos.load(std::memory_order_relaxed);
+   }
+
+   size_t len = strlen(str);
+   if (len >= log_msg_size)
+      len = log_msg_size - 1;
+   memcpy(slot->msg, str, len);
+   slot->len = (unsigned int) len;
+   slot->timestamp = timestamp;
+
+   slot->seq.store(pos + 1, std::memory_order_release);
+   return true;
+}
+
+/***************************************************************************************************
+ * t_writer - writer thread function, expects the LogMgr passed in with the data param
+ ***************************************************************************************************/
+
+void *LogMgr::t_writer(void *data) {
+   static_cast<LogMgr *>(data)->runWriter();
+   return NULL;
+}
+
+/***************************************************************************************************
+ * runWriter - writes batches until shutdown, then one last time to empty the ring. Sweeps the keyed
+ *             records once a second
+ ***************************************************************************************************/
+
+void LogMgr::runWriter() {
+   while (!_shutdown) {
+      time_t now = time(NULL);
+      if (now != _last_sweep) {
+         sweepKeys(now);
+         _last_sweep = now;
+      }
+
+      if (writeBatch() == 0)
+         usleep(log_writer_usecs);
+   }
+   writeBatch();
+}
+
+/***************************************************************************************************
+ * writeBatch - writes everything in the ring to the file with one flush at the end, plus a note if
+ *              messages were dropped since the last batch. Only called by the writer thread
+ *
+ *    Returns: the number of messages taken off the ring
+ ***************************************************************************************************/
+
+unsigned int LogMgr::writeBatch() {
+   unsigned long pos = _dequeue_pos.load(std::memory_order_relaxed);
+   unsigned int count = 0;
+
+   pthread_mutex_lock(&_mutex);
+
+   // If the file is not open yet, open it. If we can't, the messages are lost
+   if ((_lfptr == NULL) && !_open_failed) {
+      if ((_lfptr = fopen(_log_file.c_str(), "a+")) == NULL) {
+         std::cerr << "Unable to open log file " << _log_file << " to append.\n";
+         _open_failed = true;
+      }
+   }
+
+   while (true) {
+      log_slot &slot = _ring[pos & (log_ring_size - 1)];
+      if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+         break;
+
+      if (_lfptr != NULL) {
+         if (slot.timestamp != _stamp_time) {
+            _stamp_time = slot.timestamp;
+            char timestr[27];
+            if (ctime_r(&_stamp_time, timestr) != NULL) {
+               _stamp = timestr;
+               clrNewlines(_stamp);
+            }
+         }
+         fputs(_stamp.c_str(), _lfptr);
+         fputc(' ', _lfptr);
+         fwrite(slot.msg, 1, slot.len, _lfptr);
+         fputc('\n', _lfptr);
+         _written++;
+      } else {
+         _dropped++;
+      }
+
+      // Hand the slot back to the producers for the next lap
+      slot.seq.store(pos + log_ring_size, std::memory_order_release);
+      pos++;
+      count++;
+   }
+   _dequeue_pos.store(pos, std::memory_order_relaxed);
+
+   unsigned long dropped = _dropped;
+   if ((_lfptr != NULL) && (dropped > _dropped_reported)) {
+      std::string stamp;
+      createTimestamp(stamp);
+      fprintf(_lfptr, "%s %lu log messages dropped.\n", stamp.c_str(), dropped - _dropped_reported);
+      _dropped_reported = dropped;
+   }
+
+   if ((_lfptr != NULL) && (count > 0))
+      fflush(_lfptr);
+
+   pthread_mutex_unlock(&_mutex);
+
+   _flushed_pos.store(pos, std::memory_order_release);
+   return count;
+}
+
+/***************************************************************************************************
+ * flush - waits until the writer has put everything logged before the call into the file
+ ***************************************************************************************************/
+
+void LogMgr::flush() {
+   unsigned long target = _enqueue_pos.load(std::memory_order_relaxed);
+
+   while (_flushed_pos.load(std::memory_order_acquire) < target)
+      usleep(log_block_usecs);
+}
+
+// Writes out what has been logged, then closes the file. The next write reopens it
 void LogMgr::closeLog() {
+   flush();
+
+   pthread_mutex_lock(&_mutex);
    if (_lfptr != NULL) {
       fclose(_lfptr);
       _lfptr = NULL;
    }
+   _open_failed = false;
+   pthread_mutex_unlock(&_mutex);
 }
 
 
 /***************************************************************************************************
- * changeFilename - Changes the filename the log file is set to write to
+ * changeFilename - Changes the filename the log file is set to write to. What was logged before the
+ *                  call still goes to the old file
  *
  ***************************************************************************************************/
 
 void LogMgr::changeFilename(const char *filename) {
    closeLog();
+
+   pthread_mutex_lock(&_mutex);
    _log_file = filename;
+   pthread_mutex_unlock(&_mutex);
 }
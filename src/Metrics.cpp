@@ -0,0 +1,343 @@
+#include <stdexcept>
+#include <sstream>
+#include <cstring>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include "Metrics.h"
+
+// How long the server waits on a client's request, and between checks for shutdown (usecs)
+const long metrics_read_usecs = 1000000;
+const long metrics_poll_usecs = 100000;
+
+/*********************************************************************************************
+ * Metric (constructor) - base of the metric types, just the identity
+ *********************************************************************************************/
+Metric::Metric(const std::string &name, const std::string &help, const std::string &labels):
+                                                         _name(name),
+                                                         _help(help),
+                                                         _labels(labels)
+{
+}
+
+Metric::~Metric() {
+
+}
+
+/*********************************************************************************************
+ * sampleName - the name of a sample line: the metric name plus suffix, then the labels with
+ *              any extra label appended, e.g. repl_ack_usecs_bucket{peer="ds2",le="64"}
+ *********************************************************************************************/
+std::string Metric::sampleName(const char *suffix, const std::string &extra) {
+   std::string sample = _name + suffix;
+
+   if ((_labels.size() == 0) && (extra.size() == 0))
+      return sample;
+
+   sample += "{" + _labels;
+   if ((_labels.size() > 0) && (extra.size() > 0))
+      sample += ",";
+   return sample + extra + "}";
+}
+
+MetricCounter::MetricCounter(const std::string &name, const std::string &help,
+                             const std::string &labels):Metric(name, help, labels)
+{
+}
+
+/*********************************************************************************************
+ * getShard - each thread is handed its own shard, round robin, the first time it counts
+ *********************************************************************************************/
+unsigned int Metric::getShard() {
+   static std::atomic<unsigned int> next_shard(0);
+   static thread_local unsigned int shard = next_shard.fetch_add(1) % metric_shards;
+   return shard;
+}
+
+uint64_t MetricCounter::getValue() {
+   uint64_t total = 0;
+   for (unsigned int i=0; i<metric_shards; i++)
+      total += _shards[i].value.load(std::memory_order_relaxed);
+   return total;
+}
+
+void MetricCounter::writeSamples(std::string &out) {
+   out += sampleName() + " " + std::to_string(getValue()) + "\n";
+}
+
+MetricGauge::MetricGauge(const std::string &name, const std::string &help,
+                         const std::string &labels):Metric(name, help, labels),
+                                                    _value(0)
+{
+}
+
+void MetricGauge::writeSamples(std::string &out) {
+   out += sampleName() + " " + std::to_string(getValue()) + "\n";
+}
+
+MetricHistogram::MetricHistogram(const std::string &name, const std::string &help,
+                                 const std::string &labels):Metric(name, help, labels)
+{
+   for (unsigned int i=0; i<metric_hist_shards; i++) {
+      for (unsigned int j=0; j<metric_buckets; j++)
+         _shards[i].buckets[j].store(0, std::memory_order_relaxed);
+      _shards[i].count.store(0, std::memory_order_relaxed);
+      _shards[i].sum.store(0, std::memory_order_relaxed);
+   }
+}
+
+/*********************************************************************************************
+ * getBucket - values below 2^metric_sub_bits get a bucket each. Above that, each power of two
+ *             is split into 2^metric_sub_bits equal buckets
+ *********************************************************************************************/
+unsigned int MetricHistogram::getBucket(uint64_t value) {
+   const uint64_t sub_count = 1ULL << metric_sub_bits;
+
+   if (value < sub_count)
+      return (unsigned int) value;
+
+   unsigned int exp = 63 - __builtin_clzll(value);
+   unsigned int sub = (unsigned int) ((value >> (exp - metric_sub_bits)) & (sub_count - 1));
+   return ((exp - metric_sub_bits + 1) << metric_sub_bits) + sub;
+}
+
+uint64_t MetricHistogram::getBucketLimit(unsigned int bucket) {
+   const uint64_t sub_count = 1ULL << metric_sub_bits;
+
+   if (bucket < sub_count)
+      return bucket;
+
+   unsigned int exp = (bucket >> metric_sub_bits) + metric_sub_bits - 1;
+   uint64_t sub = bucket & (sub_count - 1);
+   uint64_t width = 1ULL << (exp - metric_sub_bits);
+   return ((sub_count + sub) * width) + (width - 1);
+}
+
+uint64_t MetricHistogram::getCount() {
+   uint64_t total = 0;
+   for (unsigned int i=0; i<metric_hist_shards; i++)
+      total += _shards[i].count.load(std::memory_order_relaxed);
+   return total;
+}
+
+uint64_t MetricHistogram::getSum() {
+   uint64_t total = 0;
+   for (unsigned int i=0; i<metric_hist_shards; i++)
+      total += _shards[i].sum.load(std::memory_order_relaxed);
+   return total;
+}
+
+/*********************************************************************************************
+ * mergeBuckets - one copy of the buckets summed over the shards, so a reader works from the
+ *                same numbers throughout while observations keep coming in
+ *********************************************************************************************/
+uint64_t MetricHistogram::mergeBuckets(uint64_t *counts) {
+   uint64_t total = 0;
+
+   for (unsigned int i=0; i<metric_buckets; i++) {
+      counts[i] = 0;
+      for (unsigned int j=0; j<metric_hist_shards; j++)
+         counts[i] += _shards[j].buckets[i].load(std::memory_order_relaxed);
+      total += counts[i];
+   }
+   return total;
+}
+
+uint64_t MetricHistogram::getQuantile(double q) {
+   uint64_t counts[metric_buckets];
+
+   uint64_t total = mergeBuckets(counts);
+   if (total == 0)
+      return 0;
+
+   uint64_t rank = (uint64_t) (q * total);
+   if (rank >= total)
+      rank = total - 1;
+
+   uint64_t seen = 0;
+   for (unsigned int i=0; i<metric_buckets; i++) {
+      seen += counts[i];
+      if (seen > rank)
+         return getBucketLimit(i);
+   }
+   return getBucketLimit(metric_buckets - 1);
+}
+
+void MetricHistogram::writeSamples(std::string &out) {
+   uint64_t counts[metric_buckets];
+   uint64_t cumulative = 0;
+   unsigned int last = 0;
+
+   uint64_t total = mergeBuckets(counts);
+   for (unsigned int i=0; i<metric_buckets; i++) {
+      if (counts[i] > 0)
+         last = i;
+   }
+
+   // A bucket line at each power of two (the end of each run of sub-buckets) from
+   // 2^metric_sub_bits up to the highest one in use
+   const unsigned int sub_mask = (1U << metric_sub_bits) - 1;
+   for (unsigned int i=0; i<=last; i++) {
+      cumulative += counts[i];
+      if (((i & sub_mask) != sub_mask) && (i != last))
+         continue;
+      out += sampleName("_bucket", "le=\"" + std::to_string(getBucketLimit(i) + 1) + "\"") +
+             " " + std::to_string(cumulative) + "\n";
+   }
+
+   out += sampleName("_bucket", "le=\"+Inf\"") + " " + std::to_string(total) + "\n";
+   out += sampleName("_sum") + " " + std::to_string(getSum()) + "\n";
+   out += sampleName("_count") + " " + std::to_string(total) + "\n";
+}
+
+Metrics::Metrics() {
+   pthread_mutex_init(&_mutex, NULL);
+}
+
+Metrics::~Metrics() {
+   pthread_mutex_destroy(&_mutex);
+}
+
+Metrics &Metrics::global() {
+   static Metrics metrics;
+   return metrics;
+}
+
+/*********************************************************************************************
+ * getMetric - finds name{labels}, creating it if it's new
+ *
+ *    Throws: runtime_error if name{labels} is already registered as a different type
+ *********************************************************************************************/
+template <typename T>
+T &Metrics::getMetric(const std::string &name, const std::string &help, const std::string &labels) {
+   pthread_mutex_lock(&_mutex);
+
+   std::unique_ptr<Metric> &metric = _metrics[std::make_pair(name, labels)];
+   if (metric == nullptr)
+      metric.reset(new T(name, help, labels));
+
+   T *found = dynamic_cast<T *>(metric.get());
+   pthread_mutex_unlock(&_mutex);
+
+   if (found == NULL)
+      throw std::runtime_error("Metric " + name + " registered twice with different types");
+   return *found;
+}
+
+MetricCounter &Metrics::counter(const std::string &name, const std::string &help,
+                                                         const std::string &labels) {
+   return getMetric<MetricCounter>(name, help, labels);
+}
+
+MetricGauge &Metrics::gauge(const std::string &name, const std::string &help,
+                                                     const std::string &labels) {
+   return getMetric<MetricGauge>(name, help, labels);
+}
+
+MetricHistogram &Metrics::histogram(const std::string &name, const std::string &help,
+                                                             const std::string &labels) {
+   return getMetric<MetricHistogram>(name, help, labels);
+}
+
+/*********************************************************************************************
+ * writeText - writes every metric out in the Prometheus text format, with one HELP/TYPE
+ *             header per metric name
+ *********************************************************************************************/
+void Metrics::writeText(std::string &out) {
+   std::string last_name;
+
+   pthread_mutex_lock(&_mutex);
+   for (auto mptr = _metrics.begin(); mptr != _metrics.end(); mptr++) {
+      Metric &metric = *mptr->second;
+
+      if (metric.getName() != last_name) {
+         out += "# HELP " + metric.getName() + " " + metric.getHelp() + "\n";
+         out += "# TYPE " + metric.getName() + " " + metric.getType() + "\n";
+         last_name = metric.getName();
+      }
+      metric.writeSamples(out);
+   }
+   pthread_mutex_unlock(&_mutex);
+}
+
+MetricsServer::MetricsServer(Metrics &metrics):_metrics(metrics),_shutdown(false) {
+
+}
+
+MetricsServer::~MetricsServer() {
+   stop();
+}
+
+/*********************************************************************************************
+ * start - binds the HTTP port and starts answering on a new thread
+ *
+ *    Throws: socket_error if the address can't be bound, runtime_error if the thread fails
+ *********************************************************************************************/
+void MetricsServer::start(const char *ip_addr, unsigned short port) {
+   _sockfd.setReusable();
+   _sockfd.bindFD(ip_addr, port);
+   _sockfd.listenFD();
+
+   _shutdown = false;
+   if (pthread_create(&_thread, NULL, t_server, (void *) this) != 0)
+      throw std::runtime_error("Unable to create metrics server thread");
+   _running = true;
+}
+
+void MetricsServer::stop() {
+   if (!_running)
+      return;
+
+   _shutdown = true;
+   pthread_join(_thread, NULL);
+   _sockfd.closeFD();
+   _running = false;
+}
+
+void *MetricsServer::t_server(void *data) {
+   static_cast<MetricsServer *>(data)->run();
+   return NULL;
+}
+
+/*********************************************************************************************
+ * run - accepts one scrape at a time until stop()
+ *********************************************************************************************/
+void MetricsServer::run() {
+   while (!_shutdown) {
+      try {
+         if (!_sockfd.hasData(metrics_poll_usecs))
+            continue;
+      } catch (socket_error &) {
+         continue;
+      }
+
+      int fd = accept(_sockfd.getFD(), NULL, NULL);
+      if (fd < 0)
+         continue;
+
+      // Wait for the request line so the client doesn't see a reset, but the path and
+      // headers don't matter
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      if (poll(&pfd, 1, metrics_read_usecs / 1000) > 0) {
+         char reqbuf[1024];
+         if (read(fd, reqbuf, sizeof(reqbuf)) < 0) { }
+      }
+
+      std::string body;
+      _metrics.writeText(body);
+
+      std::stringstream reply;
+      reply << "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n" <<
+               "Content-Length: " << body.size() << "\r\nConnection: close\r\n\r\n" << body;
+      std::string out = reply.str();
+
+      size_t sent = 0;
+      while (sent < out.size()) {
+         ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+         if (n <= 0)
+            break;
+         sent += n;
+      }
+      close(fd);
+   }
+}
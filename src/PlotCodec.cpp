@@ -0,0 +1,415 @@
+#include <stdexcept>
+#include <cstring>
+#include <map>
+#include "config.h"
+#include "PlotCodec.h"
+#include "DronePlotDB.h"
+
+#if defined(HAVE_LIBLZ4) && defined(HAVE_LZ4_H)
+#define PLOTCODEC_LZ4
+#include <lz4.h>
+#endif
+
+#if defined(HAVE_LIBZSTD) && defined(HAVE_ZSTD_H)
+#define PLOTCODEC_ZSTD
+#include <zstd.h>
+#endif
+
+const uint8_t PlotCodec::cap_delta;
+const uint8_t PlotCodec::cap_lz4;
+const uint8_t PlotCodec::cap_zstd;
+const uint8_t PlotCodec::cap_trace;
+const uint8_t PlotCodec::flag_trace;
+const unsigned int PlotCodec::header_size;
+
+// Refuse to inflate anything larger than this--protects against corrupted headers
+const size_t max_block_size = 256 * 1024 * 1024;
+
+const int zstd_level = 3;
+
+// Appends/reads a 32 bit unsigned integer in host order
+static void putUInt(std::vector<uint8_t> &buf, unsigned int val) {
+   uint8_t *valptr = (uint8_t *) &val;
+   buf.insert(buf.end(), valptr, valptr + sizeof(unsigned int));
+}
+
+static unsigned int getUInt(const uint8_t *data, size_t size, size_t &pos) {
+   unsigned int val;
+
+   if (pos + sizeof(unsigned int) > size)
+      throw std::runtime_error("Replication batch ended prematurely");
+
+   memcpy(&val, data + pos, sizeof(unsigned int));
+   pos += sizeof(unsigned int);
+   return val;
+}
+
+// Same for the 64 bit incarnations in range headers
+static void putUInt64(std::vector<uint8_t> &buf, uint64_t val) {
+   uint8_t *valptr = (uint8_t *) &val;
+   buf.insert(buf.end(), valptr, valptr + sizeof(uint64_t));
+}
+
+static uint64_t getUInt64(const uint8_t *data, size_t size, size_t &pos) {
+   uint64_t val;
+
+   if (pos + sizeof(uint64_t) > size)
+      throw std::runtime_error("Replication batch ended prematurely");
+
+   memcpy(&val, data + pos, sizeof(uint64_t));
+   pos += sizeof(uint64_t);
+   return val;
+}
+
+// LEB128 style varints, 7 bits per byte with the high bit set on all but the last
+static void putVarint(std::vector<uint8_t> &buf, uint64_t val) {
+   while (val >= 0x80) {
+      buf.push_back((uint8_t) (val | 0x80));
+      val >>= 7;
+   }
+   buf.push_back((uint8_t) val);
+}
+
+static uint64_t getVarint(const uint8_t *data, size_t size, size_t &pos) {
+   uint64_t val = 0;
+
+   for (unsigned int shift = 0; shift < 64; shift += 7) {
+      if (pos >= size)
+         throw std::runtime_error("Replication batch varint ended prematurely");
+
+      uint8_t byte = data[pos++];
+      val |= (uint64_t) (byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+         return val;
+   }
+   throw std::runtime_error("Replication batch varint too long");
+}
+
+// Zigzag maps small negative numbers to small unsigned numbers (0,-1,1,-2 -> 0,1,2,3)
+static uint64_t zigzag(int64_t val) {
+   return ((uint64_t) val << 1) ^ (uint64_t) (val >> 63);
+}
+
+static int64_t unzigzag(uint64_t val) {
+   return (int64_t) (val >> 1) ^ -(int64_t) (val & 1);
+}
+
+static uint32_t floatBits(float val) {
+   uint32_t bits;
+   memcpy(&bits, &val, sizeof(bits));
+   return bits;
+}
+
+static float bitsFloat(uint32_t bits) {
+   float val;
+   memcpy(&val, &bits, sizeof(val));
+   return val;
+}
+
+// The last plot seen for a drone, which the next plot of that drone is encoded against
+struct track_state {
+   int64_t timestamp = 0;
+   uint32_t latitude = 0;
+   uint32_t longitude = 0;
+};
+
+/*****************************************************************************************
+ * getCapabilities - returns the capability bits for what this build can decode
+ *****************************************************************************************/
+
+uint8_t PlotCodec::getCapabilities() {
+   uint8_t caps = cap_delta | cap_trace;
+#ifdef PLOTCODEC_LZ4
+   caps |= cap_lz4;
+#endif
+#ifdef PLOTCODEC_ZSTD
+   caps |= cap_zstd;
+#endif
+   return caps;
+}
+
+/*****************************************************************************************
+ * choose - picks the best encoding and compression that both sides support. zstd gives the
+ *          best ratio on plot tracks, LZ4 is the fallback
+ *****************************************************************************************/
+
+void PlotCodec::choose(uint8_t peer_caps, encoding_type &enc, compression_type &comp) {
+   uint8_t caps = peer_caps & getCapabilities();
+
+   enc = (caps & cap_delta) ? enc_delta : enc_raw;
+
+   if (caps & cap_zstd)
+      comp = comp_zstd;
+   else if (caps & cap_lz4)
+      comp = comp_lz4;
+   else
+      comp = comp_none;
+}
+
+/*****************************************************************************************
+ * encode - encodes a ReplLog delta and places the header plus (maybe compressed) block in
+ *          buf. Falls back to no compression if it would not make the block smaller
+ *
+ *    Throws: runtime_error if the delta is corrupted or compression fails
+ *****************************************************************************************/
+
+void PlotCodec::encode(std::vector<uint8_t> &delta, std::vector<uint8_t> &buf,
+                       encoding_type enc, compression_type comp, const plot_trace *trace) {
+   std::vector<uint8_t> encoded;
+   std::vector<uint8_t> *block = &delta;
+
+   if (enc == enc_delta) {
+      deltaEncode(delta, encoded);
+      block = &encoded;
+   }
+
+   std::vector<uint8_t> compressed;
+   if (comp != comp_none) {
+      compress(*block, compressed, comp);
+      if (compressed.size() >= block->size())
+         comp = comp_none;
+   }
+
+   buf.clear();
+   buf.push_back((uint8_t) enc);
+   buf.push_back((uint8_t) comp);
+   buf.push_back((trace != NULL) ? flag_trace : 0);
+   buf.push_back(0);
+   putUInt(buf, block->size());
+
+   if (trace != NULL)
+      PlotTrace::put(buf, *trace);
+
+   if (comp != comp_none)
+      buf.insert(buf.end(), compressed.begin(), compressed.end());
+   else
+      buf.insert(buf.end(), block->begin(), block->end());
+}
+
+/*****************************************************************************************
+ * decode - reverses encode, leaving the original ReplLog delta in delta
+ *
+ *    Throws: runtime_error for an unknown encoding/compression or corrupted data
+ *****************************************************************************************/
+
+void PlotCodec::decode(std::vector<uint8_t> &buf, std::vector<uint8_t> &delta,
+                                                   plot_trace *trace) {
+   size_t pos = 0;
+
+   if (buf.size() < header_size)
+      throw std::runtime_error("Replication batch too short for its header");
+
+   encoding_type enc = (encoding_type) buf[0];
+   compression_type comp = (compression_type) buf[1];
+   uint8_t flags = buf[2];
+   pos = 4;
+   size_t raw_size = getUInt(buf.data(), buf.size(), pos);
+
+   if (raw_size > max_block_size)
+      throw std::runtime_error("Replication batch block too large");
+
+   plot_trace batch_trace;
+   if (flags & flag_trace)
+      PlotTrace::get(buf.data(), buf.size(), pos, batch_trace);
+   if (trace != NULL)
+      *trace = batch_trace;
+
+   const uint8_t *data = buf.data() + pos;
+   size_t size = buf.size() - pos;
+
+   std::vector<uint8_t> block;
+   if (comp != comp_none) {
+      decompress(data, size, raw_size, block, comp);
+      data = block.data();
+      size = block.size();
+   } else if (size != raw_size) {
+      throw std::runtime_error("Replication batch size does not match its header");
+   }
+
+   switch (enc) {
+   case enc_raw:
+      delta.assign(data, data + size);
+      break;
+
+   case enc_delta:
+      deltaDecode(data, size, delta);
+      break;
+
+   default:
+      throw std::runtime_error("Replication batch uses an unknown encoding");
+   }
+}
+
+/*****************************************************************************************
+ * deltaEncode - converts the ReplLog delta format into varints. Range header fields are
+ *               kept as is, each plot becomes its drone_id followed by the zigzag deltas of
+ *               its timestamp and latitude/longitude bits against the drone's previous
+ *               plot. node_id is implied by the range
+ *
+ *    Throws: runtime_error if the delta is corrupted
+ *****************************************************************************************/
+
+void PlotCodec::deltaEncode(std::vector<uint8_t> &delta, std::vector<uint8_t> &buf) {
+   std::map<unsigned int, track_state> tracks;
+   unsigned int ppsize = DronePlot::getDataSize();
+   size_t pos = 0;
+   DronePlot plot;
+
+   buf.clear();
+   buf.reserve(delta.size() / 3);
+
+   unsigned int num_ranges = getUInt(delta.data(), delta.size(), pos);
+   putVarint(buf, num_ranges);
+
+   for (unsigned int i=0; i<num_ranges; i++) {
+      unsigned int node_id = getUInt(delta.data(), delta.size(), pos);
+      uint64_t incarnation = getUInt64(delta.data(), delta.size(), pos);
+      unsigned int base = getUInt(delta.data(), delta.size(), pos);
+      unsigned int first_seq = getUInt(delta.data(), delta.size(), pos);
+      unsigned int count = getUInt(delta.data(), delta.size(), pos);
+
+      if (pos + (size_t) count * ppsize > delta.size())
+         throw std::runtime_error("Replication delta range corrupted");
+
+      putVarint(buf, node_id);
+      putVarint(buf, incarnation);
+      putVarint(buf, base);
+      putVarint(buf, first_seq);
+      putVarint(buf, count);
+
+      for (unsigned int j=0; j<count; j++, pos += ppsize) {
+         plot.deserialize(delta, pos);
+         if (plot.node_id != node_id)
+            throw std::runtime_error("Replication delta plot does not match its range");
+
+         track_state &track = tracks[plot.drone_id];
+         uint32_t lat = floatBits(plot.latitude);
+         uint32_t lon = floatBits(plot.longitude);
+
+         putVarint(buf, plot.drone_id);
+         putVarint(buf, zigzag((int64_t) plot.timestamp - track.timestamp));
+         putVarint(buf, zigzag((int64_t) lat - (int64_t) track.latitude));
+         putVarint(buf, zigzag((int64_t) lon - (int64_t) track.longitude));
+
+         track.timestamp = plot.timestamp;
+         track.latitude = lat;
+         track.longitude = lon;
+      }
+   }
+}
+
+/*****************************************************************************************
+ * deltaDecode - reverses deltaEncode back into the ReplLog delta format
+ *
+ *    Throws: runtime_error if the block is corrupted
+ *****************************************************************************************/
+
+void PlotCodec::deltaDecode(const uint8_t *data, size_t size, std::vector<uint8_t> &delta) {
+   std::map<unsigned int, track_state> tracks;
+   size_t pos = 0;
+
+   delta.clear();
+
+   unsigned int num_ranges = getVarint(data, size, pos);
+   putUInt(delta, num_ranges);
+
+   for (unsigned int i=0; i<num_ranges; i++) {
+      unsigned int node_id = getVarint(data, size, pos);
+      uint64_t incarnation = getVarint(data, size, pos);
+      unsigned int base = getVarint(data, size, pos);
+      unsigned int first_seq = getVarint(data, size, pos);
+      unsigned int count = getVarint(data, size, pos);
+
+      // Every plot takes at least 4 bytes, so a bigger count can only be corruption
+      if (count > (size - pos) / 4)
+         throw std::runtime_error("Replication batch range count corrupted");
+
+      putUInt(delta, node_id);
+      putUInt64(delta, incarnation);
+      putUInt(delta, base);
+      putUInt(delta, first_seq);
+      putUInt(delta, count);
+      delta.reserve(delta.size() + (size_t) count * DronePlot::getDataSize());
+
+      for (unsigned int j=0; j<count; j++) {
+         unsigned int drone_id = getVarint(data, size, pos);
+         track_state &track = tracks[drone_id];
+
+         track.timestamp += unzigzag(getVarint(data, size, pos));
+         track.latitude += (uint32_t) unzigzag(getVarint(data, size, pos));
+         track.longitude += (uint32_t) unzigzag(getVarint(data, size, pos));
+
+         DronePlot plot(drone_id, node_id, 0, bitsFloat(track.latitude),
+                                              bitsFloat(track.longitude));
+         plot.timestamp = (time_t) track.timestamp;
+         plot.serialize(delta);
+      }
+   }
+}
+
+/*****************************************************************************************
+ * compress/decompress - run the block through the chosen compression library
+ *
+ *    Throws: runtime_error if the library is not available in this build or fails
+ *****************************************************************************************/
+
+void PlotCodec::compress(std::vector<uint8_t> &block, std::vector<uint8_t> &buf,
+                         compression_type comp) {
+   switch (comp) {
+#ifdef PLOTCODEC_LZ4
+   case comp_lz4: {
+      buf.resize(LZ4_compressBound(block.size()));
+      int results = LZ4_compress_default((const char *) block.data(), (char *) buf.data(),
+                                         block.size(), buf.size());
+      if (results <= 0)
+         throw std::runtime_error("LZ4 compression of replication batch failed");
+      buf.resize(results);
+      break;
+   }
+#endif
+#ifdef PLOTCODEC_ZSTD
+   case comp_zstd: {
+      buf.resize(ZSTD_compressBound(block.size()));
+      size_t results = ZSTD_compress(buf.data(), buf.size(), block.data(), block.size(),
+                                     zstd_level);
+      if (ZSTD_isError(results))
+         throw std::runtime_error("zstd compression of replication batch failed");
+      buf.resize(results);
+      break;
+   }
+#endif
+   default:
+      (void) block;
+      (void) buf;
+      throw std::runtime_error("Compression type not available in this build");
+   }
+}
+
+void PlotCodec::decompress(const uint8_t *data, size_t size, size_t raw_size,
+                           std::vector<uint8_t> &block, compression_type comp) {
+   block.resize(raw_size);
+
+   switch (comp) {
+#ifdef PLOTCODEC_LZ4
+   case comp_lz4: {
+      int results = LZ4_decompress_safe((const char *) data, (char *) block.data(), size,
+                                        raw_size);
+      if ((results < 0) || ((size_t) results != raw_size))
+         throw std::runtime_error("LZ4 decompression of replication batch failed");
+      break;
+   }
+#endif
+#ifdef PLOTCODEC_ZSTD
+   case comp_zstd: {
+      size_t results = ZSTD_decompress(block.data(), raw_size, data, size);
+      if (ZSTD_isError(results) || (results != raw_size))
+         throw std::runtime_error("zstd decompression of replication batch failed");
+      break;
+   }
+#endif
+   default:
+      (void) data;
+      (void) size;
+      throw std::runtime_error("Replication batch uses a compression not in this build");
+   }
+}
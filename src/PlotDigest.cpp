@@ -0,0 +1,326 @@
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include "PlotDigest.h"
+
+// Appends 32 or 64 bit unsigned integers to the end of buf
+static void putUInt(std::vector<uint8_t> &buf, unsigned int val) {
+   uint8_t *valptr = (uint8_t *) &val;
+   buf.insert(buf.end(), valptr, valptr + sizeof(unsigned int));
+}
+
+static void putHash(std::vector<uint8_t> &buf, uint64_t val) {
+   uint8_t *valptr = (uint8_t *) &val;
+   buf.insert(buf.end(), valptr, valptr + sizeof(uint64_t));
+}
+
+// Reads 32 or 64 bit unsigned integers out of buf at pos, advancing pos
+static unsigned int getUInt(std::vector<uint8_t> &buf, size_t &pos) {
+   unsigned int val;
+
+   if (pos + sizeof(unsigned int) > buf.size())
+      throw std::runtime_error("Digest data ended prematurely");
+
+   memcpy(&val, buf.data() + pos, sizeof(unsigned int));
+   pos += sizeof(unsigned int);
+   return val;
+}
+
+static uint64_t getHash(std::vector<uint8_t> &buf, size_t &pos) {
+   uint64_t val;
+
+   if (pos + sizeof(uint64_t) > buf.size())
+      throw std::runtime_error("Digest data ended prematurely");
+
+   memcpy(&val, buf.data() + pos, sizeof(uint64_t));
+   pos += sizeof(uint64_t);
+   return val;
+}
+
+// Final avalanche step (splitmix64) so nearby inputs land far apart
+static uint64_t mix(uint64_t val) {
+   val ^= val >> 30;
+   val *= 0xbf58476d1ce4e5b9ULL;
+   val ^= val >> 27;
+   val *= 0x94d049bb133111ebULL;
+   val ^= val >> 31;
+   return val;
+}
+
+const unsigned int PlotDigest::fanout;
+const unsigned int PlotDigest::depth;
+
+/*****************************************************************************************
+ * PlotDigest (constructor) - sets up an empty tree
+ *
+ *    Params:  bucket_secs - width of a time bucket in seconds
+ *****************************************************************************************/
+PlotDigest::PlotDigest(unsigned int bucket_secs):_bucket_secs(bucket_secs) {
+   if (_bucket_secs == 0)
+      throw std::runtime_error("PlotDigest time buckets must be at least one second");
+
+   _tree.resize(depth + 1);
+   _dirty.resize(depth + 1);
+   for (unsigned int level=0; level <= depth; level++) {
+      _tree[level].assign(levelSize(level), 0);
+      _dirty[level].assign(levelSize(level), false);
+   }
+}
+
+PlotDigest::~PlotDigest() {
+
+}
+
+unsigned int PlotDigest::levelSize(unsigned int level) {
+   unsigned int size = 1;
+   for (unsigned int i=0; i<level; i++)
+      size *= fanout;
+   return size;
+}
+
+/*****************************************************************************************
+ * hashPlot - 64 bit hash of all the plot's replicated attributes (FNV-1a, then mixed)
+ *****************************************************************************************/
+
+uint64_t PlotDigest::hashPlot(DronePlot &plot) {
+   uint8_t bytes[sizeof(plot.drone_id) + sizeof(plot.node_id) + sizeof(plot.timestamp) +
+                 sizeof(plot.latitude) + sizeof(plot.longitude)];
+   size_t pos = 0;
+
+   memcpy(bytes + pos, &plot.drone_id, sizeof(plot.drone_id));
+   pos += sizeof(plot.drone_id);
+   memcpy(bytes + pos, &plot.node_id, sizeof(plot.node_id));
+   pos += sizeof(plot.node_id);
+   memcpy(bytes + pos, &plot.timestamp, sizeof(plot.timestamp));
+   pos += sizeof(plot.timestamp);
+   memcpy(bytes + pos, &plot.latitude, sizeof(plot.latitude));
+   pos += sizeof(plot.latitude);
+   memcpy(bytes + pos, &plot.longitude, sizeof(plot.longitude));
+   pos += sizeof(plot.longitude);
+
+   uint64_t hash = 0xcbf29ce484222325ULL;
+   for (size_t i=0; i<pos; i++) {
+      hash ^= bytes[i];
+      hash *= 0x100000001b3ULL;
+   }
+   return mix(hash);
+}
+
+unsigned int PlotDigest::leafOf(const bucket_key &bucket) {
+   return mix(((uint64_t) bucket.first << 32) | bucket.second) % levelSize(depth);
+}
+
+/*****************************************************************************************
+ * addPlot/removePlot - adds or subtracts the plot's hash from its bucket and leaf. Hashes
+ *                      are summed so the order plots arrive in does not matter
+ *****************************************************************************************/
+
+void PlotDigest::addPlot(DronePlot &plot) {
+   updateLeaf(plot, true);
+}
+
+void PlotDigest::removePlot(DronePlot &plot) {
+   updateLeaf(plot, false);
+}
+
+void PlotDigest::updateLeaf(DronePlot &plot, bool add) {
+   bucket_key bucket((unsigned int) (plot.timestamp / _bucket_secs), plot.drone_id);
+   uint64_t hash = hashPlot(plot);
+   unsigned int leaf = leafOf(bucket);
+
+   if (add) {
+      _buckets[bucket] += hash;
+      _tree[depth][leaf] += hash;
+   } else {
+      if ((_buckets[bucket] -= hash) == 0)
+         _buckets.erase(bucket);
+      _tree[depth][leaf] -= hash;
+   }
+
+   // Mark our ancestors for recompute
+   for (int level = depth - 1; level >= 0; level--) {
+      leaf /= fanout;
+      _dirty[level][leaf] = true;
+   }
+}
+
+/*****************************************************************************************
+ * refresh - recomputes dirty inner nodes from their children
+ *****************************************************************************************/
+
+void PlotDigest::refresh() {
+   for (int level = depth - 1; level >= 0; level--) {
+      for (unsigned int node=0; node < _tree[level].size(); node++) {
+         if (!_dirty[level][node])
+            continue;
+
+         uint64_t hash = 0;
+         for (unsigned int child=0; child < fanout; child++)
+            hash = mix(hash ^ _tree[level+1][node * fanout + child]);
+
+         _tree[level][node] = hash;
+         _dirty[level][node] = false;
+      }
+   }
+}
+
+uint64_t PlotDigest::getRoot() {
+   refresh();
+   return _tree[0][0];
+}
+
+/*****************************************************************************************
+ * rootQuery - builds the query that starts a comparison
+ *****************************************************************************************/
+
+void PlotDigest::rootQuery(std::vector<uint8_t> &query) {
+   query.clear();
+   putUInt(query, 0);
+   putUInt(query, 1);
+   putUInt(query, 0);
+}
+
+/*****************************************************************************************
+ * answerQuery - replies with the hashes of the requested nodes or, one level past the
+ *               leaves, with every bucket held under the requested leaves
+ *
+ *    Throws: runtime_error if the query is corrupted
+ *****************************************************************************************/
+
+void PlotDigest::answerQuery(std::vector<uint8_t> &query, std::vector<uint8_t> &reply) {
+   size_t pos = 0;
+   unsigned int level = getUInt(query, pos);
+   unsigned int count = getUInt(query, pos);
+
+   if (level > depth + 1)
+      throw std::runtime_error("Digest query for a level that does not exist");
+
+   std::vector<unsigned int> nodes;
+   unsigned int max_node = levelSize(std::min(level, depth));
+   for (unsigned int i=0; i<count; i++) {
+      nodes.push_back(getUInt(query, pos));
+      if (nodes.back() >= max_node)
+         throw std::runtime_error("Digest query for a node that does not exist");
+   }
+
+   refresh();
+
+   reply.clear();
+   putUInt(reply, level);
+   putUInt(reply, count);
+
+   if (level <= depth) {
+      for (unsigned int i=0; i<count; i++) {
+         putUInt(reply, nodes[i]);
+         putHash(reply, _tree[level][nodes[i]]);
+      }
+      return;
+   }
+
+   // Bucket level - echo the leaves, then list the buckets under them
+   std::sort(nodes.begin(), nodes.end());
+   for (unsigned int i=0; i<count; i++)
+      putUInt(reply, nodes[i]);
+
+   std::vector<uint8_t> entries;
+   unsigned int num = 0;
+   for (auto bptr = _buckets.begin(); bptr != _buckets.end(); bptr++) {
+      if (!std::binary_search(nodes.begin(), nodes.end(), leafOf(bptr->first)))
+         continue;
+      putUInt(entries, bptr->first.first);
+      putUInt(entries, bptr->first.second);
+      putHash(entries, bptr->second);
+      num++;
+   }
+   putUInt(reply, num);
+   reply.insert(reply.end(), entries.begin(), entries.end());
+}
+
+/*****************************************************************************************
+ * checkReply - compares the other side's reply against our own tree and decides where to
+ *              descend next
+ *
+ *    Params:  reply - the reply from answerQuery on the other side
+ *             query - filled with the next query if this returns true
+ *             divergent - filled with the buckets that differ once this returns false
+ *
+ *    Returns: true if the next query should be sent, false if the comparison is complete
+ *
+ *    Throws: runtime_error if the reply is corrupted
+ *****************************************************************************************/
+
+bool PlotDigest::checkReply(std::vector<uint8_t> &reply, std::vector<uint8_t> &query,
+                            std::vector<std::pair<unsigned int, unsigned int>> &divergent) {
+   size_t pos = 0;
+   unsigned int level = getUInt(reply, pos);
+   unsigned int count = getUInt(reply, pos);
+
+   divergent.clear();
+   refresh();
+
+   if (level > depth + 1)
+      throw std::runtime_error("Digest reply for a level that does not exist");
+
+   if (level <= depth) {
+      std::vector<unsigned int> differ;
+      for (unsigned int i=0; i<count; i++) {
+         unsigned int node = getUInt(reply, pos);
+         uint64_t hash = getHash(reply, pos);
+
+         if (node >= _tree[level].size())
+            throw std::runtime_error("Digest reply for a node that does not exist");
+         if (_tree[level][node] != hash)
+            differ.push_back(node);
+      }
+
+      if (differ.size() == 0)
+         return false;
+
+      // Descend into the children of the nodes that differ or, from the leaves, ask for
+      // their buckets
+      query.clear();
+      putUInt(query, level + 1);
+      if (level == depth) {
+         putUInt(query, differ.size());
+         for (unsigned int i=0; i<differ.size(); i++)
+            putUInt(query, differ[i]);
+      } else {
+         putUInt(query, differ.size() * fanout);
+         for (unsigned int i=0; i<differ.size(); i++)
+            for (unsigned int child=0; child < fanout; child++)
+               putUInt(query, differ[i] * fanout + child);
+      }
+      return true;
+   }
+
+   // Bucket level - compare their buckets under these leaves with ours
+   std::vector<unsigned int> leaves;
+   for (unsigned int i=0; i<count; i++)
+      leaves.push_back(getUInt(reply, pos));
+
+   std::map<bucket_key, uint64_t> theirs;
+   unsigned int num = getUInt(reply, pos);
+   for (unsigned int i=0; i<num; i++) {
+      bucket_key bucket;
+      bucket.first = getUInt(reply, pos);
+      bucket.second = getUInt(reply, pos);
+      theirs[bucket] = getHash(reply, pos);
+   }
+
+   for (auto bptr = _buckets.begin(); bptr != _buckets.end(); bptr++) {
+      if (!std::binary_search(leaves.begin(), leaves.end(), leafOf(bptr->first)))
+         continue;
+
+      auto tptr = theirs.find(bptr->first);
+      if ((tptr == theirs.end()) || (tptr->second != bptr->second))
+         divergent.push_back(bptr->first);
+      if (tptr != theirs.end())
+         theirs.erase(tptr);
+   }
+
+   // Whatever is left they have and we do not
+   for (auto tptr = theirs.begin(); tptr != theirs.end(); tptr++)
+      divergent.push_back(tptr->first);
+
+   return false;
+}
@@ -0,0 +1,87 @@
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <time.h>
+#include "PlotTrace.h"
+#include "Metrics.h"
+
+const unsigned int PlotTrace::wire_size;
+
+static const char *trace_help = "Latency of each stage of a traced plot, antenna to peer apply (usecs)";
+
+static MetricHistogram &m_batch = Metrics::global().histogram("repl_trace_usecs", trace_help,
+                                                              "stage=\"batch\"");
+static MetricHistogram &m_handshake = Metrics::global().histogram("repl_trace_usecs", trace_help,
+                                                              "stage=\"handshake\"");
+static MetricHistogram &m_window = Metrics::global().histogram("repl_trace_usecs", trace_help,
+                                                              "stage=\"window\"");
+static MetricHistogram &m_network = Metrics::global().histogram("repl_trace_usecs", trace_help,
+                                                              "stage=\"network\"");
+static MetricHistogram &m_decode = Metrics::global().histogram("repl_trace_usecs", trace_help,
+                                                              "stage=\"decode\"");
+static MetricHistogram &m_queue = Metrics::global().histogram("repl_trace_usecs", trace_help,
+                                                              "stage=\"queue\"");
+static MetricHistogram &m_apply = Metrics::global().histogram("repl_trace_usecs", trace_help,
+                                                              "stage=\"apply\"");
+static MetricHistogram &m_total = Metrics::global().histogram("repl_trace_usecs", trace_help,
+                                                              "stage=\"total\"");
+
+// Time between two stamps in usecs. Stamps from different hosts can run backwards
+static uint64_t elapsed(uint64_t from_ns, uint64_t to_ns) {
+   return (to_ns > from_ns) ? (to_ns - from_ns) / 1000 : 0;
+}
+
+uint64_t PlotTrace::now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void PlotTrace::put(std::vector<uint8_t> &buf, const plot_trace &trace) {
+   uint64_t stamps[4] = { trace.inject_ns, trace.logged_ns, trace.ready_ns, trace.sent_ns };
+   uint8_t *stampptr = (uint8_t *) stamps;
+   buf.insert(buf.end(), stampptr, stampptr + wire_size);
+}
+
+/*****************************************************************************************
+ * get - reads the sender's stamps at pos, advancing pos. The receiver's stamps are cleared
+ *
+ *    Throws: runtime_error if the data ends before the trace does
+ *****************************************************************************************/
+
+void PlotTrace::get(const uint8_t *data, size_t size, size_t &pos, plot_trace &trace) {
+   uint64_t stamps[4];
+
+   if (pos + wire_size > size)
+      throw std::runtime_error("Replication batch too short for its trace");
+
+   memcpy(stamps, data + pos, wire_size);
+   pos += wire_size;
+
+   trace = plot_trace();
+   trace.inject_ns = stamps[0];
+   trace.logged_ns = stamps[1];
+   trace.ready_ns = stamps[2];
+   trace.sent_ns = stamps[3];
+}
+
+/*****************************************************************************************
+ * observe - splits a trace into its stages. The session may have been authenticated before
+ *           or after the plot was sequenced, only the part after counts as handshake
+ *****************************************************************************************/
+
+void PlotTrace::observe(const plot_trace &trace, uint64_t applied_ns) {
+   if (trace.inject_ns == 0)
+      return;
+
+   uint64_t sendable_ns = std::max(trace.logged_ns, trace.ready_ns);
+
+   m_batch.observe(elapsed(trace.inject_ns, trace.logged_ns));
+   m_handshake.observe(elapsed(trace.logged_ns, sendable_ns));
+   m_window.observe(elapsed(sendable_ns, trace.sent_ns));
+   m_network.observe(elapsed(trace.sent_ns, trace.recv_ns));
+   m_decode.observe(elapsed(trace.recv_ns, trace.decoded_ns));
+   m_queue.observe(elapsed(trace.decoded_ns, trace.popped_ns));
+   m_apply.observe(elapsed(trace.popped_ns, applied_ns));
+   m_total.observe(elapsed(trace.inject_ns, applied_ns));
+}
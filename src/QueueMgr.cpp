@@ -2,12 +2,25 @@
 #include <arpa/inet.h>
 #include <tuple>
 #include <sstream>
+#include <cstring>
+#include <signal.h>
+#include <unistd.h>
 #include <crypto++/osrng.h>
 #include <crypto++/filters.h>
 #include <crypto++/files.h>
 #include "strfuncts.h"
 #include "ReplServer.h"
 #include "TCPConn.h"
+#include "Metrics.h"
+
+static MetricCounter &m_connect_failures = Metrics::global().counter("repl_connect_failures_total",
+                                          "Outgoing connections that could not reach the peer");
+static MetricGauge &m_queue_depth = Metrics::global().gauge("repl_queue_depth",
+                                          "Entries waiting in the replication queue");
+static MetricGauge &m_connections = Metrics::global().gauge("repl_connections",
+                                          "Connections held by the I/O workers");
+static MetricGauge &m_sessions = Metrics::global().gauge("repl_sessions",
+                                          "Outgoing replication sessions open or pending");
 
 /********************************************************************************************
  * QueueMgr (constructor) - loads a hard-coded server.txt that contains a comma-separated list
@@ -15,18 +28,48 @@
  *
  ********************************************************************************************/
 
-QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity)
-               
+QueueMgr::QueueMgr(ReplLog &repl_log, unsigned int verbosity):TCPServer(verbosity),
+                                                               _repl_log(repl_log)
 {
    if (loadServerList("servers.txt") <= 0)
       throw std::runtime_error("Could not open server.txt file, or file was empty/corrupt.");
 
    loadAESKey("sharedkey.bin");
+
+   // Replication sessions outlive their peers. Writing to one that went away has to show up
+   // as a lost connection instead of killing the server
+   signal(SIGPIPE, SIG_IGN);
 }
 
-// Destructor - does nothing right now
+// Destructor - stops the workers before the rest of the object goes away
 QueueMgr::~QueueMgr() {
+   _workers.clear();
+}
 
+/*********************************************************************************************
+ * startWorkers - creates the I/O workers. Each worker thread gets its own CPU (wrapping
+ *                around the available ones) if pin_cpus is set
+ *
+ *    Params:  num_workers - number of worker threads, 0 handles the connections from
+ *                           handleQueue on the calling thread
+ *             pin_cpus - set each worker's CPU affinity
+ *
+ *    Throws: runtime_error if a worker thread could not be created
+ *********************************************************************************************/
+void QueueMgr::startWorkers(unsigned int num_workers, bool pin_cpus) {
+   _threaded = (num_workers > 0);
+   if (num_workers == 0)
+      num_workers = 1;
+
+   long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   for (unsigned int i=0; i<num_workers; i++) {
+      _workers.emplace_back(new IOWorker(i, _events, _server_log, _verbosity));
+      if (_threaded)
+         _workers.back()->start((pin_cpus && (num_cpus > 0)) ? (int) (i % num_cpus) : -1);
+   }
+
+   if (_verbosity >= 2)
+      std::cout << "Started " << (_threaded ? num_workers : 0) << " I/O worker threads.\n";
 }
 
 // Should not be called, overloaded to crash if it is
@@ -157,47 +200,66 @@ void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
  *********************************************************************************************/
 void QueueMgr::handleQueue() {
 
-   // Accept new connections, if any
-   handleSocket();
+   if (_workers.size() == 0)
+      throw std::runtime_error("QueueMgr::handleQueue called before startWorkers.");
+
+   // Accept new connections, if any. They advertise our log's vector to the client
+   TCPConn *new_conn = handleSocket();
+   if (new_conn != NULL) {
+      new_conn->setReplLog(&_repl_log);
+      new_conn->setEventLog(_event_log);
+      if (_event_log != NULL)
+         _event_log->log(ev_conn_accepted, NULL);
+   }
 
-   // Handle any open connections, reading from and writing to the socket
-   handleConnections();
+   // Hand accepted connections off to the workers (ones the whitelist turned away too, the
+   // worker cleans them up)
+   while (_connlist.size() > 0) {
+      assignConn(_connlist.front().release());
+      _connlist.pop_front();
+   }
+
+   // Without worker threads, handle the connections, reading from and writing to the socket
+   if (!_threaded)
+      _workers.front()->handleConns();
    
-   // Get data from input buffers on connections and add to the queue
+   // Get data the workers received and add to the queue
    populateQueue();
 
+   unsigned int num_conns = 0;
+   for (auto wptr = _workers.begin(); wptr != _workers.end(); wptr++)
+      num_conns += (*wptr)->getNumConns();
+   m_connections.set(num_conns);
+   m_sessions.set(_sessions.size());
+   m_queue_depth.set(_queue.size());
+
 }
 
 /**********************************************************************************************
- * populateQueue - Gets the information from the connections and populates them into the queue
- *                 for handling later
+ * populateQueue - Takes the deltas the workers received off the event queue and populates them
+ *                 into the queue for handling later. Also notes dropped connections so new
+ *                 syncs/checks to their server can be launched
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 void QueueMgr::populateQueue() {
+   conn_event event;
+
+   while (_events.pop(event)) {
+      if (event.type == conn_event::ev_dropped) {
+         if (event.stream)
+            _sessions.erase(event.server_id);
+         if (event.check)
+            _checks.erase(event.server_id);
+         continue;
+      }
 
-   // Loop through the connections, handling each one
-   auto conn_it = _connlist.begin();
-   for ( ; conn_it != _connlist.end(); conn_it++) {
-      
-      // If the connection has data marked ready, get it and handle it based on the
-      // command at the beginning
-      if (((*conn_it)->getStatus() == TCPConn::s_hasdata) && (*conn_it)->isInputDataReady()) {
-         std::vector<uint8_t> buf;
-
-         (*conn_it)->getInputData(buf);
-         if (buf.size() == 0) {
-            // Handle this better later on
-            throw std::runtime_error("TCPConn claimed replication data but none existed.");
-         }
-        
-         // Add this data to the queue
-         _queue.emplace(recv, (*conn_it)->getNodeID(), buf);
-         if (_verbosity >= 3) {
-            std::cout << "Replication info pulled off connection and placed into queue w/ " <<
-                              (buf.size()-4) / DronePlot::getDataSize() << " potential plots.\n";
-         }   
-      }      
+      // Add this data to the queue
+      _queue.emplace(recv, event.server_id.c_str(), event.data, event.trace);
+      if (_verbosity >= 3) {
+         std::cout << "Replication info pulled off connection and placed into queue w/ " <<
+                           event.data.size() << " bytes.\n";
+      }
    }
 }
 
@@ -230,6 +292,35 @@ void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data) {
 
 }
 
+/*********************************************************************************************
+ * syncToAll - queues an anti-entropy sync to each server (calls syncToServer)
+ * syncToServer - queues a sync to the server indicated by server_id. The data sent is decided
+ *                once the connection learns which plots the server is missing
+ *
+ *    Throws: socket_error for any network issues
+ *********************************************************************************************/
+void QueueMgr::syncToAll() {
+   for (unsigned int i=0; i<_server_list.size(); i++) {
+      syncToServer(std::get<0>(_server_list[i]).c_str());
+   }
+}
+
+void QueueMgr::syncToServer(const char *server_id) {
+   std::vector<uint8_t> nodata;
+   _queue.emplace(sync, server_id, nodata);
+}
+
+/*********************************************************************************************
+ * checkAll - queues a digest comparison with each server. Results are written to the log
+ *
+ *********************************************************************************************/
+void QueueMgr::checkAll() {
+   std::vector<uint8_t> nodata;
+   for (unsigned int i=0; i<_server_list.size(); i++) {
+      _queue.emplace(check, std::get<0>(_server_list[i]).c_str(), nodata);
+   }
+}
+
 /*********************************************************************************************
  * pop - removes the next received data element sitting in the queue and returns the data 
  *       loaded into the parameters. Also assigns outgoing queue elements to a connection
@@ -237,13 +328,14 @@ void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data) {
  *
  *    Params:  sid - pop action places the first recv'd pop server id into this attribute
  *             data - data received gets loaded into this vector
+ *             trace - if not NULL, gets the data's trace (see PlotTrace.h)
  *
  *    Returns: true for an incoming element found, false otherwise. Returns false even if
  *             outgoing connections are found in the process 
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
-bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
+bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data, plot_trace *trace) {
    while (_queue.size() > 0) {
       auto next_qe = _queue.front();
 
@@ -257,23 +349,78 @@ bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
          continue;  
       }
 
+      // A sync still waiting to reconnect will pick up everything this one would send, and
+      // there's no point checking a server we can't reach. Nor is there syncing to a server
+      // that streams our plots back over its own session
+      if ((next_qe.type == sync) || (next_qe.type == check)) {
+         if (!hasPendingConn(next_qe.server_id.c_str(), next_qe.type) &&
+             ((next_qe.type == check) || !isSessionOpener(next_qe.server_id.c_str())))
+            launchDataConn(next_qe.server_id.c_str(), next_qe.data, next_qe.type);
+
+         _queue.pop();
+         continue;
+      }
+
       sid = next_qe.server_id;
       data = std::move(next_qe.data);
+      if (trace != NULL) {
+         *trace = next_qe.trace;
+         if (trace->inject_ns != 0)
+            trace->popped_ns = PlotTrace::now();
+      }
       _queue.pop();
       return true;
    }
    return false;
 }
 
+/*********************************************************************************************
+ * hasPendingConn - for syncs, checks for a replication session to sid (it streams everything
+ *                  a new sync would send). For checks, checks for a check of sid that is still
+ *                  running or waiting to connect
+ *
+ *********************************************************************************************/
+bool QueueMgr::hasPendingConn(const char *sid, qe_type type) {
+   if (type == sync)
+      return (_sessions.count(sid) > 0);
+   return (_checks.count(sid) > 0);
+}
+
+/*********************************************************************************************
+ * isSessionOpener - with symmetric sessions, the server whose ID sorts first opens the
+ *                   session between two servers
+ *
+ *********************************************************************************************/
+bool QueueMgr::isSessionOpener(const char *sid) {
+   return _symmetric && (_server_ID.compare(sid) > 0);
+}
+
+/*********************************************************************************************
+ * assignConn - hands a connection to the worker with the fewest connections
+ *
+ *********************************************************************************************/
+void QueueMgr::assignConn(TCPConn *conn) {
+   IOWorker *worker = _workers.front().get();
+
+   for (auto wptr = _workers.begin(); wptr != _workers.end(); wptr++) {
+      if ((*wptr)->getNumConns() < worker->getNumConns())
+         worker = wptr->get();
+   }
+   worker->addConn(conn);
+}
+
 /*********************************************************************************************
  * launchDataConn - launches a connection and starts the process of sending the queue data to
  *                  the target server
  *
  *    Params:  sid - pop action places the first recv'd pop server id into this attribute
  *             data - data received gets loaded into this vector
+ *             type - send: send data, sync: ignore data and start a replication session
+ *                    streaming the plots from the log that the server is missing, check:
+ *                    compare digests
  *
  *********************************************************************************************/
-void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
+void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data, qe_type type) {
 
    unsigned long ip_addr;
    unsigned short port;
@@ -296,6 +443,8 @@ void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
    TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
    new_conn->setNodeID(sid);
    new_conn->setSvrID(getServerID());
+   new_conn->setEventLog(_event_log);
+   new_conn->setTickets(&_tickets);
 
    try {
       new_conn->connect(ip_addr, port);
@@ -303,13 +452,28 @@ void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
       std::stringstream msg;
       msg << "Connect to SID " << sid << " failed when trying to send data. Retrying. Msg: " <<
                         e.what();
-      _server_log.writeLog(msg.str().c_str());
+      _server_log.writeLogLimited(std::string("connect:") + sid, msg.str().c_str());
+      if (_event_log != NULL)
+         _event_log->log(ev_connect_failed, sid);
+      m_connect_failures.inc();
       new_conn->disconnect();
       new_conn->reconnect = time(NULL) + reconnect_delay;  // Try again in 5 seconds, real-world
    }
 
 
-   new_conn->assignOutgoingData(data);
-   _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
+   if (type == send) {
+      new_conn->assignOutgoingData(data);
+   } else {
+      new_conn->setReplLog(&_repl_log);
+      new_conn->setDigestCheck(type == check);
+      new_conn->setStream(type == sync);
+      new_conn->setSymmetric((type == sync) && _symmetric);
+
+      if (type == sync)
+         _sessions.insert(sid);
+      else
+         _checks.insert(sid);
+   }
+   assignConn(new_conn);
 }
 
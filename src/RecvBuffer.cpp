@@ -0,0 +1,72 @@
+#include <cstring>
+#include "RecvBuffer.h"
+
+RecvBuffer::RecvBuffer() {
+}
+
+RecvBuffer::~RecvBuffer() {
+}
+
+/*********************************************************************************************
+ * fill - reads into the free space at the end until the socket runs dry or limit bytes are
+ *        buffered. Anything past the limit stays in the socket, so TCP flow control holds
+ *        the sender back instead of the buffer growing
+ *
+ *    Returns: the number of bytes read
+ *********************************************************************************************/
+size_t RecvBuffer::fill(SocketFD &sock, size_t limit) {
+   size_t total = 0;
+
+   while (!_closed && size() < limit) {
+      reserve(recv_chunk_size);
+
+      size_t room = _buf.size() - _end;
+      if (room > limit - size())
+         room = limit - size();
+
+      ssize_t results = sock.recvSome(_buf.data() + _end, room);
+      if (results < 0)
+         _closed = true;
+      if (results <= 0)
+         break;
+
+      _end += results;
+      total += results;
+   }
+   return total;
+}
+
+void RecvBuffer::consume(size_t len) {
+   _start += (len < size()) ? len : size();
+
+   // Empty, so the next read can start at the front for free
+   if (_start == _end)
+      _start = _end = 0;
+}
+
+void RecvBuffer::clear() {
+   _start = _end = 0;
+   _closed = false;
+}
+
+/*********************************************************************************************
+ * reserve - makes room for len bytes past _end. Moves what's buffered to the front if that's
+ *           no more than was consumed ahead of it, otherwise grows the buffer
+ *********************************************************************************************/
+void RecvBuffer::reserve(size_t len) {
+   if (_buf.size() - _end >= len)
+      return;
+
+   if ((_start > 0) && (size() <= _start)) {
+      memmove(_buf.data(), _buf.data() + _start, size());
+      _end -= _start;
+      _start = 0;
+      if (_buf.size() - _end >= len)
+         return;
+   }
+
+   size_t new_size = (_buf.size() < recv_chunk_size) ? recv_chunk_size : _buf.size() * 2;
+   while (new_size - _end < len)
+      new_size *= 2;
+   _buf.resize(new_size);
+}
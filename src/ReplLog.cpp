@@ -0,0 +1,480 @@
+#include <stdexcept>
+#include <cstring>
+#include <random>
+#include "ReplLog.h"
+
+// Appends a 32 bit unsigned integer to the end of buf
+static void putUInt(std::vector<uint8_t> &buf, unsigned int val) {
+   uint8_t *valptr = (uint8_t *) &val;
+   buf.insert(buf.end(), valptr, valptr + sizeof(unsigned int));
+}
+
+// Reads a 32 bit unsigned integer out of buf at pos, advancing pos
+static unsigned int getUInt(std::vector<uint8_t> &buf, size_t &pos) {
+   unsigned int val;
+
+   if (pos + sizeof(unsigned int) > buf.size())
+      throw std::runtime_error("Replication log data ended prematurely");
+
+   memcpy(&val, buf.data() + pos, sizeof(unsigned int));
+   pos += sizeof(unsigned int);
+   return val;
+}
+
+// Same for the 64 bit incarnations
+static void putUInt64(std::vector<uint8_t> &buf, uint64_t val) {
+   uint8_t *valptr = (uint8_t *) &val;
+   buf.insert(buf.end(), valptr, valptr + sizeof(uint64_t));
+}
+
+static uint64_t getUInt64(std::vector<uint8_t> &buf, size_t &pos) {
+   uint64_t val;
+
+   if (pos + sizeof(uint64_t) > buf.size())
+      throw std::runtime_error("Replication log data ended prematurely");
+
+   memcpy(&val, buf.data() + pos, sizeof(uint64_t));
+   pos += sizeof(uint64_t);
+   return val;
+}
+
+ReplLog::ReplLog() {
+   std::random_device rnd;
+   _incarnation = ((uint64_t) rnd() << 32) | rnd();
+
+   pthread_mutex_init(&_mutex, NULL);
+}
+
+ReplLog::~ReplLog() {
+   pthread_mutex_destroy(&_mutex);
+}
+
+/*****************************************************************************************
+ * appendLocal - stores a plot that was received by our own antenna, giving it the next
+ *               sequence number for its origin (its node_id under our incarnation)
+ *
+ *    Returns: the sequence number assigned
+ *****************************************************************************************/
+
+unsigned int ReplLog::appendLocal(DronePlot &plot) {
+   pthread_mutex_lock(&_mutex);
+
+   origin_log &origin = _log[origin_id(plot.node_id, _incarnation)];
+   plot.serialize(origin.plots);
+   _digest.addPlot(plot);
+   unsigned int seq = origin.highest();
+
+   if (_tracing && (plot.inject_ns != 0)) {
+      unsigned int index = seq - origin.base - 1;
+      origin.traces.resize(index + 1, log_trace{0, 0});
+      origin.traces[index] = log_trace{ plot.inject_ns, PlotTrace::now() };
+   }
+
+   pthread_mutex_unlock(&_mutex);
+   return seq;
+}
+
+/*****************************************************************************************
+ * size - total number of plots held across all origins
+ *****************************************************************************************/
+
+size_t ReplLog::size() {
+   size_t total = 0;
+
+   pthread_mutex_lock(&_mutex);
+   for (auto lptr = _log.begin(); lptr != _log.end(); lptr++)
+      total += lptr->second.plots.size() / DronePlot::getDataSize();
+   pthread_mutex_unlock(&_mutex);
+
+   return total;
+}
+
+/*****************************************************************************************
+ * trimBefore - drops the oldest plots of each origin while they're timestamped before
+ *              cutoff, raising the origin's base past them. Plots come out of an origin in
+ *              sequence order only, so one that arrived late stays until everything
+ *              sequenced before it is trimmed
+ *
+ *    Params:  cutoff - plots older than this are dropped
+ *
+ *    Returns: the number of plots dropped
+ *****************************************************************************************/
+
+size_t ReplLog::trimBefore(time_t cutoff) {
+   unsigned int ppsize = DronePlot::getDataSize();
+   size_t total = 0;
+   DronePlot plot;
+
+   pthread_mutex_lock(&_mutex);
+   for (auto lptr = _log.begin(); lptr != _log.end(); lptr++) {
+      origin_log &origin = lptr->second;
+      unsigned int count = 0;
+
+      for (size_t pos = 0; pos < origin.plots.size(); pos += ppsize, count++) {
+         plot.deserialize(origin.plots.data() + pos);
+         if (plot.timestamp >= cutoff)
+            break;
+      }
+
+      trimOrigin(origin, count);
+      total += count;
+   }
+   pthread_mutex_unlock(&_mutex);
+
+   return total;
+}
+
+/*****************************************************************************************
+ * trimOrigin - drops the first count plots held for an origin along with their traces
+ *              and digest contributions. Called with the mutex held
+ *****************************************************************************************/
+
+void ReplLog::trimOrigin(origin_log &origin, unsigned int count) {
+   unsigned int ppsize = DronePlot::getDataSize();
+   DronePlot plot;
+
+   if (count == 0)
+      return;
+
+   for (size_t pos = 0; pos < (size_t) count * ppsize; pos += ppsize) {
+      plot.deserialize(origin.plots.data() + pos);
+      _digest.removePlot(plot);
+   }
+
+   origin.plots.erase(origin.plots.begin(), origin.plots.begin() + (size_t) count * ppsize);
+   if (origin.traces.size() > count)
+      origin.traces.erase(origin.traces.begin(), origin.traces.begin() + count);
+   else
+      origin.traces.clear();
+   origin.base += count;
+}
+
+/*****************************************************************************************
+ * getVector - serializes our sequence vector (node_id, incarnation, base, highest_seq)
+ *             into buf
+ *****************************************************************************************/
+
+void ReplLog::getVector(std::vector<uint8_t> &buf) {
+   pthread_mutex_lock(&_mutex);
+   buildVector(buf);
+   pthread_mutex_unlock(&_mutex);
+}
+
+void ReplLog::buildVector(std::vector<uint8_t> &buf) {
+   buf.clear();
+   buf.reserve(sizeof(unsigned int) + (3 * sizeof(unsigned int) + sizeof(uint64_t)) * _log.size());
+
+   putUInt(buf, _log.size());
+   for (auto lptr = _log.begin(); lptr != _log.end(); lptr++) {
+      putUInt(buf, lptr->first.first);
+      putUInt64(buf, lptr->first.second);
+      putUInt(buf, lptr->second.base);
+      putUInt(buf, lptr->second.highest());
+   }
+}
+
+/*****************************************************************************************
+ * parseVector - converts a serialized sequence vector into a map of origin -> seq, and
+ *               origin -> base into bases if given
+ *
+ *    Throws: runtime_error if the vector is truncated
+ *****************************************************************************************/
+
+void ReplLog::parseVector(std::vector<uint8_t> &buf, std::map<origin_id, unsigned int> &vec,
+                          std::map<origin_id, unsigned int> *bases) {
+   size_t pos = 0;
+
+   vec.clear();
+   if (bases != NULL)
+      bases->clear();
+
+   unsigned int count = getUInt(buf, pos);
+   for (unsigned int i=0; i<count; i++) {
+      unsigned int node_id = getUInt(buf, pos);
+      uint64_t incarnation = getUInt64(buf, pos);
+      unsigned int base = getUInt(buf, pos);
+      vec[origin_id(node_id, incarnation)] = getUInt(buf, pos);
+      if (bases != NULL)
+         (*bases)[origin_id(node_id, incarnation)] = base;
+   }
+}
+
+/*****************************************************************************************
+ * buildDelta - builds the ranges of plots the peer is missing based off their vector
+ *
+ *             A peer missing plots we've already trimmed gets everything we still hold
+ *             for that origin, starting at our base + 1 (see ReplLog.h)
+ *
+ *    Params:  peer_vec - the peer's serialized sequence vector
+ *             buf - where to place the delta (see ReplLog.h for format)
+ *             max_plots - stop after this many plots (0 for no limit). The remainder is
+ *                         picked up by the next delta
+ *             trace - if not NULL, gets the trace of the first traced plot in the delta
+ *
+ *    Returns: number of plots placed in the delta
+ *
+ *    Throws: runtime_error if the peer's vector was corrupted
+ *****************************************************************************************/
+
+unsigned int ReplLog::buildDelta(std::vector<uint8_t> &peer_vec, std::vector<uint8_t> &buf,
+                                 unsigned int max_plots, plot_trace *trace) {
+   std::map<origin_id, unsigned int> vec;
+   unsigned int ppsize = DronePlot::getDataSize();
+   unsigned int num_ranges = 0, count = 0;
+
+   parseVector(peer_vec, vec);
+
+   buf.clear();
+   putUInt(buf, 0);
+   if (trace != NULL)
+      *trace = plot_trace();
+
+   pthread_mutex_lock(&_mutex);
+   for (auto lptr = _log.begin(); lptr != _log.end(); lptr++) {
+      origin_log &origin = lptr->second;
+      unsigned int have = origin.highest();
+      unsigned int peer_have = vec.count(lptr->first) ? vec[lptr->first] : 0;
+
+      if (peer_have >= have)
+         continue;
+
+      // What the peer is missing may be trimmed already, in which case it gets what's left
+      if (peer_have < origin.base)
+         peer_have = origin.base;
+
+      if ((max_plots > 0) && (have - peer_have > max_plots - count))
+         have = peer_have + (max_plots - count);
+
+      // Range header, then the plots straight out of the log
+      putUInt(buf, lptr->first.first);
+      putUInt64(buf, lptr->first.second);
+      putUInt(buf, origin.base);
+      putUInt(buf, peer_have + 1);
+      putUInt(buf, have - peer_have);
+      buf.insert(buf.end(), origin.plots.begin() + (size_t) (peer_have - origin.base) * ppsize,
+                            origin.plots.begin() + (size_t) (have - origin.base) * ppsize);
+
+      if ((trace != NULL) && (trace->inject_ns == 0))
+         findTrace(origin, peer_have + 1, have, *trace);
+
+      count += have - peer_have;
+      num_ranges++;
+
+      if ((max_plots > 0) && (count >= max_plots))
+         break;
+   }
+   pthread_mutex_unlock(&_mutex);
+
+   memcpy(buf.data(), &num_ranges, sizeof(unsigned int));
+   return count;
+}
+
+/*****************************************************************************************
+ * findTrace - fills in trace from the first traced plot of origin in sequences
+ *             first_seq..last_seq, if any. Called with the mutex held
+ *****************************************************************************************/
+
+void ReplLog::findTrace(origin_log &origin, unsigned int first_seq, unsigned int last_seq,
+                        plot_trace &trace) {
+   std::vector<log_trace> &traces = origin.traces;
+
+   for (unsigned int seq = first_seq; (seq <= last_seq) && (seq - origin.base <= traces.size());
+        seq++) {
+      if (traces[seq - origin.base - 1].inject_ns != 0) {
+         trace.inject_ns = traces[seq - origin.base - 1].inject_ns;
+         trace.logged_ns = traces[seq - origin.base - 1].logged_ns;
+         return;
+      }
+   }
+}
+
+/*****************************************************************************************
+ * advanceVector - updates a peer's vector as if it had applied the delta: ranges that extend
+ *                 its contiguous run raise it, resync ranges replace it, and ranges past a
+ *                 gap are ignored like applyDelta does
+ *
+ *    Params:  vec - the serialized vector to update
+ *             delta - a delta built against (or after) that vector
+ *
+ *    Throws: runtime_error if the vector or delta is corrupted
+ *****************************************************************************************/
+
+void ReplLog::advanceVector(std::vector<uint8_t> &vec, std::vector<uint8_t> &delta) {
+   std::map<origin_id, unsigned int> seqs, bases;
+   unsigned int ppsize = DronePlot::getDataSize();
+   size_t pos = 0;
+
+   parseVector(vec, seqs, &bases);
+
+   unsigned int num_ranges = getUInt(delta, pos);
+   for (unsigned int i=0; i<num_ranges; i++) {
+      unsigned int node_id = getUInt(delta, pos);
+      uint64_t incarnation = getUInt64(delta, pos);
+      unsigned int range_base = getUInt(delta, pos);
+      unsigned int first_seq = getUInt(delta, pos);
+      unsigned int count = getUInt(delta, pos);
+
+      origin_id id(node_id, incarnation);
+      unsigned int &have = seqs[id];
+      if ((have < range_base) && (first_seq == range_base + 1) && (count > 0)) {
+         bases[id] = range_base;
+         have = first_seq + count - 1;
+      } else if ((first_seq <= have + 1) && (first_seq + count - 1 > have)) {
+         have = first_seq + count - 1;
+      }
+
+      pos += (size_t) count * ppsize;
+   }
+
+   vec.clear();
+   putUInt(vec, seqs.size());
+   for (auto sptr = seqs.begin(); sptr != seqs.end(); sptr++) {
+      putUInt(vec, sptr->first.first);
+      putUInt64(vec, sptr->first.second);
+      putUInt(vec, bases[sptr->first]);
+      putUInt(vec, sptr->second);
+   }
+}
+
+/*****************************************************************************************
+ * applyDelta - takes in the ranges sent by a peer and appends any plots that extend our
+ *              contiguous run for their origin. Plots we already hold are skipped and plots
+ *              past a gap are dropped (the peer will resend them once the gap is filled).
+ *              A range starting right after the peer's base when we don't reach that base
+ *              is a resync: what the peer trimmed is gone, so we drop what we still hold
+ *              of that origin and take the range in its place
+ *
+ *    Params:  buf - the delta sent by the peer
+ *             newplots - plots that were new to us get appended here
+ *
+ *    Returns: number of plots that were new
+ *
+ *    Throws: runtime_error if the delta is corrupted
+ *****************************************************************************************/
+
+unsigned int ReplLog::applyDelta(std::vector<uint8_t> &buf, std::list<DronePlot> &newplots) {
+   unsigned int added = 0;
+
+   pthread_mutex_lock(&_mutex);
+   try {
+      applyRanges(buf, newplots, added);
+   } catch (std::runtime_error &e) {
+      pthread_mutex_unlock(&_mutex);
+      throw;
+   }
+   pthread_mutex_unlock(&_mutex);
+
+   return added;
+}
+
+/*****************************************************************************************
+ * applyRanges - applyDelta's work, called with the mutex held. Ranges before a corrupted
+ *               one stay applied
+ *
+ *    Throws: runtime_error if the delta is corrupted
+ *****************************************************************************************/
+
+void ReplLog::applyRanges(std::vector<uint8_t> &buf, std::list<DronePlot> &newplots,
+                          unsigned int &added) {
+   unsigned int ppsize = DronePlot::getDataSize();
+   size_t pos = 0;
+
+   unsigned int num_ranges = getUInt(buf, pos);
+   for (unsigned int i=0; i<num_ranges; i++) {
+      unsigned int node_id = getUInt(buf, pos);
+      uint64_t incarnation = getUInt64(buf, pos);
+      unsigned int range_base = getUInt(buf, pos);
+      unsigned int first_seq = getUInt(buf, pos);
+      unsigned int count = getUInt(buf, pos);
+
+      if ((first_seq == 0) || (pos + (size_t) count * ppsize > buf.size()))
+         throw std::runtime_error("Replication delta range corrupted");
+
+      origin_log &origin = _log[origin_id(node_id, incarnation)];
+      unsigned int have = origin.highest();
+
+      // The peer trimmed past everything we hold, so start over from its base
+      if ((have < range_base) && (first_seq == range_base + 1) && (count > 0)) {
+         trimOrigin(origin, have - origin.base);
+         origin.base = range_base;
+         have = range_base;
+      }
+
+      // Skip what we already have, and drop the range entirely if it starts past a gap
+      if ((first_seq <= have + 1) && (first_seq + count - 1 > have)) {
+         size_t start = pos + (size_t) (have + 1 - first_seq) * ppsize;
+         size_t end = pos + (size_t) count * ppsize;
+
+         origin.plots.insert(origin.plots.end(), buf.begin() + start, buf.begin() + end);
+         for ( ; start < end; start += ppsize) {
+            newplots.emplace_back();
+            newplots.back().deserialize(buf, start);
+            _digest.addPlot(newplots.back());
+            added++;
+         }
+      }
+      pos += (size_t) count * ppsize;
+   }
+}
+
+/*****************************************************************************************
+ * answerDigestQuery, checkDigestReply, getDigestRoot - mutex'd access to the log's
+ *                  PlotDigest (see PlotDigest.h). The first two only go ahead while our
+ *                  sequence vector is still vec, checked under the same lock
+ *
+ *    Throws: runtime_error if the query or reply is corrupted
+ *****************************************************************************************/
+
+bool ReplLog::answerDigestQuery(std::vector<uint8_t> &vec, std::vector<uint8_t> &query,
+                                std::vector<uint8_t> &reply) {
+   std::vector<uint8_t> cur_vec;
+   bool answered = false;
+
+   reply.clear();
+
+   pthread_mutex_lock(&_mutex);
+   try {
+      buildVector(cur_vec);
+      if (cur_vec == vec) {
+         _digest.answerQuery(query, reply);
+         answered = true;
+      }
+   } catch (std::runtime_error &e) {
+      pthread_mutex_unlock(&_mutex);
+      throw;
+   }
+   pthread_mutex_unlock(&_mutex);
+
+   return answered;
+}
+
+ReplLog::digest_status ReplLog::checkDigestReply(std::vector<uint8_t> &vec,
+                     std::vector<uint8_t> &reply, std::vector<uint8_t> &query,
+                     std::vector<std::pair<unsigned int, unsigned int>> &divergent) {
+   std::vector<uint8_t> cur_vec;
+   digest_status results = digest_moved;
+
+   query.clear();
+   divergent.clear();
+
+   pthread_mutex_lock(&_mutex);
+   try {
+      buildVector(cur_vec);
+      if (cur_vec == vec)
+         results = _digest.checkReply(reply, query, divergent) ? digest_more : digest_done;
+   } catch (std::runtime_error &e) {
+      pthread_mutex_unlock(&_mutex);
+      throw;
+   }
+   pthread_mutex_unlock(&_mutex);
+
+   return results;
+}
+
+uint64_t ReplLog::getDigestRoot() {
+   pthread_mutex_lock(&_mutex);
+   uint64_t root = _digest.getRoot();
+   pthread_mutex_unlock(&_mutex);
+
+   return root;
+}
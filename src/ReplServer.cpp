@@ -1,10 +1,48 @@
 #include <iostream>
 #include <exception>
+#include <algorithm>
+#include <sched.h>
 #include "ReplServer.h"
+#include "Metrics.h"
 
 const time_t secs_between_repl = 20;
+const time_t secs_between_checks = 5;
 const unsigned int max_servers = 10;
 
+// Dedup erases plots as tombstones. They're compacted once there are this many, or they're a
+// quarter of the database
+const size_t compact_min_dead = 1024;
+
+// How often the compaction thread looks for enough tombstones to reclaim
+const useconds_t compact_poll_usecs = 50000;
+
+// Plots from different nodes this close in time (at the same spot) are copies of one sighting
+const time_t dedup_secs = 7;
+
+// How far behind plot time segments are sealed, on top of the hot window, so copies that come
+// in a little late are still deduped and skew corrected in memory. Copies for time that's
+// already sealed are checked against the cold tier as they come in (see addReplDronePlots)
+const time_t seal_lag_secs = 2 * secs_between_repl;
+
+static MetricCounter &m_plots_applied = Metrics::global().counter("repl_plots_applied_total",
+                                          "Replicated plots added to the local database");
+static MetricCounter &m_batches_applied = Metrics::global().counter("repl_batches_applied_total",
+                                          "Replicated batches applied");
+static MetricCounter &m_dedup_hits = Metrics::global().counter("repl_dedup_hits_total",
+                                          "Plots dropped as copies of another node's plot");
+static MetricHistogram &m_apply_usecs = Metrics::global().histogram("repl_apply_usecs",
+                                          "Time to apply a replicated batch (usecs)");
+static MetricHistogram &m_lag_secs = Metrics::global().histogram("repl_lag_secs",
+                                          "Simulated time from the newest plot in a batch to its apply");
+static MetricGauge &m_log_plots = Metrics::global().gauge("repl_log_plots",
+                                          "Plots in the replication log");
+static MetricGauge &m_events_dropped = Metrics::global().gauge("event_log_records_dropped",
+                                          "Event log records dropped for want of a file");
+static MetricGauge &m_event_trim_failures = Metrics::global().gauge("event_log_trim_failures",
+                                          "Rotated event log files that couldn't be trimmed");
+static MetricCounter &m_plots_compacted = Metrics::global().counter("repl_plots_compacted_total",
+                                          "Dead plots reclaimed from the database");
+
 /*********************************************************************************************
  * ReplServer (constructor) - creates our ReplServer. Initializes:
  *
@@ -15,35 +53,63 @@ const unsigned int max_servers = 10;
  *
  *********************************************************************************************/
 ReplServer::ReplServer(DronePlotDB &plotdb, float time_mult)
-                              :_queue(1),
+                              :_queue(_repl_log, 1),
                                _plotdb(plotdb),
                                _shutdown(false), 
-                               _time_mult(time_mult),
+                               _own_clock(time_mult),
+                               _clock(&_own_clock),
                                _verbosity(1),
                                _ip_addr("127.0.0.1"),
-                               _port(9999)
+                               _port(9999),
+                               _io_workers(1),
+                               _pin_workers(false)
 {
-   _start_time = time(NULL);
+   pthread_mutex_init(&_walk_mutex, NULL);
+   _own_clock.start();
 }
 
 ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short port, int offset, 
                         float time_mult, unsigned int verbosity)
-                                 :_queue(verbosity),
+                                 :_queue(_repl_log, verbosity),
                                   _plotdb(plotdb),
                                   _shutdown(false), 
-                                  _time_mult(time_mult), 
+                                  _own_clock(time_mult),
+                                  _clock(&_own_clock),
                                   _verbosity(verbosity),
                                   _ip_addr(ip_addr),
-                                  _port(port)
+                                  _port(port),
+                                  _io_workers(1),
+                                  _pin_workers(false)
 
 {
-   _start_time = time(NULL) + offset;
+   pthread_mutex_init(&_walk_mutex, NULL);
+   _own_clock.start(offset);
 }
 
 ReplServer::~ReplServer() {
+   pthread_mutex_destroy(&_walk_mutex);
+}
 
+
+/**********************************************************************************************
+ * setIOWorkers - sets how many threads handle the replication connections (0 = the replication
+ *                thread does it) and whether to pin them to CPUs. Call before replicate
+ **********************************************************************************************/
+
+void ReplServer::setIOWorkers(unsigned int num_workers, bool pin_cpus) {
+   _io_workers = num_workers;
+   _pin_workers = pin_cpus;
 }
 
+/**********************************************************************************************
+ * setEventLog - records replication activity (connections, frames, applied batches) as binary
+ *               events in event_log. Call before replicate
+ **********************************************************************************************/
+
+void ReplServer::setEventLog(EventLog *event_log) {
+   _event_log = event_log;
+   _queue.setEventLog(event_log);
+}
 
 /**********************************************************************************************
  * getAdjustedTime - gets the time since the replication server started up in seconds, modified
@@ -51,7 +117,7 @@ ReplServer::~ReplServer() {
  **********************************************************************************************/
 
 time_t ReplServer::getAdjustedTime() {
-   return static_cast<time_t>((time(NULL) - _start_time) * _time_mult);
+   return static_cast<time_t>(_clock->getTime());
 }
 
 /**********************************************************************************************
@@ -75,10 +141,19 @@ void ReplServer::replicate() {
 
    // Track when we started the server
    _last_repl = 0;
+   _last_check = 0;
+
+   // Dedup marks the copies it finds dead rather than unlinking them mid-scan
+   _plotdb.setTombstones(true);
 
    // Set up our queue's listening socket
    _queue.bindSvr(_ip_addr.c_str(), _port);
    _queue.listenSvr();
+   _queue.startWorkers(_io_workers, _pin_workers);
+
+   // Tombstones are reclaimed off this thread (see t_compactor)
+   if (pthread_create(&_compactor, NULL, t_compactor, (void *) this) != 0)
+      throw std::runtime_error("Unable to create compaction thread");
 
    if (_verbosity >= 2)
       std::cout << "Server bound to " << _ip_addr << ", port: " << _port << " and listening\n";
@@ -88,6 +163,9 @@ void ReplServer::replicate() {
    int tmpSize = _plotdb.size();
    while (!_shutdown) {
 
+      // Everything below walks the database without its lock, so compaction waits until we sleep
+      pthread_mutex_lock(&_walk_mutex);
+
       // Check for new connections, process existing connections, and populate the queue as applicable
       _queue.handleQueue();     
 
@@ -97,6 +175,20 @@ void ReplServer::replicate() {
 
          queueNewPlots();
          _last_repl = getAdjustedTime();
+         m_log_plots.set(_repl_log.size());
+
+         if (_event_log != NULL) {
+            m_events_dropped.set(_event_log->getDropped());
+            m_event_trim_failures.set(_event_log->getTrimFailures());
+         }
+      }
+
+      // Periodically compare our log's digest with the other servers to confirm we converged.
+      // Each check is a connection, so they keep to the -t pace even when the clock skips
+      if (_clock->getPacedTime() - _last_check > secs_between_checks) {
+         if (_repl_log.size() > 0)
+            _queue.checkAll();
+         _last_check = _clock->getPacedTime();
       }
       
       // Check the queue for updates and pop them until the queue is empty. The pop command only returns
@@ -104,10 +196,11 @@ void ReplServer::replicate() {
       // object and automatically removed from the queue by pop
       std::string sid;
       std::vector<uint8_t> data;
-      while (_queue.pop(sid, data)) {
+      plot_trace trace;
+      while (_queue.pop(sid, data, &trace)) {
 
          // Incoming replication--add it to this server's local database
-         addReplDronePlots(data);         
+         addReplDronePlots(sid, data, &trace);         
       }
 
 
@@ -123,7 +216,7 @@ void ReplServer::replicate() {
       //first entry is diff between node 1 and 2, second entry is between node 1 and 3, third entry is between node 2 and 3
       
       //vector to store items to be deleted after iterating through it here
-      std::vector<std::list<DronePlot>::iterator> dups;
+      std::vector<DronePlotDB::iterator> dups;
       if(_plotdb.size() > 1) {
          _plotdb.sortByTime();
          //tmp size keeps track of size of db after last time
@@ -133,18 +226,21 @@ void ReplServer::replicate() {
             //std::cout << "size: " << _plotdb.size() << "\n";
             tmpSize = _plotdb.size();
             auto i = _plotdb.begin();
-            auto end = _plotdb.end();
-            end--;
             //i and j are two rows in the database, if they are not the same row
-            //but are replicates, then remove one of them
-            while(i != end) {
+            //but are replicates, then remove one of them. The last row may get erased as a
+            //duplicate, so check against end() each pass rather than holding onto it
+            while(i != _plotdb.end()) {
+               if (i->isFlagSet(DBFLAG_DEAD)) {
+                  i++;
+                  continue;
+               }
                auto j = _plotdb.begin();
                j++;
                while(j != _plotdb.end()) {
-                  if( j != i) {
+                  if( j != i && !j->isFlagSet(DBFLAG_DEAD)) {
                      if (i->latitude == j->latitude && i->longitude == j->longitude && i->drone_id == j->drone_id && i->node_id != j->node_id)  {
                         //time difference can be up to six second difference(one can be -3 from actual time and other can be +3)
-                        if(abs(i->timestamp - j->timestamp) < 7){
+                        if(abs(i->timestamp - j->timestamp) < dedup_secs){
                            //adding skews
                            if(i->node_id == electedNode) {
                               if(j->node_id == 2) {
@@ -180,14 +276,13 @@ void ReplServer::replicate() {
                            // std::cout << "\nnode: " << j->node_id << ", drone: " << j->drone_id << ", " << j->latitude << ",  " << j->longitude << "   time:  " << j->timestamp;
                            // std::cout << "-------------------------------------\n";
                            // std::cout << "before erase size: " << _plotdb.size();
-                           _plotdb.erase(j);
+                           //erase only marks j dead, so the scan carries on from the next one
+                           j = _plotdb.erase(j);
+                           m_dedup_hits.inc();
                            // std::cout << "\nafter erase size: " << _plotdb.size() << "\n";
-                           //reset j to the beginning of the list
-                              //I tried setting it to where i is but I would get errors
-                           j = _plotdb.begin();
-                           j++;
                            //adjust tmpSize since changed database
                            tmpSize = _plotdb.size();
+                           continue;
                         }  
                      }
                   }
@@ -204,9 +299,10 @@ void ReplServer::replicate() {
             if(skew.at(1) == -16) {
                skew.at(1) = skew.at(2) + skew.at(0);
             }
-            //adjusts time for any entries not made by elected node given the found skews
+            //adjusts time for any entries not made by elected node given the found skews.
+            //Skews are only worked out for nodes 1-3, plots from any others are left alone
             for(auto i = _plotdb.begin(); i != _plotdb.end(); i++){
-               if(!i->isFlagSet(DBFLAG_UNSKEW)) {
+               if(!i->isFlagSet(DBFLAG_UNSKEW) && (i->node_id >= 1) && (i->node_id <= skew.size())) {
                   i->timestamp -= skew.at(i->node_id-1);
                }
             }
@@ -214,120 +310,183 @@ void ReplServer::replicate() {
 
       }       
 
+      // Drop whole segments past the database's retention limits, if it has any
+      size_t dropped = _plotdb.applyRetention(getAdjustedTime());
+
+      // Spill segments that have left the hot window to the cold tier, if there is one. One
+      // that can't be written stays hot and is tried again after the next replication
+      if (getAdjustedTime() >= _next_seal) {
+         try {
+            dropped += _plotdb.sealSegments(getAdjustedTime() - seal_lag_secs);
+         } catch (std::runtime_error &e) {
+            std::string msg("Unable to seal a segment to the cold tier, keeping it in memory. Msg: ");
+            msg += e.what();
+            _queue.getServerLog().writeLogLimited("cold_tier", msg.c_str());
+            _next_seal = getAdjustedTime() + secs_between_repl;
+         }
+      }
+
+      // Keep the replication log to what's still in memory. A server that's been gone longer
+      // than that resyncs from the oldest plot we still log (see ReplLog.h)
+      if (dropped > 0) {
+         time_t oldest = _plotdb.oldestStart(_plotdb.coldSegmentCount() > 0);
+         if ((oldest > 0) && (_repl_log.trimBefore(oldest) > 0))
+            m_log_plots.set(_repl_log.size());
+      }
+
+      pthread_mutex_unlock(&_walk_mutex);
+
       usleep(1000);
    }   
+
+   pthread_join(_compactor, NULL);
+}
+
+/**********************************************************************************************
+ * t_compactor - compaction thread, expects the ReplServer passed in with the data param. Runs
+ *               at idle priority (where the system has it) so it only takes spare CPU, and
+ *               reclaims the copies dedup marked dead once there are enough to be worth a pass.
+ *               It holds the walk mutex while it does, as unlinking plots would pull them out
+ *               from under the replication loop's iterators
+ **********************************************************************************************/
+
+void *ReplServer::t_compactor(void *data) {
+   ReplServer *server = static_cast<ReplServer *>(data);
+
+#ifdef SCHED_IDLE
+   struct sched_param param;
+   param.sched_priority = 0;
+   pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+   DronePlotDB &plotdb = server->_plotdb;
+   while (!server->_shutdown) {
+      usleep(compact_poll_usecs);
+
+      if ((plotdb.deadCount() < compact_min_dead) &&
+          ((plotdb.deadCount() == 0) || (plotdb.deadCount() * 4 < plotdb.size())))
+         continue;
+
+      pthread_mutex_lock(&server->_walk_mutex);
+      m_plots_compacted.inc(plotdb.compact());
+      pthread_mutex_unlock(&server->_walk_mutex);
+   }
+   return NULL;
 }
 
 /**********************************************************************************************
- * queueNewPlots - looks at the database and grabs the new plots, marshalling them and
- *                 sending them to the queue manager
+ * queueNewPlots - looks at the database and grabs the new plots, adding them to the replication
+ *                 log, then queues a sync to every server. Servers that missed earlier syncs
+ *                 (e.g. were down) get those plots on this sync as well
  *
- *    Returns: number of new plots sent to the QueueMgr
+ *    Returns: number of new plots added to the replication log
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
 unsigned int ReplServer::queueNewPlots() {
-   std::vector<uint8_t> marshall_data;
    unsigned int count = 0;
 
    if (_verbosity >= 3)
       std::cout << "Replicating plots.\n";
 
    // Loop through the drone plots, looking for new ones
-   std::list<DronePlot>::iterator dpit = _plotdb.begin();
+   DronePlotDB::iterator dpit = _plotdb.begin();
    for ( ; dpit != _plotdb.end(); dpit++) {
 
-      // If this is a new one, marshall it and clear the flag
-      if (dpit->isFlagSet(DBFLAG_NEW)) {
+      // If this is a new one, sequence it into the log and clear the flag (unless dedup
+      // already found it was a copy)
+      if (dpit->isFlagSet(DBFLAG_NEW) && !dpit->isFlagSet(DBFLAG_DEAD)) {
          
-         dpit->serialize(marshall_data);
+         _repl_log.appendLocal(*dpit);
          dpit->clrFlags(DBFLAG_NEW);
 
          count++;
       }
-      if (marshall_data.size() % DronePlot::getDataSize() != 0)
-         throw std::runtime_error("Issue with marshalling!");
-
    }
   
    if (count == 0) {
       if (_verbosity >= 3)
          std::cout << "No new plots found to replicate.\n";
+   }
 
+   // Nothing to offer anyone yet
+   if (_repl_log.size() == 0)
       return 0;
-   }
  
-   // Add the count onto the front
-   if (_verbosity >= 3)
-      std::cout << "Adding in count: " << count << "\n";
-
-   uint8_t *ctptr_begin = (uint8_t *) &count;
-   marshall_data.insert(marshall_data.begin(), ctptr_begin, ctptr_begin+sizeof(unsigned int));
-
-   // Send to the queue manager
-   if (marshall_data.size() > 0) {
-      _queue.sendToAll(marshall_data);
-   }
+   // Queue up the syncs--each connection works out what its server is missing
+   _queue.syncToAll();
 
    if (_verbosity >= 2) 
-      std::cout << "Queued up " << count << " plots to be replicated.\n";
+      std::cout << "Queued up syncs with " << count << " new plots to be replicated.\n";
 
    return count;
 }
 
 /**********************************************************************************************
  * addReplDronePlots - Adds drone plots to the database from data that was replicated in. 
- *                     Deconflicts issues between plot points.
+ *                     Deconflicts issues between plot points. The new plots go into the
+ *                     database as one batch, so the antenna only waits on one lock
  * 
- * Params:  data - should start with the number of data points in a 32 bit unsigned integer, 
- *                 then a series of drone plot points
+ * Params:  sid - the server it came from
+ *          data - a replication log delta (see ReplLog.h), already decoded by the I/O
+ *                  worker that received it. Plots we already hold are skipped, as are
+ *                  copies of plots that have already been sealed to the cold tier
+ *          trace - the delta's trace, if any, is finished off and added to the histograms
  *
  **********************************************************************************************/
 
-void ReplServer::addReplDronePlots(std::vector<uint8_t> &data) {
-   if (data.size() < 4) {
-      throw std::runtime_error("Not enough data passed into addReplDronePlots");
-   }
+void ReplServer::addReplDronePlots(std::string &sid, std::vector<uint8_t> &data,
+                                                   const plot_trace *trace) {
+   std::list<DronePlot> newplots;
+   uint64_t start_ns = EventLog::monotonic();
+
+   unsigned int count = _repl_log.applyDelta(data, newplots);
+
+   // The main loop's dedup only walks the hot segments, so a copy turning up after its
+   // sighting was sealed has to be caught here
+   time_t cold_end = _plotdb.coldEnd();
+   auto dpit = newplots.begin();
+   while (dpit != newplots.end()) {
+      bool dup = false;
+      if (dpit->timestamp - dedup_secs < cold_end) {
+         _plotdb.scanRange(dpit->timestamp - dedup_secs + 1, dpit->timestamp + dedup_secs - 1,
+                           [&](DronePlot &plot) {
+            if ((plot.drone_id == dpit->drone_id) && (plot.node_id != dpit->node_id) &&
+                (plot.latitude == dpit->latitude) && (plot.longitude == dpit->longitude))
+               dup = true;
+         });
+      }
 
-   if ((data.size() - 4) % DronePlot::getDataSize() != 0) {
-      throw std::runtime_error("Data passed into addReplDronePlots was not the right multiple of DronePlot size");
+      if (dup) {
+         dpit = newplots.erase(dpit);
+         m_dedup_hits.inc();
+      } else
+         dpit++;
    }
 
-   // Get the number of plot points
-   unsigned int *numptr = (unsigned int *) data.data();
-   unsigned int count = *numptr;
-
-   // Store sub-vectors for efficiency
-   std::vector<uint8_t> plot;
-   auto dptr = data.begin() + sizeof(unsigned int);
-
-   for (unsigned int i=0; i<count; i++) {
-      plot.clear();
-      plot.assign(dptr, dptr + DronePlot::getDataSize());
-      addSingleDronePlot(plot);
-      dptr += DronePlot::getDataSize();      
-   }
+   time_t newest = 0;
+   for (auto dpit = newplots.begin(); dpit != newplots.end(); dpit++)
+      newest = std::max(newest, dpit->timestamp);
+   _plotdb.addPlots(newplots);
+
+   uint64_t apply_ns = EventLog::monotonic() - start_ns;
+   if (trace != NULL)
+      PlotTrace::observe(*trace, PlotTrace::now());
+   m_batches_applied.inc();
+   m_plots_applied.inc(count);
+   m_apply_usecs.observe(apply_ns / 1000);
+   if ((count > 0) && (getAdjustedTime() >= newest))
+      m_lag_secs.observe(getAdjustedTime() - newest);
+   m_log_plots.set(_repl_log.size());
+
+   if (_event_log != NULL)
+      _event_log->log(ev_batch_applied, sid.c_str(), data.size(), count, apply_ns);
    if (_verbosity >= 2)
       std::cout << "Replicated in " << count << " plots\n";   
 }
 
 
-/**********************************************************************************************
- * addSingleDronePlot - Takes in binary serialized drone data and adds it to the database. 
- *
- **********************************************************************************************/
-
-void ReplServer::addSingleDronePlot(std::vector<uint8_t> &data) {
-   DronePlot tmp_plot;
-
-   tmp_plot.deserialize(data);
-
-   _plotdb.addPlot(tmp_plot.drone_id, tmp_plot.node_id, tmp_plot.timestamp, tmp_plot.latitude,
-                                                         tmp_plot.longitude);
-}
-
-
 void ReplServer::shutdown() {
    _shutdown = true;
 }
@@ -0,0 +1,54 @@
+#include <cstring>
+#include "SendBuffer.h"
+
+SendBuffer::SendBuffer() {
+}
+
+SendBuffer::~SendBuffer() {
+}
+
+/*********************************************************************************************
+ * add - appends buf, first moving what's still waiting to the front if that's no more than
+ *       was sent ahead of it
+ *********************************************************************************************/
+void SendBuffer::add(const std::vector<uint8_t> &buf) {
+   if ((_start > 0) && (size() <= _start)) {
+      memmove(_buf.data(), _buf.data() + _start, size());
+      _buf.resize(size());
+      _start = 0;
+   }
+   _buf.insert(_buf.end(), buf.begin(), buf.end());
+}
+
+/*********************************************************************************************
+ * flush - writes what's waiting until the socket won't take any more
+ *
+ *    Returns: the number of bytes written
+ *********************************************************************************************/
+size_t SendBuffer::flush(SocketFD &sock) {
+   size_t total = 0;
+
+   while (!_failed && (size() > 0)) {
+      ssize_t results = sock.sendSome(_buf.data() + _start, size());
+      if (results < 0)
+         _failed = true;
+      if (results <= 0)
+         break;
+
+      _start += results;
+      total += results;
+   }
+
+   // All sent, so the next add can start at the front for free
+   if (size() == 0) {
+      _buf.clear();
+      _start = 0;
+   }
+   return total;
+}
+
+void SendBuffer::clear() {
+   _buf.clear();
+   _start = 0;
+   _failed = false;
+}
@@ -0,0 +1,198 @@
+#include <stdexcept>
+#include <cstring>
+#include <crypto++/osrng.h>
+#include <crypto++/filters.h>
+#include <crypto++/modes.h>
+#include <crypto++/aes.h>
+#include <crypto++/sha.h>
+#include <crypto++/hmac.h>
+#include <crypto++/misc.h>
+#include "SessionTickets.h"
+
+using namespace CryptoPP;
+
+// Ticket layout: IV, then encrypted expiry, secret size, secret and client SID, then the MAC
+const unsigned int ticket_iv_size = AES::BLOCKSIZE;
+const unsigned int ticket_mac_size = SHA256::DIGESTSIZE;
+const unsigned int ticket_fixed_size = sizeof(int64_t) + 1;
+
+/*********************************************************************************************
+ * SessionTickets (constructor) - draws the keys tickets are sealed with
+ *********************************************************************************************/
+SessionTickets::SessionTickets(time_t lifetime):_lifetime(lifetime),
+                                                _enc_key(AES::DEFAULT_KEYLENGTH),
+                                                _mac_key(SHA256::DIGESTSIZE)
+{
+   AutoSeededRandomPool rnd;
+   rnd.GenerateBlock(_enc_key, _enc_key.size());
+   rnd.GenerateBlock(_mac_key, _mac_key.size());
+
+   pthread_mutex_init(&_mutex, NULL);
+}
+
+SessionTickets::~SessionTickets() {
+   pthread_mutex_destroy(&_mutex);
+}
+
+void SessionTickets::setLifetime(time_t secs) {
+   pthread_mutex_lock(&_mutex);
+   _lifetime = secs;
+   pthread_mutex_unlock(&_mutex);
+}
+
+time_t SessionTickets::getLifetime() {
+   pthread_mutex_lock(&_mutex);
+   time_t secs = _lifetime;
+   pthread_mutex_unlock(&_mutex);
+   return secs;
+}
+
+/*********************************************************************************************
+ * issue - encrypts the expiry, secret and client SID under a fresh IV, then MACs the IV and
+ *         ciphertext (encrypt-then-MAC)
+ *
+ *    Throws: runtime_error if the secret is too long to fit
+ *********************************************************************************************/
+void SessionTickets::issue(const std::string &client_sid, const SecByteBlock &secret,
+                                                            std::vector<uint8_t> &ticket) {
+   if (secret.size() > 255)
+      throw std::runtime_error("Session ticket secret too long");
+
+   int64_t expires = (int64_t) (time(NULL) + getLifetime());
+   std::string plain((const char *) &expires, sizeof(expires));
+   plain += (char) secret.size();
+   plain.append((const char *) secret.begin(), secret.size());
+   plain += client_sid;
+
+   SecByteBlock init_vector(ticket_iv_size);
+   AutoSeededRandomPool rnd;
+   rnd.GenerateBlock(init_vector, init_vector.size());
+
+   CFB_Mode<AES>::Encryption encryptor;
+   encryptor.SetKeyWithIV(_enc_key, _enc_key.size(), init_vector);
+
+   std::string cipher;
+   StringSource ss(plain, true, new StreamTransformationFilter(encryptor, new StringSink(cipher)));
+
+   ticket.assign(init_vector.begin(), init_vector.end());
+   ticket.insert(ticket.end(), cipher.begin(), cipher.end());
+
+   CryptoPP::HMAC<SHA256> hmac(_mac_key, _mac_key.size());
+   ticket.resize(ticket.size() + ticket_mac_size);
+   hmac.CalculateDigest(ticket.data() + ticket.size() - ticket_mac_size, ticket.data(),
+                                                            ticket.size() - ticket_mac_size);
+}
+
+/*********************************************************************************************
+ * open - checks the MAC before decrypting anything, then the expiry and client SID, and last
+ *        that the ticket wasn't redeemed before. Nothing is recorded, so a ticket sent by
+ *        someone who can't prove they hold its secret isn't used up
+ *********************************************************************************************/
+bool SessionTickets::open(const std::vector<uint8_t> &ticket, const std::string &client_sid,
+                                          SecByteBlock &secret, time_t &expires) {
+   if (ticket.size() < ticket_iv_size + ticket_fixed_size + ticket_mac_size)
+      return false;
+
+   size_t mac_pos = ticket.size() - ticket_mac_size;
+   CryptoPP::HMAC<SHA256> hmac(_mac_key, _mac_key.size());
+   if (!hmac.VerifyDigest(ticket.data() + mac_pos, ticket.data(), mac_pos))
+      return false;
+
+   CFB_Mode<AES>::Decryption decryptor;
+   decryptor.SetKeyWithIV(_enc_key, _enc_key.size(), ticket.data(), ticket_iv_size);
+
+   std::string plain;
+   ArraySource as(ticket.data() + ticket_iv_size, mac_pos - ticket_iv_size, true,
+            new StreamTransformationFilter(decryptor, new StringSink(plain)));
+
+   int64_t sealed_expires;
+   memcpy(&sealed_expires, plain.data(), sizeof(sealed_expires));
+   size_t secret_size = (uint8_t) plain[sizeof(sealed_expires)];
+   if ((plain.size() < ticket_fixed_size + secret_size) ||
+       (sealed_expires < (int64_t) time(NULL)))
+      return false;
+
+   if (plain.compare(ticket_fixed_size + secret_size, std::string::npos, client_sid) != 0)
+      return false;
+
+   pthread_mutex_lock(&_mutex);
+   bool seen = (_redeemed.count(std::string((const char *) ticket.data(), ticket_iv_size)) > 0);
+   pthread_mutex_unlock(&_mutex);
+   if (seen)
+      return false;
+
+   expires = (time_t) sealed_expires;
+   secret.Assign((const byte *) plain.data() + ticket_fixed_size, secret_size);
+   return true;
+}
+
+/*********************************************************************************************
+ * redeem - uses up a ticket that open accepted, once the client has proven it holds the
+ *          secret
+ *
+ *    Returns: false if it was redeemed in the meantime
+ *********************************************************************************************/
+bool SessionTickets::redeem(const std::vector<uint8_t> &ticket, time_t expires) {
+   if (ticket.size() < ticket_iv_size)
+      return false;
+   return markRedeemed(std::string((const char *) ticket.data(), ticket_iv_size), expires);
+}
+
+/*********************************************************************************************
+ * markRedeemed - remembers a ticket's IV until it expires, forgetting the ones that have
+ *
+ *    Returns: false if the IV was already there (the ticket is being replayed)
+ *********************************************************************************************/
+bool SessionTickets::markRedeemed(const std::string &iv, time_t expires) {
+   time_t now = time(NULL);
+
+   pthread_mutex_lock(&_mutex);
+   while ((_redeemed_expiry.size() > 0) && (_redeemed_expiry.begin()->first < now)) {
+      _redeemed.erase(_redeemed_expiry.begin()->second);
+      _redeemed_expiry.erase(_redeemed_expiry.begin());
+   }
+
+   bool fresh = _redeemed.insert(iv).second;
+   if (fresh)
+      _redeemed_expiry.emplace(expires, iv);
+   pthread_mutex_unlock(&_mutex);
+
+   return fresh;
+}
+
+void SessionTickets::store(const std::string &server_sid, const std::vector<uint8_t> &ticket,
+                           const SecByteBlock &secret, uint8_t caps, time_t lifetime) {
+   pthread_mutex_lock(&_mutex);
+   held_ticket &held = _held[server_sid];
+   held.ticket = ticket;
+   held.secret = secret;
+   held.caps = caps;
+   held.expires = time(NULL) + lifetime;
+   pthread_mutex_unlock(&_mutex);
+}
+
+bool SessionTickets::find(const std::string &server_sid, std::vector<uint8_t> &ticket,
+                          SecByteBlock &secret, uint8_t &caps) {
+   bool found = false;
+
+   pthread_mutex_lock(&_mutex);
+   auto hptr = _held.find(server_sid);
+   if (hptr != _held.end()) {
+      if (hptr->second.expires > time(NULL)) {
+         ticket = hptr->second.ticket;
+         secret = hptr->second.secret;
+         caps = hptr->second.caps;
+         found = true;
+      } else {
+         _held.erase(hptr);
+      }
+   }
+   pthread_mutex_unlock(&_mutex);
+   return found;
+}
+
+void SessionTickets::forget(const std::string &server_sid) {
+   pthread_mutex_lock(&_mutex);
+   _held.erase(server_sid);
+   pthread_mutex_unlock(&_mutex);
+}
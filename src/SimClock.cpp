@@ -0,0 +1,99 @@
+#include <time.h>
+#include <cmath>
+#include "SimClock.h"
+
+/*********************************************************************************************
+ * SimClock (constructor) - the condition variable waits on the monotonic clock, like the
+ *                          clock itself, so setting the system time doesn't upset a run
+ *********************************************************************************************/
+SimClock::SimClock(float time_mult):_time_mult(time_mult)
+{
+   pthread_condattr_t attr;
+
+   pthread_mutex_init(&_mutex, NULL);
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&_skipped, &attr);
+   pthread_condattr_destroy(&attr);
+}
+
+SimClock::~SimClock() {
+   pthread_cond_destroy(&_skipped);
+   pthread_mutex_destroy(&_mutex);
+}
+
+double SimClock::realSecs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double SimClock::simTime(double real_secs) {
+   return (real_secs - _start_secs) * _time_mult + _skipped_secs;
+}
+
+void SimClock::start(double offset) {
+   pthread_mutex_lock(&_mutex);
+   _start_secs = realSecs() + offset;
+   _skipped_secs = 0.0;
+   _started = true;
+   pthread_mutex_unlock(&_mutex);
+}
+
+double SimClock::getTime() {
+   pthread_mutex_lock(&_mutex);
+   double sim_secs = simTime(realSecs());
+   pthread_mutex_unlock(&_mutex);
+   return sim_secs;
+}
+
+double SimClock::getPacedTime() {
+   pthread_mutex_lock(&_mutex);
+   double sim_secs = simTime(realSecs()) - _skipped_secs;
+   pthread_mutex_unlock(&_mutex);
+   return sim_secs;
+}
+
+/*********************************************************************************************
+ * sleepUntil - a real clock sleeps for the exact time left, a virtual clock skips the time
+ *              left and wakes anyone in waitUntil
+ *********************************************************************************************/
+void SimClock::sleepUntil(double sim_secs) {
+   if (!_virtual) {
+      waitUntil(sim_secs);
+      return;
+   }
+
+   pthread_mutex_lock(&_mutex);
+   double behind = sim_secs - simTime(realSecs());
+   if (behind > 0.0) {
+      _skipped_secs += behind;
+      pthread_cond_broadcast(&_skipped);
+   }
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*********************************************************************************************
+ * waitUntil - sleeps until the real clock gets to sim_secs, waking early if the clock is
+ *             skipped. Loops as the wait can end before the time is up
+ *********************************************************************************************/
+void SimClock::waitUntil(double sim_secs) {
+   pthread_mutex_lock(&_mutex);
+
+   while (true) {
+      double now_secs = realSecs();
+      double left = sim_secs - simTime(now_secs);
+      if (left <= 0.0)
+         break;
+
+      double wake_secs = now_secs + left / _time_mult;
+      struct timespec wake;
+      wake.tv_sec = (time_t) wake_secs;
+      wake.tv_nsec = (long) ((wake_secs - std::floor(wake_secs)) * 1e9);
+      if (wake.tv_nsec > 999999999)
+         wake.tv_nsec = 999999999;
+      pthread_cond_timedwait(&_skipped, &_mutex, &wake);
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
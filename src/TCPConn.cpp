@@ -1,18 +1,25 @@
 #include <stdexcept>
 #include <strings.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include <cstring>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
 #include "TCPConn.h"
 #include "strfuncts.h"
+#include "PlotCodec.h"
+#include "Metrics.h"
 #include <crypto++/secblock.h>
 #include <crypto++/osrng.h>
 #include <crypto++/filters.h>
 #include <crypto++/rijndael.h>
 #include <crypto++/gcm.h>
 #include <crypto++/aes.h>
+#include <crypto++/sha.h>
+#include <crypto++/hmac.h>
+#include <crypto++/hkdf.h>
+#include <crypto++/misc.h>
 #include <stdlib.h>
 #include <cmath>
 
@@ -23,6 +30,42 @@ const unsigned int iv_size = AES::BLOCKSIZE;
 const unsigned int key_size = AES::DEFAULT_KEYLENGTH;
 const unsigned int auth_size = 16;
 
+// One round trip handshake: nonce sizes, the derived session key and the proofs of it
+const unsigned int nonce_size = 16;
+const unsigned int session_key_size = 32;
+const unsigned int proof_size = SHA256::DIGESTSIZE;
+
+// Messages are their length (32 bit unsigned int, host order), then the bytes. The largest
+// we'll buffer--anything bigger means the stream is corrupted
+const size_t msg_hdr_size = sizeof(uint32_t);
+const uint32_t max_message_size = 64 * 1024 * 1024;
+
+// How long a connect attempt gets before it's given up on (nanoseconds)
+const uint64_t connect_timeout_ns = 2000000000ULL;
+
+static MetricCounter &m_bytes_sent = Metrics::global().counter("repl_bytes_sent_total",
+                                          "Bytes written to replication connections");
+static MetricCounter &m_bytes_recv = Metrics::global().counter("repl_bytes_recv_total",
+                                          "Bytes read from replication connections");
+static MetricCounter &m_frames_sent = Metrics::global().counter("repl_frames_sent_total",
+                                          "Session frames sent");
+static MetricCounter &m_frames_recv = Metrics::global().counter("repl_frames_recv_total",
+                                          "Session frames received");
+static MetricCounter &m_auth_failures = Metrics::global().counter("repl_auth_failures_total",
+                                          "Peers that failed the challenge");
+static MetricCounter &m_resumed = Metrics::global().counter("repl_sessions_resumed_total",
+                                          "Connections that skipped the handshake with a ticket");
+static MetricCounter &m_tickets_rejected = Metrics::global().counter("repl_tickets_rejected_total",
+                                          "Resumption tickets turned down");
+static MetricHistogram &m_server_handshake = Metrics::global().histogram("repl_handshake_usecs",
+                                          "Connect/accept to mutual authentication (usecs)",
+                                          "role=\"server\"");
+static MetricHistogram &m_client_handshake = Metrics::global().histogram("repl_handshake_usecs",
+                                          "Connect/accept to mutual authentication (usecs)",
+                                          "role=\"client\"");
+static MetricHistogram &m_ack_usecs = Metrics::global().histogram("repl_ack_usecs",
+                                          "Session frame sent to acknowledged (usecs)");
+
 /**********************************************************************************************
  * TCPConn (constructor) - creates the connector and initializes - creates the command strings
  *                         to wrap around network commands
@@ -72,6 +115,81 @@ TCPConn::TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int v
 
    c_endsid = c_sid;
    c_endsid.insert(c_endsid.begin()+1, 1, slash);
+
+   c_vec.push_back((uint8_t) '<');
+   c_vec.push_back((uint8_t) 'V');
+   c_vec.push_back((uint8_t) 'E');
+   c_vec.push_back((uint8_t) 'C');
+   c_vec.push_back((uint8_t) '>');
+
+   c_endvec = c_vec;
+   c_endvec.insert(c_endvec.begin()+1, 1, slash);
+
+   c_dig.push_back((uint8_t) '<');
+   c_dig.push_back((uint8_t) 'D');
+   c_dig.push_back((uint8_t) 'I');
+   c_dig.push_back((uint8_t) 'G');
+   c_dig.push_back((uint8_t) '>');
+
+   c_enddig = c_dig;
+   c_enddig.insert(c_enddig.begin()+1, 1, slash);
+
+   c_cod.push_back((uint8_t) '<');
+   c_cod.push_back((uint8_t) 'C');
+   c_cod.push_back((uint8_t) 'O');
+   c_cod.push_back((uint8_t) 'D');
+   c_cod.push_back((uint8_t) '>');
+
+   c_endcod = c_cod;
+   c_endcod.insert(c_endcod.begin()+1, 1, slash);
+
+   c_frm.push_back((uint8_t) '<');
+   c_frm.push_back((uint8_t) 'F');
+   c_frm.push_back((uint8_t) 'R');
+   c_frm.push_back((uint8_t) 'M');
+   c_frm.push_back((uint8_t) '>');
+
+   c_endfrm = c_frm;
+   c_endfrm.insert(c_endfrm.begin()+1, 1, slash);
+
+   c_endack = c_ack;
+   c_endack.insert(c_endack.begin()+1, 1, slash);
+
+   c_hel.push_back((uint8_t) '<');
+   c_hel.push_back((uint8_t) 'H');
+   c_hel.push_back((uint8_t) 'E');
+   c_hel.push_back((uint8_t) 'L');
+   c_hel.push_back((uint8_t) '>');
+
+   c_endhel = c_hel;
+   c_endhel.insert(c_endhel.begin()+1, 1, slash);
+
+   c_prf.push_back((uint8_t) '<');
+   c_prf.push_back((uint8_t) 'P');
+   c_prf.push_back((uint8_t) 'R');
+   c_prf.push_back((uint8_t) 'F');
+   c_prf.push_back((uint8_t) '>');
+
+   c_endprf = c_prf;
+   c_endprf.insert(c_endprf.begin()+1, 1, slash);
+
+   c_res.push_back((uint8_t) '<');
+   c_res.push_back((uint8_t) 'R');
+   c_res.push_back((uint8_t) 'E');
+   c_res.push_back((uint8_t) 'S');
+   c_res.push_back((uint8_t) '>');
+
+   c_endres = c_res;
+   c_endres.insert(c_endres.begin()+1, 1, slash);
+
+   c_tkt.push_back((uint8_t) '<');
+   c_tkt.push_back((uint8_t) 'T');
+   c_tkt.push_back((uint8_t) 'K');
+   c_tkt.push_back((uint8_t) 'T');
+   c_tkt.push_back((uint8_t) '>');
+
+   c_endtkt = c_tkt;
+   c_endtkt.insert(c_endtkt.begin()+1, 1, slash);
 }
 
 
@@ -90,7 +208,7 @@ TCPConn::~TCPConn() {
 bool TCPConn::accept(SocketFD &server) {
    // Accept the connection
    bool results = _connfd.acceptFD(server);
-
+   _start_ns = EventLog::monotonic();
 
    // Set the state as waiting for the authorization packet
    _status = s_connected;
@@ -99,19 +217,55 @@ bool TCPConn::accept(SocketFD &server) {
 }
 
 /**********************************************************************************************
- * sendData - sends the data in the parameter to the socket
+ * sendData - sends the data in the parameter to the socket as one message (see getData).
+ *            Anything held back in _tx_prefix (the client's handshake proof) goes out first,
+ *            in the same write. An empty buf just sends what's held back. It's queued behind
+ *            anything still waiting in _txbuf and written without blocking, so a large batch
+ *            or a full socket leaves the rest for flushData on later passes
  *
- *    Params:  msg - the string to be sent
- *             size - if we know how much data we should expect to send, this should be populated
+ *    Params:  buf - the data to be sent
  *
  *    Throws: runtime_error for unrecoverable errors
  **********************************************************************************************/
 
 bool TCPConn::sendData(std::vector<uint8_t> &buf) {
-   
-   _connfd.writeBytes<uint8_t>(buf);
-   
-   return true;
+   std::vector<uint8_t> out = std::move(_tx_prefix);
+   _tx_prefix.clear();
+
+   if (buf.size() > 0)
+      addMessage(out, buf);
+   if (out.size() == 0)
+      return true;
+
+   _txbuf.add(out);
+   return flushData();
+}
+
+/**********************************************************************************************
+ * flushData - writes as much of what's waiting in _txbuf as the socket will take
+ *
+ *    Returns: false if the write failed (the connection was lost), true otherwise
+ **********************************************************************************************/
+
+bool TCPConn::flushData() {
+   if (_txbuf.size() == 0)
+      return true;
+
+   m_bytes_sent.inc(_txbuf.flush(_connfd));
+   return !_txbuf.isFailed();
+}
+
+/**********************************************************************************************
+ * addMessage - appends buf to out as a message: its length, then the bytes
+ *
+ **********************************************************************************************/
+
+void TCPConn::addMessage(std::vector<uint8_t> &out, std::vector<uint8_t> &buf) {
+   uint32_t len = buf.size();
+
+   out.reserve(out.size() + msg_hdr_size + buf.size());
+   out.insert(out.end(), (uint8_t *) &len, (uint8_t *) &len + sizeof(len));
+   out.insert(out.end(), buf.begin(), buf.end());
 }
 
 /**********************************************************************************************
@@ -163,7 +317,9 @@ void TCPConn::encryptData(std::vector<uint8_t> &buf) {
 }
 
 /**********************************************************************************************
- * sendChallenge - creates a random number string of auth_size to be encrypted then decrypted
+ * sendChallenge - creates a random number string of auth_size to be encrypted then decrypted.
+ *                 A server with a replication log also sends its sequence vector in the same
+ *                 write so the client knows which plots we are missing
  *
  **********************************************************************************************/
 
@@ -174,6 +330,18 @@ void TCPConn::sendChallenge() {
    //buf.clear();
    std::vector<uint8_t> buf(_authstr.begin(), _authstr.end());
    wrapCmd(buf, c_auth, c_endauth);
+
+   if ((_status == s_connected) && (_repl_log != NULL)) {
+      std::vector<uint8_t> vec;
+      _repl_log->getVector(vec);
+      wrapCmd(vec, c_vec, c_endvec);
+      buf.insert(buf.end(), vec.begin(), vec.end());
+
+      // As do the batch encodings we can decode
+      std::vector<uint8_t> caps(1, PlotCodec::getCapabilities());
+      wrapCmd(caps, c_cod, c_endcod);
+      buf.insert(buf.end(), caps.begin(), caps.end());
+   }
    sendData(buf);
    if(_status == challengingServer)
       _status = waitServerResponse;
@@ -188,11 +356,16 @@ void TCPConn::sendChallenge() {
  **********************************************************************************************/
 
 void TCPConn::waitForChallenge() {
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
+   std::vector<uint8_t> buf;
+   if (getData(buf)) {
+      // The server's sequence vector rides along with its challenge
+      std::vector<uint8_t> vec = buf;
+      if (getCmdData(vec, c_vec, c_endvec))
+         _peer_vec = vec;
 
-      if (!getData(buf))
-         return;
+      std::vector<uint8_t> caps = buf;
+      if (getCmdData(caps, c_cod, c_endcod) && (caps.size() == 1))
+         _peer_caps = caps[0];
 
       if (!getCmdData(buf, c_auth, c_endauth)) {
          std::stringstream msg;
@@ -207,8 +380,11 @@ void TCPConn::waitForChallenge() {
       if(_status == waitServerChallenge)
          _status = challengingServer;
 
-      if(_status == waitClientChallenge)
+      if(_status == waitClientChallenge) {
+         _ready_ns = PlotTrace::now();
+         m_server_handshake.observe((EventLog::monotonic() - _start_ns) / 1000);
          _status = s_datarx;
+      }
    }
 }
 
@@ -219,29 +395,37 @@ void TCPConn::waitForChallenge() {
  **********************************************************************************************/
 
 void TCPConn::waitForResponse() {
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
-
-      if(!getEncryptedData(buf))
-         return;
-
+   std::vector<uint8_t> buf;
+   if (getEncryptedData(buf)) {
       std::vector<uint8_t> compAuth(_authstr.begin(), _authstr.end());
       if(buf !=  compAuth) {
          //failed challenge, log this and disconnect
          std::stringstream msg;
          msg << "Challenge response failed from " << getNodeID() << "\n";
          _server_log.writeLog(msg.str().c_str());
+         if (_event_log != NULL)
+            _event_log->log(ev_auth_failed, getNodeID());
+         m_auth_failures.inc();
          disconnect();
          return;
       }
       
+      if (_event_log != NULL)
+         _event_log->log(ev_auth_ok, getNodeID());
+
       //server verified client
       if(_status == waitClientResponse)
          _status = waitClientChallenge;
 
       //client verified server
-      if(_status == waitServerResponse)
-         transmitData();
+      if(_status == waitServerResponse) {
+         _ready_ns = PlotTrace::now();
+         m_client_handshake.observe((EventLog::monotonic() - _start_ns) / 1000);
+         if (_digest_check)
+            startDigestCheck();
+         else
+            transmitData();
+      }
    }
 
        
@@ -270,11 +454,20 @@ void TCPConn::sendSID() {
 void TCPConn::waitForSID() {
 
    // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
+   std::vector<uint8_t> buf;
+   if (getData(buf)) {
+      // Clients using the one round trip handshake open with a hello instead, or with a
+      // ticket to resume and their first data
+      if (hasCmd(buf, c_res)) {
+         answerResume(buf);
+         return;
+      }
 
-      if (!getData(buf))
+      std::vector<uint8_t> hello = buf;
+      if (getCmdData(hello, c_hel, c_endhel)) {
+         answerHello(hello);
          return;
+      }
 
       if (!getCmdData(buf, c_sid, c_endsid)) {
          std::stringstream msg;
@@ -302,42 +495,506 @@ void TCPConn::waitForSID() {
 
 
 /**********************************************************************************************
- * transmitData()  - receives the SID from the server and transmits data
+ * sendHello - Client: after a connection, opens the one round trip handshake with our nonce
+ *             and Server ID. The server's reply proves it holds the shared key, and our proof
+ *             goes out with the first data, so the session is ready after one round trip
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::transmitData() {
+void TCPConn::sendHello() {
+   AutoSeededRandomPool rnd;
 
-   // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
+   _client_nonce.resize(nonce_size);
+   rnd.GenerateBlock(_client_nonce.data(), _client_nonce.size());
+
+   std::vector<uint8_t> buf = _client_nonce;
+   buf.insert(buf.end(), _svr_id.begin(), _svr_id.end());
+   wrapCmd(buf, c_hel, c_endhel);
+   sendData(buf);
+
+   _status = waitServerHello;
+}
+
+/**********************************************************************************************
+ * answerHello - Server: takes the client's nonce and Server ID from its hello, then replies
+ *               with our nonce and proof. A server with a replication log also sends its
+ *               sequence vector and batch encodings, as it does with the challenge
+ *
+ *    Params:  hello - what was between the hello commands
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::answerHello(std::vector<uint8_t> &hello) {
+   if (hello.size() <= nonce_size) {
+      std::stringstream msg;
+      msg << "Hello from connecting client invalid format. Cannot authenticate.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+
+   _client_nonce.assign(hello.begin(), hello.begin() + nonce_size);
+   std::string node(hello.begin() + nonce_size, hello.end());
+   setNodeID(node.c_str());
+
+   AutoSeededRandomPool rnd;
+   _server_nonce.resize(nonce_size);
+   rnd.GenerateBlock(_server_nonce.data(), _server_nonce.size());
+   deriveSessionKey(_aes_key, "repl session ");
+
+   std::vector<uint8_t> proof;
+   calcProof("server", proof);
+
+   std::vector<uint8_t> buf = _server_nonce;
+   buf.insert(buf.end(), proof.begin(), proof.end());
+   wrapCmd(buf, c_hel, c_endhel);
+
+   // A ticket to resume with next time. Only a client that can work out the session key
+   // can use it, so it's safe to hand out before the client has proven itself
+   addTicket(buf);
+
+   if (_repl_log != NULL) {
+      std::vector<uint8_t> vec;
+      _repl_log->getVector(vec);
+      wrapCmd(vec, c_vec, c_endvec);
+      buf.insert(buf.end(), vec.begin(), vec.end());
+
+      std::vector<uint8_t> caps(1, PlotCodec::getCapabilities());
+      wrapCmd(caps, c_cod, c_endcod);
+      buf.insert(buf.end(), caps.begin(), caps.end());
+   }
+   sendData(buf);
+
+   _status = waitClientProof;
+}
 
-      if (!getData(buf))
+/**********************************************************************************************
+ * waitForHello - Client: checks the server's proof, then sends the data (or starts the session
+ *                or digest check) behind our own proof
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::waitForHello() {
+   std::vector<uint8_t> buf;
+   if (getData(buf)) {
+      std::vector<uint8_t> vec = buf;
+      if (getCmdData(vec, c_vec, c_endvec))
+         _peer_vec = vec;
+
+      std::vector<uint8_t> caps = buf;
+      if (getCmdData(caps, c_cod, c_endcod) && (caps.size() == 1))
+         _peer_caps = caps[0];
+
+      std::vector<uint8_t> ticket = buf;
+      if (!getCmdData(ticket, c_tkt, c_endtkt))
+         ticket.clear();
+
+      if (!getCmdData(buf, c_hel, c_endhel) || (buf.size() != nonce_size + proof_size)) {
+         std::stringstream msg;
+         msg << "Hello possibly corrupted from " << getNodeID() << "\n";
+         _server_log.writeLog(msg.str().c_str());
+         disconnect();
          return;
+      }
 
-      if (!getCmdData(buf, c_sid, c_endsid)) {
+      _server_nonce.assign(buf.begin(), buf.begin() + nonce_size);
+      deriveSessionKey(_aes_key, "repl session ");
+
+      std::vector<uint8_t> proof;
+      calcProof("server", proof);
+      if (!VerifyBufsEqual(proof.data(), buf.data() + nonce_size, proof_size)) {
          std::stringstream msg;
-         msg << "SID string from connected server invalid format. Cannot authenticate.";
+         msg << "Handshake proof failed from " << getNodeID() << "\n";
          _server_log.writeLog(msg.str().c_str());
+         if (_event_log != NULL)
+            _event_log->log(ev_auth_failed, getNodeID());
+         m_auth_failures.inc();
          disconnect();
          return;
       }
 
-      std::string node(buf.begin(), buf.end());
+      if (_event_log != NULL)
+         _event_log->log(ev_auth_ok, getNodeID());
+      _ready_ns = PlotTrace::now();
+      m_client_handshake.observe((EventLog::monotonic() - _start_ns) / 1000);
+
+      // Keep the ticket (and the encodings the server takes) for when we reconnect
+      storeTicket(ticket);
+
+      std::vector<uint8_t> proof_msg;
+      calcProof("client", proof_msg);
+      wrapCmd(proof_msg, c_prf, c_endprf);
+      addMessage(_tx_prefix, proof_msg);
+
+      if (_digest_check)
+         startDigestCheck();
+      else
+         transmitData();
+
+      // Nothing to send yet (an idle session), the proof goes on its own
+      if (_connected && (_tx_prefix.size() > 0)) {
+         std::vector<uint8_t> nodata;
+         sendData(nodata);
+      }
+   }
+}
+
+/**********************************************************************************************
+ * waitForProof - Server: checks the client's proof, then handles any data that came with it
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::waitForProof() {
+   std::vector<uint8_t> buf;
+
+   if (!getData(buf))
+      return;
+
+   std::vector<uint8_t> proof;
+   calcProof("client", proof);
+
+   if ((buf.size() != c_prf.size() + proof_size + c_endprf.size()) ||
+       !std::equal(c_prf.begin(), c_prf.end(), buf.begin()) ||
+       !std::equal(c_endprf.begin(), c_endprf.end(), buf.end() - c_endprf.size()) ||
+       !VerifyBufsEqual(proof.data(), buf.data() + c_prf.size(), proof_size)) {
+      std::stringstream msg;
+      msg << "Handshake proof failed from " << getNodeID() << "\n";
+      _server_log.writeLog(msg.str().c_str());
+      if (_event_log != NULL)
+         _event_log->log(ev_auth_failed, getNodeID());
+      m_auth_failures.inc();
+      disconnect();
+      return;
+   }
+
+   // Only now is a resumed client's ticket used up, so one sent without its secret isn't
+   if (_resumed && !_tickets->redeem(_resume_ticket, _resume_expires)) {
+      std::stringstream msg;
+      msg << "Resumption ticket from " << getNodeID() << " was already redeemed. Disconnecting.";
+      _server_log.writeLogLimited(std::string("ticket:") + getNodeID(), msg.str().c_str());
+      m_tickets_rejected.inc();
+      disconnect();
+      return;
+   }
+
+   if (_event_log != NULL)
+      _event_log->log(ev_auth_ok, getNodeID());
+   _ready_ns = PlotTrace::now();
+   m_server_handshake.observe((EventLog::monotonic() - _start_ns) / 1000);
+   _status = s_datarx;
+
+   // A resumed client is waiting on our proof before it takes our replies. Its ticket is
+   // spent, so a fresh one goes with the proof
+   if (_resumed) {
+      calcProof("server", proof);
+      wrapCmd(proof, c_res, c_endres);
+      addTicket(proof);
+      sendData(proof);
+      m_resumed.inc();
+   }
+
+   // The data may have come in behind the proof
+   waitForData();
+}
+
+/**********************************************************************************************
+ * deriveSessionKey - HKDF of secret (the shared key, or a ticket's resumption secret), salted
+ *                    with the nonces and bound to the client's Server ID, so every connection
+ *                    gets its own key
+ *
+ *    Params:  secret - what to derive the key from
+ *             label - what it's for, the client's Server ID is added to it
+ *
+ **********************************************************************************************/
+
+void TCPConn::deriveSessionKey(const SecByteBlock &secret, const char *label) {
+   std::vector<uint8_t> salt = _client_nonce;
+   salt.insert(salt.end(), _server_nonce.begin(), _server_nonce.end());
+
+   std::string info(label);
+   info += (_status == s_connected) ? _node_id : _svr_id;
+
+   HKDF<SHA256> hkdf;
+   _session_key.resize(session_key_size);
+   hkdf.DeriveKey(_session_key.begin(), _session_key.size(), secret.begin(), secret.size(),
+                  salt.data(), salt.size(), (const byte *) info.data(), info.size());
+}
+
+/**********************************************************************************************
+ * resumptionSecret - the secret a ticket from this session carries, derived from the session
+ *                    key so both ends can work it out without sending it
+ *
+ **********************************************************************************************/
+
+void TCPConn::resumptionSecret(SecByteBlock &secret) {
+   const char *info = "repl resumption";
+
+   HKDF<SHA256> hkdf;
+   secret.resize(session_key_size);
+   hkdf.DeriveKey(secret.begin(), secret.size(), _session_key.begin(), _session_key.size(),
+                  NULL, 0, (const byte *) info, strlen(info));
+}
+
+/**********************************************************************************************
+ * addTicket - Server: issues a ticket for this session's resumption secret and adds it to buf
+ *             (the lifetime as a 32 bit unsigned int, then the ticket), if we issue any
+ *
+ **********************************************************************************************/
+
+void TCPConn::addTicket(std::vector<uint8_t> &buf) {
+   time_t lifetime = (_tickets != NULL) ? _tickets->getLifetime() : 0;
+   if (lifetime <= 0)
+      return;
+
+   SecByteBlock secret;
+   std::vector<uint8_t> ticket;
+   resumptionSecret(secret);
+   _tickets->issue(_node_id, secret, ticket);
+
+   uint32_t ticket_secs = (uint32_t) lifetime;
+   std::vector<uint8_t> tkt((uint8_t *) &ticket_secs, (uint8_t *) &ticket_secs + sizeof(ticket_secs));
+   tkt.insert(tkt.end(), ticket.begin(), ticket.end());
+   wrapCmd(tkt, c_tkt, c_endtkt);
+   buf.insert(buf.end(), tkt.begin(), tkt.end());
+}
+
+/**********************************************************************************************
+ * storeTicket - Client: keeps a ticket the server gave us (as addTicket sent it, unwrapped)
+ *               with this session's resumption secret and the encodings the server takes
+ *
+ **********************************************************************************************/
+
+void TCPConn::storeTicket(std::vector<uint8_t> &ticket) {
+   if ((_tickets == NULL) || (ticket.size() <= sizeof(uint32_t)))
+      return;
+
+   uint32_t ticket_secs;
+   memcpy(&ticket_secs, ticket.data(), sizeof(ticket_secs));
+   ticket.erase(ticket.begin(), ticket.begin() + sizeof(ticket_secs));
+
+   SecByteBlock secret;
+   resumptionSecret(secret);
+   _tickets->store(_node_id, ticket, secret, _peer_caps, ticket_secs);
+}
+
+/**********************************************************************************************
+ * sendResume - Client: reconnecting with a ticket, so skips the handshake. Our nonce, Server
+ *              ID, the ticket and our proof under a key derived from the ticket's secret all
+ *              go out in the same write as the first data. Sessions carry on from the frames
+ *              they sent before (the server skips what it already applied)
+ *
+ *    Returns: true if resumed, false if the handshake is needed: there's no ticket for the
+ *             server, or this is a digest check or a new session, which need the server's
+ *             sequence vector
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+bool TCPConn::sendResume() {
+   std::vector<uint8_t> ticket;
+   SecByteBlock secret;
+   AutoSeededRandomPool rnd;
+
+   if ((_tickets == NULL) || _digest_check || (_stream && (_sent_vec.size() == 0)) ||
+                                    !_tickets->find(_node_id, ticket, secret, _peer_caps))
+      return false;
+
+   // Tickets are single use, so this one is spent whatever the server makes of it. The
+   // server hands a fresh one back with its proof
+   _tickets->forget(_node_id);
+
+   _client_nonce.resize(nonce_size);
+   rnd.GenerateBlock(_client_nonce.data(), _client_nonce.size());
+   _server_nonce.clear();
+   deriveSessionKey(secret, "repl resume ");
+
+   std::vector<uint8_t> res = _client_nonce;
+   res.insert(res.end(), _svr_id.begin(), _svr_id.end());
+   wrapCmd(res, c_res, c_endres);
+
+   std::vector<uint8_t> buf = ticket;
+   wrapCmd(buf, c_tkt, c_endtkt);
+   res.insert(res.end(), buf.begin(), buf.end());
+   _tx_prefix.clear();
+   addMessage(_tx_prefix, res);
+
+   calcProof("client", buf);
+   wrapCmd(buf, c_prf, c_endprf);
+   addMessage(_tx_prefix, buf);
+
+   _ready_ns = PlotTrace::now();
+   if (_stream) {
+      if (_symmetric)
+         sendVector();
+      for (auto fptr = _unacked.begin(); fptr != _unacked.end(); fptr++)
+         sendDelta(*fptr);
+      _status = s_stream;
+      streamData();
+   } else {
+      transmitData();
+   }
+
+   if (_connected && (_tx_prefix.size() > 0)) {
+      std::vector<uint8_t> nodata;
+      sendData(nodata);
+   }
+
+   // Replies wait until the server proves it opened the ticket
+   _resume_status = _status;
+   _status = waitServerResume;
+   return true;
+}
+
+/**********************************************************************************************
+ * answerResume - Server: opens the client's ticket and derives the session key from its
+ *                secret, then checks the proof and takes in the data that came with it. A
+ *                ticket we can't open (expired, or from before we restarted) gets the client
+ *                disconnected, and it falls back to the full handshake
+ *
+ *    Params:  buf - the client's first flight
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::answerResume(std::vector<uint8_t> &buf) {
+   std::vector<uint8_t> res = buf, ticket = buf;
+   SecByteBlock secret;
+
+   bool valid = getCmdData(res, c_res, c_endres) && (res.size() > nonce_size) &&
+                getCmdData(ticket, c_tkt, c_endtkt) && (_tickets != NULL);
+   if (valid) {
+      std::string node(res.begin() + nonce_size, res.end());
       setNodeID(node.c_str());
+      valid = _tickets->open(ticket, _node_id, secret, _resume_expires);
+   }
 
-      // Send the replication data
-      sendData(_outputbuf);
-      //CHANGE what is outputbuf
+   if (!valid) {
+      std::stringstream msg;
+      msg << "Resumption ticket from " << getNodeID() << " turned down. Disconnecting.";
+      _server_log.writeLogLimited(std::string("ticket:") + getNodeID(), msg.str().c_str());
+      m_tickets_rejected.inc();
+      disconnect();
+      return;
+   }
 
-      if (_verbosity >= 3)
-         std::cout << "Successfully authenticated connection with " << getNodeID() <<
-                      " and sending replication data.\n";
+   _client_nonce.assign(res.begin(), res.begin() + nonce_size);
+   _server_nonce.clear();
+   deriveSessionKey(secret, "repl resume ");
+   _resumed = true;
+   _resume_ticket = ticket;
 
-      // Wait for their response
-      _status = s_waitack;
+   // The proof and data follow in the same flight
+   _status = waitClientProof;
+   waitForProof();
+}
+
+/**********************************************************************************************
+ * waitForResume - Client: checks the server's proof that it opened our ticket, then goes back
+ *                 to what the first flight started. If the server turns the ticket down (it
+ *                 disconnects), the ticket is dropped and the next connect does the handshake
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::waitForResume() {
+   std::vector<uint8_t> buf;
+
+   if (!getData(buf)) {
+      if (!_connected) {
+         _tickets->forget(_node_id);
+         if (_stream)
+            lostStream();
+      }
+      return;
    }
+
+   std::vector<uint8_t> proof;
+   calcProof("server", proof);
+
+   // The proof, then maybe a fresh ticket
+   size_t res_size = c_res.size() + proof_size + c_endres.size();
+   if ((buf.size() < res_size) ||
+       !std::equal(c_res.begin(), c_res.end(), buf.begin()) ||
+       !std::equal(c_endres.begin(), c_endres.end(), buf.begin() + res_size - c_endres.size()) ||
+       !VerifyBufsEqual(proof.data(), buf.data() + c_res.size(), proof_size)) {
+      std::stringstream msg;
+      msg << "Resumption proof failed from " << getNodeID() << "\n";
+      _server_log.writeLog(msg.str().c_str());
+      if (_event_log != NULL)
+         _event_log->log(ev_auth_failed, getNodeID());
+      m_auth_failures.inc();
+      _tickets->forget(_node_id);
+      if (_stream)
+         lostStream();
+      else
+         disconnect();
+      return;
+   }
+
+   if (_event_log != NULL)
+      _event_log->log(ev_auth_ok, getNodeID());
+   m_client_handshake.observe((EventLog::monotonic() - _start_ns) / 1000);
+
+   std::vector<uint8_t> ticket(buf.begin() + res_size, buf.end());
+   if (getCmdData(ticket, c_tkt, c_endtkt))
+      storeTicket(ticket);
+
+   _status = _resume_status;
+
+   // The server's first replies may have come in behind its proof
+   if (_status == s_stream)
+      streamData();
+   else if (_status == s_waitack)
+      awaitAck();
+}
+
+/**********************************************************************************************
+ * calcProof - HMAC of both nonces under the session key. The label keeps the server's proof
+ *             from being reflected back as the client's
+ *
+ *    Params:  label - "server" or "client"
+ *             proof - gets the proof_size byte HMAC
+ *
+ **********************************************************************************************/
+
+void TCPConn::calcProof(const char *label, std::vector<uint8_t> &proof) {
+   CryptoPP::HMAC<SHA256> hmac(_session_key.begin(), _session_key.size());
+
+   hmac.Update((const byte *) label, strlen(label));
+   hmac.Update(_client_nonce.data(), _client_nonce.size());
+   hmac.Update(_server_nonce.data(), _server_nonce.size());
+
+   proof.resize(proof_size);
+   hmac.Final(proof.data());
+}
+
+/**********************************************************************************************
+ * transmitData()  - client, authentication complete: transmits the data. Replication sessions
+ *                   start streaming the log instead
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::transmitData() {
+
+   if (_stream) {
+      startStream();
+      return;
+   }
+
+   // Send the replication data
+   sendData(_outputbuf);
+
+   if (_verbosity >= 3)
+      std::cout << "Successfully authenticated connection with " << getNodeID() <<
+                   " and sending replication data.\n";
+
+   // Wait for their response
+   _status = s_waitack;
 }
 
 
@@ -349,36 +1006,91 @@ void TCPConn::transmitData() {
  **********************************************************************************************/
 
 void TCPConn::waitForData() {
+   const uint8_t *msg;
+   size_t len;
 
-   // If data on the socket, should be replication data
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
+   // If there's a message, should be replication data. A replication session streams
+   // frames from here on (a symmetric one opens with the client's vector)
+   if (!peekData(msg, len))
+      return;
 
-      if (!getData(buf))
+   if ((len >= c_frm.size()) && (std::equal(c_frm.begin(), c_frm.end(), msg) ||
+                                 std::equal(c_vec.begin(), c_vec.end(), msg))) {
+      _status = s_streamrx;
+      waitForFrames();
+      return;
+   }
+
+   std::vector<uint8_t> buf;
+   getData(buf);
+   processData(buf);
+}
+
+/**********************************************************************************************
+ * processData - receiving server, authentication complete: handles a message the client sent,
+ *               a digest query or a one-off replication transfer
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::processData(std::vector<uint8_t> &buf) {
+
+   // Not replication data--might be a digest check from the client
+   if (!hasCmd(buf, c_rep) && (_repl_log != NULL)) {
+
+      // Answer digest queries and keep waiting for the next one. A query starts with the
+      // vector the check is pinned to, and gets an empty reply once our log has moved on
+      if (getCmdData(buf, c_dig, c_enddig)) {
+         uint32_t vec_size = 0;
+         if (buf.size() >= sizeof(vec_size))
+            memcpy(&vec_size, buf.data(), sizeof(vec_size));
+         if ((buf.size() < sizeof(vec_size)) || (buf.size() - sizeof(vec_size) < vec_size)) {
+            std::stringstream msg;
+            msg << "Digest query possibly corrupted from " << getNodeID();
+            _server_log.writeLog(msg.str().c_str());
+            disconnect();
+            return;
+         }
+
+         std::vector<uint8_t> vec(buf.begin() + sizeof(vec_size),
+                                  buf.begin() + sizeof(vec_size) + vec_size);
+         std::vector<uint8_t> query(buf.begin() + sizeof(vec_size) + vec_size, buf.end());
+         std::vector<uint8_t> reply;
+         _repl_log->answerDigestQuery(vec, query, reply);
+         wrapCmd(reply, c_dig, c_enddig);
+         sendData(reply);
          return;
+      }
 
-      if (!getCmdData(buf, c_rep, c_endrep)) {
-         std::stringstream msg;
-         msg << "Replication data possibly corrupted from" << getNodeID() << "\n";
-         _server_log.writeLog(msg.str().c_str());
+      // Digest check complete
+      if (hasCmd(buf, c_ack)) {
          disconnect();
+         _status = s_none;
          return;
       }
+   }
 
-      // Got the data, save it
-      _inputbuf = buf;
-      _data_ready = true;
+   if (!getCmdData(buf, c_rep, c_endrep)) {
+      std::stringstream msg;
+      msg << "Replication data possibly corrupted from" << getNodeID() << "\n";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
 
-      // Send the acknowledgement and disconnect
-      sendData(c_ack);
+   // Got the data, save it
+   _inputbuf = buf;
+   _data_ready = true;
 
-      if (_verbosity >= 2)
-         std::cout << "Successfully received replication data from " << getNodeID() << "\n";
+   // Send the acknowledgement and disconnect
+   sendData(c_ack);
 
+   if (_verbosity >= 2)
+      std::cout << "Successfully received replication data from " << getNodeID() << "\n";
 
-      disconnect();
-      _status = s_hasdata;
-   }
+
+   disconnect();
+   _status = s_hasdata;
 }
 
 
@@ -391,12 +1103,8 @@ void TCPConn::waitForData() {
 void TCPConn::awaitAck() {
 
    // Should have the awk message
-   if (_connfd.hasData()) {
-      std::vector<uint8_t> buf;
-
-      if (!getData(buf))
-         return;
-
+   std::vector<uint8_t> buf;
+   if (getData(buf)) {
       if (findCmd(buf, c_ack) == buf.end())
       {
          std::stringstream msg;
@@ -413,46 +1121,455 @@ void TCPConn::awaitAck() {
 }
 
 /**********************************************************************************************
- * getData - Reads in data from the socket and checks to see if there's an end command to the
- *           message to confirm we got it all
+ * startStream - client, authentication complete: starts a replication session. Frames the
+ *               last connection didn't get acknowledged are resent first (the server skips
+ *               whatever it already applied), then the log is streamed from where they end
  *
- *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::startStream() {
+   if (_peer_vec.size() == 0) {
+      std::stringstream msg;
+      msg << "Server " << getNodeID() << " did not send a sequence vector. Cannot sync.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return;
+   }
+
+   _sent_vec = _peer_vec;
+   if (_symmetric)
+      sendVector();
+
+   for (auto fptr = _unacked.begin(); fptr != _unacked.end(); fptr++) {
+      sendDelta(*fptr);
+      _repl_log->advanceVector(_sent_vec, fptr->delta);
+   }
+
+   if ((_verbosity >= 2) && (_unacked.size() > 0))
+      std::cout << "Resent " << _unacked.size() << " unacknowledged frames to " <<
+                                                                  getNodeID() << "\n";
+
+   _status = s_stream;
+   streamData();
+}
+
+/**********************************************************************************************
+ * streamData - client session: takes in the server's cumulative ACKs (and, in a symmetric
+ *              session, its frames), then keeps up to max_frames_inflight frames of the plots
+ *              the server is missing on the wire
  *
- *    Returns: true if the data is ready to be read, false if they lost connection
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::streamData() {
+   takeFrames();
+   if (!_connected) {
+      lostStream();
+      return;
+   }
+   fillWindow();
+}
+
+/**********************************************************************************************
+ * sendVector - symmetric client session: sends our log's sequence vector and the batch
+ *              encodings we can decode as the session's first frame, so the server knows what
+ *              to stream back
  *
- *    Throws: runtime_error for unrecoverable issues
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-bool TCPConn::getData(std::vector<uint8_t> &buf) {
+void TCPConn::sendVector() {
+   std::vector<uint8_t> vec(1, PlotCodec::getCapabilities());
+   std::vector<uint8_t> log_vec;
+
+   _repl_log->getVector(log_vec);
+   vec.insert(vec.end(), log_vec.begin(), log_vec.end());
+   sendFrame(0, vec, c_vec, c_endvec);
+}
+
+/**********************************************************************************************
+ * takeFrames - session, either end: handles every complete frame received. Data frames are
+ *              queued up for the queue manager, and acknowledged once it has decoded them (see
+ *              ackInputData). ACKs cover our own frames up to their sequence. A symmetric
+ *              client's vector frame starts the server streaming back to it
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::takeFrames() {
+   const uint8_t *msg;
+   size_t len;
+   std::vector<uint8_t> frame;
+   unsigned int seq, last_seq = 0, count = 0;
+
+   while (peekData(msg, len)) {
+      if (getFrame(msg, len, seq, frame, c_frm, c_endfrm)) {
+         if (_event_log != NULL)
+            _event_log->log(ev_frame_recv, getNodeID(), frame.size());
+         _frames_in.push_back(std::move(frame));
+         _frames_in_seq.push_back(seq);
+         m_frames_recv.inc();
+         last_seq = seq;
+         count++;
+
+      } else if (getFrame(msg, len, seq, frame, c_ack, c_endack)) {
+         takeAck(seq);
+
+      } else if (!_stream && getFrame(msg, len, seq, frame, c_vec, c_endvec)) {
+         if (frame.size() == 0)
+            throw socket_error("Replication session vector corrupted");
+
+         // Stream back from what the client already has
+         _peer_caps = frame[0];
+         _sent_vec.assign(frame.begin() + 1, frame.end());
+         _unacked.clear();
+         _symmetric = true;
+
+         if (_verbosity >= 2)
+            std::cout << "Replication session with " << getNodeID() << " is symmetric\n";
+
+      } else {
+         throw socket_error("Replication session frame out of sync");
+      }
+      consumeData(len);
+   }
+
+   if (count > 0) {
+      _data_ready = true;
+
+      if (_verbosity >= 3)
+         std::cout << "Received " << count << " frames through " << last_seq << " from " <<
+                                                                  getNodeID() << "\n";
+   }
+}
+
+/**********************************************************************************************
+ * takeAck - session sender: an ACK covers every frame up to its sequence
+ *
+ **********************************************************************************************/
+
+void TCPConn::takeAck(unsigned int seq) {
+   while ((_unacked.size() > 0) && (_unacked.front().seq <= seq)) {
+      m_ack_usecs.observe((EventLog::monotonic() - _unacked.front().sent_ns) / 1000);
+      if (_event_log != NULL)
+         _event_log->log(ev_frame_acked, getNodeID(), 0, _unacked.front().plots,
+                         EventLog::monotonic() - _unacked.front().sent_ns);
+      _unacked.pop_front();
+   }
+}
+
+/**********************************************************************************************
+ * fillWindow - session sender: keeps up to max_frames_inflight frames of the plots the other
+ *              end is missing on the wire. No new frames are built while more than
+ *              max_tx_pending bytes are still waiting for the socket, so a slow peer doesn't
+ *              pile up encoded frames here
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
 
-   std::vector<uint8_t> readbuf;
-   size_t count = 0;
+void TCPConn::fillWindow() {
+   while (_connected && (_unacked.size() < max_frames_inflight) &&
+                        (_txbuf.size() < max_tx_pending)) {
+      std::vector<uint8_t> delta;
+      plot_trace trace;
 
-   buf.clear();
+      unsigned int count = _repl_log->buildDelta(_sent_vec, delta, max_frame_plots, &trace);
+      if (count == 0)
+         break;
 
-   while (_connfd.hasData()) {
-      // read the data on the socket up to 1024
-      count += _connfd.readBytes<uint8_t>(readbuf, 1024);
+      _repl_log->advanceVector(_sent_vec, delta);
+      _unacked.push_back(unacked_frame{ _next_frame++, std::move(delta), count, 0, trace });
+      sendDelta(_unacked.back());
 
-      // check if we lost connection
-      if (readbuf.size() == 0) {
+      if (_verbosity >= 3)
+         std::cout << "Sent frame " << _unacked.back().seq << " with " << count <<
+                      " plots to " << getNodeID() << "\n";
+   }
+}
+
+/**********************************************************************************************
+ * sendDelta - encodes a replication log delta as compactly as the server can decode (raw if
+ *             it advertised nothing) and sends it as a session frame
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::sendDelta(unacked_frame &frame) {
+   std::vector<uint8_t> batch;
+   PlotCodec::encoding_type enc;
+   PlotCodec::compression_type comp;
+
+   PlotCodec::choose(_peer_caps, enc, comp);
+   frame.sent_ns = EventLog::monotonic();
+
+   // Traced frames carry the stamps so far, resent ones get this session's
+   if ((frame.trace.inject_ns != 0) && (_peer_caps & PlotCodec::cap_trace)) {
+      frame.trace.ready_ns = _ready_ns;
+      frame.trace.sent_ns = PlotTrace::now();
+      PlotCodec::encode(frame.delta, batch, enc, comp, &frame.trace);
+   } else {
+      PlotCodec::encode(frame.delta, batch, enc, comp);
+   }
+   sendFrame(frame.seq, batch, c_frm, c_endfrm);
+
+   m_frames_sent.inc();
+   if (_event_log != NULL)
+      _event_log->log(ev_frame_sent, getNodeID(), batch.size(), frame.plots);
+}
+
+/**********************************************************************************************
+ * waitForFrames - server session: queues up and acknowledges the frames received. Once a
+ *                 symmetric client has sent its vector, streams the plots it is missing back
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::waitForFrames() {
+   takeFrames();
+   if (_connected && _symmetric)
+      fillWindow();
+}
+
+/**********************************************************************************************
+ * lostStream - client session: the connection dropped, so set up to reconnect. Unacknowledged
+ *              frames are kept to resend once the new connection authenticates
+ *
+ **********************************************************************************************/
+
+void TCPConn::lostStream() {
+   std::stringstream msg;
+   msg << "Replication session with " << getNodeID() << " lost with " << _unacked.size() <<
+          " frames unacknowledged. Reconnecting.";
+   _server_log.writeLog(msg.str().c_str());
+   if (_event_log != NULL)
+      _event_log->log(ev_session_lost, getNodeID(), 0, _unacked.size());
+   if (_verbosity >= 2)
+      std::cout << msg.str() << "\n";
+
+   disconnect();
+   _rxbuf.clear();
+   _peer_vec.clear();
+   _peer_caps = 0;
+
+   // Frames the server streamed back that weren't ACKed yet come again on the next session
+   _frames_in.clear();
+   _frames_in_seq.clear();
+   _data_ready = false;
+   _ack_pending = 0;
+
+   _status = s_connecting;
+   reconnect = time(NULL);
+}
+
+/**********************************************************************************************
+ * dropSession - closes the connection after an error. A client session sets up to reconnect
+ *
+ **********************************************************************************************/
+
+void TCPConn::dropSession() {
+   if (_stream && (_status != s_connecting))
+      lostStream();
+   else
+      disconnect();
+}
+
+/**********************************************************************************************
+ * startDigestCheck - client, authentication complete: starts comparing our log's digest with
+ *                    the server's. If our sequence vectors differ, the replicas are still
+ *                    syncing and the comparison would only show that, so we stop there.
+ *                    Otherwise the walk is pinned to that vector (see sendDigestQuery)
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::startDigestCheck() {
+   std::vector<uint8_t> buf;
+
+   _repl_log->getVector(buf);
+   if (buf != _peer_vec) {
+      std::stringstream msg;
+      msg << "Digest check with " << getNodeID() << ": replicas still syncing (vectors differ).";
+      _server_log.writeLog(msg.str().c_str());
+      if (_verbosity >= 2)
+         std::cout << msg.str() << "\n";
+
+      sendData(c_ack);
+      disconnect();
+      return;
+   }
+
+   _digest_vec = buf;
+   PlotDigest::rootQuery(buf);
+   sendDigestQuery(buf);
+
+   _status = s_digest;
+}
+
+/**********************************************************************************************
+ * sendDigestQuery - client: sends a digest query behind the vector the check is pinned to
+ *                   (its size as a 32 bit unsigned int, then the vector), so the server only
+ *                   answers while its log still holds exactly that
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::sendDigestQuery(std::vector<uint8_t> &query) {
+   uint32_t vec_size = _digest_vec.size();
+   std::vector<uint8_t> buf((uint8_t *) &vec_size, (uint8_t *) &vec_size + sizeof(vec_size));
+
+   buf.insert(buf.end(), _digest_vec.begin(), _digest_vec.end());
+   buf.insert(buf.end(), query.begin(), query.end());
+   wrapCmd(buf, c_dig, c_enddig);
+   sendData(buf);
+}
+
+/**********************************************************************************************
+ * waitForDigest - client: compares the server's digest reply with ours, drilling down one
+ *                 level per reply until the divergent buckets are known, then reports them.
+ *                 If either log took in plots since the check started, it is given up
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::waitForDigest() {
+
+   std::vector<uint8_t> buf;
+   if (getData(buf)) {
+      if (!getCmdData(buf, c_dig, c_enddig)) {
          std::stringstream msg;
-         std::string ip_addr;
-         msg << "Connection from server " << _node_id << " lost (IP: " << 
-                                                         getIPAddrStr(ip_addr) << ")"; 
+         msg << "Digest reply possibly corrupted from " << getNodeID();
          _server_log.writeLog(msg.str().c_str());
          disconnect();
-         return false;
+         return;
       }
 
-      buf.insert(buf.end(), readbuf.begin(), readbuf.end());
+      std::vector<uint8_t> query;
+      std::vector<std::pair<unsigned int, unsigned int>> divergent;
+      ReplLog::digest_status status = ReplLog::digest_moved;
+      if (buf.size() > 0)
+         status = _repl_log->checkDigestReply(_digest_vec, buf, query, divergent);
 
-      // concat the data onto anything we've read before
-//      _inputbuf.insert(_inputbuf.end(), readbuf.begin(), readbuf.end());
+      if (status == ReplLog::digest_more) {
+         sendDigestQuery(query);
+         return;
+      }
+
+      std::stringstream msg;
+      msg << "Digest check with " << getNodeID() << ": ";
+      if (status == ReplLog::digest_moved) {
+         msg << "replicas took in plots during the check, not compared.";
+      } else if (divergent.size() == 0) {
+         msg << "replicas match (root " << std::hex << _repl_log->getDigestRoot() << std::dec << ").";
+      } else {
+         msg << divergent.size() << " divergent buckets:";
+         for (unsigned int i=0; (i < divergent.size()) && (i < 10); i++)
+            msg << " (t=" << divergent[i].first * _repl_log->getDigestBucketSecs() << ", drone=" <<
+                                                                divergent[i].second << ")";
+         if (divergent.size() > 10)
+            msg << " ...";
+      }
+      _server_log.writeLog(msg.str().c_str());
+      if (_verbosity >= 2)
+         std::cout << msg.str() << "\n";
+      if ((_event_log != NULL) && (status == ReplLog::digest_done))
+         _event_log->log((divergent.size() == 0) ? ev_digest_match : ev_digest_diverged,
+                                                               getNodeID(), 0, divergent.size());
+
+      sendData(c_ack);
+      disconnect();
    }
+}
+
+/**********************************************************************************************
+ * getData - takes the next complete message off the receive buffer, reading whatever the
+ *           socket has first if there isn't one yet
+ *
+ *    Params: buf - gets the message
+ *
+ *    Returns: true if buf holds a message, false if there isn't a complete one yet or the
+ *             connection was lost (it's disconnected, isConnected is false)
+ *
+ *    Throws: socket_error if the stream is corrupted, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+bool TCPConn::getData(std::vector<uint8_t> &buf) {
+   const uint8_t *msg;
+   size_t len;
+
+   if (!peekData(msg, len))
+      return false;
+
+   buf.assign(msg, msg + len);
+   consumeData(len);
    return true;
 }
 
+/**********************************************************************************************
+ * peekData - like getData, but leaves the message in the receive buffer and points at it
+ *            instead of copying it out. consumeData takes it off once it's been handled.
+ *            Messages that came in before the other end closed are handed out before the
+ *            connection counts as lost
+ *
+ *    Params: msg - points to the message, valid until the next peekData
+ *            len - the message's length
+ *
+ *    Returns: as getData
+ *
+ *    Throws: socket_error if the stream is corrupted
+ **********************************************************************************************/
+
+bool TCPConn::peekData(const uint8_t *&msg, size_t &len) {
+   if (!_connected)
+      return false;
+
+   // Not a whole message buffered yet, read what's waiting, up to the largest message allowed
+   if (!isMessageBuffered(len)) {
+      m_bytes_recv.inc(_rxbuf.fill(_connfd, msg_hdr_size + max_message_size));
+
+      if (!isMessageBuffered(len)) {
+         if (_rxbuf.isClosed()) {
+            std::stringstream lost;
+            std::string ip_addr;
+            lost << "Connection from server " << _node_id << " lost (IP: " << 
+                                                         getIPAddrStr(ip_addr) << ")"; 
+            _server_log.writeLog(lost.str().c_str());
+            disconnect();
+         }
+         return false;
+      }
+   }
+
+   msg = _rxbuf.data() + msg_hdr_size;
+   return true;
+}
+
+/**********************************************************************************************
+ * isMessageBuffered - checks the front of the receive buffer for a whole message
+ *
+ *    Params: len - gets the message's length, if its length has come in
+ *
+ *    Throws: socket_error if the length is too large to be real
+ **********************************************************************************************/
+
+bool TCPConn::isMessageBuffered(size_t &len) {
+   uint32_t msg_len;
+
+   if (_rxbuf.size() < msg_hdr_size)
+      return false;
+
+   memcpy(&msg_len, _rxbuf.data(), sizeof(msg_len));
+   if (msg_len > max_message_size)
+      throw socket_error("Message too large, stream corrupted");
+
+   len = msg_len;
+   return (_rxbuf.size() >= msg_hdr_size + len);
+}
+
+void TCPConn::consumeData(size_t len) {
+   _rxbuf.consume(msg_hdr_size + len);
+}
+
 /**********************************************************************************************
  * decryptData - Takes in an encrypted buffer in the form IV/Data and decrypts it, replacing
  *               buf with the decrypted info (destroys IV string>
@@ -563,6 +1680,62 @@ void TCPConn::wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
    buf = temp;
 }
 
+/**********************************************************************************************
+ * sendFrame - sends data as a session frame: startcmd, sequence, data length, data, endcmd
+ *             (sequence and length are 32 bit unsigned ints in host order)
+ *
+ *    Params: seq - the frame's sequence number
+ *            data - the data to send, can be empty
+ *            startcmd, endcmd - the commands framing the data
+ *
+ **********************************************************************************************/
+
+void TCPConn::sendFrame(unsigned int seq, std::vector<uint8_t> &data,
+                        std::vector<uint8_t> &startcmd, std::vector<uint8_t> &endcmd) {
+   std::vector<uint8_t> buf = startcmd;
+   unsigned int len = data.size();
+
+   buf.insert(buf.end(), (uint8_t *) &seq, (uint8_t *) &seq + sizeof(unsigned int));
+   buf.insert(buf.end(), (uint8_t *) &len, (uint8_t *) &len + sizeof(unsigned int));
+   buf.insert(buf.end(), data.begin(), data.end());
+   buf.insert(buf.end(), endcmd.begin(), endcmd.end());
+   sendData(buf);
+}
+
+/**********************************************************************************************
+ * getFrame - parses a message as a session frame of the startcmd type
+ *
+ *    Params: msg, len - the message
+ *            seq - the frame's sequence number
+ *            data - the data in the frame
+ *            startcmd, endcmd - the commands framing the data
+ *
+ *    Returns: true if it was that type of frame, false if it's something else
+ *
+ *    Throws: socket_error if the message is a corrupted frame
+ **********************************************************************************************/
+
+bool TCPConn::getFrame(const uint8_t *msg, size_t len, unsigned int &seq,
+                       std::vector<uint8_t> &data, std::vector<uint8_t> &startcmd,
+                       std::vector<uint8_t> &endcmd) {
+   size_t hdr_size = startcmd.size() + 2 * sizeof(unsigned int);
+   unsigned int data_len;
+
+   if ((len < startcmd.size()) || !std::equal(startcmd.begin(), startcmd.end(), msg))
+      return false;
+
+   if (len < hdr_size + endcmd.size())
+      throw socket_error("Replication session frame truncated");
+
+   memcpy(&seq, msg + startcmd.size(), sizeof(unsigned int));
+   memcpy(&data_len, msg + startcmd.size() + sizeof(unsigned int), sizeof(unsigned int));
+   if ((len != hdr_size + data_len + endcmd.size()) ||
+       !std::equal(endcmd.begin(), endcmd.end(), msg + hdr_size + data_len))
+      throw socket_error("Replication session frame corrupted");
+
+   data.assign(msg + hdr_size, msg + hdr_size + data_len);
+   return true;
+}
 
 /**********************************************************************************************
  * getReplData - Returns the data received on the socket and marks the socket as done
@@ -575,6 +1748,19 @@ void TCPConn::wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
 
 void TCPConn::getInputData(std::vector<uint8_t> &buf) {
 
+   // Replication sessions hand over one frame at a time and keep going
+   if ((_status == s_streamrx) || (_status == s_stream)) {
+      buf.clear();
+      if (_frames_in.size() > 0) {
+         buf = std::move(_frames_in.front());
+         _frames_in.pop_front();
+         _ack_pending = _frames_in_seq.front();
+         _frames_in_seq.pop_front();
+      }
+      _data_ready = (_frames_in.size() > 0);
+      return;
+   }
+
    // Returns the replication data off this connection, then prepares it to be removed
    buf = _inputbuf;
 
@@ -582,6 +1768,42 @@ void TCPConn::getInputData(std::vector<uint8_t> &buf) {
    _status = s_none;
 }
 
+/**********************************************************************************************
+ * ackInputData - session receiver: acknowledges the frames handed over by getInputData, which
+ *                have all decoded. The ACK of the last covers the rest
+ *
+ **********************************************************************************************/
+
+void TCPConn::ackInputData() {
+   if ((_ack_pending == 0) || !_connected)
+      return;
+
+   try {
+      std::vector<uint8_t> nodata;
+      sendFrame(_ack_pending, nodata, c_ack, c_endack);
+   } catch (socket_error &e) {
+      dropSession();
+   }
+   _ack_pending = 0;
+}
+
+/**********************************************************************************************
+ * rejectInputData - session receiver: the frame last handed over didn't decode. It and the
+ *                   frames queued behind it are dropped without an ACK along with the
+ *                   session, so the sender resends them all once it reconnects
+ *
+ **********************************************************************************************/
+
+void TCPConn::rejectInputData() {
+   _frames_in.clear();
+   _frames_in_seq.clear();
+   _data_ready = false;
+   _ack_pending = 0;
+
+   if (_connected)
+      dropSession();
+}
+
 /**********************************************************************************************
  * connect - Opens the socket FD, attempting to connect to the remote server
  *
@@ -592,26 +1814,59 @@ void TCPConn::getInputData(std::vector<uint8_t> &buf) {
  **********************************************************************************************/
 
 void TCPConn::connect(const char *ip_addr, unsigned short port) {
+   unsigned long n_ip_addr;
 
-   // Set the status to connecting
-   _status = s_connecting;
-
-   // Try to connect
-   if (!_connfd.connectTo(ip_addr, port))
-      throw socket_error("TCP Connection failed!");
-
-   _connected = true;
+   inet_pton(AF_INET, ip_addr, &n_ip_addr);
+   connect(n_ip_addr, htons(port));
 }
 
 // Same as above, but ip_addr and port are in network (big endian) format
 void TCPConn::connect(unsigned long ip_addr, unsigned short port) {
    // Set the status to connecting
    _status = s_connecting;
+   _connected = false;
+   _connect_pending = false;
 
-   if (!_connfd.connectTo(ip_addr, port))
+   // Start the connect, the server loop finishes it
+   SocketFD::connect_status status = _connfd.startConnect(ip_addr, port);
+   if (status == SocketFD::connect_failed) {
+      _connfd.closeFD();
       throw socket_error("TCP Connection failed!");
+   }
 
+   _connect_pending = true;
+   _connect_deadline_ns = EventLog::monotonic() + connect_timeout_ns;
+   if (status == SocketFD::connect_done)
+      finishConnect();
+}
+
+/**********************************************************************************************
+ * finishConnect - checks on a connect started by connect() without blocking
+ *
+ *    Returns: true if connected, false if still waiting on the other end
+ *
+ *    Throws: socket_error if the connect failed or passed its deadline
+ **********************************************************************************************/
+bool TCPConn::finishConnect() {
+   if (_connected)
+      return true;
+   if (!_connect_pending)
+      throw socket_error("No connect underway.");
+
+   SocketFD::connect_status status = _connfd.checkConnect();
+   if ((status == SocketFD::connect_pending) && (EventLog::monotonic() < _connect_deadline_ns))
+      return false;
+
+   _connect_pending = false;
+   if (status != SocketFD::connect_done) {
+      _connfd.closeFD();
+      throw socket_error((status == SocketFD::connect_pending) ? "TCP Connection timed out!" :
+                                                                 "TCP Connection failed!");
+   }
+
+   _start_ns = EventLog::monotonic();
    _connected = true;
+   return true;
 }
 
 /**********************************************************************************************
@@ -637,8 +1892,18 @@ void TCPConn::assignOutgoingData(std::vector<uint8_t> &data) {
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 void TCPConn::disconnect() {
+   // Give anything still waiting (e.g. a final ACK) one last chance to go out
+   if (_connected)
+      flushData();
+   _txbuf.clear();
+
    _connfd.closeFD();
    _connected = false;
+   _connect_pending = false;
+   _tx_prefix.clear();
+   _rxbuf.clear();
+   _resumed = false;
+   _resume_ticket.clear();
 }
 
 
@@ -671,14 +1936,31 @@ const char *TCPConn::getIPAddrStr(std::string &buf) {
 void TCPConn::handleConnection() {
 
    try {
+      // Keep writing out anything the socket couldn't take on earlier passes
+      if (!flushData())
+         throw socket_error("Write to connection failed");
+
       switch (_status) {
 
          // Client: Just connected, send our SID
          case s_connecting:
-            sendSID();
+            if (_legacy_auth)
+               sendSID();
+            else if (!sendResume())
+               sendHello();
             //std::cout << "1\n";
             break;
 
+         // Client: Wait for the server's hello, check its proof and send ours with the data
+         case waitServerHello:
+            waitForHello();
+            break;
+
+         // Client: Resumed with a ticket, wait for the server's proof
+         case waitServerResume:
+            waitForResume();
+            break;
+
          //Client: Wait for challenge string, encrypt and send encrypted string back
          case waitServerChallenge:
             waitForChallenge();
@@ -703,12 +1985,27 @@ void TCPConn::handleConnection() {
             // std::cout << "e\n";
             break;
 
+         // Client: Digest check, wait for the server's reply to our last query
+         case s_digest:
+            waitForDigest();
+            break;
+
+         // Client: Replication session, stream the log and take in ACKs
+         case s_stream:
+            streamData();
+            break;
+
          // Server: Wait for the SID from a newly-connected client, then send our challenge string
          case s_connected:
             waitForSID();
             // std::cout << "f\n";
             break;
 
+         // Server: Wait for the client's proof (and whatever data came with it)
+         case waitClientProof:
+            waitForProof();
+            break;
+
          //Server: Wait for encrypted challenge string, decrypt it and compare it, send ACK back
          case waitClientResponse:
             waitForResponse();
@@ -727,6 +2024,11 @@ void TCPConn::handleConnection() {
             // std::cout << "i\n";
             break;
          
+         // Server: Replication session, receive and acknowledge frames
+         case s_streamrx:
+            waitForFrames();
+            break;
+
          // Server: Data received and conn disconnected, but waiting for the data to be retrieved
          case s_hasdata:
             // std::cout << "j\n";
@@ -738,8 +2040,8 @@ void TCPConn::handleConnection() {
       }
    } catch (socket_error &e) {
       std::cout << "Socket error, disconnecting.\n";
-      disconnect();
+      dropSession();
       return;
    }
 
-}
\ No newline at end of file
+}
\ No newline at end of file
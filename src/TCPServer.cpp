@@ -14,11 +14,17 @@
 #include <crypto++/osrng.h>
 #include <crypto++/files.h>
 #include "TCPServer.h"
-#include "ALMgr.h"
+#include "Metrics.h"
+
+static MetricCounter &m_connect_failures = Metrics::global().counter("repl_connect_failures_total",
+                                          "Outgoing connections that could not reach the peer");
+static MetricCounter &m_conns_lost = Metrics::global().counter("repl_connections_lost_total",
+                                          "Connections the other end closed or lost");
 
 TCPServer::TCPServer(unsigned int verbosity)
                         :_aes_key(CryptoPP::AES::DEFAULT_KEYLENGTH), 
                          _server_log("server.log", 0),
+                         _whitelist("whitelist"),
                          _verbosity(verbosity)
 {
 }
@@ -110,8 +116,10 @@ TCPConn *TCPServer::handleSocket() {
 
       // Try to accept the connection
       TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
+      new_conn->setTickets(&_tickets);
       if (!new_conn->accept(_sockfd)) {
          _server_log.strerrLog("Data received on socket but failed to accept.");
+         delete new_conn;
          return NULL;
       }
       std::cout << "***Got a connection***\n";
@@ -124,8 +132,7 @@ TCPConn *TCPServer::handleSocket() {
 
 
       // Check the whitelist
-      ALMgr al("whitelist");
-      if (!al.isAllowed(new_conn->getIPAddr()))
+      if (!_whitelist.isAllowed(new_conn->getIPAddr()))
       {
          // Disconnect the user
          new_conn->disconnect();
@@ -156,40 +163,57 @@ TCPConn *TCPServer::handleSocket() {
  * handleConnections - Loops through the list of clients, running their functions to handle the
  *                     clients input/output.
  *
- *    Returns: number of new connections accepted
- *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
 void TCPServer::handleConnections() {
+   handleConnList(_connlist, _server_log, _verbosity);
+}
+
+/**********************************************************************************************
+ * handleConnList - Loops through a list of connections, running their functions to handle
+ *                  their input/output. Used by handleConnections and the QueueMgr's I/O
+ *                  workers, which each own a list
+ *
+ *    Params:  connlist - the connections to handle
+ *             server_log, verbosity - where to log and how much to spam stdout
+ *             dropped - if not NULL, connections removed from connlist are moved here
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPServer::handleConnList(std::list<std::unique_ptr<TCPConn>> &connlist, LogMgr &server_log,
+                      unsigned int verbosity, std::list<std::unique_ptr<TCPConn>> *dropped) {
    // Loop through our connections, handling them
-   std::list<std::unique_ptr<TCPConn>>::iterator tptr = _connlist.begin();
-   while (tptr != _connlist.end())
+   std::list<std::unique_ptr<TCPConn>>::iterator tptr = connlist.begin();
+   while (tptr != connlist.end())
    {
       // If the client is not connected, then either reconnect or drop 
       if ((!(*tptr)->isConnected()) || ((*tptr)->getStatus() == TCPConn::s_none)) {
          // Might be trying to connect
          if ((*tptr)->getStatus() == TCPConn::s_connecting) {
 
-            // If our retry timer hasn't expired....skip
-            if ((*tptr)->reconnect > time(NULL)) {
-               tptr++;
-               continue;
-            }
-
-            unsigned long ip_addr = (*tptr)->getIPAddr();
-            unsigned short port = (*tptr)->getPort();
-            
-            // Try to connect and handle failure
+            // Try to connect (or see if a connect already underway got there) and handle
+            // failure. Connects don't block, so one slow peer doesn't hold up the rest
             try {
-               (*tptr)->connect(ip_addr, port);
+               if ((*tptr)->isConnectPending()) {
+                  (*tptr)->finishConnect();
+               } else if ((*tptr)->reconnect <= time(NULL)) {
+                  unsigned long ip_addr = (*tptr)->getIPAddr();
+                  unsigned short port = htons((*tptr)->getPort());
+                  (*tptr)->connect(ip_addr, port);
+               }
             } catch (socket_error &e) {
                std::stringstream msg;
                msg << "Connect to SID " << (*tptr)->getNodeID() << 
                         " failed when trying to send data. Msg: " << e.what();
-               if (_verbosity >= 2)
+               if (verbosity >= 2)
                   std::cout << msg.str() << "\n";
-               _server_log.writeLog(msg.str().c_str());
+               server_log.writeLogLimited(std::string("connect:") + (*tptr)->getNodeID(),
+                                                                     msg.str().c_str());
+               if ((*tptr)->getEventLog() != NULL)
+                  (*tptr)->getEventLog()->log(ev_connect_failed, (*tptr)->getNodeID());
+               m_connect_failures.inc();
                (*tptr)->disconnect();
                (*tptr)->reconnect = time(NULL) + reconnect_delay;
                tptr++;
@@ -201,10 +225,14 @@ void TCPServer::handleConnections() {
             std::string msg = "Node ID '";
             msg += (*tptr)->getNodeID();
             msg += "' lost connection.";
-            _server_log.writeLog(msg);
+            server_log.writeLogLimited(std::string("lost:") + (*tptr)->getNodeID(), msg.c_str());
+            m_conns_lost.inc();
 
             // Remove them from the connect list
-            tptr = _connlist.erase(tptr);
+            if (dropped != NULL)
+               dropped->splice(dropped->end(), connlist, tptr++);
+            else
+               tptr = connlist.erase(tptr);
             std::cout << "Connection disconnected.\n";
             continue;
          }
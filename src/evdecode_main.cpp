@@ -0,0 +1,161 @@
+/****************************************************************************************
+ * evdecode_main - reads the binary event files a replication server writes with -e and
+ *                 prints the records or a summary per event type and peer
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <time.h>
+#include <getopt.h>
+#include "EventLog.h"
+
+using namespace std;
+
+/*****************************************************************************************
+ * displayHelp - Shows command line parameters to the user.
+ *****************************************************************************************/
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " <event_file> [<event_file> ...]\n";
+   std::cout << "   a: aggregate - count, bytes, plots and latency per event type and peer\n";
+   std::cout << "   t: only events of this type (e.g. frame_acked)\n";
+   std::cout << "   p: only events with this peer\n";
+}
+
+/*****************************************************************************************
+ * printRecord - one line per record: time, type, peer, bytes, plots, latency in usecs
+ *****************************************************************************************/
+
+void printRecord(const event_record &rec) {
+   time_t secs = rec.timestamp_ns / 1000000000ULL;
+   struct tm tm_buf;
+   char timestr[32];
+
+   localtime_r(&secs, &tm_buf);
+   strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm_buf);
+
+   std::cout << timestr << "." << std::setw(9) << std::setfill('0') <<
+                rec.timestamp_ns % 1000000000ULL << std::setfill(' ') << " " << std::left <<
+                std::setw(16) << EventLog::getTypeName(rec.type) << std::setw(8) <<
+                std::string(rec.peer, strnlen(rec.peer, sizeof(rec.peer))) << std::right <<
+                std::setw(10) << rec.bytes << std::setw(8) << rec.plots << std::setw(12) <<
+                std::fixed << std::setprecision(1) << rec.latency_ns / 1000.0 << "\n";
+}
+
+/*****************************************************************************************
+ * printSummary - totals per event type and peer, with the average and max latency
+ *****************************************************************************************/
+
+struct event_totals {
+   unsigned long count = 0;
+   unsigned long long bytes = 0;
+   unsigned long long plots = 0;
+   unsigned long long latency_ns = 0;
+   unsigned long long max_latency_ns = 0;
+};
+
+void printSummary(std::vector<event_record> &records) {
+   std::map<std::pair<uint16_t, std::string>, event_totals> totals;
+
+   for (const event_record &rec : records) {
+      event_totals &t = totals[std::make_pair(rec.type,
+                                    std::string(rec.peer, strnlen(rec.peer, sizeof(rec.peer))))];
+      t.count++;
+      t.bytes += rec.bytes;
+      t.plots += rec.plots;
+      t.latency_ns += rec.latency_ns;
+      t.max_latency_ns = std::max(t.max_latency_ns, (unsigned long long) rec.latency_ns);
+   }
+
+   std::cout << std::left << std::setw(16) << "type" << std::setw(8) << "peer" << std::right <<
+                std::setw(10) << "count" << std::setw(14) << "bytes" << std::setw(12) << "plots" <<
+                std::setw(14) << "avg lat us" << std::setw(14) << "max lat us" << "\n";
+   std::cout << std::fixed << std::setprecision(1);
+
+   for (auto tptr = totals.begin(); tptr != totals.end(); tptr++) {
+      event_totals &t = tptr->second;
+      std::cout << std::left << std::setw(16) << EventLog::getTypeName(tptr->first.first) <<
+                   std::setw(8) << tptr->first.second << std::right << std::setw(10) << t.count <<
+                   std::setw(14) << t.bytes << std::setw(12) << t.plots << std::setw(14) <<
+                   (double) t.latency_ns / t.count / 1000.0 << std::setw(14) <<
+                   t.max_latency_ns / 1000.0 << "\n";
+   }
+}
+
+
+int main(int argc, char *argv[]) {
+   std::vector<std::string> files;
+   std::string type_filter, peer_filter;
+   bool aggregate = false;
+
+   int c = 0;
+   while ((c = getopt(argc, argv, "-at:p:h")) != -1) {
+      switch (c) {
+
+      // Event files to read
+      case 1:
+         files.push_back(optarg);
+         break;
+
+      case 'a':
+         aggregate = true;
+         break;
+
+      case 't':
+         type_filter = optarg;
+         break;
+
+      case 'p':
+         peer_filter = optarg;
+         break;
+
+      case 'h':
+      case '?':
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   if (files.size() == 0) {
+      displayHelp(argv[0]);
+      exit(0);
+   }
+
+   std::vector<event_record> records;
+   try {
+      for (auto fptr = files.begin(); fptr != files.end(); fptr++)
+         EventLog::readFile(fptr->c_str(), records);
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      exit(-1);
+   }
+
+   // Apply the filters, then put rotated files back in time order
+   auto keep = std::remove_if(records.begin(), records.end(), [&](const event_record &rec) {
+      if ((type_filter.size() > 0) && (type_filter != EventLog::getTypeName(rec.type)))
+         return true;
+      std::string peer(rec.peer, strnlen(rec.peer, sizeof(rec.peer)));
+      return ((peer_filter.size() > 0) && (peer_filter != peer));
+   });
+   records.erase(keep, records.end());
+   std::stable_sort(records.begin(), records.end(),
+                    [](const event_record &a, const event_record &b) {
+                       return a.timestamp_ns < b.timestamp_ns; });
+
+   if (aggregate)
+      printSummary(records);
+   else {
+      for (const event_record &rec : records)
+         printRecord(rec);
+   }
+
+   return 0;
+}
@@ -0,0 +1,187 @@
+/****************************************************************************************
+ * fleetgen_main - generates per-node drone plot files (the format csv2bin writes, or CSV)
+ *                 for a synthetic fleet, to load test replication with more than the
+ *                 bundled data. Plots are streamed to the files, so the output can be
+ *                 much larger than memory
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <getopt.h>
+#include "DronePlotDB.h"
+#include "FleetGen.h"
+
+using namespace std;
+
+// Bytes each node's output collects before it's written out
+const size_t fleet_flush_bytes = 1 << 20;
+
+/*****************************************************************************************
+ * displayHelp - Shows command line parameters to the user.
+ *****************************************************************************************/
+
+void displayHelp(const char *execname) {
+   fleet_params defaults;
+
+   std::cout << execname << " [options]\n";
+   std::cout << "   d: number of drones (default " << defaults.drones << ")\n";
+   std::cout << "   t: length of the run in secs (default " << defaults.secs << ")\n";
+   std::cout << "   n: number of antenna nodes (default " << defaults.nodes << ")\n";
+   std::cout << "   r: secs between each drone's reports (default " << defaults.report_secs << ")\n";
+   std::cout << "   l: chance a report is heard by each node outside its band, 0-1 (default " <<
+                                                                  defaults.overlap << ")\n";
+   std::cout << "   c: per-node clock offsets up to +/- this many secs (default " <<
+                                                                  defaults.max_offset << ")\n";
+   std::cout << "   j: per-plot timestamp jitter up to +/- this many secs (default " <<
+                                                                  defaults.jitter << ")\n";
+   std::cout << "   s: random seed (default " << defaults.seed << ")\n";
+   std::cout << "   o: output prefix, files are <prefix>N<node>.bin (default Fleet)\n";
+   std::cout << "   f: write CSV files (<prefix>N<node>.csv) instead of binary\n";
+   std::cout << "   v: verbosity\n";
+}
+
+/*****************************************************************************************
+ * node_output - one node's file, plus the serialized plots waiting to go into it
+ *****************************************************************************************/
+
+struct node_output {
+   std::string filename;
+   std::ofstream file;
+   std::vector<uint8_t> buf;
+   unsigned long long plots = 0;
+   unsigned long long bytes = 0;
+};
+
+void flushOutput(node_output &out) {
+   out.file.write((const char *) out.buf.data(), out.buf.size());
+   if (out.file.fail())
+      throw std::runtime_error("Unable to write to " + out.filename);
+   out.bytes += out.buf.size();
+   out.buf.clear();
+}
+
+
+int main(int argc, char *argv[]) {
+   fleet_params params;
+   std::string prefix("Fleet");
+   bool csv = false;
+   int verbosity = 0;
+
+   int c = 0;
+   while ((c = getopt(argc, argv, "d:t:n:r:l:c:j:s:o:fv:h")) != -1) {
+      switch (c) {
+
+      case 'd':
+         params.drones = strtoul(optarg, NULL, 10);
+         break;
+
+      case 't':
+         params.secs = strtoul(optarg, NULL, 10);
+         break;
+
+      case 'n':
+         params.nodes = strtoul(optarg, NULL, 10);
+         break;
+
+      case 'r':
+         params.report_secs = strtoul(optarg, NULL, 10);
+         break;
+
+      case 'l':
+         params.overlap = strtod(optarg, NULL);
+         break;
+
+      case 'c':
+         params.max_offset = strtoul(optarg, NULL, 10);
+         break;
+
+      case 'j':
+         params.jitter = strtoul(optarg, NULL, 10);
+         break;
+
+      case 's':
+         params.seed = strtoull(optarg, NULL, 10);
+         break;
+
+      case 'o':
+         prefix = optarg;
+         break;
+
+      case 'f':
+         csv = true;
+         break;
+
+      case 'v':
+         verbosity = strtol(optarg, NULL, 10);
+         break;
+
+      case 'h':
+      case '?':
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   std::vector<std::unique_ptr<node_output>> outputs;
+   unsigned long long total = 0;
+
+   try {
+      FleetGen fleet(params);
+
+      for (unsigned int i=1; i<=params.nodes; i++) {
+         outputs.emplace_back(new node_output);
+         node_output &out = *outputs.back();
+
+         out.filename = prefix + "N" + std::to_string(i) + (csv ? ".csv" : ".bin");
+         out.file.open(out.filename, std::ios::out | std::ios::trunc | std::ios::binary);
+         if (out.file.fail())
+            throw std::runtime_error("Unable to open " + out.filename + " for writing");
+         out.buf.reserve(fleet_flush_bytes + DronePlot::getDataSize() + 64);
+      }
+
+      DronePlot plot;
+      std::string line;
+      while (fleet.next(plot)) {
+         node_output &out = *outputs[plot.node_id - 1];
+
+         if (csv) {
+            plot.writeCSV(line);
+            out.buf.insert(out.buf.end(), line.begin(), line.end());
+         } else
+            plot.serialize(out.buf);
+         out.plots++;
+         total++;
+
+         if (out.buf.size() >= fleet_flush_bytes)
+            flushOutput(out);
+
+         if ((verbosity >= 1) && (total % 10000000 == 0))
+            std::cout << "Generated " << total << " plots, up to time " << plot.timestamp << "\n";
+      }
+
+      for (auto &out : outputs) {
+         flushOutput(*out);
+         out->file.close();
+      }
+
+      for (unsigned int i=1; i<=params.nodes; i++) {
+         node_output &out = *outputs[i - 1];
+         std::cout << out.filename << ": " << out.plots << " plots, " << out.bytes <<
+                      " bytes, clock offset " << fleet.getOffset(i) << " secs\n";
+      }
+   } catch (std::runtime_error &e) {
+      std::cerr << e.what() << "\n";
+      exit(-1);
+   }
+
+   std::cout << "Total: " << total << " plots from " << params.drones << " drones over " <<
+                params.secs << " secs (seed " << params.seed << ")\n";
+   return 0;
+}
@@ -0,0 +1,1530 @@
+/****************************************************************************************
+ * replbench_main - benchmarks for the replication code paths. Not built by default, use
+ *                  "make bench" to build and run it.
+ *
+ *                  Suites:
+ *                     codec - bytes per plot and encode/decode throughput of replication
+ *                             batches for every PlotCodec option this build supports
+ *                     workers - replication throughput into one server from several
+ *                               loopback peers as the number of I/O worker threads grows
+ *                     handshake - time to first byte of a one-off transfer over
+ *                                 loopback: the challenge/response handshake, the one
+ *                                 round trip hello and resuming with a ticket
+ *                     acl - ALMgr load time and lookup rate with a large access list,
+ *                           next to the old scan of the file on every lookup
+ *                     micro - time per plot/call of the building blocks: DronePlotDB,
+ *                             DronePlot serialization and CSV, TCPConn framing and
+ *                             crypto, ALMgr lookups. -o saves the results, -b compares
+ *                             them to saved ones and fails on regressions
+ *                     cluster - N full ReplServers on loopback with synthetic plots
+ *                               injected at a fixed rate into each: replication
+ *                               throughput, antenna-to-apply latency percentiles, CPU
+ *                               per plot and how long the nodes take to converge.
+ *                               -B runs them with symmetric sessions
+ *                     replay - N full ReplServers, each fed by an AntennaSim on one
+ *                              shared virtual clock (see SimClock.h), so a whole trace
+ *                              is replicated as fast as the servers can keep up. The
+ *                              trace is the given .bin files, one per server, if
+ *                              there are two or more, otherwise a fleetgen fleet
+ *
+ *                  Plots come from the given .bin files (see csv2bin) or, if none are
+ *                  given, from seeded synthetic drone tracks.
+ *
+ ****************************************************************************************/
+
+#include <stdexcept>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <atomic>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <getopt.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <crypto++/osrng.h>
+#include "DronePlotDB.h"
+#include "ReplLog.h"
+#include "PlotCodec.h"
+#include "QueueMgr.h"
+#include "ReplServer.h"
+#include "AntennaSim.h"
+#include "SimClock.h"
+#include "FleetGen.h"
+#include "Metrics.h"
+#include "PlotTrace.h"
+#include "ALMgr.h"
+#include "TCPConn.h"
+#include "SessionTickets.h"
+#include "LogMgr.h"
+#include "strfuncts.h"
+
+using namespace std;
+
+typedef std::chrono::steady_clock bench_clock;
+
+// Each measurement repeats until it has run at least this long
+const double min_bench_secs = 0.25;
+
+// Worker pool sizes the workers suite compares (0 = connections handled inline)
+const unsigned int bench_workers[] = { 0, 1, 2, 4 };
+
+// Give up on a workers run that has not replicated everything by then
+const double max_repl_secs = 60.0;
+
+// Transfers each handshake is timed over, and how long one may take before it's a failure
+const unsigned int handshake_trials = 200;
+const double max_handshake_secs = 2.0;
+
+// Access list size for the acl suite, and how many of the entries are subnets
+const unsigned int acl_entries = 100000;
+const unsigned int acl_subnets = 1000;
+
+// How often the cluster suite injects plots and checks for convergence
+const useconds_t cluster_tick_usecs = 10000;
+
+// Sim secs the replay suite skips each tick once the trace is in, and how long the
+// servers' plot counts must hold still to count as converged
+const double replay_skip_secs = 5.0;
+const double replay_settle_secs = 1.0;
+
+/*****************************************************************************************
+ * displayHelp - Shows command line parameters to the user.
+ *****************************************************************************************/
+
+void displayHelp(const char *execname) {
+   std::cout << execname << " [<plot_file.bin> ...]\n";
+   std::cout << "   s: suite to run - codec, workers, handshake, acl, micro, cluster, replay (default: all)\n";
+   std::cout << "   d: number of synthetic drones, in the replay fleet too (default: 20)\n";
+   std::cout << "   n: number of synthetic plots per drone (default: 500)\n";
+   std::cout << "   r: random seed for the synthetic tracks (default: 1)\n";
+   std::cout << "   k: number of sending peers in the workers suite (default: 4)\n";
+   std::cout << "   p: first loopback port the workers/handshake/cluster suites use (default: 31000)\n";
+   std::cout << "   o: write the micro suite results to this file (name,ns_per_item)\n";
+   std::cout << "   b: compare the micro suite to results written with -o earlier\n";
+   std::cout << "   x: percent slower than the baseline that fails the run (default: 10)\n";
+   std::cout << "   N: number of servers in the cluster/replay suites (default: 3)\n";
+   std::cout << "   l: plots per second injected into each cluster server (default: 100)\n";
+   std::cout << "   t: seconds of injection in the cluster suite (default: 10)\n";
+   std::cout << "   m: cluster/replay time multiplier, replication runs every 20/m secs (default: 40)\n";
+   std::cout << "   B: cluster/replay servers share one bidirectional session per pair\n";
+}
+
+/*****************************************************************************************
+ * genTracks - generates drone tracks that look like the antenna data: every drone reports
+ *             its position every few seconds and drifts a little each time, with the plots
+ *             spread over three nodes
+ *****************************************************************************************/
+
+void genTracks(DronePlotDB &db, unsigned int drones, unsigned int plots, unsigned int seed) {
+   std::mt19937 rng(seed);
+   std::uniform_real_distribution<float> start_lat(39.70, 39.90), start_lon(-84.20, -83.90);
+   std::uniform_real_distribution<float> step(-0.0005, 0.0005);
+   std::uniform_int_distribution<int> interval(3, 7), node(1, 3);
+
+   for (unsigned int d=1; d<=drones; d++) {
+      float lat = start_lat(rng), lon = start_lon(rng);
+      time_t ts = 1000;
+
+      for (unsigned int i=0; i<plots; i++) {
+         db.addPlot(d, node(rng), ts, lat, lon);
+         ts += interval(rng);
+         lat += step(rng);
+         lon += step(rng);
+      }
+   }
+}
+
+/*****************************************************************************************
+ * elapsed - seconds since start
+ *****************************************************************************************/
+
+double elapsed(bench_clock::time_point start) {
+   return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/*****************************************************************************************
+ * benchCodec - encodes a full replication delta of the plots with every codec option and
+ *              reports the size and the encode/decode throughput (in plots and raw MB)
+ *****************************************************************************************/
+
+void benchCodec(DronePlotDB &db) {
+   ReplLog log;
+
+   db.sortByTime();
+   for (auto dpit = db.begin(); dpit != db.end(); dpit++)
+      log.appendLocal(*dpit);
+
+   // An empty sequence vector (count of 0) asks for everything
+   std::vector<uint8_t> empty_vec(sizeof(unsigned int), 0), delta;
+   unsigned int count = log.buildDelta(empty_vec, delta);
+
+   struct codec_option {
+      const char *name;
+      PlotCodec::encoding_type enc;
+      PlotCodec::compression_type comp;
+      uint8_t caps;
+   };
+   const codec_option options[] = {
+      { "raw",       PlotCodec::enc_raw,   PlotCodec::comp_none, 0 },
+      { "raw+lz4",   PlotCodec::enc_raw,   PlotCodec::comp_lz4,  PlotCodec::cap_lz4 },
+      { "raw+zstd",  PlotCodec::enc_raw,   PlotCodec::comp_zstd, PlotCodec::cap_zstd },
+      { "delta",     PlotCodec::enc_delta, PlotCodec::comp_none, PlotCodec::cap_delta },
+      { "delta+lz4", PlotCodec::enc_delta, PlotCodec::comp_lz4,  PlotCodec::cap_delta |
+                                                                 PlotCodec::cap_lz4 },
+      { "delta+zstd",PlotCodec::enc_delta, PlotCodec::comp_zstd, PlotCodec::cap_delta |
+                                                                 PlotCodec::cap_zstd },
+   };
+
+   double raw_mb = delta.size() / (1024.0 * 1024.0);
+
+   std::cout << "codec: " << count << " plots, " << delta.size() << " raw bytes\n";
+   std::cout << std::left << std::setw(12) << "option" << std::right << std::setw(12) <<
+                "bytes" << std::setw(12) << "bytes/plot" << std::setw(14) << "enc MB/s" <<
+                std::setw(14) << "enc plots/s" << std::setw(14) << "dec MB/s" <<
+                std::setw(14) << "dec plots/s" << "\n";
+   std::cout << std::fixed;
+
+   for (const codec_option &opt : options) {
+      if ((opt.caps & PlotCodec::getCapabilities()) != opt.caps)
+         continue;
+
+      std::vector<uint8_t> batch, decoded;
+      unsigned int encodes = 0, decodes = 0;
+
+      bench_clock::time_point start = bench_clock::now();
+      do {
+         PlotCodec::encode(delta, batch, opt.enc, opt.comp);
+         encodes++;
+      } while (elapsed(start) < min_bench_secs);
+      double enc_secs = elapsed(start) / encodes;
+
+      start = bench_clock::now();
+      do {
+         PlotCodec::decode(batch, decoded);
+         decodes++;
+      } while (elapsed(start) < min_bench_secs);
+      double dec_secs = elapsed(start) / decodes;
+
+      if (decoded != delta)
+         throw std::runtime_error(std::string("Codec option ") + opt.name +
+                                  " did not round trip");
+
+      std::cout << std::left << std::setw(12) << opt.name << std::right << std::setw(12) <<
+                   batch.size() << std::setw(12) << std::setprecision(2) <<
+                   (double) batch.size() / count << std::setw(14) << std::setprecision(1) <<
+                   raw_mb / enc_secs << std::setw(14) << std::setprecision(0) <<
+                   count / enc_secs << std::setw(14) << std::setprecision(1) <<
+                   raw_mb / dec_secs << std::setw(14) << std::setprecision(0) <<
+                   count / dec_secs << "\n";
+   }
+}
+
+/*****************************************************************************************
+ * bench_sender - a peer in the workers suite. Its thread runs the queue the way
+ *                ReplServer::replicate does until done is set
+ *****************************************************************************************/
+
+struct bench_sender {
+   ReplLog repl_log;
+   std::unique_ptr<QueueMgr> queue;
+   std::atomic<bool> *done;
+};
+
+void *t_sender(void *data) {
+   bench_sender *sender = static_cast<bench_sender *>(data);
+   std::string sid;
+   std::vector<uint8_t> buf;
+
+   try {
+      sender->queue->syncToServer("rx");
+      while (!*sender->done) {
+         sender->queue->handleQueue();
+         while (sender->queue->pop(sid, buf));
+         usleep(100);
+      }
+   } catch (std::exception &e) {
+      std::cerr << "Sender failed: " << e.what() << "\n";
+   }
+   return NULL;
+}
+
+/*****************************************************************************************
+ * writeBenchKey - writes a whitelist for loopback and a fresh sharedkey.bin into the
+ *                 current directory
+ *****************************************************************************************/
+
+void writeBenchKey() {
+   std::ofstream whitelist("whitelist");
+   whitelist << "127.0.0.1\n";
+
+   uint8_t key[16];
+   CryptoPP::AutoSeededRandomPool rng;
+   rng.GenerateBlock(key, sizeof(key));
+   std::ofstream keyfile("sharedkey.bin", std::ios::binary);
+   keyfile.write((const char *) key, sizeof(key));
+}
+
+/*****************************************************************************************
+ * writeBenchConfig - writes the servers.txt, sharedkey.bin and whitelist a QueueMgr
+ *                    expects in the current directory: the receiver "rx" on port, and
+ *                    senders "tx1".."txk" on the ports after it
+ *****************************************************************************************/
+
+void writeBenchConfig(unsigned int senders, unsigned short port) {
+   std::ofstream servers("servers.txt");
+   servers << "rx, 127.0.0.1, " << port << "\n";
+   for (unsigned int i=1; i<=senders; i++)
+      servers << "tx" << i << ", 127.0.0.1, " << port + i << "\n";
+   servers.close();
+
+   writeBenchKey();
+}
+
+/*****************************************************************************************
+ * cleanBenchDir - removes a suite's scratch directory and what is in it
+ *****************************************************************************************/
+
+void cleanBenchDir(const std::string &dir) {
+   DIR *dirp = opendir(dir.c_str());
+   if (dirp != NULL) {
+      struct dirent *entry;
+      while ((entry = readdir(dirp)) != NULL) {
+         if (entry->d_name[0] != '.')
+            unlink((dir + "/" + entry->d_name).c_str());
+      }
+      closedir(dirp);
+   }
+   rmdir(dir.c_str());
+}
+
+/*****************************************************************************************
+ * enterBenchDir - creates a scratch directory and changes to it, since QueueMgr reads its
+ *                 configuration from the current directory
+ *
+ *    Params:  cwd - gets the directory to change back to
+ *
+ *    Returns: the scratch directory, for cleanBenchDir
+ *
+ *    Throws: runtime_error if it could not be created or entered
+ *****************************************************************************************/
+
+std::string enterBenchDir(std::string &cwd) {
+   char dirtmpl[] = "/tmp/replbench.XXXXXX";
+   if (mkdtemp(dirtmpl) == NULL)
+      throw std::runtime_error("Unable to create a scratch directory");
+
+   char cwdbuf[4096];
+   if ((getcwd(cwdbuf, sizeof(cwdbuf)) == NULL) || (chdir(dirtmpl) != 0)) {
+      cleanBenchDir(dirtmpl);
+      throw std::runtime_error("Unable to change to the scratch directory");
+   }
+   cwd = cwdbuf;
+   return dirtmpl;
+}
+
+/*****************************************************************************************
+ * benchWorkers - every sender streams its own copy of the plots (as a separate origin
+ *                node) to one receiver over loopback. Reports how long the receiver takes
+ *                to hold all of them for each worker pool size
+ *****************************************************************************************/
+
+void benchWorkers(DronePlotDB &db, unsigned int senders, unsigned short port) {
+   std::string cwd;
+   std::string dirtmpl = enterBenchDir(cwd);
+
+   size_t total = db.size() * senders;
+   std::cout << "workers: " << senders << " senders, " << total << " plots, " <<
+                sysconf(_SC_NPROCESSORS_ONLN) << " CPUs\n";
+   std::cout << std::left << std::setw(12) << "workers" << std::right << std::setw(12) <<
+                "secs" << std::setw(14) << "plots/s" << std::setw(12) << "speedup" << "\n";
+   std::cout << std::fixed;
+
+   double base_rate = 0.0;
+   try {
+      for (unsigned int workers : bench_workers) {
+         writeBenchConfig(senders, port);
+
+         ReplLog rx_log;
+         QueueMgr rx_queue(rx_log, 0);
+         rx_queue.bindSvr("127.0.0.1", port);
+         rx_queue.listenSvr();
+         rx_queue.startWorkers(workers);
+
+         std::atomic<bool> done(false);
+         std::vector<std::unique_ptr<bench_sender>> tx(senders);
+         for (unsigned int i=0; i<senders; i++) {
+            tx[i].reset(new bench_sender);
+            tx[i]->done = &done;
+            for (auto dpit = db.begin(); dpit != db.end(); dpit++) {
+               DronePlot plot = *dpit;
+               plot.node_id = i + 1;
+               tx[i]->repl_log.appendLocal(plot);
+            }
+            tx[i]->queue.reset(new QueueMgr(tx[i]->repl_log, 0));
+            tx[i]->queue->bindSvr("127.0.0.1", port + i + 1);
+            tx[i]->queue->listenSvr();
+            tx[i]->queue->startWorkers(0);
+         }
+
+         bench_clock::time_point start = bench_clock::now();
+         std::vector<pthread_t> threads(senders);
+         for (unsigned int i=0; i<senders; i++) {
+            if (pthread_create(&threads[i], NULL, t_sender, (void *) tx[i].get()) != 0)
+               throw std::runtime_error("Unable to create sender thread");
+         }
+
+         // Receive the way ReplServer::replicate does
+         std::string sid;
+         std::vector<uint8_t> buf;
+         std::list<DronePlot> newplots;
+         while ((rx_log.size() < total) && (elapsed(start) < max_repl_secs)) {
+            rx_queue.handleQueue();
+            while (rx_queue.pop(sid, buf))
+               rx_log.applyDelta(buf, newplots);
+            newplots.clear();
+         }
+         double secs = elapsed(start);
+
+         done = true;
+         for (unsigned int i=0; i<senders; i++)
+            pthread_join(threads[i], NULL);
+
+         if (rx_log.size() < total)
+            throw std::runtime_error("Receiver only got " + std::to_string(rx_log.size()) +
+                                     " plots before timing out");
+
+         double rate = total / secs;
+         if (base_rate == 0.0)
+            base_rate = rate;
+         std::cout << std::left << std::setw(12) << workers << std::right << std::setw(12) <<
+                      std::setprecision(3) << secs << std::setw(14) << std::setprecision(0) <<
+                      rate << std::setw(12) << std::setprecision(2) << rate / base_rate << "\n";
+
+         // Fresh ports for the next run so lingering connections can't get in the way
+         port += senders + 1;
+      }
+   } catch (std::exception &) {
+      if (chdir(cwd.c_str()) != 0) { }
+      cleanBenchDir(dirtmpl);
+      throw;
+   }
+
+   if (chdir(cwd.c_str()) != 0) { }
+   cleanBenchDir(dirtmpl);
+}
+
+/*****************************************************************************************
+ * handshakeOnce - connects a client TCPConn to a server one and times how long until the
+ *                 server holds the data, running both ends' handleConnection in turn the
+ *                 way the server loop does
+ *
+ *    Params:  client_tickets, server_tickets - ticket stores for each end (NULL for none)
+ *             passes - gets how many passes over the two connections it took
+ *
+ *    Returns: secs to the first byte of data, or a negative number if it never got there
+ *****************************************************************************************/
+
+double handshakeOnce(SocketFD &listener, unsigned short port, LogMgr &log,
+                     CryptoPP::SecByteBlock &client_key, CryptoPP::SecByteBlock &server_key,
+                     bool legacy, SessionTickets *client_tickets, SessionTickets *server_tickets,
+                     std::vector<uint8_t> &data, unsigned int &passes) {
+   TCPConn client(log, client_key, 0);
+   client.setSvrID("tx");
+   client.setNodeID("rx");
+   client.setLegacyAuth(legacy);
+   client.setTickets(client_tickets);
+   client.assignOutgoingData(data);
+
+   bench_clock::time_point start = bench_clock::now();
+   client.connect("127.0.0.1", port);
+
+   std::unique_ptr<TCPConn> server;
+   for (passes = 0; elapsed(start) < max_handshake_secs; passes++) {
+      if (client.isConnectPending())
+         client.finishConnect();
+      else if (client.isConnected())
+         client.handleConnection();
+
+      if ((server == nullptr) && listener.hasData()) {
+         server.reset(new TCPConn(log, server_key, 0));
+         server->setTickets(server_tickets);
+         server->accept(listener);
+      }
+      if ((server != nullptr) && server->isConnected()) {
+         server->handleConnection();
+         if (server->getStatus() == TCPConn::s_hasdata)
+            return elapsed(start);
+      }
+
+      // Turned away--let the client see it, so it drops a bad ticket
+      if ((server != nullptr) && !server->isConnected() && !client.isConnected())
+         break;
+   }
+   return -1.0;
+}
+
+/*****************************************************************************************
+ * benchHandshake - times one-off transfers from connect to the server holding the data:
+ *                  with the challenge/response handshake, the one round trip hello, and
+ *                  resuming with a ticket. Also makes sure a client with the wrong key, or
+ *                  a ticket from before the server restarted, is turned away
+ *
+ *    Throws: runtime_error if a transfer fails, or one that should fail gets through
+ *****************************************************************************************/
+
+void benchHandshake(unsigned short port) {
+   const unsigned int payload_size = 256;
+   enum { hs_challenge, hs_hello, hs_resumed };
+   const char *names[] = { "challenge", "hello", "resumed" };
+
+   std::string cwd;
+   std::string dirtmpl = enterBenchDir(cwd);
+
+   std::cout << "handshake: " << handshake_trials << " transfers of " << payload_size <<
+                " bytes over loopback\n";
+   std::cout << std::left << std::setw(12) << "handshake" << std::right << std::setw(14) <<
+                "median usecs" << std::setw(12) << "p90 usecs" << std::setw(10) << "passes" << "\n";
+   std::cout << std::fixed;
+
+   try {
+      LogMgr log("server.log", 0);
+      CryptoPP::AutoSeededRandomPool rng;
+      CryptoPP::SecByteBlock key(CryptoPP::AES::DEFAULT_KEYLENGTH);
+      CryptoPP::SecByteBlock bad_key(CryptoPP::AES::DEFAULT_KEYLENGTH);
+      rng.GenerateBlock(key, key.size());
+      rng.GenerateBlock(bad_key, bad_key.size());
+
+      std::vector<uint8_t> data(payload_size);
+      rng.GenerateBlock(data.data(), data.size());
+
+      SocketFD listener;
+      listener.setReusable();
+      listener.bindFD("127.0.0.1", port);
+      listener.listenFD(64);
+
+      for (int mode = hs_challenge; mode <= hs_resumed; mode++) {
+         bool legacy = (mode == hs_challenge);
+         SessionTickets client_tickets, server_tickets;
+         SessionTickets *ctp = NULL, *stp = NULL;
+         std::vector<double> usecs;
+         unsigned long total_passes = 0;
+         unsigned int passes;
+
+         // The first transfer does the handshake and gets the ticket the rest resume with
+         if (mode == hs_resumed) {
+            ctp = &client_tickets;
+            stp = &server_tickets;
+            if (handshakeOnce(listener, port, log, key, key, legacy, ctp, stp, data, passes) < 0.0)
+               throw std::runtime_error("Transfer to get a ticket failed");
+         }
+
+         for (unsigned int i=0; i<handshake_trials; i++) {
+            double secs = handshakeOnce(listener, port, log, key, key, legacy, ctp, stp, data,
+                                                                                       passes);
+            if (secs < 0.0)
+               throw std::runtime_error(std::string(names[mode]) + " transfer failed");
+            usecs.push_back(secs * 1e6);
+            total_passes += passes;
+         }
+
+         if (mode == hs_resumed) {
+            SessionTickets restarted;
+            if (handshakeOnce(listener, port, log, key, key, legacy, ctp, &restarted, data,
+                                                                              passes) >= 0.0)
+               throw std::runtime_error("Server took a ticket it never issued");
+            if (handshakeOnce(listener, port, log, key, key, legacy, ctp, &restarted, data,
+                                                                              passes) < 0.0)
+               throw std::runtime_error("No handshake after a ticket was turned down");
+         } else if (handshakeOnce(listener, port, log, bad_key, key, legacy, ctp, stp, data,
+                                                                              passes) >= 0.0) {
+            throw std::runtime_error(std::string(names[mode]) + " let in the wrong key");
+         }
+
+         std::sort(usecs.begin(), usecs.end());
+         std::cout << std::left << std::setw(12) << names[mode] << std::right <<
+                      std::setprecision(1) << std::setw(14) << usecs[usecs.size() / 2] <<
+                      std::setw(12) << usecs[usecs.size() * 9 / 10] << std::setw(10) <<
+                      (double) total_passes / handshake_trials << "\n";
+      }
+   } catch (std::exception &) {
+      if (chdir(cwd.c_str()) != 0) { }
+      cleanBenchDir(dirtmpl);
+      throw;
+   }
+
+   if (chdir(cwd.c_str()) != 0) { }
+   cleanBenchDir(dirtmpl);
+}
+
+/*****************************************************************************************
+ * cluster_node - a server in the cluster suite: its database, the ReplServer replicating
+ *                it and the thread running the server
+ *****************************************************************************************/
+
+struct cluster_node {
+   DronePlotDB db;
+   std::unique_ptr<ReplServer> server;
+   pthread_t thread;
+
+   // Replay suite only
+   std::unique_ptr<AntennaSim> sim;
+   pthread_t sim_thread;
+};
+
+void *t_cluster_node(void *data) {
+   ReplServer *server = static_cast<ReplServer *>(data);
+
+   try {
+      server->replicate();
+   } catch (std::exception &e) {
+      std::cerr << "Cluster server failed: " << e.what() << "\n";
+   }
+   return NULL;
+}
+
+void *t_cluster_antenna(void *data) {
+   static_cast<AntennaSim *>(data)->simulate();
+   return NULL;
+}
+
+/*****************************************************************************************
+ * cpuSecs - user plus system CPU seconds used by the process so far
+ *****************************************************************************************/
+
+double cpuSecs() {
+   struct rusage usage;
+
+   getrusage(RUSAGE_SELF, &usage);
+   return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+          usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/*****************************************************************************************
+ * injectPlot - adds a plot to a server's database the way AntennaSim does. Every server
+ *              reports its own 50 drones at random positions, so no plot looks like a copy
+ *              of another server's
+ *****************************************************************************************/
+
+void injectPlot(DronePlotDB &db, unsigned int node_id, size_t seq, std::mt19937 &rng) {
+   std::uniform_real_distribution<float> lat(30.0, 45.0), lon(-100.0, -80.0);
+
+   std::list<DronePlot> batch;
+
+   batch.emplace_back(node_id * 1000 + seq % 50, node_id, 1000 + seq / 50, lat(rng), lon(rng));
+   batch.back().inject_ns = PlotTrace::now();
+   db.addPlots(batch, DBFLAG_NEW);
+}
+
+/*****************************************************************************************
+ * benchCluster - runs nodes ReplServers on loopback, each replicating to all of the others,
+ *                and injects rate plots/s into every one of them for load_secs. Reports
+ *                how fast the plots were replicated, the traced latency of each stage
+ *                (see PlotTrace.h), the process CPU per injected plot, how long after
+ *                the injection stopped every server held every plot and how many
+ *                handshakes the servers did
+ *****************************************************************************************/
+
+void benchCluster(unsigned int nodes, unsigned int rate, unsigned int load_secs,
+                  float time_mult, unsigned short port, bool symmetric) {
+   std::string cwd;
+   std::string dirtmpl = enterBenchDir(cwd);
+
+   size_t per_node = (size_t) rate * load_secs;
+   size_t total = per_node * nodes;
+   std::cout << "cluster: " << nodes << " servers, " << rate << " plots/s into each for " <<
+                load_secs << " secs (" << total << " plots), time multiplier " << time_mult <<
+                ", " << (symmetric ? "symmetric" : "one-way") << " sessions, " <<
+                sysconf(_SC_NPROCESSORS_ONLN) << " CPUs\n";
+
+   // The servers print every connection, keep that out of the results
+   std::ofstream devnull("/dev/null");
+   std::streambuf *cout_buf = std::cout.rdbuf();
+
+   std::vector<std::unique_ptr<cluster_node>> cluster(nodes);
+   unsigned int started = 0;
+   try {
+      std::cout.rdbuf(devnull.rdbuf());
+
+      std::ofstream servers("servers.txt");
+      for (unsigned int n=0; n<nodes; n++)
+         servers << "ds" << n + 1 << ", 127.0.0.1, " << port + n << "\n";
+      servers.close();
+      writeBenchKey();
+
+      for (unsigned int n=0; n<nodes; n++) {
+         cluster[n].reset(new cluster_node);
+         cluster[n]->server.reset(new ReplServer(cluster[n]->db, "127.0.0.1", port + n, 0,
+                                                                          time_mult, 0));
+         cluster[n]->server->setTracing(true);
+         cluster[n]->server->setSymmetric(symmetric);
+      }
+      for ( ; started<nodes; started++) {
+         if (pthread_create(&cluster[started]->thread, NULL, t_cluster_node,
+                            (void *) cluster[started]->server.get()) != 0)
+            throw std::runtime_error("Unable to create cluster server thread");
+      }
+
+      // Inject at the requested rate, then wait for every server to hold every plot
+      MetricHistogram &handshakes = Metrics::global().histogram("repl_handshake_usecs", "",
+                                                                "role=\"server\"");
+      uint64_t handshakes_start = handshakes.getCount();
+      std::mt19937 rng(1);
+      double cpu_start = cpuSecs();
+      bench_clock::time_point start = bench_clock::now();
+      for (size_t injected = 0; injected < per_node; ) {
+         size_t due = std::min(per_node, (size_t) (elapsed(start) * rate));
+         for ( ; injected < due; injected++) {
+            for (unsigned int n=0; n<nodes; n++)
+               injectPlot(cluster[n]->db, n + 1, injected, rng);
+         }
+         usleep(cluster_tick_usecs);
+      }
+      double load_end = elapsed(start);
+
+      size_t held = 0;
+      while ((held < total) && (elapsed(start) < load_end + max_repl_secs)) {
+         usleep(cluster_tick_usecs);
+         held = total;
+         for (unsigned int n=0; n<nodes; n++)
+            held = std::min(held, cluster[n]->db.size());
+      }
+      double secs = elapsed(start);
+      double cpu = cpuSecs() - cpu_start;
+      uint64_t num_handshakes = handshakes.getCount() - handshakes_start;
+
+      for (unsigned int n=0; n<nodes; n++)
+         cluster[n]->server->shutdown();
+      for ( ; started>0; started--)
+         pthread_join(cluster[started - 1]->thread, NULL);
+      cluster.clear();
+      std::cout.rdbuf(cout_buf);
+
+      if (held < total)
+         throw std::runtime_error("Cluster did not converge, a server only held " +
+                                  std::to_string(held) + " of " + std::to_string(total) + " plots");
+
+      std::cout << std::fixed << std::setprecision(2);
+      std::cout << "converged " << secs - load_end << " secs after injection stopped, " <<
+                   std::setprecision(0) << total * (nodes - 1) / secs <<
+                   " replicated plots/s, " << std::setprecision(1) << cpu * 1e6 / total <<
+                   " CPU usecs per plot, " << num_handshakes << " handshakes\n";
+
+      std::cout << std::left << std::setw(12) << "stage" << std::right << std::setw(10) <<
+                   "traces" << std::setw(12) << "p50 ms" << std::setw(12) << "p90 ms" <<
+                   std::setw(12) << "p99 ms" << std::setw(12) << "max ms" << "\n";
+      std::cout << std::setprecision(3);
+      const char *stages[] = { "batch", "handshake", "window", "network", "decode", "queue",
+                               "apply", "total" };
+      for (const char *stage : stages) {
+         MetricHistogram &hist = Metrics::global().histogram("repl_trace_usecs", "",
+                                              std::string("stage=\"") + stage + "\"");
+         std::cout << std::left << std::setw(12) << stage << std::right << std::setw(10) <<
+                      hist.getCount() << std::setw(12) << hist.getQuantile(0.5) / 1000.0 <<
+                      std::setw(12) << hist.getQuantile(0.9) / 1000.0 << std::setw(12) <<
+                      hist.getQuantile(0.99) / 1000.0 << std::setw(12) <<
+                      hist.getQuantile(1.0) / 1000.0 << "\n";
+      }
+   } catch (std::exception &) {
+      for (unsigned int n=0; n<started; n++)
+         cluster[n]->server->shutdown();
+      for ( ; started>0; started--)
+         pthread_join(cluster[started - 1]->thread, NULL);
+      cluster.clear();
+      std::cout.rdbuf(cout_buf);
+      if (chdir(cwd.c_str()) != 0) { }
+      cleanBenchDir(dirtmpl);
+      throw;
+   }
+
+   if (chdir(cwd.c_str()) != 0) { }
+   cleanBenchDir(dirtmpl);
+}
+
+/*****************************************************************************************
+ * writeFleet - writes a fleetgen fleet (see FleetGen.h) to <prefix>N<node>.bin files
+ *
+ *    Returns: the number of plots written
+ *****************************************************************************************/
+
+size_t writeFleet(const fleet_params &params, const std::string &prefix,
+                  std::vector<std::string> &files) {
+   FleetGen fleet(params);
+   std::vector<std::unique_ptr<std::ofstream>> outs;
+
+   for (unsigned int n=1; n<=params.nodes; n++) {
+      files.push_back(prefix + "N" + std::to_string(n) + ".bin");
+      outs.emplace_back(new std::ofstream(files.back(), std::ios::out | std::ios::binary));
+   }
+
+   DronePlot plot;
+   std::vector<uint8_t> buf;
+   size_t count = 0;
+   while (fleet.next(plot)) {
+      buf.clear();
+      plot.serialize(buf);
+      outs[plot.node_id - 1]->write((const char *) buf.data(), buf.size());
+      count++;
+   }
+
+   for (auto &out : outs) {
+      out->close();
+      if (out->fail())
+         throw std::runtime_error("Unable to write the replay fleet");
+   }
+   return count;
+}
+
+/*****************************************************************************************
+ * benchReplay - replays a trace through nodes full ReplServers on loopback. Each server's
+ *               AntennaSim injects its file by one shared virtual clock, which skips
+ *               ahead to every inject, then keeps skipping while the servers finish
+ *               replicating. Reports how much faster than real time the trace was
+ *               replayed, the replication throughput, the process CPU per plot and
+ *               how long after the last inject the servers converged
+ *****************************************************************************************/
+
+void benchReplay(const std::vector<std::string> &plot_files, unsigned int nodes,
+                 unsigned int drones, unsigned int seed, float time_mult, unsigned short port,
+                 bool symmetric) {
+   std::vector<std::string> files;
+   for (const std::string &file : plot_files) {
+      char *path = realpath(file.c_str(), NULL);
+      if (path == NULL)
+         throw std::runtime_error("Unable to find replay file " + file);
+      files.push_back(path);
+      free(path);
+   }
+
+   std::string cwd;
+   std::string dirtmpl = enterBenchDir(cwd);
+
+   size_t total = 0;
+   fleet_params params;
+   if (files.size() == 0) {
+      params.drones = drones;
+      params.nodes = nodes;
+      params.seed = seed;
+      try {
+         total = writeFleet(params, "replay", files);
+      } catch (std::exception &) {
+         if (chdir(cwd.c_str()) != 0) { }
+         cleanBenchDir(dirtmpl);
+         throw;
+      }
+   } else {
+      for (const std::string &file : files) {
+         std::ifstream in(file, std::ios::in | std::ios::binary | std::ios::ate);
+         total += (size_t) in.tellg() / DronePlot::getDataSize();
+      }
+   }
+   nodes = files.size();
+
+   std::cout << "replay: " << nodes << " servers, " << total << " plots from " <<
+                ((plot_files.size() > 0) ? std::string("the plot files") :
+                 std::to_string(drones) + " fleetgen drones over " +
+                 std::to_string(params.secs) + " secs") <<
+                ", time multiplier " << time_mult << ", " << sysconf(_SC_NPROCESSORS_ONLN) <<
+                " CPUs\n";
+
+   // The servers print every connection, keep that out of the results
+   std::ofstream devnull("/dev/null");
+   std::streambuf *cout_buf = std::cout.rdbuf();
+
+   SimClock sim_clock(time_mult);
+   sim_clock.setVirtual(true);
+
+   std::vector<std::unique_ptr<cluster_node>> cluster(nodes);
+   unsigned int started = 0, injecting = 0;
+   try {
+      std::cout.rdbuf(devnull.rdbuf());
+
+      std::ofstream servers("servers.txt");
+      for (unsigned int n=0; n<nodes; n++)
+         servers << "ds" << n + 1 << ", 127.0.0.1, " << port + n << "\n";
+      servers.close();
+      writeBenchKey();
+
+      for (unsigned int n=0; n<nodes; n++) {
+         cluster[n].reset(new cluster_node);
+         cluster[n]->server.reset(new ReplServer(cluster[n]->db, "127.0.0.1", port + n, 0,
+                                                                          time_mult, 0));
+         cluster[n]->server->setClock(&sim_clock);
+         cluster[n]->server->setSymmetric(symmetric);
+         cluster[n]->sim.reset(new AntennaSim(cluster[n]->db, files[n].c_str(), time_mult, 0));
+         cluster[n]->sim->setClock(&sim_clock);
+      }
+      sim_clock.start();
+      for ( ; started<nodes; started++) {
+         if (pthread_create(&cluster[started]->thread, NULL, t_cluster_node,
+                            (void *) cluster[started]->server.get()) != 0)
+            throw std::runtime_error("Unable to create cluster server thread");
+      }
+
+      // The antennas inject as fast as they can, every server shares the clock they skip
+      double cpu_start = cpuSecs();
+      double applied_start = Metrics::global().counter("repl_plots_applied_total", "").getValue();
+      bench_clock::time_point start = bench_clock::now();
+      for ( ; injecting<nodes; injecting++) {
+         if (pthread_create(&cluster[injecting]->sim_thread, NULL, t_cluster_antenna,
+                            (void *) cluster[injecting]->sim.get()) != 0)
+            throw std::runtime_error("Unable to create cluster antenna thread");
+      }
+      for ( ; injecting>0; injecting--)
+         pthread_join(cluster[injecting - 1]->sim_thread, NULL);
+      double inject_end = elapsed(start);
+
+      // Keep the clock skipping so replication runs flat out, until no server's plots have
+      // changed for a while. The servers' dedup doesn't always drop the same copies, so
+      // they can settle on different counts
+      std::vector<size_t> held(nodes, 0);
+      double last_change = inject_end, last_change_sim = sim_clock.getTime();
+      bool converged = false;
+      while (!converged && (elapsed(start) < inject_end + max_repl_secs)) {
+         usleep(cluster_tick_usecs);
+         sim_clock.sleepUntil(sim_clock.getTime() + replay_skip_secs);
+
+         for (unsigned int n=0; n<nodes; n++) {
+            size_t size = cluster[n]->db.size();
+            if (size != held[n]) {
+               last_change = elapsed(start);
+               last_change_sim = sim_clock.getTime();
+            }
+            held[n] = size;
+         }
+         converged = (elapsed(start) - last_change >= replay_settle_secs);
+      }
+      double secs = last_change;
+      double cpu = cpuSecs() - cpu_start;
+      double applied = Metrics::global().counter("repl_plots_applied_total", "").getValue() -
+                                                                                 applied_start;
+      double sim_secs = last_change_sim;
+
+      for (unsigned int n=0; n<nodes; n++)
+         cluster[n]->server->shutdown();
+      for ( ; started>0; started--)
+         pthread_join(cluster[started - 1]->thread, NULL);
+      cluster.clear();
+      std::cout.rdbuf(cout_buf);
+
+      size_t min_held = *std::min_element(held.begin(), held.end());
+      size_t max_held = *std::max_element(held.begin(), held.end());
+      if (!converged)
+         throw std::runtime_error("Replay did not settle, the servers hold " +
+                                  std::to_string(min_held) + " to " + std::to_string(max_held) +
+                                  " plots");
+
+      std::cout << std::fixed << std::setprecision(2);
+      std::cout << "injected in " << inject_end << " secs, settled " << secs - inject_end <<
+                   " secs later with " << min_held << " to " << max_held <<
+                   " plots per server\n";
+      std::cout << std::setprecision(0) << sim_secs << " sim secs in " << std::setprecision(2) <<
+                   secs << " secs (" << std::setprecision(1) << sim_secs / secs <<
+                   "x real time), " << std::setprecision(0) << total / secs << " plots/s in, " <<
+                   applied / secs << " replicated plots/s, " << std::setprecision(1) <<
+                   cpu * 1e6 / total << " CPU usecs per plot\n";
+   } catch (std::exception &) {
+      // Antennas stop once their trace is in, which doesn't take long on a virtual clock
+      for ( ; injecting>0; injecting--)
+         pthread_join(cluster[injecting - 1]->sim_thread, NULL);
+      for (unsigned int n=0; n<started; n++)
+         cluster[n]->server->shutdown();
+      for ( ; started>0; started--)
+         pthread_join(cluster[started - 1]->thread, NULL);
+      cluster.clear();
+      std::cout.rdbuf(cout_buf);
+      if (chdir(cwd.c_str()) != 0) { }
+      cleanBenchDir(dirtmpl);
+      throw;
+   }
+
+   if (chdir(cwd.c_str()) != 0) { }
+   cleanBenchDir(dirtmpl);
+}
+
+/*****************************************************************************************
+ * scanAccessList - the lookup ALMgr used to do on every connection: read the file until a
+ *                  line matches
+ *****************************************************************************************/
+
+bool scanAccessList(const char *filename, uint32_t ipaddr) {
+   FILE *alfile = fopen(filename, "r");
+   if (alfile == NULL)
+      throw std::runtime_error("Unable to open access list file.");
+
+   char strbuf[30];
+   std::string ipstr;
+   in_addr al_ip;
+   bool found = false;
+
+   while (!found && (fgets(strbuf, 30, alfile) != NULL)) {
+      ipstr = strbuf;
+      clrNewlines(ipstr);
+      found = (inet_pton(AF_INET, ipstr.c_str(), &al_ip) == 1) && (al_ip.s_addr == ipaddr);
+   }
+   fclose(alfile);
+   return found;
+}
+
+/*****************************************************************************************
+ * benchACL - builds an access list of random hosts and subnets and times loading it and
+ *            looking up listed hosts, addresses inside the subnets and unlisted addresses
+ *****************************************************************************************/
+
+void benchACL(unsigned int seed) {
+   char filename[] = "/tmp/replbench_acl.XXXXXX";
+   int fd = mkstemp(filename);
+   if (fd < 0)
+      throw std::runtime_error("Unable to create the access list file");
+   close(fd);
+
+   // Hosts are in 10/8, subnets in 172.16/12, misses in 192.168/16
+   std::mt19937 rng(seed);
+   std::uniform_int_distribution<uint32_t> host_dist(0, 0xFFFFFF), subnet_dist(0, 0xFFFFF),
+                                           miss_dist(0, 0xFFFF), len_dist(16, 28);
+   std::vector<uint32_t> hosts, subnet_addrs, misses;
+   std::set<std::pair<uint32_t, unsigned int>> listed;
+
+   std::ofstream alfile(filename);
+   for (unsigned int i=0; i<acl_entries; ) {
+      in_addr addr;
+      char strbuf[INET_ADDRSTRLEN];
+
+      // Every entry is distinct so the loaded list size can be checked
+      unsigned int len = (i < acl_subnets) ? len_dist(rng) : 32;
+      uint32_t net = (i < acl_subnets) ? (0xAC100000 | subnet_dist(rng)) &
+                                         (0xFFFFFFFF << (32 - len)) : 0x0A000000 | host_dist(rng);
+      if (!listed.emplace(net, len).second)
+         continue;
+      i++;
+
+      if (len < 32) {
+         addr.s_addr = htonl(net);
+         inet_ntop(AF_INET, &addr, strbuf, sizeof(strbuf));
+         alfile << strbuf << "/" << len << "\n";
+         subnet_addrs.push_back(htonl(net | (~(0xFFFFFFFF << (32 - len)) & rng())));
+      } else {
+         addr.s_addr = htonl(net);
+         inet_ntop(AF_INET, &addr, strbuf, sizeof(strbuf));
+         alfile << strbuf << "\n";
+         hosts.push_back(addr.s_addr);
+      }
+      misses.push_back(htonl(0xC0A80000 | miss_dist(rng)));
+   }
+   alfile.close();
+
+   std::cout << "acl: " << acl_entries << " entries (" << acl_subnets << " subnets)\n";
+   std::cout << std::left << std::setw(24) << "operation" << std::right << std::setw(16) <<
+                "usecs/op" << std::setw(16) << "ops/s" << "\n";
+   std::cout << std::fixed;
+
+   auto report = [](const char *name, double secs, unsigned long ops) {
+      std::cout << std::left << std::setw(24) << name << std::right << std::setw(16) <<
+                   std::setprecision(3) << secs * 1000000.0 / ops << std::setw(16) <<
+                   std::setprecision(0) << ops / secs << "\n";
+   };
+
+   try {
+      // Loading the list (on startup and every time the file changes)
+      unsigned long loads = 0;
+      bench_clock::time_point start = bench_clock::now();
+      do {
+         ALMgr al(filename);
+         al.reload();
+         if (al.size() != acl_entries)
+            throw std::runtime_error("Access list loaded " + std::to_string(al.size()) +
+                                     " entries");
+         loads++;
+      } while (elapsed(start) < min_bench_secs);
+      report("load", elapsed(start), loads);
+
+      ALMgr al(filename);
+      const std::pair<const char *, std::vector<uint32_t> *> lookups[] = {
+         { "lookup host", &hosts }, { "lookup subnet", &subnet_addrs }, { "lookup miss", &misses }
+      };
+      for (auto &lookup : lookups) {
+         unsigned long ops = 0;
+         bool expect = (lookup.second != &misses);
+         std::vector<uint32_t> &addrs = *lookup.second;
+
+         start = bench_clock::now();
+         do {
+            for (unsigned int i=0; i<1000; i++, ops++) {
+               if (al.isAllowed(addrs[ops % addrs.size()]) != expect)
+                  throw std::runtime_error(std::string(lookup.first) + " got the wrong answer");
+            }
+         } while (elapsed(start) < min_bench_secs);
+         report(lookup.first, elapsed(start), ops);
+      }
+
+      // The old way, a miss reads the whole file
+      unsigned long scans = 0;
+      start = bench_clock::now();
+      do {
+         if (scanAccessList(filename, misses[scans % misses.size()]))
+            throw std::runtime_error("File scan found an unlisted address");
+         scans++;
+      } while (elapsed(start) < min_bench_secs);
+      report("file scan miss (old)", elapsed(start), scans);
+
+   } catch (std::exception &) {
+      unlink(filename);
+      throw;
+   }
+   unlink(filename);
+}
+
+
+/*****************************************************************************************
+ * micro_result - one microbenchmark: nanoseconds per item, where an item is one plot, one
+ *                call or one lookup depending on the benchmark
+ *****************************************************************************************/
+
+struct micro_result {
+   std::string name;
+   double ns_per_item;
+};
+
+/*****************************************************************************************
+ * timeMicro - runs setup (untimed) then op (timed) until op has run for min_bench_secs
+ *
+ *    Params:  items - how many items one run of op processes
+ *
+ *    Returns: nanoseconds per item
+ *****************************************************************************************/
+
+template <typename Setup, typename Op>
+double timeMicro(unsigned int items, Setup setup, Op op) {
+   double secs = 0.0;
+   unsigned long runs = 0;
+
+   do {
+      setup();
+      bench_clock::time_point start = bench_clock::now();
+      op();
+      secs += elapsed(start);
+      runs++;
+   } while (secs < min_bench_secs);
+
+   return secs * 1e9 / ((double) runs * items);
+}
+
+/*****************************************************************************************
+ * BenchConn - opens up TCPConn's command framing for the micro suite
+ *****************************************************************************************/
+
+class BenchConn : public TCPConn
+{
+public:
+   BenchConn(LogMgr &server_log, CryptoPP::SecByteBlock &key):TCPConn(server_log, key, 0) {}
+
+   using TCPConn::wrapCmd;
+   using TCPConn::getCmdData;
+};
+
+/*****************************************************************************************
+ * loadBaseline - reads the name,ns_per_item lines of a results file written with -o
+ *
+ *    Throws: runtime_error if the file can't be opened
+ *****************************************************************************************/
+
+void loadBaseline(const char *filename, std::map<std::string, double> &baseline) {
+   std::ifstream infile(filename);
+   if (!infile.is_open())
+      throw std::runtime_error(std::string("Unable to open baseline file ") + filename);
+
+   std::string line;
+   while (std::getline(infile, line)) {
+      size_t comma = line.find(',');
+      if ((line.size() == 0) || (line[0] == '#') || (comma == std::string::npos))
+         continue;
+      baseline[line.substr(0, comma)] = strtod(line.c_str() + comma + 1, NULL);
+   }
+}
+
+/*****************************************************************************************
+ * benchMicro - times the building blocks one at a time: DronePlotDB, DronePlot
+ *              serialization and CSV, TCPConn framing and crypto, ALMgr lookups
+ *
+ *    Params:  outfile - if not empty, results are written here as name,ns_per_item lines
+ *             basefile - if not empty, results are compared to this earlier outfile
+ *             max_regress - percent slower than the baseline that counts as a regression
+ *
+ *    Returns: the number of benchmarks that regressed
+ *
+ *    Throws: runtime_error if a file can't be read or written
+ *****************************************************************************************/
+
+unsigned int benchMicro(unsigned int seed, const std::string &outfile,
+                        const std::string &basefile, double max_regress) {
+   const unsigned int num_plots = 10000;
+   const unsigned int num_calls = 1000;
+   const unsigned int payload_size = 256;
+
+   std::map<std::string, double> baseline;
+   if (basefile.size() > 0)
+      loadBaseline(basefile.c_str(), baseline);
+
+   std::mt19937 rng(seed);
+   std::uniform_real_distribution<float> lat_dist(30.0, 45.0), lon_dist(-100.0, -80.0);
+   std::uniform_int_distribution<int> time_dist(0, 100000);
+   std::vector<micro_result> results;
+
+   // DronePlotDB
+   DronePlotDB db;
+   auto fillDB = [&]() {
+      db.clear();
+      for (unsigned int i=0; i<num_plots; i++)
+         db.addPlot(1 + i % 50, 1 + i % 3, time_dist(rng), lat_dist(rng), lon_dist(rng));
+   };
+
+   results.push_back({ "db.addPlot", timeMicro(num_plots, [&]() { db.clear(); }, [&]() {
+      for (unsigned int i=0; i<num_plots; i++)
+         db.addPlot(1 + i % 50, 1 + i % 3, i, 39.75, -84.05);
+   }) });
+
+   results.push_back({ "db.sortByTime", timeMicro(num_plots, [&]() {
+      for (auto dpit = db.begin(); dpit != db.end(); dpit++)
+         dpit->timestamp = time_dist(rng);
+   }, [&]() { db.sortByTime(); }) });
+
+   results.push_back({ "db.erase", timeMicro(num_plots / 2, fillDB, [&]() {
+      for (auto dpit = db.begin(); dpit != db.end(); ) {
+         dpit = db.erase(dpit);
+         if (dpit != db.end())
+            dpit++;
+      }
+   }) });
+
+   results.push_back({ "db.removeIf", timeMicro(num_plots / 2, fillDB, [&]() {
+      db.removeIf([](DronePlot &plot) { return (plot.timestamp & 1) == 0; });
+   }) });
+
+   db.setTombstones(true);
+   results.push_back({ "db.tombstone+compact", timeMicro(num_plots / 2, fillDB, [&]() {
+      db.removeIf([](DronePlot &plot) { return (plot.timestamp & 1) == 0; });
+      db.compact();
+   }) });
+   db.setTombstones(false);
+
+   // A 1% slice of plot time, timed per plot in the database to show what the skipped
+   // segments save over walking it all
+   fillDB();
+   size_t scanned = 0;
+   results.push_back({ "db.scanRange", timeMicro(num_plots, []() {}, [&]() {
+      scanned += db.scanRange(50000, 50999, [](DronePlot &plot) { (void) plot; });
+   }) });
+
+   // DronePlot serialization and CSV
+   fillDB();
+   std::vector<uint8_t> plotbuf;
+   results.push_back({ "plot.serialize", timeMicro(num_plots, [&]() { plotbuf.clear(); }, [&]() {
+      for (auto dpit = db.begin(); dpit != db.end(); dpit++)
+         dpit->serialize(plotbuf);
+   }) });
+
+   std::vector<DronePlot> plots(num_plots);
+   results.push_back({ "plot.deserialize", timeMicro(num_plots, []() {}, [&]() {
+      for (unsigned int i=0; i<num_plots; i++)
+         plots[i].deserialize(plotbuf, i * DronePlot::getDataSize());
+   }) });
+
+   std::vector<std::string> lines(num_plots);
+   results.push_back({ "plot.writeCSV", timeMicro(num_plots, []() {}, [&]() {
+      for (unsigned int i=0; i<num_plots; i++)
+         plots[i].writeCSV(lines[i]);
+   }) });
+
+   results.push_back({ "plot.readCSV", timeMicro(num_plots, []() {}, [&]() {
+      for (unsigned int i=0; i<num_plots; i++)
+         plots[i].readCSV(lines[i]);
+   }) });
+
+   // TCPConn framing and crypto, and ALMgr, want their files in a scratch directory
+   std::string cwd;
+   std::string dirtmpl = enterBenchDir(cwd);
+   try {
+      writeBenchKey();
+
+      LogMgr server_log("server.log", 0);
+      CryptoPP::SecByteBlock key(CryptoPP::AES::DEFAULT_KEYLENGTH);
+      CryptoPP::AutoSeededRandomPool keyrng;
+      keyrng.GenerateBlock(key, key.size());
+      BenchConn conn(server_log, key);
+
+      std::vector<uint8_t> payload(payload_size), buf;
+      for (unsigned int i=0; i<payload_size; i++)
+         payload[i] = (uint8_t) rng();
+      std::vector<uint8_t> c_start = { '<', 'R', 'E', 'P', '>' };
+      std::vector<uint8_t> c_end = { '<', '/', 'R', 'E', 'P', '>' };
+
+      results.push_back({ "conn.wrapCmd", timeMicro(num_calls, []() {}, [&]() {
+         for (unsigned int i=0; i<num_calls; i++) {
+            buf = payload;
+            conn.wrapCmd(buf, c_start, c_end);
+         }
+      }) });
+
+      std::vector<uint8_t> wrapped = buf;
+      results.push_back({ "conn.getCmdData", timeMicro(num_calls, []() {}, [&]() {
+         for (unsigned int i=0; i<num_calls; i++) {
+            buf = wrapped;
+            conn.getCmdData(buf, c_start, c_end);
+         }
+      }) });
+
+      results.push_back({ "conn.encryptData", timeMicro(num_calls, []() {}, [&]() {
+         for (unsigned int i=0; i<num_calls; i++) {
+            buf = payload;
+            conn.encryptData(buf);
+         }
+      }) });
+
+      std::vector<uint8_t> encrypted = buf;
+      results.push_back({ "conn.decryptData", timeMicro(num_calls, []() {}, [&]() {
+         for (unsigned int i=0; i<num_calls; i++) {
+            buf = encrypted;
+            conn.decryptData(buf);
+         }
+      }) });
+
+      // A whitelist of 1000 hosts in 10/8 and 100 subnets in 172.16/12, half the lookups miss
+      std::ofstream alfile("micro_acl");
+      for (unsigned int i=0; i<1000; i++)
+         alfile << "10." << (i >> 8) << "." << (i & 0xFF) << ".1\n";
+      for (unsigned int i=0; i<100; i++)
+         alfile << "172." << 16 + (i >> 4) << "." << (i & 0xF) * 16 << ".0/20\n";
+      alfile.close();
+
+      ALMgr al("micro_acl");
+      std::vector<unsigned long> addrs(num_calls);
+      for (unsigned int i=0; i<num_calls; i++) {
+         uint32_t host = (i % 2) ? (0x0A000001 | ((rng() % 1000) << 8)) : (0xC0A80000 | (rng() & 0xFFFF));
+         addrs[i] = htonl(host);
+      }
+      results.push_back({ "acl.isAllowed", timeMicro(num_calls, []() {}, [&]() {
+         for (unsigned int i=0; i<num_calls; i++)
+            al.isAllowed(addrs[i]);
+      }) });
+
+      // The db.scanRange slice again, with all but the newest segment in the cold tier
+      fillDB();
+      db.setColdTier(".", 0);
+      db.sealSegments(time_dist.max() + default_segment_secs);
+      results.push_back({ "db.scanRange.cold", timeMicro(num_plots, []() {}, [&]() {
+         scanned += db.scanRange(50000, 50999, [](DronePlot &plot) { (void) plot; });
+      }) });
+      db.clear();
+      db.setColdTier("");
+   } catch (std::exception &) {
+      if (chdir(cwd.c_str()) != 0) { }
+      cleanBenchDir(dirtmpl);
+      throw;
+   }
+   if (chdir(cwd.c_str()) != 0) { }
+   cleanBenchDir(dirtmpl);
+
+   // Report, against the baseline if there is one
+   unsigned int regressed = 0;
+   std::cout << "micro: " << num_plots << " plots, " << num_calls << " calls of " <<
+                payload_size << " bytes\n";
+   std::cout << std::left << std::setw(20) << "benchmark" << std::right << std::setw(14) <<
+                "ns/item" << std::setw(16) << "items/s";
+   if (baseline.size() > 0)
+      std::cout << std::setw(14) << "base ns" << std::setw(10) << "change";
+   std::cout << "\n" << std::fixed;
+
+   for (const micro_result &result : results) {
+      std::cout << std::left << std::setw(20) << result.name << std::right << std::setw(14) <<
+                   std::setprecision(1) << result.ns_per_item << std::setw(16) <<
+                   std::setprecision(0) << 1e9 / result.ns_per_item;
+
+      auto bptr = baseline.find(result.name);
+      if (bptr != baseline.end() && (bptr->second > 0.0)) {
+         double change = (result.ns_per_item - bptr->second) * 100.0 / bptr->second;
+         std::cout << std::setw(14) << std::setprecision(1) << bptr->second << std::setw(9) <<
+                      std::showpos << change << std::noshowpos << "%";
+         if (change > max_regress) {
+            std::cout << "  REGRESSED";
+            regressed++;
+         }
+      }
+      std::cout << "\n";
+   }
+
+   if (outfile.size() > 0) {
+      std::ofstream out(outfile);
+      if (!out.is_open())
+         throw std::runtime_error("Unable to write results file " + outfile);
+      out << "# benchmark,ns_per_item\n" << std::fixed << std::setprecision(3);
+      for (const micro_result &result : results)
+         out << result.name << "," << result.ns_per_item << "\n";
+   }
+
+   return regressed;
+}
+
+int main(int argc, char *argv[]) {
+   std::string suite("all");
+   std::vector<std::string> plot_files;
+   unsigned long drones = 20, plots = 500, seed = 1;
+   unsigned long senders = 4, port = 31000;
+   unsigned long nodes = 3, rate = 100, load_secs = 10;
+   float time_mult = 40.0;
+   std::string outfile, basefile;
+   double max_regress = 10.0;
+   unsigned int regressed = 0;
+   bool symmetric = false;
+
+   int c = 0;
+   while ((c = getopt(argc, argv, "-s:d:n:r:k:p:N:l:t:m:o:b:x:Bh")) != -1) {
+      switch (c) {
+
+      // Plot files to benchmark with
+      case 1:
+         plot_files.push_back(optarg);
+         break;
+
+      case 's':
+         suite = optarg;
+         break;
+
+      case 'd':
+         drones = strtol(optarg, NULL, 10);
+         break;
+
+      case 'n':
+         plots = strtol(optarg, NULL, 10);
+         break;
+
+      case 'r':
+         seed = strtol(optarg, NULL, 10);
+         break;
+
+      case 'k':
+         senders = strtol(optarg, NULL, 10);
+         if ((senders < 1) || (senders > 64)) {
+            std::cerr << "Invalid number of senders. Range: 1 to 64\n";
+            exit(0);
+         }
+         break;
+
+      case 'p':
+         port = strtol(optarg, NULL, 10);
+         if ((port < 1) || (port > 60000)) {
+            std::cerr << "Invalid port. Range: 1 to 60000\n";
+            exit(0);
+         }
+         break;
+
+      case 'N':
+         nodes = strtol(optarg, NULL, 10);
+         if ((nodes < 2) || (nodes > 32)) {
+            std::cerr << "Invalid number of cluster servers. Range: 2 to 32\n";
+            exit(0);
+         }
+         break;
+
+      case 'l':
+         rate = strtol(optarg, NULL, 10);
+         if ((rate < 1) || (rate > 1000000)) {
+            std::cerr << "Invalid plot rate. Range: 1 to 1000000\n";
+            exit(0);
+         }
+         break;
+
+      case 't':
+         load_secs = strtol(optarg, NULL, 10);
+         if ((load_secs < 1) || (load_secs > 3600)) {
+            std::cerr << "Invalid injection time. Range: 1 to 3600\n";
+            exit(0);
+         }
+         break;
+
+      case 'm':
+         time_mult = strtof(optarg, NULL);
+         if (time_mult <= 0.0) {
+            std::cerr << "Invalid time multiplier. Must be > 0.\n";
+            exit(0);
+         }
+         break;
+
+      case 'o':
+         outfile = optarg;
+         break;
+
+      case 'b':
+         basefile = optarg;
+         break;
+
+      case 'x':
+         max_regress = strtod(optarg, NULL);
+         if (max_regress < 0.0) {
+            std::cerr << "Invalid regression threshold. Must be >= 0.\n";
+            exit(0);
+         }
+         break;
+
+      case 'B':
+         symmetric = true;
+         break;
+
+      case 'h':
+      case '?':
+      default:
+         displayHelp(argv[0]);
+         exit(0);
+      }
+   }
+
+   DronePlotDB db;
+   for (auto fptr = plot_files.begin(); fptr != plot_files.end(); fptr++) {
+      if (db.loadBinaryFile(fptr->c_str()) < 0) {
+         std::cerr << "Unable to load plot file " << *fptr << "\n";
+         exit(-1);
+      }
+   }
+   if (plot_files.size() == 0)
+      genTracks(db, drones, plots, seed);
+
+   if (db.size() == 0) {
+      std::cerr << "No plots to benchmark with.\n";
+      exit(-1);
+   }
+
+   try {
+      if ((suite == "all") || (suite == "codec"))
+         benchCodec(db);
+      if ((suite == "all") || (suite == "workers"))
+         benchWorkers(db, senders, port);
+      if ((suite == "all") || (suite == "handshake"))
+         benchHandshake(port);
+      if ((suite == "all") || (suite == "acl"))
+         benchACL(seed);
+      if ((suite == "all") || (suite == "micro"))
+         regressed = benchMicro(seed, outfile, basefile, max_regress);
+      if ((suite == "all") || (suite == "cluster"))
+         benchCluster(nodes, rate, load_secs, time_mult, port, symmetric);
+      if ((suite == "all") || (suite == "replay"))
+         benchReplay((plot_files.size() > 1) ? plot_files : std::vector<std::string>(),
+                     nodes, drones, seed, time_mult, port, symmetric);
+   } catch (std::exception &e) {
+      std::cerr << "Benchmark failed: " << e.what() << "\n";
+      exit(-1);
+   }
+
+   if (regressed > 0) {
+      std::cerr << regressed << " microbenchmarks are more than " << max_regress <<
+                   "% slower than the baseline.\n";
+      return 1;
+   }
+   return 0;
+}
@@ -10,6 +10,7 @@
 
 #include <stdexcept>
 #include <iostream>
+#include <memory>
 #include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
@@ -18,6 +19,9 @@
 #include "AntennaSim.h"
 #include "strfuncts.h"
 #include "ReplServer.h"
+#include "EventLog.h"
+#include "Metrics.h"
+#include "SimClock.h"
 
 using namespace std; 
 
@@ -65,6 +69,27 @@ void displayHelp(const char *execname) {
    std::cout << "   o: the file to write the DB dump CSV to (default: replication_db.cv)\n";
    std::cout << "   d: duration - seconds in \"sim time\" to run the sim\n";
    std::cout << "   v: verbosity - how much information to send to stdout (0-3, 3=max)\n";
+   std::cout << "   w: number of I/O worker threads for replication connections (default: 1,\n";
+   std::cout << "      0 handles them on the replication thread)\n";
+   std::cout << "   A: pin each I/O worker thread to its own CPU\n";
+   std::cout << "   e: record replication events to this binary file (read it with evdecode)\n";
+   std::cout << "   T: trace the latency of our plots to the servers applying them (see the\n";
+   std::cout << "      repl_trace_usecs metric on those servers)\n";
+   std::cout << "   m: serve metrics in the Prometheus text format over HTTP on this port\n";
+   std::cout << "   F: fast replay - skip the sim clock ahead to each inject instead of waiting\n";
+   std::cout << "      for it, so the sim data is replayed as fast as it can be replicated\n";
+   std::cout << "   L: seconds the session resumption tickets we issue are good for (default:\n";
+   std::cout << "      3600, 0 issues none so every reconnect does the full handshake)\n";
+   std::cout << "   B: bidirectional sessions - one replication session per pair of servers,\n";
+   std::cout << "      carrying plots both ways (every server must be given -B)\n";
+   std::cout << "   S: seconds of plot time per database segment (default: 300)\n";
+   std::cout << "   R: retention - drop database segments older than this many seconds of plot\n";
+   std::cout << "      time (default: 0, keep everything)\n";
+   std::cout << "   P: plot budget - drop the oldest database segments while there are more\n";
+   std::cout << "      than this many plots (default: 0, no limit)\n";
+   std::cout << "   C: cold tier - spill sealed database segments to memory-mapped files in this\n";
+   std::cout << "      directory (default: none, keep everything in memory)\n";
+   std::cout << "   H: hot window - seconds of plot time kept in memory with -C (default: 600)\n";
 }
 
 
@@ -77,6 +102,19 @@ int main(int argc, char *argv[]) {
    int sim_time = 900; // Default 900 seconds
    std::string ip_addr = "127.0.0.1";
    unsigned short port = 9999;
+   unsigned int io_workers = 1;
+   bool pin_workers = false;
+   std::string event_file;
+   unsigned short metrics_port = 0;
+   bool tracing = false;
+   bool fast_replay = false;
+   long ticket_secs = default_ticket_secs;
+   bool symmetric = false;
+   long segment_secs = default_segment_secs;
+   long retention_secs = 0;
+   long max_plots = 0;
+   std::string cold_dir;
+   long hot_secs = default_hot_secs;
 
    // Filename to write the replication output
    std::string outfile("replication_db.csv");
@@ -87,7 +125,7 @@ int main(int argc, char *argv[]) {
    // will appear in case 1
    unsigned long portval;
    int c = 0;
-   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:")) != -1) {
+   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:w:Ae:m:TFL:BS:R:P:C:H:")) != -1) {
       switch (c) {
 
       // The inject database file specified in the command line
@@ -138,6 +176,97 @@ int main(int argc, char *argv[]) {
          }
          break;
 
+      // Number of I/O worker threads
+      case 'w':
+         io_workers = (unsigned int) strtol(optarg, NULL, 10);
+         if (io_workers > 64) {
+            std::cerr << "Invalid number of I/O workers. Range: 0 to 64\n";
+            exit(0);
+         }
+         break;
+
+      // Pin the I/O workers to CPUs
+      case 'A':
+         pin_workers = true;
+         break;
+
+      // Binary event log
+      case 'e':
+         event_file = optarg;
+         break;
+
+      // Latency tracing
+      case 'T':
+         tracing = true;
+         break;
+
+      // Virtual sim clock
+      case 'F':
+         fast_replay = true;
+         break;
+
+      // Resumption ticket lifetime
+      case 'L':
+         ticket_secs = strtol(optarg, NULL, 10);
+         if (ticket_secs < 0) {
+            std::cerr << "Invalid ticket lifetime. Value must be 0 or more seconds\n";
+            exit(0);
+         }
+         break;
+
+      // Symmetric replication sessions
+      case 'B':
+         symmetric = true;
+         break;
+
+      // Database segments and retention
+      case 'S':
+         segment_secs = strtol(optarg, NULL, 10);
+         if (segment_secs < 1) {
+            std::cerr << "Invalid segment size. Value must be 1 or more seconds\n";
+            exit(0);
+         }
+         break;
+
+      case 'R':
+         retention_secs = strtol(optarg, NULL, 10);
+         if (retention_secs < 0) {
+            std::cerr << "Invalid retention. Value must be 0 or more seconds\n";
+            exit(0);
+         }
+         break;
+
+      case 'P':
+         max_plots = strtol(optarg, NULL, 10);
+         if (max_plots < 0) {
+            std::cerr << "Invalid plot budget. Value must be 0 or more plots\n";
+            exit(0);
+         }
+         break;
+
+      // Cold tier
+      case 'C':
+         cold_dir = optarg;
+         break;
+
+      case 'H':
+         hot_secs = strtol(optarg, NULL, 10);
+         if (hot_secs < 0) {
+            std::cerr << "Invalid hot window. Value must be 0 or more seconds\n";
+            exit(0);
+         }
+         break;
+
+      // Metrics HTTP port
+      case 'm':
+         portval = strtol(optarg, NULL, 10);
+         if ((portval < 1) || (portval > 65535)) {
+            std::cerr << "Invalid metrics port. Value must be between 1 and 65535\n";
+            exit(0);
+         }
+         metrics_port = (unsigned short) portval;
+         break;
+
       // IP address to attempt to bind to
       case 'o':
          outfile = optarg;
@@ -162,10 +291,18 @@ int main(int argc, char *argv[]) {
    }
 
    DronePlotDB db;
+   db.setSegmentSecs((time_t) segment_secs);
+   db.setRetention((time_t) retention_secs, (size_t) max_plots);
+   db.setColdTier(cold_dir, (time_t) hot_secs);
+
+   // The antenna starts the clock (with its offset) and the server replicates by it
+   SimClock sim_clock(time_mult);
+   sim_clock.setVirtual(fast_replay);
 
    // Kick off the simulation thread by creating the sim management object
    // This will raise a runtime_exception if the simdata database load fails
    AntennaSim sim(db, simdata_file.c_str(), time_mult, verbosity);
+   sim.setClock(&sim_clock);
 
    // Launch the thread
    pthread_t simthread;
@@ -174,13 +311,29 @@ int main(int argc, char *argv[]) {
 
    // Start the replication server
    ReplServer repl_server(db, ip_addr.c_str(), port, sim.getOffset(), time_mult, verbosity); 
+   repl_server.setClock(&sim_clock);
+   repl_server.setIOWorkers(io_workers, pin_workers);
+   repl_server.setTracing(tracing);
+   repl_server.setTicketLifetime((time_t) ticket_secs);
+   repl_server.setSymmetric(symmetric);
+
+   std::unique_ptr<EventLog> event_log;
+   if (event_file.size() > 0) {
+      event_log.reset(new EventLog(event_file.c_str()));
+      repl_server.setEventLog(event_log.get());
+   }
+
+   // Metrics are served from the same address as replication
+   MetricsServer metrics_server(Metrics::global());
+   if (metrics_port > 0)
+      metrics_server.start(ip_addr.c_str(), metrics_port);
 
    pthread_t replthread;
    if (pthread_create(&replthread, NULL, t_replserver, (void *) &repl_server) != 0)
       throw std::runtime_error("Unable to create replication server thread");
 
-   // Sleep the duration of the simulation
-   sleep(sim_time / time_mult);
+   // Sleep the duration of the simulation (less whatever a fast replay skips)
+   sim_clock.waitUntil(sim_time);
 
    // Stop the replication server
    repl_server.shutdown();